@@ -2,6 +2,12 @@
 #define _LOG_H_
 
 void log_error(const char *format, ...);
+
+#ifdef DEBUG
 void log_debug(const char *format, ...);
+#else
+// Inlined away, see nanofs_trace.h to trace production builds
+static inline void log_debug(const char *format, ...) { (void)format; }
+#endif
 
 #endif
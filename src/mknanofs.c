@@ -38,10 +38,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 
 #include "nanofs.h"
 #include "nanofs_io.h"
+#include "nanofs_dev.h"
+#include "nanofs_journal.h"
+#include "nanofs_dirindex.h"
+#include "nanofs_dirbtree.h"
 #include <endian.h>
 
 #ifdef __BYTE_ORDER
@@ -59,7 +64,8 @@
 #define _(x) gettext(x)
 
 int check_mount(char *device_name);
-int do_format(char* device, char* volname, int blk_size);
+int do_format(char* device, char* volname, int blk_size, int journal_blocks,
+        int features);
 
 //getopt functions and vars
 int getopt(int argc, char * const argv[], const char *optstring);
@@ -75,12 +81,21 @@ int global_verbose = 0;
 static const char *UsageStr = "Usage: %s [OPTION...] file or device \n"
         "Options\n"
         "\t-b <block-size in bytes>. Valid:1, 512, 1024\n"
+        "\t-d Delete large files in the background\n"
+        "\t-e Index the data blocks of large files, implies -s\n"
         "\t-h Show help\n"
+        "\t-i Keep small files inline in their directory entry\n"
+        "\t-j Create a metadata journal of default size\n"
+        "\t-J <journal-size in blocks>\n"
         "\t-r Nanofs revision number\n"
+        "\t-s Keep the size of each file in a block of its own\n"
         "\t-S Write superblock\n"
         "\t-l <volumelabel> \n"
+        "\t-p Pack several directory entries per block\n"
+        "\t-t Turn large directories into B-trees\n"
         "\t-V Version number\n"
-        "\t-v Increase verbosity\n";
+        "\t-v Increase verbosity\n"
+        "\t-x Index large directories\n";
 
 int main(int argc, char **argv) {
 
@@ -97,8 +112,10 @@ int main(int argc, char **argv) {
     int boption = 0;
     int loption = 0;
     int block_size = 512;
+    int journal_blocks = 0; // -1 default size
+    int features = 0;
 
-    while ((optc = getopt(argc, argv, "b:l:vV")) != -1) {
+    while ((optc = getopt(argc, argv, "b:deijJ:l:pstvVx")) != -1) {
         switch (optc) {
         case ':':
             fprintf(stderr, "** Error: Argument missing, see usage.\n");
@@ -127,6 +144,39 @@ int main(int argc, char **argv) {
 
             break;
 
+        case 'j':
+            if (journal_blocks == 0)
+                journal_blocks = -1;
+            break;
+        case 'J':
+            journal_blocks = (int) strtol(optarg, NULL, 0);
+            if (journal_blocks < NANOFS_JOURNAL_MIN_BLOCKS) {
+                fprintf(stderr, "** Error: -J option must be at least %d "
+                        "blocks\n", NANOFS_JOURNAL_MIN_BLOCKS);
+                error = EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            features |= NANOFS_FEAT_ORPHANS;
+            break;
+        case 'e':
+            features |= NANOFS_FEAT_EXTENTS | NANOFS_FEAT_FILE_SIZE;
+            break;
+        case 'i':
+            features |= NANOFS_FEAT_INLINE_DATA;
+            break;
+        case 'p':
+            features |= NANOFS_FEAT_PACKED_DIRS;
+            break;
+        case 's':
+            features |= NANOFS_FEAT_FILE_SIZE;
+            break;
+        case 't':
+            features |= NANOFS_FEAT_DIR_BTREE;
+            break;
+        case 'x':
+            features |= NANOFS_FEAT_DIR_INDEX;
+            break;
         case 'V':
             printf("mkfs.nanofs Version %s\n", VERSION);
             return EXIT_SUCCESS;
@@ -192,7 +242,8 @@ int main(int argc, char **argv) {
         if (check_mount(devicestring) != 0) // Check if filesystem is mounted
             error = EXIT_FAILURE;
         if (!error) {
-            error = do_format(devicestring, volumelabel, block_size);
+            error = do_format(devicestring, volumelabel, block_size,
+                    journal_blocks, features);
         }
     }
     if (show_help)
@@ -221,16 +272,21 @@ int check_mount(char *device_name) {
 }
 
 // NanosFS Format
-int do_format(char* device, char* volname, int blk_size) {
+int do_format(char* device, char* volname, int blk_size, int journal_blocks,
+        int features) {
     //int err;
-    int fd;
+    struct nanofs_dev dev;
     __u64 dev_size;
     int blk_bits;
     off_t current_off, next_off;
 
     struct nanofs_superblock sb;
+    struct nanofs_sb_extra sbx;
+    __u8 sb_buf[NANOFS_SB_SIZE + sizeof(struct nanofs_sb_extra)];
+    int sb_size;
     struct nanofs_dir_node dn;
     struct nanofs_data_node db;
+    struct nanofs_dir_block pb;
 
     if (global_verbose) {
         printf("Creating new file system:\n");
@@ -240,8 +296,8 @@ int do_format(char* device, char* volname, int blk_size) {
     }
 
     // fd = open(device, O_FSYNC  | O_DIRECT | O_EXLOCK | O_RDWR, 0);
-    fd = open(device, O_FSYNC | O_RDWR, 0);
-    if (fd < 0) {
+    if (nanofs_dev_open(&dev, device, NANOFS_DEV_POSIX,
+            O_FSYNC | O_RDWR) != 0) {
         fprintf( stderr, "Open failed.\n");
         perror(device);
         return EXIT_FAILURE;
@@ -251,7 +307,7 @@ int do_format(char* device, char* volname, int blk_size) {
 
     //Get device Info
 
-    dev_size = lseek64(fd, 0, SEEK_END);
+    dev_size = nanofs_dev_size(&dev);
 
     if (global_verbose)
         printf(" - Detected device size bytes %llu\n", dev_size);
@@ -265,7 +321,7 @@ int do_format(char* device, char* volname, int blk_size) {
     } else {
         fprintf( stderr, "** Error: Block size of %d is not supported\n",
                 blk_size);
-        close(fd);
+        nanofs_dev_close(&dev);
         return EXIT_FAILURE;
     }
 
@@ -274,11 +330,107 @@ int do_format(char* device, char* volname, int blk_size) {
     sb.s_alloc_ptr = 1; // Root on block 1
     sb.s_free_ptr = 2;
     sb.s_fs_size = dev_size >> blk_bits;
-    sb.s_extra_size = 0; // Not implemented
+    sb.s_extra_size = 0;
+    memset(&sbx, 0, sizeof(sbx));
+
+    // Journal, reserved between the root directory and the free blocks
+    if (journal_blocks < 0) {
+        journal_blocks = NANOFS_JOURNAL_DEFAULT_BLOCKS;
+        if ((__u32)journal_blocks > sb.s_fs_size / 16)
+            journal_blocks = sb.s_fs_size / 16;
+    }
+    if (journal_blocks > 0) {
+        if (journal_blocks < NANOFS_JOURNAL_MIN_BLOCKS
+                || (__u32)journal_blocks + 3 > sb.s_fs_size) {
+            fprintf( stderr, "** Error: Device too small for a journal\n");
+            nanofs_dev_close(&dev);
+            return EXIT_FAILURE;
+        }
+        srandom(time(NULL) ^ getpid());
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sb.s_free_ptr += journal_blocks;
+        sbx.s_features = NANOFS_FEAT_JOURNAL;
+        sbx.s_journal_ptr = 2;
+        sbx.s_journal_blocks = journal_blocks;
+        sbx.s_journal_id = random();
+        sbx.s_journal_seq = 1;
+        sbx.s_journal_head = 0;
+        if (global_verbose)
+            printf(" - Journal: %d blocks at block %u\n", journal_blocks,
+                    sbx.s_journal_ptr);
+    }
+    if (features & NANOFS_FEAT_DIR_INDEX) {
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sbx.s_features |= NANOFS_FEAT_DIR_INDEX;
+        if (global_verbose)
+            printf(" - Directory index from %d entries\n",
+                    NANOFS_DIR_INDEX_MIN);
+    }
+    if (features & NANOFS_FEAT_DIR_BTREE) {
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sbx.s_features |= NANOFS_FEAT_DIR_BTREE;
+        if (global_verbose)
+            printf(" - Directory B-trees from %d entries\n",
+                    NANOFS_DIR_BTREE_MIN);
+    }
+    if (features & NANOFS_FEAT_ORPHANS) {
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sbx.s_features |= NANOFS_FEAT_ORPHANS;
+        if (global_verbose)
+            printf(" - Large files deleted in the background\n");
+    }
+    if (features & NANOFS_FEAT_FILE_SIZE) {
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sbx.s_features |= NANOFS_FEAT_FILE_SIZE;
+        if (global_verbose)
+            printf(" - File sizes kept in metadata blocks\n");
+    }
+    if (features & NANOFS_FEAT_EXTENTS) {
+        sbx.s_features |= NANOFS_FEAT_EXTENTS;
+        if (global_verbose)
+            printf(" - Extent index of file data blocks, %d per block\n",
+                    NANOFS_EXTENT_SLOTS);
+    }
+    if (features & NANOFS_FEAT_INLINE_DATA) {
+        // Packed dir nodes have no room left in their block
+        if (features & NANOFS_FEAT_PACKED_DIRS) {
+            fprintf( stderr, "** Error: Inline data cannot be used with "
+                    "packed directories\n");
+            nanofs_dev_close(&dev);
+            return EXIT_FAILURE;
+        }
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sbx.s_features |= NANOFS_FEAT_INLINE_DATA;
+        if (global_verbose)
+            printf(" - Inline data for small files\n");
+    }
+    // Root goes in the first slots of block 1, after the block header
+    if (features & NANOFS_FEAT_PACKED_DIRS) {
+        if (sb.s_fs_size > (__u32)1 << (32 - NANOFS_DIR_SLOT_BITS)) {
+            fprintf( stderr, "** Error: Device too big for packed "
+                    "directories\n");
+            nanofs_dev_close(&dev);
+            return EXIT_FAILURE;
+        }
+        sb.s_revision = NANOFS_REVISION_EXTRA;
+        sb.s_extra_size = sizeof(struct nanofs_sb_extra);
+        sbx.s_features |= NANOFS_FEAT_PACKED_DIRS;
+        sb.s_alloc_ptr = 1 << NANOFS_DIR_SLOT_BITS | 1;
+        if (global_verbose)
+            printf(" - Packed directory entries, %d bytes slots\n",
+                    NANOFS_DIR_SLOT_SIZE);
+    }
 
-    if (nanofs_write_sb(fd, current_off, &sb) == -1) {
+    sb_size = nanofs_pack_sb(sb_buf, &sb, &sbx);
+    if (nanofs_write_dev(&dev, current_off, sb_buf, sb_size) != sb_size) {
         fprintf( stderr, "** Error writing superblock\n");
-        close(fd);
+        nanofs_dev_close(&dev);
         return EXIT_FAILURE;
     }
     if (global_verbose)
@@ -292,9 +444,21 @@ int do_format(char* device, char* volname, int blk_size) {
     dn.d_fname_len = strlen(volname);
     memset(dn.d_fname, 0, NANOFS_MAXFILENAME);
     strcpy((char *)dn.d_fname, volname);
-    if (nanofs_write_dir_node(fd, current_off, &dn) != 0) {
+    if (features & NANOFS_FEAT_PACKED_DIRS) {
+        pb.p_magic = NANOFS_DIR_BLOCK_MAGIC;
+        pb.p_used = (1 << (DN_SLOTS(dn.d_fname_len) + 1)) - 1;
+        pb.p_pad = 0;
+        if (nanofs_write_dev(&dev, current_off, &pb, sizeof(pb)) !=
+                (int)sizeof(pb)) {
+            fprintf( stderr, "** Error: Fail while writing root directory\n");
+            nanofs_dev_close(&dev);
+            return EXIT_FAILURE;
+        }
+        current_off += NANOFS_DIR_SLOT_SIZE;
+    }
+    if (nanofs_write_dir_node(&dev, current_off, &dn) != 0) {
         fprintf( stderr, "** Error: Fail while writing root directory\n");
-        close(fd);
+        nanofs_dev_close(&dev);
         return EXIT_FAILURE;
     }
     if (global_verbose)
@@ -303,7 +467,7 @@ int do_format(char* device, char* volname, int blk_size) {
     // Free blocks
     if (global_verbose)
         printf("Free blocks:\n");
-    current_off += 1 << blk_bits;
+    current_off = (off_t)(sb.s_free_ptr) << blk_bits;
     while ( (__u64)current_off < dev_size) {
         if (dev_size - current_off <= 0xFFFFFFFFL - NANOFS_HEADER_DATA_NODE_SIZE) // Free space fits on one free node
         {
@@ -317,8 +481,8 @@ int do_format(char* device, char* volname, int blk_size) {
             db.d_len = (1L << 32) - NANOFS_HEADER_DATA_NODE_SIZE;
         }
 
-        if (nanofs_write_data_node(fd, current_off, &db) != 0) {
-            close(fd);
+        if (nanofs_write_data_node(&dev, current_off, &db) != 0) {
+            nanofs_dev_close(&dev);
             fprintf( stderr, "** Error writing free blocks\n");
             return EXIT_FAILURE;
         }
@@ -330,7 +494,7 @@ int do_format(char* device, char* volname, int blk_size) {
 
     if (global_verbose)
         printf("Free blocks written\n");
-    close(fd);
+    nanofs_dev_close(&dev);
     if (global_verbose)
         printf("Nanofs filesystem successfully created\n");
     return EXIT_SUCCESS;
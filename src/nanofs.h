@@ -28,6 +28,7 @@
 #define NANOFS_MAXFILENAME     255
 #define NANOFS_DEFAULT_BLKSIZE 512
 #define NANOFS_REVISION        0
+#define NANOFS_REVISION_EXTRA  1   ///< Superblock followed by nanofs_sb_extra
 
 
 // Nodes size in bytes, required due C structs are not mem aligned:
@@ -43,9 +44,44 @@
 
 /* Flags for f_type field in directory node structure */
 #define NANOFS_FLG_FTYPE  0 // bit 0: 1 for directory, 0 reg file
+#define NANOFS_FLG_INLINE 1 // bit 1: file data follows the name in the
+                            //   block of the dir node, d_data_ptr is its size
+#define NANOFS_FLG_BTREE  2 // bit 2: children of the directory are in a
+                            //   B-tree at d_data_ptr, not chained
+
+/* Flags for s_features field in the extended superblock */
+#define NANOFS_FEAT_JOURNAL  0x0001 // Metadata journal, see nanofs_journal.c
+#define NANOFS_FEAT_DIR_INDEX 0x0002 // Large dirs indexed, see nanofs_dirindex.c
+#define NANOFS_FEAT_PACKED_DIRS 0x0004 // Dir nodes share blocks, see below
+#define NANOFS_FEAT_INLINE_DATA 0x0008 // Small files in the dir node block
+#define NANOFS_FEAT_DIR_BTREE 0x0010 // Large dirs as B-trees, see nanofs_dirbtree.c
+#define NANOFS_FEAT_ORPHANS  0x0020 // Large files deleted in the background
+#define NANOFS_FEAT_FILE_SIZE 0x0040 // Files keep their size, see below
+#define NANOFS_FEAT_EXTENTS  0x0080 // Data nodes indexed, see nanofs_extent.c
+#define NANOFS_FEAT_ALL      0x00FF // Flags known by this version
 
 #define DN_ISREG(dn) (!(dn.d_flags & 0x01))  ///< Is dir node regular file?
 #define DN_ISDIR(dn) (  dn.d_flags & 0x01 )  ///< Is dir node directory?
+#define DN_ISINLINE(dn) (dn.d_flags & (1 << NANOFS_FLG_INLINE)) ///< Inline data?
+#define DN_ISBTREE(dn) (dn.d_flags & (1 << NANOFS_FLG_BTREE)) ///< B-tree dir?
+
+/* Packed dir nodes, NANOFS_FEAT_PACKED_DIRS with 512 bytes blocks. A dir
+ * node is then referenced by its address, blockNo << NANOFS_DIR_SLOT_BITS
+ * | slot, instead of by its blockNo. It takes the slots needed for its
+ * header and name, contiguous in one block. Slot 0 of the block holds a
+ * struct nanofs_dir_block. */
+#define NANOFS_DIR_SLOT_BITS  4     ///< 16 slots per block
+#define NANOFS_DIR_SLOT_SIZE  32
+#define NANOFS_DIR_BLOCK_MAGIC 0x4e614470  // "NaDp"
+
+/** Slots taken by a dir node with a name of 'len' bytes */
+#define DN_SLOTS(len) ((NANOFS_HEADER_DIR_NODE_SIZE + (len) + \
+        NANOFS_DIR_SLOT_SIZE - 1) / NANOFS_DIR_SLOT_SIZE)
+/** Block and offset in the block of the dir node at 'addr', 'shift' is
+ * NANOFS_DIR_SLOT_BITS with packed dir nodes, 0 otherwise */
+#define DN_BLOCK(addr, shift)  ((addr) >> (shift))
+#define DN_OFFSET(addr, shift) \
+        (((addr) & ((1u << (shift)) - 1)) * NANOFS_DIR_SLOT_SIZE)
 
 
 /**
@@ -58,12 +94,171 @@ struct nanofs_superblock
     __u16 s_magic;
     __u8  s_blocksize;  ///< Block size. Set to 1 for 512 and fit in SD Cards
     __u8  s_revision;   ///< Filesystem revision, only 0 is valid
-    __u32 s_alloc_ptr;  ///< Absolute blockNo of allocated root entry
+    __u32 s_alloc_ptr;  ///< Absolute blockNo of allocated root entry, its
+                        ///<   address with NANOFS_FEAT_PACKED_DIRS
     __u32 s_free_ptr;   ///< Absolute blockNo of start of free blocks list
     __u32 s_fs_size;    ///< Filesystem size in blocks
     __u16 s_extra_size; ///< Extra superblock size in bytes
 };
 
+/** Extended superblock, revision 1. It is stored at byte NANOFS_SB_SIZE of
+ * block 0 and takes 's_extra_size' bytes, fields beyond that size read
+ * as 0.
+ * */
+struct nanofs_sb_extra
+{
+    __u32 s_features;       ///< NANOFS_FEAT_* flags
+    __u32 s_journal_ptr;    ///< Absolute blockNo of the journal
+    __u32 s_journal_blocks; ///< Journal size in blocks
+    __u32 s_journal_id;     ///< Random id set by mkfs, stamped in records
+    __u32 s_journal_seq;    ///< Sequence of the next record to replay
+    __u32 s_journal_head;   ///< Journal block where that record starts
+    __u32 s_orphan_ptr;     ///< Dir node of the first deleted file whose
+                            ///<   data is not freed yet, see nanofs_rm()
+};
+
+#define NANOFS_JOURNAL_MAGIC  0x4e614a72  // "NaJr"
+
+/** Journal record header, at the start of a journal block. Followed by
+ * 'j_count' entries, each one a nanofs_journal_entry and its data. A record
+ * is valid when magic, id and sequence match and the CRC32 of the header
+ * (with j_crc set to 0) and of the 'j_bytes' following bytes is 'j_crc'.
+ * */
+struct nanofs_journal_header
+{
+    __u32 j_magic;
+    __u32 j_id;         ///< s_journal_id of the filesystem
+    __u32 j_seq;        ///< Record sequence number
+    __u32 j_blocks;     ///< Record size in blocks, header included
+    __u32 j_count;      ///< Number of entries
+    __u32 j_bytes;      ///< Bytes of entries following the header
+    __u32 j_crc;
+};
+
+/** Journal record entry, 'e_len' bytes to be written at byte 'e_off' of
+ * block 'e_blk_no' follow it */
+struct nanofs_journal_entry
+{
+    __u32 e_blk_no;
+    __u16 e_off;
+    __u16 e_len;
+};
+
+#define NANOFS_DIR_INDEX_MAGIC 0x4e614478  // "NaDx"
+
+/** Bytes used at the start of each block of a directory index, they are
+ * updated through the header cache */
+#define NANOFS_DIR_INDEX_BLOCK 256
+/** Entries of a bucket */
+#define NANOFS_DIR_INDEX_SLOTS 31
+
+/** Directory index, pointed by 'd_meta_ptr' of a directory when the
+ * filesystem has NANOFS_FEAT_DIR_INDEX. It takes 1 + 'x_buckets' contiguous
+ * blocks: this header in the first one and a nanofs_dir_index_bucket at the
+ * start of each of the others. The child named 'name' is in bucket
+ * FNV-1a(name) % 'x_buckets', see nanofs_dindex_hash().
+ * */
+struct nanofs_dir_index
+{
+    __u32 x_magic;
+    __u32 x_buckets;
+};
+
+struct nanofs_dir_index_entry
+{
+    __u32 x_hash;       ///< Hash of the child name
+    __u32 x_blk_no;     ///< Absolute blockNo of the child dir node
+};
+
+/** Bucket of a directory index, the first 'b_count' entries are used */
+struct nanofs_dir_index_bucket
+{
+    __u32 b_count;
+    __u32 b_pad;
+    struct nanofs_dir_index_entry b_entries[NANOFS_DIR_INDEX_SLOTS];
+};
+
+#define NANOFS_DIR_BTREE_MAGIC 0x4e614474  // "NaDt"
+
+/** Children of an inner node of a directory B-tree, a leaf holds one key
+ * less */
+#define NANOFS_DIR_BTREE_ORDER 41
+
+/** Node of a directory B-tree, it takes the start of one 512 bytes block.
+ * The key of a child is (FNV-1a(name) & 0x7fffffff) << 32 | address of its
+ * dir node, keys are kept sorted.
+ *
+ * A leaf holds 't_count' keys. An inner node holds 't_count' children,
+ * child i has the keys from t_keys[i - 1] up to t_keys[i], not included.
+ * */
+struct nanofs_dir_btree
+{
+    __u32 t_magic;
+    __u16 t_count;
+    __u16 t_level;      ///< 0 for leaves
+    __u64 t_keys[NANOFS_DIR_BTREE_ORDER - 1];
+    __u32 t_child[NANOFS_DIR_BTREE_ORDER]; ///< Blocks of children, inner
+};
+
+#define NANOFS_FILE_META_MAGIC 0x4e61467a  // "NaFz"
+
+/** m_flags of a file metadata block */
+#define NANOFS_META_EXTENTS 0x0001  ///< The file has an extent index
+
+/** Metadata of a regular file, pointed by 'd_meta_ptr' of the file when
+ * the filesystem has NANOFS_FEAT_FILE_SIZE. It takes the start of one
+ * block and is updated through the header cache. A file with data nodes
+ * and no metadata block has its size found walking them.
+ *
+ * With NANOFS_FEAT_EXTENTS the block is allocated with the first data node
+ * of the file and has the root of its extent index, see struct
+ * nanofs_extent_node.
+ * */
+struct nanofs_file_meta
+{
+    __u32 m_magic;
+    __u16 m_flags;      ///< NANOFS_META_* flags
+    __u16 m_levels;     ///< Levels of the extent index, 0 if it is empty
+    __u64 m_size;       ///< Sum of the lengths of the data nodes
+    __u32 m_extents;    ///< Absolute blockNo of the extent index root
+    __u32 m_count;      ///< Data nodes in the extent index
+};
+
+#define NANOFS_EXTENT_MAGIC 0x4e614578  // "NaEx"
+
+/** Entries of a node of an extent index */
+#define NANOFS_EXTENT_SLOTS 31
+
+/** Data node of a file in a leaf, or node one level down in an inner
+ * node with 'x_offset' the offset of its first data node */
+struct nanofs_extent_entry
+{
+    __u64 x_offset;     ///< File offset of the data of the node
+    __u32 x_blk_no;
+    __u32 x_pad;
+};
+
+/** Node of the extent index of a file, it takes the start of one block.
+ * The index lists the data nodes of the file in file order, nodes are
+ * only appended to a file so entries are only added at the end and a
+ * full node is never split. The length of a data node is in its header.
+ * */
+struct nanofs_extent_node
+{
+    __u32 n_magic;
+    __u16 n_count;
+    __u16 n_level;      ///< 0 for leaves
+    struct nanofs_extent_entry n_entries[NANOFS_EXTENT_SLOTS];
+};
+
+/** Header of a block of packed dir nodes */
+struct nanofs_dir_block
+{
+    __u32 p_magic;
+    __u16 p_used;       ///< Bitmap of used slots, bit 0 is this header
+    __u16 p_pad;
+};
+
 /** Be carefully reading this struct from device
  * is not aligned to 8bits in memory. In disk must be aligned to 8bits
  * */
@@ -71,9 +266,14 @@ struct nanofs_superblock
 struct nanofs_dir_node
 {
     __u8  d_flags;      ///< Directory entry flags
-    __u32 d_next_ptr;   ///< Absolute blockNo of next directory entry
-    __u32 d_data_ptr;   ///< Absolute blockNo of first child data block
-    __u32 d_meta_ptr;   ///< Absolute blockNo of first metadata block
+    __u32 d_next_ptr;   ///< Absolute blockNo of next directory entry, its
+                        ///<   address with packed dir nodes
+    __u32 d_data_ptr;   ///< Absolute blockNo of first child data block, the
+                        ///<   address of the first child of a directory,
+                        ///<   the size of inline data, the B-tree root
+    __u32 d_meta_ptr;   ///< Absolute blockNo of first metadata block, the
+                        ///<   index of a directory, the size of a file,
+                        ///<   0 if none
     __u8  d_fname_len;  ///< Length in bytes of filename
     __u8  d_fname[NANOFS_MAXFILENAME]; //< Name of file
 };
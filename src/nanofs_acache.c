@@ -0,0 +1,95 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_acache.c
+    @version 0.4
+    @brief Cache of file sizes
+
+    The size of a file is the sum of the lengths of its data nodes, so
+    finding it reads every node header of the file, or the metadata block
+    of the file with NANOFS_FEAT_FILE_SIZE. Listing a directory
+    with attributes asks for the size of each child, and the kernel asks
+    again for each of them right after. The cache keeps the sizes found by
+    dir node address in a table with one entry per slot, a new entry takes
+    the place of the one in its slot.
+
+    A dir node address is only reused once the node is freed. Writes
+    update the entry of the file, entries are dropped when the data of the
+    file changes otherwise and when its dir node is freed.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+
+#include "nanofs_acache.h"
+
+static unsigned slot_of(__u32 blk_no)
+{
+    return (blk_no * 2654435761u) & (NANOFS_ACACHE_SLOTS - 1);
+}
+
+/** Allocate the table, the cache stays disabled when there is no memory */
+void nanofs_acache_init(struct nanofs_acache *ac)
+{
+    ac->c_slot = calloc(NANOFS_ACACHE_SLOTS,
+            sizeof(struct nanofs_acache_entry));
+}
+
+void nanofs_acache_destroy(struct nanofs_acache *ac)
+{
+    free(ac->c_slot);
+    ac->c_slot = NULL;
+}
+
+/** Get the cached size of a file
+ * @return 0 on success | -1 when it is not cached */
+int nanofs_acache_get(struct nanofs_acache *ac, __u32 blk_no,
+        __u64 *size_out)
+{
+    struct nanofs_acache_entry *e;
+
+    if (ac->c_slot == NULL || blk_no == 0)
+        return -1;
+    e = &ac->c_slot[slot_of(blk_no)];
+    if (e->a_blk_no != blk_no)
+        return -1;
+    *size_out = e->a_size;
+    return 0;
+}
+
+void nanofs_acache_set(struct nanofs_acache *ac, __u32 blk_no, __u64 size)
+{
+    struct nanofs_acache_entry *e;
+
+    if (ac->c_slot == NULL)
+        return;
+    e = &ac->c_slot[slot_of(blk_no)];
+    e->a_blk_no = blk_no;
+    e->a_size = size;
+}
+
+void nanofs_acache_forget(struct nanofs_acache *ac, __u32 blk_no)
+{
+    struct nanofs_acache_entry *e;
+
+    if (ac->c_slot == NULL)
+        return;
+    e = &ac->c_slot[slot_of(blk_no)];
+    if (e->a_blk_no == blk_no)
+        e->a_blk_no = 0;
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_acache.h
+    @version 0.4
+    @brief Cache of file sizes
+
+******************************************************************************/
+
+#ifndef __NANOFS_ACACHE_H__
+#define __NANOFS_ACACHE_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/** Slots of the table, a power of 2 */
+#define NANOFS_ACACHE_SLOTS (16 * 1024)
+
+/** Size of a file, a_blk_no is 0 when the slot is free */
+struct nanofs_acache_entry {
+    __u32 a_blk_no;                     ///< Dir node of the file
+    __u64 a_size;
+};
+
+/** Sizes found by nanofs_get_file_size() and set by nanofs_write(). The
+ * other functions that change the data of a file, or free its dir node,
+ * drop its entry. */
+struct nanofs_acache {
+    struct nanofs_acache_entry *c_slot; ///< NULL disables the cache
+};
+
+void nanofs_acache_init(struct nanofs_acache *ac);
+void nanofs_acache_destroy(struct nanofs_acache *ac);
+
+int  nanofs_acache_get(struct nanofs_acache *ac, __u32 blk_no,
+        __u64 *size_out);
+void nanofs_acache_set(struct nanofs_acache *ac, __u32 blk_no, __u64 size);
+void nanofs_acache_forget(struct nanofs_acache *ac, __u32 blk_no);
+
+#endif
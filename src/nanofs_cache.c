@@ -0,0 +1,571 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_cache.c
+    @version 0.4
+    @brief Write-back cache of node headers
+
+    Each entry keeps the first NANOFS_CACHE_DATA bytes of a block, where dir
+    node and data node headers live, packed dir nodes fill whole blocks.
+    Entries are found by block number in a hash table and replaced in LRU
+    order, dirty bytes are written back on eviction and on
+    nanofs_cache_flush().
+
+    With 1 byte blocks the ranges of two entries can overlap. Every write,
+    cached or not, is copied to all the entries it overlaps so they always
+    agree with each other, and dirty entries overlapping a range are written
+    back before the range is read from the device.
+
+    When dirty entries are pinned (journal mounts) they are only written by
+    nanofs_cache_flush(), the cache grows over its cap instead of evicting
+    them. Blocks must then be at least NANOFS_CACHE_DATA bytes so entries
+    never overlap.
+
+******************************************************************************/
+
+#define _LARGEFILE64_SOURCE
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "nanofs.h"
+#include "nanofs_io.h"
+#include "nanofs_dev.h"
+#include "nanofs_cache.h"
+#include "nanofs_stats.h"
+
+#define CACHE_MIN_HASH_BITS 6
+
+static off_t entry_offset(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    return (off_t)(e->e_blk_no) << c->c_block_bits;
+}
+
+static unsigned cache_hash(struct nanofs_cache *c, __u32 blk_no)
+{
+    return (blk_no * 2654435761u) >> (32 - c->c_hash_bits);
+}
+
+static struct nanofs_cache_entry *cache_lookup(struct nanofs_cache *c,
+        __u32 blk_no)
+{
+    struct nanofs_cache_entry *e;
+
+    for (e = c->c_hash[cache_hash(c, blk_no)]; e != NULL; e = e->e_hnext)
+        if (e->e_blk_no == blk_no)
+            return e;
+    return NULL;
+}
+
+static void hash_insert(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    unsigned h = cache_hash(c, e->e_blk_no);
+
+    e->e_hnext = c->c_hash[h];
+    c->c_hash[h] = e;
+}
+
+static void hash_remove(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    struct nanofs_cache_entry **p = &c->c_hash[cache_hash(c, e->e_blk_no)];
+
+    while (*p != e)
+        p = &(*p)->e_hnext;
+    *p = e->e_hnext;
+}
+
+static void lru_unlink(struct nanofs_cache_entry *e)
+{
+    e->e_prev->e_next = e->e_next;
+    e->e_next->e_prev = e->e_prev;
+}
+
+static void lru_push(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    e->e_next = c->c_lru.e_next;
+    e->e_prev = &c->c_lru;
+    c->c_lru.e_next->e_prev = e;
+    c->c_lru.e_next = e;
+}
+
+/** Write the dirty bytes of an entry
+ * @return 0 on success | -1 on error, c_error is set */
+static int entry_writeback(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    int lo = e->e_dirty_lo, size = e->e_dirty_hi - e->e_dirty_lo;
+
+    if (size == 0)
+        return 0;
+    e->e_dirty_lo = e->e_dirty_hi = 0;
+    c->c_ndirty--;
+    NANOFS_STAT_INC(c->c_dev->d_stats, st_cache_writebacks);
+    if (nanofs_write_dev(c->c_dev, entry_offset(c, e) + lo, e->e_data + lo,
+            size) != size)
+    {
+        log_error("nanofs_cache: write back of block %u failed", e->e_blk_no);
+        c->c_error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/** Remove the least recently used entry, it is written back if dirty.
+ * Pinned dirty entries are skipped.
+ * @return the entry, not linked anywhere | NULL if there is none */
+static struct nanofs_cache_entry *cache_evict(struct nanofs_cache *c)
+{
+    struct nanofs_cache_entry *e = c->c_lru.e_prev;
+
+    if (c->c_pin_dirty)
+        while (e != &c->c_lru && e->e_dirty_lo != e->e_dirty_hi)
+            e = e->e_prev;
+    if (e == &c->c_lru)
+        return NULL;
+    entry_writeback(c, e);
+    hash_remove(c, e);
+    lru_unlink(e);
+    return e;
+}
+
+/** New entry for 'blk_no', linked and empty
+ * @return the entry | NULL without memory */
+static struct nanofs_cache_entry *cache_new(struct nanofs_cache *c,
+        __u32 blk_no)
+{
+    struct nanofs_cache_entry *e = NULL;
+
+    if (c->c_count >= c->c_max)
+        e = cache_evict(c);
+    if (e == NULL)
+    {
+        e = malloc(sizeof(struct nanofs_cache_entry));
+        if (e == NULL)
+            return NULL;
+        c->c_count++;
+    }
+    e->e_blk_no = blk_no;
+    e->e_len = 0;
+    e->e_dirty_lo = e->e_dirty_hi = 0;
+    hash_insert(c, e);
+    lru_push(c, e);
+    return e;
+}
+
+/** Drop an entry that could not be filled */
+static void cache_drop(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    hash_remove(c, e);
+    lru_unlink(e);
+    free(e);
+    c->c_count--;
+}
+
+typedef void (*overlap_fn)(struct nanofs_cache *c,
+        struct nanofs_cache_entry *e, off_t offset, const __u8 *buf,
+        size_t size);
+
+/** Call 'fn' for each entry overlapping [offset, offset + size) */
+static void cache_overlaps(struct nanofs_cache *c, off_t offset, size_t size,
+        overlap_fn fn, const __u8 *buf)
+{
+    struct nanofs_cache_entry *e, *next;
+    off_t first, e_off;
+    __u32 blk, blk_first, blk_last;
+
+    if (c->c_count == 0 || size == 0)
+        return;
+    first = offset - (NANOFS_CACHE_DATA - 1);
+    if (first < 0)
+        first = 0;
+    blk_first = first >> c->c_block_bits;
+    blk_last = (offset + size - 1) >> c->c_block_bits;
+
+    if (blk_last - blk_first >= c->c_count)
+    {
+        // Cheaper to check all the entries
+        for (e = c->c_lru.e_next; e != &c->c_lru; e = next)
+        {
+            next = e->e_next;
+            e_off = entry_offset(c, e);
+            if (e_off < offset + (off_t)size && offset < e_off + e->e_len)
+                fn(c, e, offset, buf, size);
+        }
+        return;
+    }
+    for (blk = blk_first; blk <= blk_last; blk++)
+    {
+        e = cache_lookup(c, blk);
+        if (e == NULL)
+            continue;
+        e_off = entry_offset(c, e);
+        if (e_off < offset + (off_t)size && offset < e_off + e->e_len)
+            fn(c, e, offset, buf, size);
+    }
+}
+
+/** Copy the part of a write that falls in the entry */
+static void overlap_patch(struct nanofs_cache *c, struct nanofs_cache_entry *e,
+        off_t offset, const __u8 *buf, size_t size)
+{
+    off_t e_off = entry_offset(c, e);
+    off_t lo = offset > e_off ? offset : e_off;
+    off_t hi = offset + (off_t)size < e_off + e->e_len ?
+            offset + (off_t)size : e_off + e->e_len;
+
+    memcpy(e->e_data + (lo - e_off), buf + (lo - offset), hi - lo);
+}
+
+/** Drop the dirty range of an entry when the write covers it */
+static void overlap_clean(struct nanofs_cache *c, struct nanofs_cache_entry *e,
+        off_t offset, const __u8 *buf, size_t size)
+{
+    off_t e_off = entry_offset(c, e);
+
+    (void)buf;
+    if (e->e_dirty_lo == e->e_dirty_hi)
+        return;
+    if (offset <= e_off + e->e_dirty_lo &&
+            e_off + e->e_dirty_hi <= offset + (off_t)size)
+    {
+        e->e_dirty_lo = e->e_dirty_hi = 0;
+        c->c_ndirty--;
+    }
+}
+
+static void overlap_writeback(struct nanofs_cache *c,
+        struct nanofs_cache_entry *e, off_t offset, const __u8 *buf,
+        size_t size)
+{
+    (void)offset;
+    (void)buf;
+    (void)size;
+    entry_writeback(c, e);
+}
+
+/** Read the rest of the entry from the device, a short read is only
+ * possible at the end of the device
+ * @return 0 on success | -1 on error */
+static int entry_fill(struct nanofs_cache *c, struct nanofs_cache_entry *e)
+{
+    off_t offset = entry_offset(c, e) + e->e_len;
+    size_t size = NANOFS_CACHE_DATA - e->e_len;
+    ssize_t res;
+
+    // Device bytes may be older than dirty entries sharing the range
+    cache_overlaps(c, offset, size, overlap_writeback, NULL);
+    res = nanofs_dev_pread(c->c_dev, offset, e->e_data + e->e_len, size);
+    if (res < 0)
+        return -1;
+    e->e_len += res;
+    return 0;
+}
+
+static int cache_rehash(struct nanofs_cache *c, int bits)
+{
+    struct nanofs_cache_entry **hash, *e;
+
+    hash = calloc((size_t)1 << bits, sizeof(struct nanofs_cache_entry *));
+    if (hash == NULL)
+        return -1;
+    free(c->c_hash);
+    c->c_hash = hash;
+    c->c_hash_bits = bits;
+    for (e = c->c_lru.e_next; e != &c->c_lru; e = e->e_next)
+        hash_insert(c, e);
+    return 0;
+}
+
+
+/** Init an empty cache
+ * @param max_bytes Memory cap, 0 disables caching
+ * @return 0 on success | -1 without memory */
+int nanofs_cache_init(struct nanofs_cache *cache, struct nanofs_dev *dev,
+        int block_bits, size_t max_bytes)
+{
+    memset(cache, 0, sizeof(struct nanofs_cache));
+    cache->c_dev = dev;
+    cache->c_block_bits = block_bits;
+    cache->c_lru.e_next = cache->c_lru.e_prev = &cache->c_lru;
+    return nanofs_cache_set_size(cache, max_bytes);
+}
+
+/** Free all the entries, dirty data is lost. See nanofs_cache_flush() */
+void nanofs_cache_destroy(struct nanofs_cache *cache)
+{
+    struct nanofs_cache_entry *e, *next;
+
+    if (cache->c_hash == NULL)
+        return;
+    for (e = cache->c_lru.e_next; e != &cache->c_lru; e = next)
+    {
+        next = e->e_next;
+        free(e);
+    }
+    free(cache->c_hash);
+    cache->c_hash = NULL;
+    cache->c_count = cache->c_ndirty = 0;
+    cache->c_lru.e_next = cache->c_lru.e_prev = &cache->c_lru;
+}
+
+/** Change the memory cap, entries over the new cap are evicted
+ * @return 0 on success | -1 on write back error or without memory */
+int nanofs_cache_set_size(struct nanofs_cache *cache, size_t max_bytes)
+{
+    size_t max = max_bytes / sizeof(struct nanofs_cache_entry);
+    struct nanofs_cache_entry *e;
+    int bits = CACHE_MIN_HASH_BITS;
+
+    while (cache->c_count > max && (e = cache_evict(cache)) != NULL)
+    {
+        free(e);
+        cache->c_count--;
+    }
+    cache->c_max = max;
+    while (((size_t)1 << bits) < max && bits < 31)
+        bits++;
+    if (cache->c_hash == NULL || bits > cache->c_hash_bits)
+        if (cache_rehash(cache, bits) != 0)
+            return -1;
+    return cache->c_error ? -1 : 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+    __u32 x = (*(struct nanofs_cache_entry **)a)->e_blk_no;
+    __u32 y = (*(struct nanofs_cache_entry **)b)->e_blk_no;
+
+    return x < y ? -1 : x > y;
+}
+
+/** Get the dirty entries in block order
+ * @param vec_out Array of entries, to be freed by the caller
+ * @return number of entries | -1 without memory */
+int nanofs_cache_dirty(struct nanofs_cache *cache,
+        struct nanofs_cache_entry ***vec_out)
+{
+    struct nanofs_cache_entry **vec, *e;
+    size_t n = 0;
+
+    vec = malloc((cache->c_ndirty + 1) * sizeof(struct nanofs_cache_entry *));
+    if (vec == NULL)
+        return -1;
+    for (e = cache->c_lru.e_next; e != &cache->c_lru; e = e->e_next)
+        if (e->e_dirty_lo != e->e_dirty_hi)
+            vec[n++] = e;
+    qsort(vec, n, sizeof(struct nanofs_cache_entry *), entry_cmp);
+    *vec_out = vec;
+    return n;
+}
+
+/** Write back all dirty entries, in block order and as one device batch
+ * @return 0 on success | -1 if any write back failed since the last flush */
+int nanofs_cache_flush(struct nanofs_cache *cache)
+{
+    struct nanofs_cache_entry **vec, *e;
+    int n, i, err;
+
+    if (cache->c_ndirty > 0)
+    {
+        n = nanofs_cache_dirty(cache, &vec);
+        nanofs_dev_batch_begin(cache->c_dev);
+        if (n < 0)
+        {
+            for (e = cache->c_lru.e_next; e != &cache->c_lru; e = e->e_next)
+                entry_writeback(cache, e);  // Unsorted, still correct
+        }
+        else
+        {
+            for (i = 0; i < n; i++)
+                entry_writeback(cache, vec[i]);
+            free(vec);
+        }
+        if (nanofs_dev_batch_end(cache->c_dev) != 0)
+            cache->c_error = 1;
+    }
+    // Pinned entries may have taken the cache over its cap
+    while (cache->c_count > cache->c_max && (e = cache_evict(cache)) != NULL)
+    {
+        free(e);
+        cache->c_count--;
+    }
+    err = cache->c_error ? -1 : 0;
+    cache->c_error = 0;
+    return err;
+}
+
+/** Get the cached start of a block, read from the device on a miss
+ * @param need Bytes required, at most NANOFS_CACHE_DATA
+ * @param len_out Valid bytes in the returned buffer, >= need
+ * @return the data, valid until the next call | NULL on error */
+__u8 *nanofs_cache_get(struct nanofs_cache *cache, __u32 blk_no, size_t need,
+        size_t *len_out)
+{
+    struct nanofs_cache_entry *e;
+    int created = 0;
+
+    e = cache_lookup(cache, blk_no);
+    if (e != NULL && e->e_len >= need)
+        NANOFS_STAT_INC(cache->c_dev->d_stats, st_cache_hits);
+    else
+        NANOFS_STAT_INC(cache->c_dev->d_stats, st_cache_misses);
+    if (e == NULL && cache->c_max == 0)
+    {
+        e = &cache->c_scratch;
+        e->e_blk_no = blk_no;
+        e->e_len = 0;
+        if (entry_fill(cache, e) != 0 || e->e_len < need)
+            return NULL;
+        *len_out = e->e_len;
+        return e->e_data;
+    }
+
+    if (e == NULL)
+    {
+        e = cache_new(cache, blk_no);
+        if (e == NULL)
+            return NULL;
+        created = 1;
+    }
+    else
+    {
+        lru_unlink(e);
+        lru_push(cache, e);
+    }
+    if (e->e_len < need && (entry_fill(cache, e) != 0 || e->e_len < need))
+    {
+        if (created)
+            cache_drop(cache, e);
+        return NULL;
+    }
+    *len_out = e->e_len;
+    return e->e_data;
+}
+
+/** Write the first 'len' bytes of a block, the device is updated on write
+ * back. Without caching the data is written now, unless dirty entries are
+ * pinned.
+ * @return 0 on success | -1 on error */
+int nanofs_cache_put(struct nanofs_cache *cache, __u32 blk_no,
+        const void *buf, size_t len)
+{
+    return nanofs_cache_put_at(cache, blk_no, 0, buf, len);
+}
+
+/** Write 'len' bytes at 'offset' of a block as nanofs_cache_put(), the
+ * bytes before 'offset' are read first when they are not cached
+ * @return 0 on success | -1 on error */
+int nanofs_cache_put_at(struct nanofs_cache *cache, __u32 blk_no,
+        size_t offset, const void *buf, size_t len)
+{
+    struct nanofs_cache_entry *e;
+    off_t dev_offset = ((off_t)(blk_no) << cache->c_block_bits) + offset;
+    int created = 0;
+
+    if (cache->c_max == 0 && !cache->c_pin_dirty)
+        return nanofs_write_dev(cache->c_dev, dev_offset, buf, len) ==
+                        (int)len ? 0 : -1;
+
+    // Entries of neighbour blocks may share the range
+    cache_overlaps(cache, dev_offset, len, overlap_patch, buf);
+    e = cache_lookup(cache, blk_no);
+    if (e == NULL)
+    {
+        e = cache_new(cache, blk_no);
+        if (e == NULL)
+            return -1;
+        created = 1;
+    }
+    else
+    {
+        lru_unlink(e);
+        lru_push(cache, e);
+    }
+    if (e->e_len < offset && (entry_fill(cache, e) != 0 || e->e_len < offset))
+    {
+        if (created)
+            cache_drop(cache, e);
+        return -1;
+    }
+    memcpy(e->e_data + offset, buf, len);
+    if (e->e_len < offset + len)
+        e->e_len = offset + len;
+    if (e->e_dirty_lo == e->e_dirty_hi)
+    {
+        cache->c_ndirty++;
+        e->e_dirty_lo = offset;
+        e->e_dirty_hi = offset + len;
+    }
+    else
+    {
+        if (e->e_dirty_lo > offset)
+            e->e_dirty_lo = offset;
+        if (e->e_dirty_hi < offset + len)
+            e->e_dirty_hi = offset + len;
+    }
+    return 0;
+}
+
+/** Cache the first 'len' bytes of a block the caller writes to the device
+ * itself, the entry is not made dirty. See nanofs_cache_clean().
+ * @return 0 on success | -1 without memory */
+int nanofs_cache_store(struct nanofs_cache *cache, __u32 blk_no,
+        const void *buf, size_t len)
+{
+    struct nanofs_cache_entry *e;
+
+    cache_overlaps(cache, (off_t)(blk_no) << cache->c_block_bits, len,
+            overlap_patch, buf);
+    if (cache->c_max == 0)
+        return 0;
+    e = cache_lookup(cache, blk_no);
+    if (e == NULL)
+    {
+        e = cache_new(cache, blk_no);
+        if (e == NULL)
+            return -1;
+    }
+    else
+    {
+        lru_unlink(e);
+        lru_push(cache, e);
+    }
+    memcpy(e->e_data, buf, len);
+    if (e->e_len < len)
+        e->e_len = len;
+    return 0;
+}
+
+/** Keep cached entries in sync with a write done directly to the device,
+ * e.g. file data */
+void nanofs_cache_patch(struct nanofs_cache *cache, off_t offset,
+        const void *buf, size_t size)
+{
+    cache_overlaps(cache, offset, size, overlap_patch, buf);
+}
+
+/** The range was written to the device after patching the cache, entries
+ * whose dirty bytes all lie in it do not need a write back. Pinned entries
+ * stay dirty.
+ * */
+void nanofs_cache_clean(struct nanofs_cache *cache, off_t offset, size_t size)
+{
+    if (!cache->c_pin_dirty)
+        cache_overlaps(cache, offset, size, overlap_clean, NULL);
+}
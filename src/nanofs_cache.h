@@ -0,0 +1,86 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_cache.h
+    @version 0.4
+    @brief Write-back cache of node headers
+
+******************************************************************************/
+
+#ifndef __NANOFS_CACHE_H__
+#define __NANOFS_CACHE_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+#include "nanofs.h"
+
+struct nanofs_dev;
+
+/** Bytes cached from the start of a block, a whole 512 bytes block as
+ * packed dir nodes may be anywhere in it */
+#define NANOFS_CACHE_DATA    512
+/** Default memory cap in bytes */
+#define NANOFS_CACHE_DEFAULT (2 * 1024 * 1024)
+
+/** Cached start of a block */
+struct nanofs_cache_entry {
+    __u32  e_blk_no;
+    __u16  e_len;                       ///< Valid bytes from block start
+    __u16  e_dirty_lo;                  ///< Dirty bytes [lo, hi), lo == hi
+    __u16  e_dirty_hi;                  ///<   when the entry is clean
+    struct nanofs_cache_entry *e_hnext; ///< Hash chain
+    struct nanofs_cache_entry *e_prev;  ///< LRU list, most recent first
+    struct nanofs_cache_entry *e_next;
+    __u8   e_data[NANOFS_CACHE_DATA];
+};
+
+struct nanofs_cache {
+    struct nanofs_dev *c_dev;
+    int    c_block_bits;
+    size_t c_max;                       ///< Max entries, 0 disables caching
+    size_t c_count;                     ///< Entries allocated
+    size_t c_ndirty;                    ///< Dirty entries
+    int    c_hash_bits;
+    struct nanofs_cache_entry **c_hash;
+    struct nanofs_cache_entry c_lru;    ///< LRU list head
+    struct nanofs_cache_entry c_scratch;///< Used when caching is disabled
+    int    c_error;                     ///< A write back failed
+    int    c_pin_dirty;                 ///< Dirty entries wait for a flush
+};
+
+int  nanofs_cache_init(struct nanofs_cache *cache, struct nanofs_dev *dev,
+        int block_bits, size_t max_bytes);
+void nanofs_cache_destroy(struct nanofs_cache *cache);
+int  nanofs_cache_set_size(struct nanofs_cache *cache, size_t max_bytes);
+int  nanofs_cache_flush(struct nanofs_cache *cache);
+int  nanofs_cache_dirty(struct nanofs_cache *cache,
+        struct nanofs_cache_entry ***vec_out);
+
+__u8 *nanofs_cache_get(struct nanofs_cache *cache, __u32 blk_no, size_t need,
+        size_t *len_out);
+int  nanofs_cache_put(struct nanofs_cache *cache, __u32 blk_no,
+        const void *buf, size_t len);
+int  nanofs_cache_put_at(struct nanofs_cache *cache, __u32 blk_no,
+        size_t offset, const void *buf, size_t len);
+int  nanofs_cache_store(struct nanofs_cache *cache, __u32 blk_no,
+        const void *buf, size_t len);
+void nanofs_cache_patch(struct nanofs_cache *cache, off_t offset,
+        const void *buf, size_t size);
+void nanofs_cache_clean(struct nanofs_cache *cache, off_t offset,
+        size_t size);
+
+#endif
@@ -0,0 +1,204 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dcache.c
+    @version 0.4
+    @brief Cache of resolved absolute paths
+
+    nanofs_lookup_absolute() walks a path from the root directory, one
+    nanofs_lookup() per component. The cache maps a whole path to the dir
+    node it resolves to, or to nothing when its last component does not
+    exist, so a path seen before takes one hash probe. Dir nodes are not
+    copied, they are read through the header cache which is always up to
+    date.
+
+    An entry only depends on the link between its parent directory and its
+    name. Linking or unlinking a dir node drops the entries of that parent
+    and name, and freeing a directory drops the entries below it, as its
+    block will be reused.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nanofs_dindex.h"
+#include "nanofs_dcache.h"
+
+static unsigned key_bucket(__u32 key)
+{
+    return key & (NANOFS_DCACHE_BUCKETS - 1);
+}
+
+/** Hash of a dir node linked in a directory */
+static __u32 entry_key(__u32 parent, const char *name, size_t len)
+{
+    return nanofs_dindex_hash((const __u8 *)name, len) ^
+            (parent * 2654435761u);
+}
+
+static void lru_unlink(struct nanofs_dcache_entry *e)
+{
+    e->e_prev->e_next = e->e_next;
+    e->e_next->e_prev = e->e_prev;
+}
+
+static void lru_push(struct nanofs_dcache *dc, struct nanofs_dcache_entry *e)
+{
+    e->e_next = dc->c_lru.e_next;
+    e->e_prev = &dc->c_lru;
+    dc->c_lru.e_next->e_prev = e;
+    dc->c_lru.e_next = e;
+}
+
+/** Unlink an entry from both tables and the LRU list and free it */
+static void entry_free(struct nanofs_dcache *dc, struct nanofs_dcache_entry *e)
+{
+    struct nanofs_dcache_entry **p;
+
+    p = &dc->c_hash[key_bucket(e->e_hash)];
+    while (*p != e)
+        p = &(*p)->e_hnext;
+    *p = e->e_hnext;
+    p = &dc->c_khash[key_bucket(e->e_key)];
+    while (*p != e)
+        p = &(*p)->e_knext;
+    *p = e->e_knext;
+    lru_unlink(e);
+    dc->c_count--;
+    free(e);
+}
+
+void nanofs_dcache_init(struct nanofs_dcache *dc, size_t max_entries)
+{
+    memset(dc, 0, sizeof(struct nanofs_dcache));
+    dc->c_max = max_entries;
+    dc->c_lru.e_next = dc->c_lru.e_prev = &dc->c_lru;
+}
+
+/** Free all the entries */
+void nanofs_dcache_destroy(struct nanofs_dcache *dc)
+{
+    while (dc->c_lru.e_next != &dc->c_lru)
+        entry_free(dc, dc->c_lru.e_next);
+}
+
+/** Get the entry of a path, it becomes the most recently used
+ * @return the entry | NULL if the path is not cached */
+struct nanofs_dcache_entry *nanofs_dcache_get(struct nanofs_dcache *dc,
+        const char *path, size_t len)
+{
+    struct nanofs_dcache_entry *e;
+    __u32 hash = nanofs_dindex_hash((const __u8 *)path, len);
+
+    for (e = dc->c_hash[key_bucket(hash)]; e != NULL; e = e->e_hnext)
+        if (e->e_hash == hash && e->e_len == len &&
+                memcmp(e->e_path, path, len) == 0)
+        {
+            lru_unlink(e);
+            lru_push(dc, e);
+            return e;
+        }
+    return NULL;
+}
+
+/** Cache the resolution of a path, its name is the text after the last
+ * '/', the least recently used entry is dropped when the cache is full
+ * @param parent Dir node of the directory holding the name
+ * @param blk_no Dir node of the path, 0 when the name does not exist
+ * */
+void nanofs_dcache_add(struct nanofs_dcache *dc, const char *path,
+        size_t len, __u32 parent, __u32 blk_no)
+{
+    struct nanofs_dcache_entry *e;
+    size_t name = len;
+
+    if (dc->c_max == 0 || len > 0xffff)
+        return;
+    e = nanofs_dcache_get(dc, path, len);
+    if (e != NULL)
+        entry_free(dc, e);
+    if (dc->c_count >= dc->c_max)
+        entry_free(dc, dc->c_lru.e_prev);
+    e = malloc(sizeof(struct nanofs_dcache_entry) + len + 1);
+    if (e == NULL)
+        return;
+    while (name > 0 && path[name - 1] != '/')
+        name--;
+    e->e_hash = nanofs_dindex_hash((const __u8 *)path, len);
+    e->e_key = entry_key(parent, path + name, len - name);
+    e->e_parent = parent;
+    e->e_blk_no = blk_no;
+    e->e_len = len;
+    e->e_name = name;
+    memcpy(e->e_path, path, len);
+    e->e_path[len] = 0;
+    e->e_hnext = dc->c_hash[key_bucket(e->e_hash)];
+    dc->c_hash[key_bucket(e->e_hash)] = e;
+    e->e_knext = dc->c_khash[key_bucket(e->e_key)];
+    dc->c_khash[key_bucket(e->e_key)] = e;
+    lru_push(dc, e);
+    dc->c_count++;
+}
+
+/** Drop the entries of a name in a directory, called when a dir node is
+ * linked or unlinked */
+void nanofs_dcache_forget(struct nanofs_dcache *dc, __u32 parent,
+        const char *name, size_t len)
+{
+    struct nanofs_dcache_entry *e, *next;
+    __u32 key = entry_key(parent, name, len);
+
+    for (e = dc->c_khash[key_bucket(key)]; e != NULL; e = next)
+    {
+        next = e->e_knext;
+        if (e->e_key == key && e->e_parent == parent &&
+                (size_t)(e->e_len - e->e_name) == len &&
+                memcmp(e->e_path + e->e_name, name, len) == 0)
+            entry_free(dc, e);
+    }
+}
+
+/** Drop the entries of names in a directory being freed */
+void nanofs_dcache_forget_dir(struct nanofs_dcache *dc, __u32 dir_blk_no)
+{
+    struct nanofs_dcache_entry *e, *next;
+
+    for (e = dc->c_lru.e_next; e != &dc->c_lru; e = next)
+    {
+        next = e->e_next;
+        if (e->e_parent == dir_blk_no)
+            entry_free(dc, e);
+    }
+}
+
+/** Drop the entries of the paths below a directory, called when it is
+ * renamed */
+void nanofs_dcache_forget_below(struct nanofs_dcache *dc, const char *path,
+        size_t len)
+{
+    struct nanofs_dcache_entry *e, *next;
+
+    for (e = dc->c_lru.e_next; e != &dc->c_lru; e = next)
+    {
+        next = e->e_next;
+        if (e->e_len > len && e->e_path[len] == '/' &&
+                memcmp(e->e_path, path, len) == 0)
+            entry_free(dc, e);
+    }
+}
@@ -0,0 +1,73 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dcache.h
+    @version 0.4
+    @brief Cache of resolved absolute paths
+
+******************************************************************************/
+
+#ifndef __NANOFS_DCACHE_H__
+#define __NANOFS_DCACHE_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/** Buckets of each of the two hash tables */
+#define NANOFS_DCACHE_BUCKETS 4096
+/** Default cap of entries */
+#define NANOFS_DCACHE_DEFAULT (16 * 1024)
+
+/** Resolved path, e_blk_no is 0 when the path does not exist */
+struct nanofs_dcache_entry {
+    __u32 e_hash;                       ///< Hash of the path
+    __u32 e_key;                        ///< Hash of parent and name
+    __u32 e_parent;                     ///< Dir node of the parent directory
+    __u32 e_blk_no;                     ///< Dir node of the path, 0 negative
+    __u16 e_len;                        ///< Path length
+    __u16 e_name;                       ///< Offset of the name in e_path
+    struct nanofs_dcache_entry *e_hnext;///< Path hash chain
+    struct nanofs_dcache_entry *e_knext;///< Parent and name hash chain
+    struct nanofs_dcache_entry *e_prev; ///< LRU list, most recent first
+    struct nanofs_dcache_entry *e_next;
+    char  e_path[];
+};
+
+/** Paths resolved by nanofs_lookup_absolute(). Entries are dropped by the
+ * functions that link and unlink dir nodes, looking them up by parent
+ * directory and name. */
+struct nanofs_dcache {
+    size_t c_max;                       ///< Max entries, 0 disables the cache
+    size_t c_count;
+    struct nanofs_dcache_entry *c_hash[NANOFS_DCACHE_BUCKETS];
+    struct nanofs_dcache_entry *c_khash[NANOFS_DCACHE_BUCKETS];
+    struct nanofs_dcache_entry c_lru;   ///< LRU list head
+};
+
+void nanofs_dcache_init(struct nanofs_dcache *dc, size_t max_entries);
+void nanofs_dcache_destroy(struct nanofs_dcache *dc);
+
+struct nanofs_dcache_entry *nanofs_dcache_get(struct nanofs_dcache *dc,
+        const char *path, size_t len);
+void nanofs_dcache_add(struct nanofs_dcache *dc, const char *path,
+        size_t len, __u32 parent, __u32 blk_no);
+void nanofs_dcache_forget(struct nanofs_dcache *dc, __u32 parent,
+        const char *name, size_t len);
+void nanofs_dcache_forget_dir(struct nanofs_dcache *dc, __u32 dir_blk_no);
+void nanofs_dcache_forget_below(struct nanofs_dcache *dc, const char *path,
+        size_t len);
+
+#endif
@@ -0,0 +1,882 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dev.c
+    @version 0.4
+    @brief Block device backends (storage engines)
+
+    Four engines are available:
+     - posix: plain descriptor with positional I/O, works with block devices.
+              With O_DIRECT the host page cache is bypassed, transfers are
+              staged in aligned bounce buffers.
+     - uring: posix engine whose batches are submitted with io_uring, only
+              when built with liburing (see nanofs_dev_uring.c)
+     - mmap:  the image file is mapped with MAP_SHARED, I/O is a memcpy
+     - ram:   the image is copied to anonymous memory on open, nothing is
+              written back. Useful as test double and for benchmarking the
+              file system code without the kernel in the way.
+
+******************************************************************************/
+
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+
+#include <config.h>
+#include <asm/types.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "nanofs_dev.h"
+#include "nanofs_stats.h"
+#include "nanofs_trace.h"
+
+
+/* Posix engine */
+
+static ssize_t posix_read(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size)
+{
+    return pread(dev->d_fd, buf, size, offset);
+}
+
+static ssize_t posix_write(struct nanofs_dev *dev, off_t offset,
+        const void *buf, size_t size)
+{
+    return pwrite(dev->d_fd, buf, size, offset);
+}
+
+static ssize_t posix_readv(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    return preadv(dev->d_fd, iov, iovcnt, offset);
+}
+
+static ssize_t posix_writev(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    return pwritev(dev->d_fd, iov, iovcnt, offset);
+}
+
+static int posix_flush(struct nanofs_dev *dev)
+{
+    return fdatasync(dev->d_fd);
+}
+
+/** Discard a range, punch a hole in image files or BLKDISCARD on devices.
+ * Not supported ranges are silently ignored, discard is only a hint */
+static int posix_discard(struct nanofs_dev *dev, off_t offset, off_t size)
+{
+    struct stat st;
+    __u64 range[2];
+
+    if (fstat(dev->d_fd, &st) != 0)
+        return -1;
+    if (S_ISBLK(st.st_mode))
+    {
+        range[0] = offset;
+        range[1] = size;
+        ioctl(dev->d_fd, BLKDISCARD, &range);
+    }
+    else
+        fallocate(dev->d_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                offset, size);
+    return 0;
+}
+
+static off_t dev_size(struct nanofs_dev *dev)
+{
+    return dev->d_size;
+}
+
+static void posix_close(struct nanofs_dev *dev)
+{
+    close(dev->d_fd);
+}
+
+static const struct nanofs_dev_ops posix_ops = {
+    .name    = "posix",
+    .read    = posix_read,
+    .write   = posix_write,
+    .readv   = posix_readv,
+    .writev  = posix_writev,
+    .flush   = posix_flush,
+    .discard = posix_discard,
+    .size    = dev_size,
+    .close   = posix_close
+};
+
+
+/* Posix engine with O_DIRECT
+ *
+ * Offset, length and memory of every transfer must be aligned to the
+ * logical block size of the device. A request is widened to aligned windows
+ * of at most one bounce buffer. The part of a window out of the request is
+ * read first on writes (read-modify-write), this happens for node headers
+ * and most payload writes. The read-modify-write of a window is not atomic,
+ * concurrent writes to the same device block must be serialized by the
+ * caller, as done by the file system lock.
+ * */
+
+/** Take a buffer from the pool, a new one is allocated when all are busy
+ * @param idx Pool index, -1 when allocated
+ * @return the buffer | NULL without memory */
+static __u8 *dio_get(struct nanofs_dev_dio_pool *pool, int *idx)
+{
+    void *buf;
+    int i;
+
+    for (i = 0; i < NANOFS_DEV_DIO_BUFS; i++)
+        if (__sync_lock_test_and_set(&pool->p_busy[i], 1) == 0)
+        {
+            *idx = i;
+            return pool->p_buf[i];
+        }
+    *idx = -1;
+    if (posix_memalign(&buf, pool->p_align, pool->p_size) != 0)
+        return NULL;
+    return buf;
+}
+
+static void dio_put(struct nanofs_dev_dio_pool *pool, __u8 *buf, int idx)
+{
+    if (idx < 0)
+        free(buf);
+    else
+        __sync_lock_release(&pool->p_busy[idx]);
+}
+
+/** Copy 'size' bytes between 'buf' and the iovec, starting at byte 'pos'
+ * of the iovec data
+ * @param to_iov 1 copies buf to iovec, 0 the iovec to buf */
+static void dio_copy(const struct iovec *iov, int iovcnt, size_t pos,
+        __u8 *buf, size_t size, int to_iov)
+{
+    size_t n;
+    int i;
+
+    for (i = 0; i < iovcnt && size > 0; i++)
+    {
+        if (pos >= iov[i].iov_len)
+        {
+            pos -= iov[i].iov_len;
+            continue;
+        }
+        n = iov[i].iov_len - pos;
+        if (n > size)
+            n = size;
+        if (to_iov)
+            memcpy((__u8 *)iov[i].iov_base + pos, buf, n);
+        else
+            memcpy(buf, (__u8 *)iov[i].iov_base + pos, n);
+        buf += n;
+        size -= n;
+        pos = 0;
+    }
+}
+
+/** Transfer through bounce buffers, pread/pwrite semantics */
+static ssize_t dio_xfer(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt, int write)
+{
+    struct nanofs_dev_dio_pool *pool = dev->d_priv;
+    size_t align = pool->p_align;
+    size_t total = 0, done = 0, skip, wlen, chunk;
+    off_t wstart;
+    ssize_t res = 0;
+    __u8 *buf;
+    int i, idx;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    // Already aligned, no bounce buffer
+    if (iovcnt == 1 && ((size_t)offset & (align - 1)) == 0 &&
+            (total & (align - 1)) == 0 &&
+            ((size_t)iov[0].iov_base & (align - 1)) == 0)
+        return write ? pwrite(dev->d_fd, iov[0].iov_base, total, offset) :
+                pread(dev->d_fd, iov[0].iov_base, total, offset);
+
+    buf = dio_get(pool, &idx);
+    if (buf == NULL)
+        return -1;
+    while (done < total)
+    {
+        wstart = (offset + done) & ~(off_t)(align - 1);
+        skip = offset + done - wstart;
+        wlen = (skip + total - done + align - 1) & ~(align - 1);
+        if (wlen > pool->p_size)
+            wlen = pool->p_size;
+        chunk = wlen - skip;
+        if (chunk > total - done)
+            chunk = total - done;
+
+        if (!write || skip != 0 || chunk != wlen)
+        {
+            res = pread(dev->d_fd, buf, wlen, wstart);
+            if (res < 0)
+                break;
+            if (write && (size_t)res < wlen)
+                memset(buf + res, 0, wlen - res);
+            if (!write && (size_t)res < skip + chunk)
+            {
+                // End of device
+                if ((size_t)res > skip)
+                {
+                    dio_copy(iov, iovcnt, done, buf + skip, res - skip, 1);
+                    done += res - skip;
+                }
+                break;
+            }
+        }
+        if (write)
+        {
+            dio_copy(iov, iovcnt, done, buf + skip, chunk, 0);
+            res = pwrite(dev->d_fd, buf, wlen, wstart);
+            if (res != (ssize_t)wlen)
+                break;
+        }
+        else
+            dio_copy(iov, iovcnt, done, buf + skip, chunk, 1);
+        done += chunk;
+    }
+    dio_put(pool, buf, idx);
+    if (done == 0 && total > 0 && (write || res < 0))
+        return -1;
+    return done;
+}
+
+static ssize_t dio_read(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    return dio_xfer(dev, offset, &iov, 1, 0);
+}
+
+static ssize_t dio_write(struct nanofs_dev *dev, off_t offset,
+        const void *buf, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = size;
+    return dio_xfer(dev, offset, &iov, 1, 1);
+}
+
+static ssize_t dio_readv(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    return dio_xfer(dev, offset, iov, iovcnt, 0);
+}
+
+static ssize_t dio_writev(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    return dio_xfer(dev, offset, iov, iovcnt, 1);
+}
+
+static void dio_pool_free(struct nanofs_dev_dio_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < NANOFS_DEV_DIO_BUFS; i++)
+        free(pool->p_buf[i]);
+    free(pool);
+}
+
+static void dio_close(struct nanofs_dev *dev)
+{
+    dio_pool_free(dev->d_priv);
+    dev->d_priv = NULL;
+    close(dev->d_fd);
+}
+
+static const struct nanofs_dev_ops dio_ops = {
+    .name    = "posix-direct",
+    .read    = dio_read,
+    .write   = dio_write,
+    .readv   = dio_readv,
+    .writev  = dio_writev,
+    .flush   = posix_flush,
+    .discard = posix_discard,
+    .size    = dev_size,
+    .close   = dio_close
+};
+
+/** Set up the bounce buffers, aligned to the logical block size
+ * @return 0 on success | -1 on error */
+static int dio_init(struct nanofs_dev *dev)
+{
+    struct nanofs_dev_dio_pool *pool;
+    struct stat st;
+    int i, sector = 0;
+
+    pool = calloc(1, sizeof(struct nanofs_dev_dio_pool));
+    if (pool == NULL)
+        return -1;
+    pool->p_align = NANOFS_DEV_DIO_ALIGN;
+    if (fstat(dev->d_fd, &st) == 0 && S_ISBLK(st.st_mode) &&
+            ioctl(dev->d_fd, BLKSSZGET, &sector) == 0 &&
+            (size_t)sector > pool->p_align)
+        pool->p_align = sector;
+    pool->p_size = NANOFS_DEV_DIO_BUF_SIZE;
+    if (pool->p_size < pool->p_align)
+        pool->p_size = pool->p_align;
+    for (i = 0; i < NANOFS_DEV_DIO_BUFS; i++)
+        if (posix_memalign((void **)&pool->p_buf[i], pool->p_align,
+                pool->p_size) != 0)
+        {
+            dio_pool_free(pool);
+            return -1;
+        }
+    dev->d_priv = pool;
+    dev->d_ops = &dio_ops;
+    return 0;
+}
+
+
+/* Memory engines: mmap and ram share the I/O functions, the image is at
+ * 'd_map' with 'd_size' bytes */
+
+static ssize_t mem_read(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size)
+{
+    if (offset < 0)
+        return -1;
+    if (offset >= dev->d_size)
+        return 0;
+    if ((off_t)size > dev->d_size - offset)
+        size = dev->d_size - offset;
+    memcpy(buf, dev->d_map + offset, size);
+    return size;
+}
+
+static ssize_t mem_write(struct nanofs_dev *dev, off_t offset,
+        const void *buf, size_t size)
+{
+    if (offset < 0 || (dev->d_oflags & O_ACCMODE) == O_RDONLY)
+        return -1;
+    if (offset >= dev->d_size)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    if ((off_t)size > dev->d_size - offset)
+        size = dev->d_size - offset;
+    memcpy(dev->d_map + offset, buf, size);
+    return size;
+}
+
+static ssize_t mem_readv(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0, res;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+    {
+        res = mem_read(dev, offset + total, iov[i].iov_base, iov[i].iov_len);
+        if (res < 0)
+            return -1;
+        total += res;
+        if ((size_t)res < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+static ssize_t mem_writev(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0, res;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+    {
+        res = mem_write(dev, offset + total, iov[i].iov_base, iov[i].iov_len);
+        if (res < 0)
+            return total > 0 ? total : -1;
+        total += res;
+        if ((size_t)res < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+static int mmap_flush(struct nanofs_dev *dev)
+{
+    return msync(dev->d_map, dev->d_size, MS_SYNC);
+}
+
+static int mmap_discard(struct nanofs_dev *dev, off_t offset, off_t size)
+{
+    return posix_discard(dev, offset, size);
+}
+
+static void mmap_close(struct nanofs_dev *dev)
+{
+    if ((dev->d_oflags & O_ACCMODE) != O_RDONLY)
+        msync(dev->d_map, dev->d_size, MS_SYNC);
+    munmap(dev->d_map, dev->d_size);
+    close(dev->d_fd);
+}
+
+static const struct nanofs_dev_ops mmap_ops = {
+    .name    = "mmap",
+    .read    = mem_read,
+    .write   = mem_write,
+    .readv   = mem_readv,
+    .writev  = mem_writev,
+    .flush   = mmap_flush,
+    .discard = mmap_discard,
+    .size    = dev_size,
+    .close   = mmap_close
+};
+
+static int ram_flush(struct nanofs_dev *dev)
+{
+    (void)dev;
+    return 0;
+}
+
+static int ram_discard(struct nanofs_dev *dev, off_t offset, off_t size)
+{
+    (void)dev;
+    (void)offset;
+    (void)size;
+    return 0;
+}
+
+static void ram_close(struct nanofs_dev *dev)
+{
+    free(dev->d_map);
+}
+
+static const struct nanofs_dev_ops ram_ops = {
+    .name    = "ram",
+    .read    = mem_read,
+    .write   = mem_write,
+    .readv   = mem_readv,
+    .writev  = mem_writev,
+    .flush   = ram_flush,
+    .discard = ram_discard,
+    .size    = dev_size,
+    .close   = ram_close
+};
+
+
+/** Copy the whole image into RAM
+ * @return 0 on success | -1 on error */
+static int ram_load(struct nanofs_dev *dev)
+{
+    off_t pos = 0;
+    ssize_t res;
+
+    dev->d_map = malloc(dev->d_size);
+    if (dev->d_map == NULL)
+        return -1;
+    while (pos < dev->d_size)
+    {
+        res = pread(dev->d_fd, dev->d_map + pos, dev->d_size - pos, pos);
+        if (res <= 0)
+        {
+            free(dev->d_map);
+            return -1;
+        }
+        pos += res;
+    }
+    return 0;
+}
+
+/* Batched I/O
+ *
+ * While a batch is open writes are queued instead of issued. Requests are
+ * kept free of overlaps: a read that overlaps a queued write, or a write
+ * that overlaps any queued request, first submits the pending ones. Hence
+ * the submit function of the engine may run them in any order.
+ * */
+
+/** Execute the queued requests and empty the queue
+ * @return 0 on success | -1 if any request failed */
+static int batch_submit(struct nanofs_dev *dev)
+{
+    struct nanofs_dev_batch *b = dev->d_batch;
+    struct nanofs_dev_req *r;
+    ssize_t res;
+    int i, err = 0;
+
+    if (b->b_nreqs == 0)
+        return 0;
+    NANOFS_STAT_INC(dev->d_stats, st_dev_batches);
+    if (dev->d_ops->submit != NULL)
+        err = dev->d_ops->submit(dev, b->b_reqs, b->b_nreqs);
+    else
+        for (i = 0; i < b->b_nreqs; i++)
+        {
+            r = &b->b_reqs[i];
+            if (r->r_write)
+                res = dev->d_ops->writev(dev, r->r_offset, r->r_iov,
+                        r->r_iovcnt);
+            else
+                res = dev->d_ops->readv(dev, r->r_offset, r->r_iov,
+                        r->r_iovcnt);
+            if (res != (ssize_t)r->r_len)
+                err = -1;
+        }
+    if (err != 0)
+    {
+        log_error("nanofs_dev: batch of %d requests failed", b->b_nreqs);
+        b->b_error = 1;
+    }
+    b->b_nreqs = 0;
+    b->b_nwrites = 0;
+    b->b_arena_used = 0;
+    return err;
+}
+
+/** Check if [offset, offset+size) overlaps a queued request
+ * @param writes_only Only queued writes are checked */
+static int batch_overlaps(struct nanofs_dev_batch *b, off_t offset,
+        size_t size, int writes_only)
+{
+    struct nanofs_dev_req *r;
+    int i;
+
+    if (writes_only && b->b_nwrites == 0)
+        return 0;
+    for (i = 0; i < b->b_nreqs; i++)
+    {
+        r = &b->b_reqs[i];
+        if (writes_only && !r->r_write)
+            continue;
+        if (offset < r->r_offset + (off_t)r->r_len &&
+                r->r_offset < offset + (off_t)size)
+            return 1;
+    }
+    return 0;
+}
+
+static int batch_active(struct nanofs_dev *dev)
+{
+    return dev->d_batch != NULL && dev->d_batch->b_depth > 0;
+}
+
+/** Queue a request, small write buffers are copied to the arena
+ * @return 0 on success | -1 if it cannot be queued, caller does the I/O */
+static int batch_queue(struct nanofs_dev *dev, int write, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    struct nanofs_dev_batch *b = dev->d_batch;
+    struct nanofs_dev_req *r;
+    size_t size = 0, copy = 0;
+    int i;
+
+    if (iovcnt > NANOFS_DEV_REQ_IOV)
+        return -1;
+    for (i = 0; i < iovcnt; i++)
+    {
+        size += iov[i].iov_len;
+        if (write && iov[i].iov_len <= NANOFS_DEV_BATCH_COPY)
+            copy += iov[i].iov_len;
+    }
+    if (batch_overlaps(b, offset, size, !write))
+        batch_submit(dev);
+    if (b->b_nreqs == NANOFS_DEV_BATCH_MAX ||
+            b->b_arena_used + copy > NANOFS_DEV_BATCH_ARENA)
+        batch_submit(dev);
+
+    r = &b->b_reqs[b->b_nreqs++];
+    r->r_write = write;
+    r->r_offset = offset;
+    r->r_len = size;
+    r->r_iovcnt = iovcnt;
+    for (i = 0; i < iovcnt; i++)
+    {
+        r->r_iov[i] = iov[i];
+        if (write && iov[i].iov_len <= NANOFS_DEV_BATCH_COPY)
+        {
+            r->r_iov[i].iov_base = b->b_arena + b->b_arena_used;
+            memcpy(r->r_iov[i].iov_base, iov[i].iov_base, iov[i].iov_len);
+            b->b_arena_used += iov[i].iov_len;
+        }
+    }
+    if (write)
+        b->b_nwrites++;
+    return 0;
+}
+
+/** Start a batch, batches can be nested and only the outer one submits */
+void nanofs_dev_batch_begin(struct nanofs_dev *dev)
+{
+    if (dev->d_batch == NULL)
+    {
+        dev->d_batch = calloc(1, sizeof(struct nanofs_dev_batch));
+        if (dev->d_batch == NULL)
+            return; // Not fatal, I/O is done without batching
+    }
+    if (dev->d_batch->b_depth++ == 0)
+        dev->d_batch->b_error = 0;
+}
+
+/** End a batch, the outer call submits the queued requests
+ * @return 0 on success | -1 if any request of the batch failed */
+int nanofs_dev_batch_end(struct nanofs_dev *dev)
+{
+    struct nanofs_dev_batch *b = dev->d_batch;
+
+    if (b == NULL || b->b_depth == 0)
+        return 0;
+    if (--b->b_depth > 0)
+        return 0;
+    batch_submit(dev);
+    return b->b_error ? -1 : 0;
+}
+
+/** Count a request in the handle counters and the trace */
+static void dev_account(struct nanofs_dev *dev, int write, off_t offset,
+        size_t size)
+{
+    if (write)
+    {
+        NANOFS_STAT_INC(dev->d_stats, st_dev_writes);
+        NANOFS_STAT_ADD(dev->d_stats, st_dev_write_bytes, size);
+    }
+    else
+    {
+        NANOFS_STAT_INC(dev->d_stats, st_dev_reads);
+        NANOFS_STAT_ADD(dev->d_stats, st_dev_read_bytes, size);
+    }
+    NANOFS_TRACE(write ? NANOFS_EV_DEV_WRITE : NANOFS_EV_DEV_READ, 0, 0, size,
+            offset, 0);
+    (void)offset;
+}
+
+/** Read into 'buf' when the batch is submitted, 'buf' must stay valid until
+ * then. Without batch the read is done now.
+ * @return 0 on success | -1 on error */
+int nanofs_dev_queue_read(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    dev_account(dev, 0, offset, size);
+    if (batch_active(dev) && batch_queue(dev, 0, offset, &iov, 1) == 0)
+        return 0;
+    if (dev->d_ops->read(dev, offset, buf, size) != (ssize_t)size)
+        return -1;
+    return 0;
+}
+
+ssize_t nanofs_dev_pread(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size)
+{
+    dev_account(dev, 0, offset, size);
+    if (batch_active(dev) && batch_overlaps(dev->d_batch, offset, size, 1))
+        batch_submit(dev);
+    return dev->d_ops->read(dev, offset, buf, size);
+}
+
+ssize_t nanofs_dev_preadv(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    dev_account(dev, 0, offset, size);
+    if (batch_active(dev) && batch_overlaps(dev->d_batch, offset, size, 1))
+        batch_submit(dev);
+    return dev->d_ops->readv(dev, offset, iov, iovcnt);
+}
+
+ssize_t nanofs_dev_pwrite(struct nanofs_dev *dev, off_t offset,
+        const void *buf, size_t size)
+{
+    struct iovec iov;
+
+    dev_account(dev, 1, offset, size);
+    if (batch_active(dev))
+    {
+        iov.iov_base = (void *)buf;
+        iov.iov_len = size;
+        if (batch_queue(dev, 1, offset, &iov, 1) == 0)
+            return size;
+    }
+    return dev->d_ops->write(dev, offset, buf, size);
+}
+
+ssize_t nanofs_dev_pwritev(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    dev_account(dev, 1, offset, size);
+    if (batch_active(dev) && batch_queue(dev, 1, offset, iov, iovcnt) == 0)
+        return size;
+    // Not queued, pending requests on the same range go first
+    if (batch_active(dev) && batch_overlaps(dev->d_batch, offset, size, 0))
+        batch_submit(dev);
+    return dev->d_ops->writev(dev, offset, iov, iovcnt);
+}
+
+/** Flush the device caches to stable storage
+ * @return 0 on success | -1 on error */
+int nanofs_dev_flush(struct nanofs_dev *dev)
+{
+    NANOFS_STAT_INC(dev->d_stats, st_dev_flushes);
+    NANOFS_TRACE(NANOFS_EV_DEV_FLUSH, 0, 0, 0, 0, 0);
+    return dev->d_ops->flush(dev);
+}
+
+
+/** Open a device with the given engine
+ * @param oflags Flags for open(), O_RDWR or O_RDONLY plus modifiers
+ * @return 0 on success | -1 on error, errno is set
+ * */
+int nanofs_dev_open(struct nanofs_dev *dev, const char *name, int engine,
+        int oflags)
+{
+    int prot;
+
+    memset(dev, 0, sizeof(struct nanofs_dev));
+    if ((oflags & O_DIRECT) && engine != NANOFS_DEV_POSIX)
+    {
+        // Memory engines are cached by definition, the ring submits
+        // unaligned requests
+        log_error("nanofs_dev_open: direct I/O uses the posix engine");
+        engine = NANOFS_DEV_POSIX;
+    }
+    dev->d_engine = engine;
+    dev->d_oflags = oflags;
+    dev->d_fd = open(name, oflags);
+    if (dev->d_fd < 0)
+    {
+        log_error("nanofs_dev_open: cannot open '%s'", name);
+        return -1;
+    }
+    // lseek is fine here, device size is valid for files and block devices
+    dev->d_size = lseek64(dev->d_fd, 0, SEEK_END);
+    if (dev->d_size < 0)
+    {
+        close(dev->d_fd);
+        return -1;
+    }
+
+    switch (engine)
+    {
+    case NANOFS_DEV_POSIX:
+        dev->d_ops = &posix_ops;
+        if ((oflags & O_DIRECT) && dio_init(dev) != 0)
+        {
+            log_error("nanofs_dev_open: cannot allocate direct I/O buffers");
+            close(dev->d_fd);
+            return -1;
+        }
+        break;
+    case NANOFS_DEV_MMAP:
+        prot = PROT_READ;
+        if ((oflags & O_ACCMODE) != O_RDONLY)
+            prot |= PROT_WRITE;
+        dev->d_map = mmap(NULL, dev->d_size, prot, MAP_SHARED, dev->d_fd, 0);
+        if (dev->d_map == MAP_FAILED)
+        {
+            log_error("nanofs_dev_open: mmap of '%s' failed", name);
+            close(dev->d_fd);
+            return -1;
+        }
+        dev->d_ops = &mmap_ops;
+        break;
+    case NANOFS_DEV_URING:
+#ifdef HAVE_LIBURING
+        if (nanofs_dev_uring_init(dev) == 0)
+            break;
+        log_error("nanofs_dev_open: io_uring setup failed, using posix");
+#else
+        log_error("nanofs_dev_open: built without liburing, using posix");
+#endif
+        dev->d_engine = NANOFS_DEV_POSIX;
+        dev->d_ops = &posix_ops;
+        break;
+    case NANOFS_DEV_RAM:
+        if (ram_load(dev) != 0)
+        {
+            log_error("nanofs_dev_open: cannot load '%s' in memory", name);
+            close(dev->d_fd);
+            return -1;
+        }
+        // The descriptor is not required anymore
+        close(dev->d_fd);
+        dev->d_fd = -1;
+        dev->d_ops = &ram_ops;
+        break;
+    default:
+        log_error("nanofs_dev_open: unknown engine %d", engine);
+        close(dev->d_fd);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/** Close device and release engine resources */
+void nanofs_dev_close(struct nanofs_dev *dev)
+{
+    if (dev->d_ops == NULL)
+        return;
+    if (dev->d_batch != NULL)
+    {
+        if (dev->d_batch->b_nreqs > 0)
+            batch_submit(dev);
+        free(dev->d_batch);
+        dev->d_batch = NULL;
+    }
+    dev->d_ops->close(dev);
+    dev->d_ops = NULL;
+    dev->d_fd = -1;
+}
+
+/** Engine name, for messages */
+const char *nanofs_dev_engine_name(int engine)
+{
+    switch (engine)
+    {
+    case NANOFS_DEV_POSIX:
+        return posix_ops.name;
+    case NANOFS_DEV_MMAP:
+        return mmap_ops.name;
+    case NANOFS_DEV_RAM:
+        return ram_ops.name;
+    case NANOFS_DEV_URING:
+        return "uring";
+    }
+    return "unknown";
+}
@@ -0,0 +1,151 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dev.h
+    @version 0.4
+    @brief Block device backends (storage engines)
+
+******************************************************************************/
+
+#ifndef __NANOFS_DEV_H__
+#define __NANOFS_DEV_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <asm/types.h>
+
+struct nanofs_dev;
+struct nanofs_stats;
+
+/* Storage engines, selected when the device is opened */
+#define NANOFS_DEV_POSIX  0   ///< File descriptor and pread/pwrite
+#define NANOFS_DEV_MMAP   1   ///< Image file mapped in memory
+#define NANOFS_DEV_RAM    2   ///< Image copied to RAM, writes are volatile
+#define NANOFS_DEV_URING  3   ///< Descriptor, batches submitted with io_uring
+
+/* Batched I/O limits */
+#define NANOFS_DEV_BATCH_MAX    64       ///< Requests queued before submit
+#define NANOFS_DEV_BATCH_ARENA  32768    ///< Bytes for copies of small writes
+#define NANOFS_DEV_BATCH_COPY   512      ///< Writes up to this size are copied
+#define NANOFS_DEV_REQ_IOV      4        ///< Max buffers in a queued request
+
+/* Direct I/O (O_DIRECT) bounce buffers */
+#define NANOFS_DEV_DIO_ALIGN    4096     ///< Minimum alignment of transfers
+#define NANOFS_DEV_DIO_BUFS     4        ///< Buffers kept in the pool
+#define NANOFS_DEV_DIO_BUF_SIZE 65536    ///< Bytes per buffer
+
+/** Queued request of a batch */
+struct nanofs_dev_req {
+    int    r_write;                            ///< 1 write, 0 read
+    off_t  r_offset;                           ///< Device offset
+    size_t r_len;                              ///< Total bytes
+    int    r_iovcnt;
+    struct iovec r_iov[NANOFS_DEV_REQ_IOV];
+};
+
+/** Pending requests, see nanofs_dev_batch_begin() */
+struct nanofs_dev_batch {
+    int    b_depth;                            ///< Nesting of begin/end
+    int    b_nreqs;                            ///< Queued requests
+    int    b_nwrites;                          ///< Queued writes
+    size_t b_arena_used;
+    int    b_error;                            ///< A submit failed
+    struct nanofs_dev_req b_reqs[NANOFS_DEV_BATCH_MAX];
+    __u8   b_arena[NANOFS_DEV_BATCH_ARENA];
+};
+
+/** Engine operations. Read and write functions follow pread/pwrite
+ * semantics: they return the bytes transferred, a short count at end of
+ * device, or -1 on error.
+ * */
+struct nanofs_dev_ops {
+    const char *name;
+    ssize_t (*read)(struct nanofs_dev *dev, off_t offset, void *buf,
+            size_t size);
+    ssize_t (*write)(struct nanofs_dev *dev, off_t offset, const void *buf,
+            size_t size);
+    ssize_t (*readv)(struct nanofs_dev *dev, off_t offset,
+            const struct iovec *iov, int iovcnt);
+    ssize_t (*writev)(struct nanofs_dev *dev, off_t offset,
+            const struct iovec *iov, int iovcnt);
+    /** Execute 'nreqs' requests, they do not overlap and may run in any
+     * order. NULL for engines without asynchronous support, requests are
+     * then executed one by one. @return 0 on success, -1 if any failed */
+    int   (*submit)(struct nanofs_dev *dev, struct nanofs_dev_req *reqs,
+            int nreqs);
+    int   (*flush)(struct nanofs_dev *dev);   ///< Data to stable storage
+    int   (*discard)(struct nanofs_dev *dev, off_t offset, off_t size);
+    off_t (*size)(struct nanofs_dev *dev);    ///< Device size in bytes
+    void  (*close)(struct nanofs_dev *dev);
+};
+
+/** Aligned buffers of the direct I/O mode, a buffer is taken by setting
+ * its busy flag atomically */
+struct nanofs_dev_dio_pool {
+    size_t p_align;                            ///< Device logical block size
+    size_t p_size;                             ///< Bytes per buffer
+    int    p_busy[NANOFS_DEV_DIO_BUFS];
+    __u8  *p_buf[NANOFS_DEV_DIO_BUFS];
+};
+
+/** Opened device, the engine private state lives here */
+struct nanofs_dev {
+    const struct nanofs_dev_ops *d_ops;
+    int    d_engine;    ///< NANOFS_DEV_*
+    int    d_fd;        ///< Backing descriptor, -1 if none
+    int    d_oflags;    ///< Flags used in open()
+    __u8  *d_map;       ///< Memory image for mmap/ram engines
+    off_t  d_size;      ///< Device size in bytes
+    void  *d_priv;      ///< Engine private data
+    struct nanofs_dev_batch *d_batch; ///< Batch state, allocated on demand
+    struct nanofs_stats *d_stats;     ///< Counters, NULL if not counted
+};
+
+/* O_DIRECT in 'oflags' selects direct I/O, only for the posix engine */
+int nanofs_dev_open(struct nanofs_dev *dev, const char *name, int engine,
+        int oflags);
+void nanofs_dev_close(struct nanofs_dev *dev);
+const char *nanofs_dev_engine_name(int engine);
+
+/* Device I/O, pread/pwrite semantics. Writes issued while a batch is open
+ * are queued and executed by nanofs_dev_batch_end(). Small writes are
+ * copied, larger buffers must stay valid until the batch ends. */
+ssize_t nanofs_dev_pread(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size);
+ssize_t nanofs_dev_pwrite(struct nanofs_dev *dev, off_t offset,
+        const void *buf, size_t size);
+ssize_t nanofs_dev_preadv(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt);
+ssize_t nanofs_dev_pwritev(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt);
+int nanofs_dev_flush(struct nanofs_dev *dev);
+
+/* Batches: requests are submitted together so engines like io_uring keep
+ * several of them in flight. Not thread safe, one batch per device. */
+void nanofs_dev_batch_begin(struct nanofs_dev *dev);
+int  nanofs_dev_batch_end(struct nanofs_dev *dev);
+int  nanofs_dev_queue_read(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size);
+
+#ifdef HAVE_LIBURING
+int nanofs_dev_uring_init(struct nanofs_dev *dev);
+#endif
+
+#define nanofs_dev_size(dev)    ((dev)->d_ops->size(dev))
+#define nanofs_dev_discard(dev, offset, size) \
+    ((dev)->d_ops->discard(dev, offset, size))
+
+#endif
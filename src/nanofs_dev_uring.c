@@ -0,0 +1,249 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dev_uring.c
+    @version 0.4
+    @brief io_uring storage engine
+
+    Single requests use pread/pwrite like the posix engine, a ring round trip
+    does not pay off for them. Batches (see nanofs_dev_batch_begin) are
+    prepared as one SQE per request and submitted with a single system call,
+    so the device sees a queue depth up to NANOFS_DEV_BATCH_MAX.
+
+    Only built when configure finds liburing.
+
+******************************************************************************/
+
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#ifdef HAVE_LIBURING
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <liburing.h>
+
+#include "log.h"
+#include "nanofs_dev.h"
+
+static ssize_t uring_read(struct nanofs_dev *dev, off_t offset, void *buf,
+        size_t size)
+{
+    return pread(dev->d_fd, buf, size, offset);
+}
+
+static ssize_t uring_write(struct nanofs_dev *dev, off_t offset,
+        const void *buf, size_t size)
+{
+    return pwrite(dev->d_fd, buf, size, offset);
+}
+
+static ssize_t uring_readv(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    return preadv(dev->d_fd, iov, iovcnt, offset);
+}
+
+static ssize_t uring_writev(struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt)
+{
+    return pwritev(dev->d_fd, iov, iovcnt, offset);
+}
+
+/** Redo a request that completed short, requests are idempotent
+ * @return 0 on success | -1 on error */
+static int uring_redo(struct nanofs_dev *dev, struct nanofs_dev_req *r)
+{
+    ssize_t res;
+
+    if (r->r_write)
+        res = pwritev(dev->d_fd, r->r_iov, r->r_iovcnt, r->r_offset);
+    else
+        res = preadv(dev->d_fd, r->r_iov, r->r_iovcnt, r->r_offset);
+    return res == (ssize_t)r->r_len ? 0 : -1;
+}
+
+/** Drop the ring and set up a new one, SQEs left prepared in the old one
+ * must not be submitted with a later batch. When the new ring cannot be set
+ * up the following batches are done synchronously.
+ * */
+static void uring_reset(struct nanofs_dev *dev)
+{
+    struct io_uring *ring = dev->d_priv;
+    int res;
+
+    io_uring_queue_exit(ring);
+    res = io_uring_queue_init(NANOFS_DEV_BATCH_MAX, ring, 0);
+    if (res < 0)
+    {
+        log_error("uring_reset: '%s'", strerror(-res));
+        free(ring);
+        dev->d_priv = NULL;
+    }
+}
+
+/** Prepare one SQE per request, submit them at once and reap completions.
+ * A short transfer is done again synchronously, and so are the requests
+ * the ring could not take or complete. The ring is left empty on return,
+ * with no SQE prepared and no CQE to reap.
+ * @return 0 on success | -1 if any request failed */
+static int uring_submit(struct nanofs_dev *dev, struct nanofs_dev_req *reqs,
+        int nreqs)
+{
+    struct io_uring *ring = dev->d_priv;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct nanofs_dev_req *r;
+    char done[NANOFS_DEV_BATCH_MAX];
+    int i, res, queued = 0, submitted = 0, reaped = 0, err = 0;
+
+    memset(done, 0, sizeof(done));
+    // The ring is sized for a full batch, requests it does not take are
+    // done below
+    for (; ring != NULL && queued < nreqs; queued++)
+    {
+        sqe = io_uring_get_sqe(ring);
+        if (sqe == NULL)
+            break;
+        r = &reqs[queued];
+        if (r->r_write)
+            io_uring_prep_writev(sqe, dev->d_fd, r->r_iov, r->r_iovcnt,
+                    r->r_offset);
+        else
+            io_uring_prep_readv(sqe, dev->d_fd, r->r_iov, r->r_iovcnt,
+                    r->r_offset);
+        io_uring_sqe_set_data(sqe, r);
+    }
+
+    while (submitted < queued)
+    {
+        res = io_uring_submit(ring);
+        if (res == -EINTR || res == -EAGAIN || res == -EBUSY)
+            continue;
+        if (res <= 0)
+        {
+            log_error("uring_submit: submit failed: '%s'",
+                    strerror(res < 0 ? -res : EIO));
+            break;
+        }
+        submitted += res;
+    }
+
+    while (reaped < submitted)
+    {
+        res = io_uring_wait_cqe(ring, &cqe);
+        if (res == -EINTR)
+            continue;
+        if (res < 0)
+        {
+            log_error("uring_submit: wait failed: '%s'", strerror(-res));
+            break;
+        }
+        r = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+        reaped++;
+        done[r - reqs] = 1;
+        if (res < 0)
+        {
+            errno = -res;
+            err = -1;
+        }
+        else if ((size_t)res < r->r_len && uring_redo(dev, r) != 0)
+            err = -1;
+    }
+    // Unsubmitted SQEs and requests still in flight go with the old ring,
+    // all that did not complete are done again below
+    if (submitted < queued || reaped < submitted)
+        uring_reset(dev);
+
+    for (i = 0; i < nreqs; i++)
+        if (!done[i] && uring_redo(dev, &reqs[i]) != 0)
+            err = -1;
+    return err;
+}
+
+static int uring_flush(struct nanofs_dev *dev)
+{
+    return fdatasync(dev->d_fd);
+}
+
+/** Discard is only a hint, errors are ignored */
+static int uring_discard(struct nanofs_dev *dev, off_t offset, off_t size)
+{
+    fallocate(dev->d_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            offset, size);
+    return 0;
+}
+
+static off_t uring_size(struct nanofs_dev *dev)
+{
+    return dev->d_size;
+}
+
+static void uring_close(struct nanofs_dev *dev)
+{
+    if (dev->d_priv != NULL)
+        io_uring_queue_exit(dev->d_priv);
+    free(dev->d_priv);
+    dev->d_priv = NULL;
+    close(dev->d_fd);
+}
+
+static const struct nanofs_dev_ops uring_ops = {
+    .name    = "uring",
+    .read    = uring_read,
+    .write   = uring_write,
+    .readv   = uring_readv,
+    .writev  = uring_writev,
+    .submit  = uring_submit,
+    .flush   = uring_flush,
+    .discard = uring_discard,
+    .size    = uring_size,
+    .close   = uring_close
+};
+
+/** Set up the ring on the descriptor already opened in 'dev'
+ * @return 0 on success | -1 on error, the descriptor is left open */
+int nanofs_dev_uring_init(struct nanofs_dev *dev)
+{
+    struct io_uring *ring;
+    int res;
+
+    ring = malloc(sizeof(struct io_uring));
+    if (ring == NULL)
+        return -1;
+    res = io_uring_queue_init(NANOFS_DEV_BATCH_MAX, ring, 0);
+    if (res < 0)
+    {
+        log_error("nanofs_dev_uring_init: '%s'", strerror(-res));
+        free(ring);
+        return -1;
+    }
+    dev->d_priv = ring;
+    dev->d_ops = &uring_ops;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,275 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dindex.c
+    @version 0.4
+    @brief In-memory hash index of directory entries
+
+
+    Directories are linked lists of dir nodes, a name lookup reads every
+    child. The index maps the hash of each child name to its dir node, so
+    a lookup reads only the nodes whose hash matches, and finding that a
+    name does not exist reads none.
+
+    Each indexed directory has an open addressing table with linear
+    probing. Tables of all the directories share a cap of slots, whole
+    directories are dropped in LRU order to stay under it.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nanofs_dindex.h"
+
+#define DINDEX_MIN_SLOTS 16
+
+static unsigned dir_bucket(__u32 blk_no)
+{
+    return (blk_no * 2654435761u) >> 24;
+}
+
+static void lru_unlink(struct nanofs_dindex_dir *d)
+{
+    d->d_prev->d_next = d->d_next;
+    d->d_next->d_prev = d->d_prev;
+}
+
+static void lru_push(struct nanofs_dindex *di, struct nanofs_dindex_dir *d)
+{
+    d->d_next = di->i_lru.d_next;
+    d->d_prev = &di->i_lru;
+    di->i_lru.d_next->d_prev = d;
+    di->i_lru.d_next = d;
+}
+
+/** Unlink a directory from the table and the LRU list and free it */
+static void dir_free(struct nanofs_dindex *di, struct nanofs_dindex_dir *d)
+{
+    struct nanofs_dindex_dir **p = &di->i_hash[dir_bucket(d->d_blk_no)];
+
+    while (*p != d)
+        p = &(*p)->d_hnext;
+    *p = d->d_hnext;
+    lru_unlink(d);
+    di->i_slots -= d->d_mask + 1;
+    free(d->d_slots);
+    free(d);
+}
+
+/** Drop least recently used directories, except 'keep', until 'slots'
+ * more fit under the cap
+ * @return 0 on success | -1 if they do not fit */
+static int make_room(struct nanofs_dindex *di, size_t slots,
+        struct nanofs_dindex_dir *keep)
+{
+    struct nanofs_dindex_dir *d = di->i_lru.d_prev;
+
+    while (di->i_slots + slots > di->i_max && d != &di->i_lru)
+    {
+        struct nanofs_dindex_dir *prev = d->d_prev;
+
+        if (d != keep)
+            dir_free(di, d);
+        d = prev;
+    }
+    return di->i_slots + slots > di->i_max ? -1 : 0;
+}
+
+/** Store a child in a table with free slots */
+static void slot_insert(struct nanofs_dindex_slot *slots, __u32 mask,
+        __u32 hash, __u32 blk_no)
+{
+    __u32 i = hash & mask;
+
+    while (slots[i].s_blk_no != 0)
+        i = (i + 1) & mask;
+    slots[i].s_hash = hash;
+    slots[i].s_blk_no = blk_no;
+}
+
+/** Double the slots of a directory
+ * @return 0 on success | -1 over the cap or without memory */
+static int dir_grow(struct nanofs_dindex *di, struct nanofs_dindex_dir *d)
+{
+    __u32 i, size = (d->d_mask + 1) * 2;
+    struct nanofs_dindex_slot *slots;
+
+    if (make_room(di, d->d_mask + 1, d) != 0)
+        return -1;
+    slots = calloc(size, sizeof(struct nanofs_dindex_slot));
+    if (slots == NULL)
+        return -1;
+    for (i = 0; i <= d->d_mask; i++)
+        if (d->d_slots[i].s_blk_no != 0)
+            slot_insert(slots, size - 1, d->d_slots[i].s_hash,
+                    d->d_slots[i].s_blk_no);
+    free(d->d_slots);
+    d->d_slots = slots;
+    di->i_slots += d->d_mask + 1;
+    d->d_mask = size - 1;
+    return 0;
+}
+
+void nanofs_dindex_init(struct nanofs_dindex *di, size_t max_slots)
+{
+    memset(di, 0, sizeof(struct nanofs_dindex));
+    di->i_max = max_slots;
+    di->i_lru.d_next = di->i_lru.d_prev = &di->i_lru;
+}
+
+/** Free all the directories */
+void nanofs_dindex_destroy(struct nanofs_dindex *di)
+{
+    while (di->i_lru.d_next != &di->i_lru)
+        dir_free(di, di->i_lru.d_next);
+}
+
+/** FNV-1a hash of a name, never 0 */
+__u32 nanofs_dindex_hash(const __u8 *name, size_t len)
+{
+    __u32 h = 2166136261u;
+
+    while (len-- > 0)
+        h = (h ^ *name++) * 16777619u;
+    return h != 0 ? h : 1;
+}
+
+/** Find the index of a directory, it becomes the most recently used
+ * @return the directory | NULL if it is not indexed */
+struct nanofs_dindex_dir *nanofs_dindex_get(struct nanofs_dindex *di,
+        __u32 dir_blk_no)
+{
+    struct nanofs_dindex_dir *d;
+
+    for (d = di->i_hash[dir_bucket(dir_blk_no)]; d != NULL; d = d->d_hnext)
+        if (d->d_blk_no == dir_blk_no)
+        {
+            lru_unlink(d);
+            lru_push(di, d);
+            return d;
+        }
+    return NULL;
+}
+
+/** Start an empty index of a directory, the caller adds all its children
+ * @return the directory | NULL when the index is disabled, full or
+ *      without memory */
+struct nanofs_dindex_dir *nanofs_dindex_new(struct nanofs_dindex *di,
+        __u32 dir_blk_no)
+{
+    struct nanofs_dindex_dir *d;
+    unsigned h = dir_bucket(dir_blk_no);
+
+    nanofs_dindex_drop(di, dir_blk_no);
+    if (make_room(di, DINDEX_MIN_SLOTS, NULL) != 0)
+        return NULL;
+    d = malloc(sizeof(struct nanofs_dindex_dir));
+    if (d == NULL)
+        return NULL;
+    d->d_slots = calloc(DINDEX_MIN_SLOTS, sizeof(struct nanofs_dindex_slot));
+    if (d->d_slots == NULL)
+    {
+        free(d);
+        return NULL;
+    }
+    d->d_blk_no = dir_blk_no;
+    d->d_count = 0;
+    d->d_mask = DINDEX_MIN_SLOTS - 1;
+    d->d_hnext = di->i_hash[h];
+    di->i_hash[h] = d;
+    lru_push(di, d);
+    di->i_slots += DINDEX_MIN_SLOTS;
+    return d;
+}
+
+/** Forget the index of a directory, if any */
+void nanofs_dindex_drop(struct nanofs_dindex *di, __u32 dir_blk_no)
+{
+    struct nanofs_dindex_dir *d;
+
+    for (d = di->i_hash[dir_bucket(dir_blk_no)]; d != NULL; d = d->d_hnext)
+        if (d->d_blk_no == dir_blk_no)
+        {
+            dir_free(di, d);
+            return;
+        }
+}
+
+/** Add a child to a directory, tables are kept at most 3/4 full
+ * @return 0 on success | -1 if it does not fit, the caller must drop the
+ *      directory */
+int nanofs_dindex_add(struct nanofs_dindex *di, struct nanofs_dindex_dir *d,
+        __u32 hash, __u32 blk_no)
+{
+    if ((d->d_count + 1) * 4 > (d->d_mask + 1) * 3 && dir_grow(di, d) != 0)
+        return -1;
+    slot_insert(d->d_slots, d->d_mask, hash, blk_no);
+    d->d_count++;
+    return 0;
+}
+
+/** Remove a child from a directory, following slots are shifted back so
+ * probe sequences stay unbroken */
+void nanofs_dindex_remove(struct nanofs_dindex_dir *d, __u32 hash,
+        __u32 blk_no)
+{
+    __u32 i = hash & d->d_mask, j, home;
+
+    while (d->d_slots[i].s_blk_no != blk_no)
+    {
+        if (d->d_slots[i].s_blk_no == 0)
+            return;
+        i = (i + 1) & d->d_mask;
+    }
+    d->d_slots[i].s_blk_no = 0;
+    d->d_count--;
+    for (j = (i + 1) & d->d_mask; d->d_slots[j].s_blk_no != 0;
+            j = (j + 1) & d->d_mask)
+    {
+        // Move j to the hole unless its home lies cyclically in (i, j]
+        home = d->d_slots[j].s_hash & d->d_mask;
+        if (((j - home) & d->d_mask) < ((j - i) & d->d_mask))
+            continue;
+        d->d_slots[i] = d->d_slots[j];
+        d->d_slots[j].s_blk_no = 0;
+        i = j;
+    }
+}
+
+/** Iterate the children whose name has the given hash
+ * @param pos Set to 0 before the first call
+ * @return dir node of the next candidate | 0 when there are no more */
+__u32 nanofs_dindex_next(struct nanofs_dindex_dir *d, __u32 hash, __u32 *pos)
+{
+    __u32 i;
+
+    for (; *pos <= d->d_mask; (*pos)++)
+    {
+        i = (hash + *pos) & d->d_mask;
+        if (d->d_slots[i].s_blk_no == 0)
+            break;
+        if (d->d_slots[i].s_hash == hash)
+        {
+            (*pos)++;
+            return d->d_slots[i].s_blk_no;
+        }
+    }
+    *pos = d->d_mask + 1;
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dindex.h
+    @version 0.4
+    @brief In-memory hash index of directory entries
+
+******************************************************************************/
+
+#ifndef __NANOFS_DINDEX_H__
+#define __NANOFS_DINDEX_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/** Buckets of the table of indexed directories */
+#define NANOFS_DINDEX_BUCKETS 256
+/** Default cap of slots of all the directories, 8 bytes each */
+#define NANOFS_DINDEX_DEFAULT (256 * 1024)
+
+/** Child of a directory, s_blk_no is 0 in free slots */
+struct nanofs_dindex_slot {
+    __u32 s_hash;                       ///< See nanofs_dindex_hash()
+    __u32 s_blk_no;                     ///< Dir node of the child
+};
+
+/** Index of the children of a directory, open addressing */
+struct nanofs_dindex_dir {
+    __u32 d_blk_no;                     ///< Dir node of the directory
+    __u32 d_count;                      ///< Children indexed
+    __u32 d_mask;                       ///< Slots - 1
+    struct nanofs_dindex_slot *d_slots;
+    struct nanofs_dindex_dir *d_hnext;  ///< Hash chain
+    struct nanofs_dindex_dir *d_prev;   ///< LRU list, most recent first
+    struct nanofs_dindex_dir *d_next;
+};
+
+/** Directories indexed, built on the first lookup and kept up to date by
+ * the functions that link and unlink dir nodes. Names are not stored,
+ * a candidate is confirmed reading its dir node. */
+struct nanofs_dindex {
+    size_t i_max;                       ///< Max slots, 0 disables the index
+    size_t i_slots;                     ///< Slots allocated
+    struct nanofs_dindex_dir *i_hash[NANOFS_DINDEX_BUCKETS];
+    struct nanofs_dindex_dir i_lru;     ///< LRU list head
+};
+
+void  nanofs_dindex_init(struct nanofs_dindex *di, size_t max_slots);
+void  nanofs_dindex_destroy(struct nanofs_dindex *di);
+__u32 nanofs_dindex_hash(const __u8 *name, size_t len);
+
+struct nanofs_dindex_dir *nanofs_dindex_get(struct nanofs_dindex *di,
+        __u32 dir_blk_no);
+struct nanofs_dindex_dir *nanofs_dindex_new(struct nanofs_dindex *di,
+        __u32 dir_blk_no);
+void  nanofs_dindex_drop(struct nanofs_dindex *di, __u32 dir_blk_no);
+
+int   nanofs_dindex_add(struct nanofs_dindex *di, struct nanofs_dindex_dir *d,
+        __u32 hash, __u32 blk_no);
+void  nanofs_dindex_remove(struct nanofs_dindex_dir *d, __u32 hash,
+        __u32 blk_no);
+__u32 nanofs_dindex_next(struct nanofs_dindex_dir *d, __u32 hash,
+        __u32 *pos);
+
+#endif
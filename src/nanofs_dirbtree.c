@@ -0,0 +1,503 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dirbtree.c
+    @version 0.4
+    @brief B-tree format of large directories
+
+    With NANOFS_FEAT_DIR_BTREE a directory that reaches NANOFS_DIR_BTREE_MIN
+    children is turned into a B-tree of their keys, see struct
+    nanofs_dir_btree. The children are not chained any more: 'd_data_ptr'
+    of the directory points to the root and NANOFS_FLG_BTREE is set, so
+    lookups, inserts and removes read a few nodes whatever the size of the
+    directory, and nanofs_read_dir() resumes a listing from a key.
+
+    Nodes are split when they are full but not merged, a node is freed when
+    it has no keys left. When the last child is removed the directory is an
+    empty list again.
+
+    The nodes are read and written through the header cache, so with a
+    journal they are part of the group like any other node header.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "nanofs.h"
+#include "nanofs_filedir.h"
+#include "nanofs_dindex.h"
+#include "nanofs_dirindex.h"
+#include "nanofs_dirbtree.h"
+
+/** Deepest tree, a node with a higher level is taken as damaged */
+#define NANOFS_DIR_BTREE_MAX_LEVEL 16
+/** Keys read at once by nanofs_dirbtree_lookup() */
+#define NANOFS_DIR_BTREE_BATCH 4
+
+/* Results of tree_insert() and tree_remove(), besides 0 and -1 */
+#define TREE_SPLIT 1            ///< A new node follows this one
+#define TREE_EMPTY 1            ///< The node has no keys left
+
+static int node_read(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_dir_btree *t)
+{
+    __u8 *buf;
+    size_t len;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&fs_hd->h_cache, blk_no, sizeof(*t), &len);
+    if (buf == NULL)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    memcpy(t, buf, sizeof(*t));
+    if (t->t_magic != NANOFS_DIR_BTREE_MAGIC ||
+            t->t_level >= NANOFS_DIR_BTREE_MAX_LEVEL ||
+            t->t_count > NANOFS_DIR_BTREE_ORDER - (t->t_level == 0) ||
+            (t->t_level > 0 && t->t_count == 0))
+    {
+        log_error("nanofs_dirbtree: bad node at block %u", blk_no);
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int node_write(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_dir_btree *t)
+{
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    if (nanofs_cache_put(&fs_hd->h_cache, blk_no, t, sizeof(*t)) != 0)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/** Index of the first of 'n' sorted keys not lower than 'key' */
+static int key_lower(const __u64 *keys, int n, __u64 key)
+{
+    int lo = 0, hi = n, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Child of the inner node 't' that holds 'key' */
+static int key_child(struct nanofs_dir_btree *t, __u64 key)
+{
+    return key_lower(t->t_keys, t->t_count - 1, key + 1);
+}
+
+/** Add 'key' under the node at 'blk_no'
+ * @param sep_out On split, first key of the new node
+ * @param right_out On split, block of the new node
+ * @return 0 on success | TREE_SPLIT | -1 on error, field fs_hd->h_error is
+ *      ENOSPC when a node cannot be allocated
+ * */
+static int tree_insert(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        __u64 key, __u64 *sep_out, __u32 *right_out)
+{
+    struct nanofs_dir_btree t, r;
+    __u64 keys[NANOFS_DIR_BTREE_ORDER], sep;
+    __u32 child[NANOFS_DIR_BTREE_ORDER + 1], right;
+    int i, n, half, res;
+
+    if (node_read(fs_hd, blk_no, &t) != 0)
+        return -1;
+    n = t.t_count;
+    if (t.t_level == 0)
+    {
+        i = key_lower(t.t_keys, n, key);
+        if (i < n && t.t_keys[i] == key)
+            return 0;
+        if (n < NANOFS_DIR_BTREE_ORDER - 1)
+        {
+            memmove(&t.t_keys[i + 1], &t.t_keys[i], (n - i) * sizeof(__u64));
+            t.t_keys[i] = key;
+            t.t_count++;
+            return node_write(fs_hd, blk_no, &t);
+        }
+        memcpy(keys, t.t_keys, i * sizeof(__u64));
+        keys[i] = key;
+        memcpy(&keys[i + 1], &t.t_keys[i], (n - i) * sizeof(__u64));
+        n++;
+    }
+    else
+    {
+        i = key_child(&t, key);
+        res = tree_insert(fs_hd, t.t_child[i], key, &sep, &right);
+        if (res != TREE_SPLIT)
+            return res;
+        if (n < NANOFS_DIR_BTREE_ORDER)
+        {
+            memmove(&t.t_keys[i + 1], &t.t_keys[i],
+                    (n - 1 - i) * sizeof(__u64));
+            t.t_keys[i] = sep;
+            memmove(&t.t_child[i + 2], &t.t_child[i + 1],
+                    (n - 1 - i) * sizeof(__u32));
+            t.t_child[i + 1] = right;
+            t.t_count++;
+            return node_write(fs_hd, blk_no, &t);
+        }
+        memcpy(keys, t.t_keys, i * sizeof(__u64));
+        keys[i] = sep;
+        memcpy(&keys[i + 1], &t.t_keys[i], (n - 1 - i) * sizeof(__u64));
+        memcpy(child, t.t_child, (i + 1) * sizeof(__u32));
+        child[i + 1] = right;
+        memcpy(&child[i + 2], &t.t_child[i + 1], (n - 1 - i) * sizeof(__u32));
+        n++;
+    }
+
+    // Full node, the upper half moves to a new one
+    right = nanofs_alloc_blocks(fs_hd, 1);
+    if (right == 0)
+        return -1;
+    half = n / 2;
+    memset(&r, 0, sizeof(r));
+    r.t_magic = NANOFS_DIR_BTREE_MAGIC;
+    r.t_level = t.t_level;
+    r.t_count = n - half;
+    t.t_count = half;
+    if (t.t_level == 0)
+    {
+        memcpy(t.t_keys, keys, half * sizeof(__u64));
+        memcpy(r.t_keys, &keys[half], (n - half) * sizeof(__u64));
+        *sep_out = keys[half];
+    }
+    else
+    {
+        // The separator between both halves goes up
+        memcpy(t.t_keys, keys, (half - 1) * sizeof(__u64));
+        memcpy(t.t_child, child, half * sizeof(__u32));
+        memcpy(r.t_keys, &keys[half], (n - half - 1) * sizeof(__u64));
+        memcpy(r.t_child, &child[half], (n - half) * sizeof(__u32));
+        *sep_out = keys[half - 1];
+    }
+    *right_out = right;
+    if (node_write(fs_hd, right, &r) != 0 ||
+            node_write(fs_hd, blk_no, &t) != 0)
+        return -1;
+    return TREE_SPLIT;
+}
+
+/** Add 'key' to the tree at '*root', a new root is taken when the old one
+ * is split
+ * @return 0 on success | -1 on error, see tree_insert()
+ * */
+static int tree_add(struct nanofs_fs_handle *fs_hd, __u32 *root, __u64 key)
+{
+    struct nanofs_dir_btree t;
+    __u64 sep;
+    __u32 right, new_root;
+    int res;
+
+    res = tree_insert(fs_hd, *root, key, &sep, &right);
+    if (res != TREE_SPLIT)
+        return res;
+    if (node_read(fs_hd, *root, &t) != 0)
+        return -1;
+    new_root = nanofs_alloc_blocks(fs_hd, 1);
+    if (new_root == 0)
+        return -1;
+    t.t_level++;
+    t.t_count = 2;
+    t.t_keys[0] = sep;
+    t.t_child[0] = *root;
+    t.t_child[1] = right;
+    if (node_write(fs_hd, new_root, &t) != 0)
+        return -1;
+    *root = new_root;
+    return 0;
+}
+
+/** Remove 'key' under the node at 'blk_no', children left empty are freed
+ * @return 0 on success | TREE_EMPTY, the node is not freed | ENOENT when
+ *      the key is not found | -1 on error
+ * */
+static int tree_remove(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        __u64 key)
+{
+    struct nanofs_dir_btree t;
+    int i, s, n, res;
+
+    if (node_read(fs_hd, blk_no, &t) != 0)
+        return -1;
+    n = t.t_count;
+    if (t.t_level == 0)
+    {
+        i = key_lower(t.t_keys, n, key);
+        if (i == n || t.t_keys[i] != key)
+            return ENOENT;
+        memmove(&t.t_keys[i], &t.t_keys[i + 1], (n - 1 - i) * sizeof(__u64));
+        t.t_count--;
+        if (t.t_count == 0)
+            return TREE_EMPTY;
+        return node_write(fs_hd, blk_no, &t);
+    }
+    i = key_child(&t, key);
+    res = tree_remove(fs_hd, t.t_child[i], key);
+    if (res != TREE_EMPTY)
+        return res;
+    if (nanofs_free_blocks(fs_hd, t.t_child[i], 1) != 0)
+        return -1;
+    if (n == 1)
+        return TREE_EMPTY;
+    // The separator below the child goes with it, above for the first one
+    s = i > 0 ? i - 1 : 0;
+    memmove(&t.t_keys[s], &t.t_keys[s + 1], (n - 2 - s) * sizeof(__u64));
+    memmove(&t.t_child[i], &t.t_child[i + 1], (n - 1 - i) * sizeof(__u32));
+    t.t_count--;
+    return node_write(fs_hd, blk_no, &t);
+}
+
+/** Copy the keys from 'from' on under the node at 'blk_no' to 'keys_out'
+ * @param n_io Keys in 'keys_out', up to 'max'
+ * @return 0 on success | -1 on error
+ * */
+static int tree_scan(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        __u64 from, __u64 keys_out[], int max, int *n_io)
+{
+    struct nanofs_dir_btree t;
+    int i;
+
+    if (node_read(fs_hd, blk_no, &t) != 0)
+        return -1;
+    if (t.t_level == 0)
+    {
+        for (i = key_lower(t.t_keys, t.t_count, from);
+                i < t.t_count && *n_io < max; i++)
+            keys_out[(*n_io)++] = t.t_keys[i];
+        return 0;
+    }
+    for (i = key_child(&t, from); i < t.t_count && *n_io < max; i++)
+        if (tree_scan(fs_hd, t.t_child[i], from, keys_out, max, n_io) != 0)
+            return -1;
+    return 0;
+}
+
+/** Return the nodes of the tree at 'blk_no' to the free list
+ * @return 0 on success | -1 on error
+ * */
+static int tree_release(struct nanofs_fs_handle *fs_hd, __u32 blk_no)
+{
+    struct nanofs_dir_btree t;
+    int i;
+
+    if (node_read(fs_hd, blk_no, &t) != 0)
+        return -1;
+    for (i = 0; t.t_level > 0 && i < t.t_count; i++)
+        if (tree_release(fs_hd, t.t_child[i]) != 0)
+            return -1;
+    return nanofs_free_blocks(fs_hd, blk_no, 1);
+}
+
+/** Key of the child 'dn' at 'addr', see struct nanofs_dir_btree */
+__u64 nanofs_dirbtree_key(struct nanofs_dir_node *dn, __u32 addr)
+{
+    return (__u64)(nanofs_dindex_hash(dn->d_fname, dn->d_fname_len) &
+            0x7fffffff) << 32 | addr;
+}
+
+/** Search a child of a B-tree directory
+ * @param fh_out On success is filled
+ * @return 0 on success | ENOENT if not found | -1 on error
+ * */
+int nanofs_dirbtree_lookup(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, const char *name,
+        struct nanofs_filedir_handle *fh_out)
+{
+    __u64 keys[NANOFS_DIR_BTREE_BATCH], hash, from;
+    int n, i;
+
+    hash = nanofs_dindex_hash((const __u8 *)name, strlen(name)) & 0x7fffffff;
+    from = hash << 32;
+    do
+    {
+        n = nanofs_dirbtree_scan(fs_hd, dir_hd, from, keys,
+                NANOFS_DIR_BTREE_BATCH);
+        if (n < 0)
+            return -1;
+        for (i = 0; i < n; i++)
+        {
+            // Keys of the names with the same hash are together
+            if (keys[i] >> 32 != hash)
+                return ENOENT;
+            if (nanofs_read_dir_node_b(fs_hd, (__u32)keys[i],
+                    &fh_out->f_dir_node) != 0)
+                return -1;
+            if (strcmp(name, (char *)fh_out->f_dir_node.d_fname) == 0)
+            {
+                fh_out->f_blk_no = (__u32)keys[i];
+                return 0;
+            }
+        }
+        if (n > 0)
+            from = keys[n - 1] + 1;
+    } while (n == NANOFS_DIR_BTREE_BATCH);
+    return ENOENT;
+}
+
+/** Get the keys of the children of a B-tree directory in order, from the
+ * first not lower than 'from'. The address of a child is the low 32 bits
+ * of its key.
+ * @return number of keys, up to 'max' | -1 on error
+ * */
+int nanofs_dirbtree_scan(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, __u64 from, __u64 keys_out[],
+        int max)
+{
+    int n = 0;
+
+    if (tree_scan(fs_hd, dir_hd->f_dir_node.d_data_ptr, from, keys_out, max,
+            &n) != 0)
+        return -1;
+    return n;
+}
+
+/** Turn a directory into a B-tree reading all its children, its hashed
+ * index is released. When there is no room for the tree the directory is
+ * left as it was.
+ * @return 0 on success, also when there is no room for the tree
+ *      | EIO on error
+ * */
+int nanofs_dirbtree_build(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd)
+{
+    struct nanofs_dir_btree t;
+    struct nanofs_dir_node dn;
+    __u32 root, blk_no;
+
+    fs_hd->h_error = 0;
+    root = nanofs_alloc_blocks(fs_hd, 1);
+    if (root == 0)
+        return fs_hd->h_error == ENOSPC ? 0 : EIO;
+    memset(&t, 0, sizeof(t));
+    t.t_magic = NANOFS_DIR_BTREE_MAGIC;
+    if (node_write(fs_hd, root, &t) != 0)
+        return EIO;
+    blk_no = dir_hd->f_dir_node.d_data_ptr;
+    while (blk_no != 0)
+    {
+        if (nanofs_read_dir_node_b(fs_hd, blk_no, &dn) != 0)
+            return EIO;
+        if (tree_add(fs_hd, &root, nanofs_dirbtree_key(&dn, blk_no)) != 0)
+        {
+            if (fs_hd->h_error != ENOSPC || tree_release(fs_hd, root) != 0)
+                return EIO;
+            return 0;
+        }
+        blk_no = dn.d_next_ptr;
+    }
+
+    if (nanofs_dirindex_free(fs_hd, &dir_hd->f_dir_node) != 0)
+        return EIO;
+    dir_hd->f_dir_node.d_meta_ptr = 0;
+    dir_hd->f_dir_node.d_flags |= 1 << NANOFS_FLG_BTREE;
+    dir_hd->f_dir_node.d_data_ptr = root;
+    if (nanofs_write_dir_node_b(fs_hd, dir_hd->f_blk_no,
+            &dir_hd->f_dir_node) != 0)
+        return EIO;
+    // The children list the in-memory index was built from is not used
+    nanofs_dindex_drop(&fs_hd->h_dindex, dir_hd->f_blk_no);
+    return 0;
+}
+
+/** Add a child just allocated to a B-tree directory
+ * @return 0 on success | ENOSPC when a node cannot be allocated | EIO on
+ *      error
+ * */
+int nanofs_dirbtree_insert(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, struct nanofs_dir_node *dn,
+        __u32 addr)
+{
+    __u32 root = dir_hd->f_dir_node.d_data_ptr;
+
+    fs_hd->h_error = 0;
+    if (tree_add(fs_hd, &root, nanofs_dirbtree_key(dn, addr)) != 0)
+        return fs_hd->h_error == ENOSPC ? ENOSPC : EIO;
+    if (root == dir_hd->f_dir_node.d_data_ptr)
+        return 0;
+    dir_hd->f_dir_node.d_data_ptr = root;
+    if (nanofs_write_dir_node_b(fs_hd, dir_hd->f_blk_no,
+            &dir_hd->f_dir_node) != 0)
+        return EIO;
+    return 0;
+}
+
+/** Remove a child being freed from a B-tree directory, the directory is an
+ * empty list again when it was the last one
+ * @return 0 on success | EIO on error
+ * */
+int nanofs_dirbtree_remove(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd,
+        struct nanofs_filedir_handle *fh)
+{
+    struct nanofs_dir_btree t;
+    __u32 root = dir_hd->f_dir_node.d_data_ptr;
+    int res;
+
+    res = tree_remove(fs_hd, root,
+            nanofs_dirbtree_key(&fh->f_dir_node, fh->f_blk_no));
+    if (res == ENOENT)
+    {
+        log_error("nanofs_dirbtree_remove: node %u not in the tree of "
+                "block %u", fh->f_blk_no, dir_hd->f_blk_no);
+        return 0;
+    }
+    if (res < 0 || node_read(fs_hd, root, &t) != 0)
+        return EIO;
+    if (res == TREE_EMPTY)
+    {
+        dir_hd->f_dir_node.d_flags &= ~(1 << NANOFS_FLG_BTREE);
+        dir_hd->f_dir_node.d_data_ptr = 0;
+    }
+    else if (t.t_level > 0 && t.t_count == 1)
+        // A root with one child is not needed
+        dir_hd->f_dir_node.d_data_ptr = t.t_child[0];
+    else
+        return 0;
+    if (nanofs_write_dir_node_b(fs_hd, dir_hd->f_blk_no,
+            &dir_hd->f_dir_node) != 0 ||
+            nanofs_free_blocks(fs_hd, root, 1) != 0)
+        return EIO;
+    return 0;
+}
+
+/** Release the tree of a dir node being freed, if any
+ * @return 0 on success | EIO on error
+ * */
+int nanofs_dirbtree_free(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_dir_node *dn)
+{
+    if (!DN_ISBTREE((*dn)) || dn->d_data_ptr == 0)
+        return 0;
+    return tree_release(fs_hd, dn->d_data_ptr) != 0 ? EIO : 0;
+}
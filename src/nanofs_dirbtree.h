@@ -0,0 +1,54 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dirbtree.h
+    @version 0.4
+    @brief B-tree format of large directories
+
+******************************************************************************/
+
+#ifndef __NANOFS_DIRBTREE_H__
+#define __NANOFS_DIRBTREE_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+struct nanofs_dir_node;
+struct nanofs_fs_handle;
+struct nanofs_filedir_handle;
+
+/** Children of a directory when it is turned into a B-tree */
+#define NANOFS_DIR_BTREE_MIN  64
+
+__u64 nanofs_dirbtree_key(struct nanofs_dir_node *dn, __u32 addr);
+int nanofs_dirbtree_lookup(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, const char *name,
+        struct nanofs_filedir_handle *fh_out);
+int nanofs_dirbtree_scan(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, __u64 from, __u64 keys_out[],
+        int max);
+int nanofs_dirbtree_build(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd);
+int nanofs_dirbtree_insert(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, struct nanofs_dir_node *dn,
+        __u32 addr);
+int nanofs_dirbtree_remove(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd,
+        struct nanofs_filedir_handle *fh);
+int nanofs_dirbtree_free(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_dir_node *dn);
+
+#endif
@@ -0,0 +1,348 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dirindex.c
+    @version 0.4
+    @brief On-disk hashed index of large directories
+
+    With NANOFS_FEAT_DIR_INDEX a directory that reaches NANOFS_DIR_INDEX_MIN
+    children gets an index, see struct nanofs_dir_index. A lookup reads the
+    index header, the bucket of the name and the dir nodes with the same
+    hash, instead of every child.
+
+    nanofs_alloc_dir_node() and nanofs_free_dir_node() keep the index in
+    step with the children list. When a bucket fills up the index is built
+    again with twice the buckets, when that is not possible the directory
+    is left without index and lookups walk the list as before.
+
+    The index blocks are read and written through the header cache, only
+    their first NANOFS_DIR_INDEX_BLOCK bytes are used, so with a journal
+    they are part of the group like any other node header.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "nanofs.h"
+#include "nanofs_filedir.h"
+#include "nanofs_dindex.h"
+#include "nanofs_dirindex.h"
+
+/** Largest number of buckets, an index needing more is not built */
+#define NANOFS_DIR_INDEX_MAX_BUCKETS (64 * 1024)
+
+/** Read the header of the index at 'ptr'
+ * @return 0 on success | -1 on error, bad index or IO error
+ * */
+static int index_header(struct nanofs_fs_handle *fs_hd, __u32 ptr,
+        __u32 *buckets_out)
+{
+    struct nanofs_dir_index x;
+    __u8 *buf;
+    size_t len;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&fs_hd->h_cache, ptr, sizeof(x), &len);
+    if (buf == NULL)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    memcpy(&x, buf, sizeof(x));
+    if (x.x_magic != NANOFS_DIR_INDEX_MAGIC || x.x_buckets == 0 ||
+            x.x_buckets > fs_hd->h_sb.s_fs_size - ptr - 1)
+    {
+        log_error("nanofs_dirindex: bad index at block %u", ptr);
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    *buckets_out = x.x_buckets;
+    return 0;
+}
+
+static int bucket_read(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_dir_index_bucket *b)
+{
+    __u8 *buf;
+    size_t len;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&fs_hd->h_cache, blk_no, sizeof(*b), &len);
+    if (buf == NULL)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    memcpy(b, buf, sizeof(*b));
+    if (b->b_count > NANOFS_DIR_INDEX_SLOTS)
+    {
+        log_error("nanofs_dirindex: bad bucket at block %u", blk_no);
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int bucket_write(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_dir_index_bucket *b)
+{
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    if (nanofs_cache_put(&fs_hd->h_cache, blk_no, b, sizeof(*b)) != 0)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/** Return the blocks of the index at 'ptr' to the free list
+ * @return 0 on success | EIO on error
+ * */
+static int index_release(struct nanofs_fs_handle *fs_hd, __u32 ptr)
+{
+    __u32 buckets;
+
+    if (index_header(fs_hd, ptr, &buckets) != 0 ||
+            nanofs_free_blocks(fs_hd, ptr, buckets + 1) != 0)
+        return EIO;
+    return 0;
+}
+
+/** Leave the directory without index
+ * @return 0 on success | EIO on error
+ * */
+static int index_drop(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd)
+{
+    __u32 ptr = dir_hd->f_dir_node.d_meta_ptr;
+
+    if (ptr == 0)
+        return 0;
+    dir_hd->f_dir_node.d_meta_ptr = 0;
+    if (nanofs_write_dir_node_b(fs_hd, dir_hd->f_blk_no,
+            &dir_hd->f_dir_node) != 0)
+        return EIO;
+    return index_release(fs_hd, ptr);
+}
+
+/** Build the index of a directory with 'buckets' buckets reading all its
+ * children, the index it had is released. When there is no room for the
+ * index the directory is left without it.
+ * @return 0 on success | EIO on error
+ * */
+static int index_create(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, __u32 buckets)
+{
+    struct nanofs_dir_index_bucket *table, *b;
+    struct nanofs_dir_index x;
+    struct nanofs_dir_node dn;
+    __u32 ptr, old_ptr, blk_no, hash, i;
+
+    if (buckets > NANOFS_DIR_INDEX_MAX_BUCKETS)
+        return index_drop(fs_hd, dir_hd);
+    table = calloc(buckets, sizeof(*table));
+    if (table == NULL)
+        return index_drop(fs_hd, dir_hd);
+    blk_no = dir_hd->f_dir_node.d_data_ptr;
+    while (blk_no != 0)
+    {
+        if (nanofs_read_dir_node_b(fs_hd, blk_no, &dn) != 0)
+        {
+            free(table);
+            return EIO;
+        }
+        hash = nanofs_dindex_hash(dn.d_fname, dn.d_fname_len);
+        b = &table[hash % buckets];
+        if (b->b_count == NANOFS_DIR_INDEX_SLOTS)
+        {
+            // Too many names with the same hash
+            free(table);
+            return index_drop(fs_hd, dir_hd);
+        }
+        b->b_entries[b->b_count].x_hash = hash;
+        b->b_entries[b->b_count].x_blk_no = blk_no;
+        b->b_count++;
+        blk_no = dn.d_next_ptr;
+    }
+    ptr = nanofs_alloc_blocks(fs_hd, buckets + 1);
+    if (ptr == 0)
+    {
+        free(table);
+        if (fs_hd->h_error != ENOSPC)
+            return EIO;
+        return index_drop(fs_hd, dir_hd);
+    }
+    x.x_magic = NANOFS_DIR_INDEX_MAGIC;
+    x.x_buckets = buckets;
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    if (nanofs_cache_put(&fs_hd->h_cache, ptr, &x, sizeof(x)) != 0)
+    {
+        free(table);
+        return EIO;
+    }
+    for (i = 0; i < buckets; i++)
+        if (bucket_write(fs_hd, ptr + 1 + i, &table[i]) != 0)
+        {
+            free(table);
+            return EIO;
+        }
+    free(table);
+
+    old_ptr = dir_hd->f_dir_node.d_meta_ptr;
+    dir_hd->f_dir_node.d_meta_ptr = ptr;
+    if (nanofs_write_dir_node_b(fs_hd, dir_hd->f_blk_no,
+            &dir_hd->f_dir_node) != 0)
+        return EIO;
+    if (old_ptr != 0)
+        return index_release(fs_hd, old_ptr);
+    return 0;
+}
+
+/** Search a child of a directory using its index, 'dir_hd' must have one
+ * @param fh_out On success is filled
+ * @return 0 on success | ENOENT if not found | -1 on error
+ * */
+int nanofs_dirindex_lookup(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, const char *name,
+        struct nanofs_filedir_handle *fh_out)
+{
+    struct nanofs_dir_index_bucket b;
+    __u32 ptr = dir_hd->f_dir_node.d_meta_ptr;
+    __u32 buckets, hash, i;
+
+    if (index_header(fs_hd, ptr, &buckets) != 0)
+        return -1;
+    hash = nanofs_dindex_hash((const __u8 *)name, strlen(name));
+    if (bucket_read(fs_hd, ptr + 1 + hash % buckets, &b) != 0)
+        return -1;
+    for (i = 0; i < b.b_count; i++)
+    {
+        if (b.b_entries[i].x_hash != hash)
+            continue;
+        if (nanofs_read_dir_node_b(fs_hd, b.b_entries[i].x_blk_no,
+                &fh_out->f_dir_node) != 0)
+            return -1;
+        if (strcmp(name, (char *)fh_out->f_dir_node.d_fname) == 0)
+        {
+            fh_out->f_blk_no = b.b_entries[i].x_blk_no;
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+/** Build the index of a directory without one, sized for its children
+ * @return 0 on success, also when there is no room for the index
+ *      | EIO on error
+ * */
+int nanofs_dirindex_build(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd)
+{
+    struct nanofs_dir_node dn;
+    __u32 buckets = NANOFS_DIR_INDEX_MIN_BUCKETS;
+    __u32 children = 0, blk_no = dir_hd->f_dir_node.d_data_ptr;
+
+    while (blk_no != 0)
+    {
+        if (nanofs_read_dir_node_b(fs_hd, blk_no, &dn) != 0)
+            return EIO;
+        children++;
+        blk_no = dn.d_next_ptr;
+    }
+
+    // Buckets half full
+    while (buckets * NANOFS_DIR_INDEX_SLOTS < children * 2 &&
+            buckets <= NANOFS_DIR_INDEX_MAX_BUCKETS)
+        buckets <<= 1;
+    return index_create(fs_hd, dir_hd, buckets);
+}
+
+/** Add a child just linked to the directory index, the index is built
+ * again when its bucket is full
+ * @return 0 on success | EIO on error
+ * */
+int nanofs_dirindex_insert(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, struct nanofs_dir_node *dn,
+        __u32 blk_no)
+{
+    struct nanofs_dir_index_bucket b;
+    __u32 ptr = dir_hd->f_dir_node.d_meta_ptr;
+    __u32 buckets, hash, bucket_blk;
+
+    if (index_header(fs_hd, ptr, &buckets) != 0)
+        return EIO;
+    hash = nanofs_dindex_hash(dn->d_fname, dn->d_fname_len);
+    bucket_blk = ptr + 1 + hash % buckets;
+    if (bucket_read(fs_hd, bucket_blk, &b) != 0)
+        return EIO;
+    if (b.b_count == NANOFS_DIR_INDEX_SLOTS)
+        return index_create(fs_hd, dir_hd, buckets * 2);
+    b.b_entries[b.b_count].x_hash = hash;
+    b.b_entries[b.b_count].x_blk_no = blk_no;
+    b.b_count++;
+    if (bucket_write(fs_hd, bucket_blk, &b) != 0)
+        return EIO;
+    return 0;
+}
+
+/** Remove a child just unlinked from the directory index
+ * @return 0 on success | EIO on error
+ * */
+int nanofs_dirindex_remove(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd,
+        struct nanofs_filedir_handle *fh)
+{
+    struct nanofs_dir_index_bucket b;
+    __u32 ptr = dir_hd->f_dir_node.d_meta_ptr;
+    __u32 buckets, hash, bucket_blk, i;
+
+    if (index_header(fs_hd, ptr, &buckets) != 0)
+        return EIO;
+    hash = nanofs_dindex_hash(fh->f_dir_node.d_fname,
+            fh->f_dir_node.d_fname_len);
+    bucket_blk = ptr + 1 + hash % buckets;
+    if (bucket_read(fs_hd, bucket_blk, &b) != 0)
+        return EIO;
+    for (i = 0; i < b.b_count; i++)
+        if (b.b_entries[i].x_blk_no == fh->f_blk_no)
+            break;
+    if (i == b.b_count)
+    {
+        log_error("nanofs_dirindex_remove: block %u not in the index of "
+                "block %u, index dropped", fh->f_blk_no, dir_hd->f_blk_no);
+        return index_drop(fs_hd, dir_hd);
+    }
+    b.b_entries[i] = b.b_entries[--b.b_count];
+    if (bucket_write(fs_hd, bucket_blk, &b) != 0)
+        return EIO;
+    return 0;
+}
+
+/** Release the index of a dir node being freed, if any
+ * @return 0 on success | EIO on error
+ * */
+int nanofs_dirindex_free(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_dir_node *dn)
+{
+    if (dn->d_meta_ptr == 0)
+        return 0;
+    return index_release(fs_hd, dn->d_meta_ptr);
+}
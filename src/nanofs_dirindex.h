@@ -0,0 +1,52 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_dirindex.h
+    @version 0.4
+    @brief On-disk hashed index of large directories
+
+******************************************************************************/
+
+#ifndef __NANOFS_DIRINDEX_H__
+#define __NANOFS_DIRINDEX_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+struct nanofs_dir_node;
+struct nanofs_fs_handle;
+struct nanofs_filedir_handle;
+
+/** Children of a directory when its index is built */
+#define NANOFS_DIR_INDEX_MIN  64
+/** Fewest buckets of an index */
+#define NANOFS_DIR_INDEX_MIN_BUCKETS 4
+
+int nanofs_dirindex_lookup(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, const char *name,
+        struct nanofs_filedir_handle *fh_out);
+int nanofs_dirindex_build(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd);
+int nanofs_dirindex_insert(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd, struct nanofs_dir_node *dn,
+        __u32 blk_no);
+int nanofs_dirindex_remove(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *dir_hd,
+        struct nanofs_filedir_handle *fh);
+int nanofs_dirindex_free(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_dir_node *dn);
+
+#endif
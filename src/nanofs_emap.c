@@ -0,0 +1,221 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_emap.c
+    @version 0.4
+    @brief In-memory extent maps of files
+
+
+    Files are linked lists of data nodes, reaching an offset reads the
+    header of every node before it. The map of a file keeps the offset,
+    block and length of its nodes in an array, so the node holding an
+    offset is found with a binary search. A map is filled as the chain is
+    walked, reading a file from the start maps it once.
+
+    Maps of all the files share a cap of extents, whole files are dropped
+    in LRU order to stay under it.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nanofs_emap.h"
+
+#define EMAP_MIN_EXTENTS 16
+
+static unsigned file_bucket(__u32 blk_no)
+{
+    return (blk_no * 2654435761u) >> 24;
+}
+
+static void lru_unlink(struct nanofs_emap_file *f)
+{
+    f->f_prev->f_next = f->f_next;
+    f->f_next->f_prev = f->f_prev;
+}
+
+static void lru_push(struct nanofs_emap *em, struct nanofs_emap_file *f)
+{
+    f->f_next = em->m_lru.f_next;
+    f->f_prev = &em->m_lru;
+    em->m_lru.f_next->f_prev = f;
+    em->m_lru.f_next = f;
+}
+
+/** Unlink a file from the table and the LRU list and free it */
+static void file_free(struct nanofs_emap *em, struct nanofs_emap_file *f)
+{
+    struct nanofs_emap_file **p = &em->m_hash[file_bucket(f->f_blk_no)];
+
+    while (*p != f)
+        p = &(*p)->f_hnext;
+    *p = f->f_hnext;
+    lru_unlink(f);
+    em->m_extents -= f->f_size;
+    free(f->f_ext);
+    free(f);
+}
+
+/** Drop least recently used files, except 'keep', until 'extents' more
+ * fit under the cap
+ * @return 0 on success | -1 if they do not fit */
+static int make_room(struct nanofs_emap *em, size_t extents,
+        struct nanofs_emap_file *keep)
+{
+    struct nanofs_emap_file *f = em->m_lru.f_prev;
+
+    while (em->m_extents + extents > em->m_max && f != &em->m_lru)
+    {
+        struct nanofs_emap_file *prev = f->f_prev;
+
+        if (f != keep)
+            file_free(em, f);
+        f = prev;
+    }
+    return em->m_extents + extents > em->m_max ? -1 : 0;
+}
+
+void nanofs_emap_init(struct nanofs_emap *em, size_t max_extents)
+{
+    memset(em, 0, sizeof(struct nanofs_emap));
+    em->m_max = max_extents;
+    em->m_lru.f_next = em->m_lru.f_prev = &em->m_lru;
+}
+
+/** Free all the files */
+void nanofs_emap_destroy(struct nanofs_emap *em)
+{
+    while (em->m_lru.f_next != &em->m_lru)
+        file_free(em, em->m_lru.f_next);
+}
+
+/** Find the map of a file, it becomes the most recently used
+ * @return the file | NULL if it is not mapped */
+struct nanofs_emap_file *nanofs_emap_get(struct nanofs_emap *em,
+        __u32 blk_no)
+{
+    struct nanofs_emap_file *f;
+
+    for (f = em->m_hash[file_bucket(blk_no)]; f != NULL; f = f->f_hnext)
+        if (f->f_blk_no == blk_no)
+        {
+            lru_unlink(f);
+            lru_push(em, f);
+            return f;
+        }
+    return NULL;
+}
+
+/** Start an empty map of a file, the caller adds its nodes from 'first'
+ * @return the file | NULL when maps are disabled, full or without
+ *      memory */
+struct nanofs_emap_file *nanofs_emap_new(struct nanofs_emap *em,
+        __u32 blk_no, __u32 first)
+{
+    struct nanofs_emap_file *f;
+    unsigned h = file_bucket(blk_no);
+
+    nanofs_emap_drop(em, blk_no);
+    if (make_room(em, EMAP_MIN_EXTENTS, NULL) != 0)
+        return NULL;
+    f = malloc(sizeof(struct nanofs_emap_file));
+    if (f == NULL)
+        return NULL;
+    f->f_ext = malloc(EMAP_MIN_EXTENTS * sizeof(struct nanofs_emap_extent));
+    if (f->f_ext == NULL)
+    {
+        free(f);
+        return NULL;
+    }
+    f->f_blk_no = blk_no;
+    f->f_first = first;
+    f->f_more = first;
+    f->f_count = 0;
+    f->f_size = EMAP_MIN_EXTENTS;
+    f->f_hnext = em->m_hash[h];
+    em->m_hash[h] = f;
+    lru_push(em, f);
+    em->m_extents += EMAP_MIN_EXTENTS;
+    return f;
+}
+
+/** Forget the map of a file, if any */
+void nanofs_emap_drop(struct nanofs_emap *em, __u32 blk_no)
+{
+    struct nanofs_emap_file *f;
+
+    for (f = em->m_hash[file_bucket(blk_no)]; f != NULL; f = f->f_hnext)
+        if (f->f_blk_no == blk_no)
+        {
+            file_free(em, f);
+            return;
+        }
+}
+
+/** Map the node that follows the mapped ones, it starts where the last
+ * one ends
+ * @param more The node after it, 0 if it is the last node of the file
+ * @return 0 on success | -1 if it does not fit, the caller must drop the
+ *      file */
+int nanofs_emap_add(struct nanofs_emap *em, struct nanofs_emap_file *f,
+        __u32 blk_no, __u32 len, __u32 more)
+{
+    struct nanofs_emap_extent *ext;
+
+    if (f->f_count == f->f_size)
+    {
+        if (make_room(em, f->f_size, f) != 0)
+            return -1;
+        ext = realloc(f->f_ext,
+                2 * f->f_size * sizeof(struct nanofs_emap_extent));
+        if (ext == NULL)
+            return -1;
+        f->f_ext = ext;
+        em->m_extents += f->f_size;
+        f->f_size *= 2;
+    }
+    ext = &f->f_ext[f->f_count];
+    ext->e_offset = f->f_count == 0 ? 0 :
+            ext[-1].e_offset + ext[-1].e_len;
+    ext->e_blk_no = blk_no;
+    ext->e_len = len;
+    if (f->f_count == 0)
+        f->f_first = blk_no;
+    f->f_count++;
+    f->f_more = more;
+    return 0;
+}
+
+/** Binary search of the mapped node holding byte 'offset' of the file,
+ * 'f' must have nodes mapped
+ * @return index of the last node starting at or before 'offset' */
+__u32 nanofs_emap_find(struct nanofs_emap_file *f, __u64 offset)
+{
+    __u32 lo = 0, hi = f->f_count - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo + 1) / 2;
+        if (f->f_ext[mid].e_offset <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
@@ -0,0 +1,78 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_emap.h
+    @version 0.4
+    @brief In-memory extent maps of files
+
+******************************************************************************/
+
+#ifndef __NANOFS_EMAP_H__
+#define __NANOFS_EMAP_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/** Buckets of the table of mapped files */
+#define NANOFS_EMAP_BUCKETS 256
+/** Default cap of extents of all the files, 16 bytes each */
+#define NANOFS_EMAP_DEFAULT (256 * 1024)
+
+/** Data node of a file */
+struct nanofs_emap_extent {
+    __u64 e_offset;                     ///< File offset of its data
+    __u32 e_blk_no;
+    __u32 e_len;                        ///< d_len of the node
+};
+
+/** Data nodes of a file from the first one, in file order. The first
+ * 'f_count' nodes are mapped, 'f_more' follows the last of them. */
+struct nanofs_emap_file {
+    __u32 f_blk_no;                     ///< Dir node of the file
+    __u32 f_first;                      ///< d_data_ptr of the file
+    __u32 f_more;                       ///< Next node to map, 0 when the
+                                        ///<   whole file is mapped
+    __u32 f_count;                      ///< Extents mapped
+    __u32 f_size;                       ///< Extents allocated
+    struct nanofs_emap_extent *f_ext;
+    struct nanofs_emap_file *f_hnext;   ///< Hash chain
+    struct nanofs_emap_file *f_prev;    ///< LRU list, most recent first
+    struct nanofs_emap_file *f_next;
+};
+
+/** Files mapped, built while their data chain is walked and kept up to
+ * date by the functions that change it. */
+struct nanofs_emap {
+    size_t m_max;                       ///< Max extents, 0 disables maps
+    size_t m_extents;                   ///< Extents allocated
+    struct nanofs_emap_file *m_hash[NANOFS_EMAP_BUCKETS];
+    struct nanofs_emap_file m_lru;      ///< LRU list head
+};
+
+void  nanofs_emap_init(struct nanofs_emap *em, size_t max_extents);
+void  nanofs_emap_destroy(struct nanofs_emap *em);
+
+struct nanofs_emap_file *nanofs_emap_get(struct nanofs_emap *em,
+        __u32 blk_no);
+struct nanofs_emap_file *nanofs_emap_new(struct nanofs_emap *em,
+        __u32 blk_no, __u32 first);
+void  nanofs_emap_drop(struct nanofs_emap *em, __u32 blk_no);
+
+int   nanofs_emap_add(struct nanofs_emap *em, struct nanofs_emap_file *f,
+        __u32 blk_no, __u32 len, __u32 more);
+__u32 nanofs_emap_find(struct nanofs_emap_file *f, __u64 offset);
+
+#endif
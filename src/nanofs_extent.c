@@ -0,0 +1,284 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_extent.c
+    @version 0.4
+    @brief Extent index of large files
+
+    The data nodes of a file are a linked list, the node holding an offset
+    is found reading the header of every node before it. The in-memory
+    maps of nanofs_emap.c do it once per file, but the first access to a
+    large file still walks the whole chain.
+
+    With NANOFS_FEAT_EXTENTS the metadata block of a file has the root of
+    an index of its data nodes, see struct nanofs_extent_node. It has
+    levels like indirect blocks: leaves list the offset and block of the
+    data nodes, inner nodes the offset and block of the nodes one level
+    down. A node holding an offset is found reading one node per level.
+
+    Data nodes are only added at the end of a file and a file is only
+    truncated to 0, so the index grows along its rightmost path: the last
+    node with room at each level takes the new entry, full nodes are left
+    as they are and the root gets a level above it when all are full.
+
+    The nodes are read and written through the header cache, so with a
+    journal they are part of the group like any other node header.
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "nanofs.h"
+#include "nanofs_filedir.h"
+#include "nanofs_extent.h"
+
+static int node_read(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_extent_node *n)
+{
+    __u8 *buf;
+    size_t len;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&fs_hd->h_cache, blk_no, sizeof(*n), &len);
+    if (buf == NULL)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    memcpy(n, buf, sizeof(*n));
+    if (n->n_magic != NANOFS_EXTENT_MAGIC ||
+            n->n_level >= NANOFS_EXTENT_MAX_LEVEL ||
+            n->n_count == 0 || n->n_count > NANOFS_EXTENT_SLOTS)
+    {
+        log_error("nanofs_extent: bad node at block %u", blk_no);
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int node_write(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_extent_node *n)
+{
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    if (nanofs_cache_put(&fs_hd->h_cache, blk_no, n, sizeof(*n)) != 0)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/** Write a node with a single entry */
+static int node_new(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        int level, __u64 offset, __u32 entry_blk_no)
+{
+    struct nanofs_extent_node n;
+
+    memset(&n, 0, sizeof(n));
+    n.n_magic = NANOFS_EXTENT_MAGIC;
+    n.n_count = 1;
+    n.n_level = level;
+    n.n_entries[0].x_offset = offset;
+    n.n_entries[0].x_blk_no = entry_blk_no;
+    return node_write(fs_hd, blk_no, &n);
+}
+
+/** Index of the last of the 'n' entries starting at or before 'offset' */
+static int entry_find(struct nanofs_extent_node *n, __u64 offset)
+{
+    int lo = 0, hi = n->n_count - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo + 1) / 2;
+        if (n->n_entries[mid].x_offset <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/** Add the data node appended to a file to its index. The nodes needed
+ * are allocated first, so on error the index is left as it was.
+ * @param m Metadata of the file, its index fields are updated, the caller
+ *      writes it
+ * @param offset File offset of the data of the node, the end of the file
+ * @return 0 on success | -1 on error, field fs_hd->h_error is ENOSPC when
+ *      a node cannot be allocated
+ * */
+int nanofs_extent_append(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_file_meta *m, __u64 offset, __u32 blk_no)
+{
+    struct nanofs_extent_node n;
+    __u32 path[NANOFS_EXTENT_MAX_LEVEL], fresh[NANOFS_EXTENT_MAX_LEVEL];
+    __u32 child;
+    int level, top, need, err, i;
+
+    // Rightmost path, path[level] is the last node of the level
+    top = m->m_levels;
+    child = m->m_extents;
+    for (level = top - 1; level >= 0; level--)
+    {
+        path[level] = child;
+        if (node_read(fs_hd, child, &n) != 0)
+            return -1;
+        if (n.n_level != level)
+        {
+            log_error("nanofs_extent: bad level at block %u", child);
+            fs_hd->h_error = EIO;
+            return -1;
+        }
+        child = n.n_entries[n.n_count - 1].x_blk_no;
+    }
+    // Lowest level with room, 'top' when a new root is needed
+    for (level = 0; level < top; level++)
+    {
+        if (node_read(fs_hd, path[level], &n) != 0)
+            return -1;
+        if (n.n_count < NANOFS_EXTENT_SLOTS)
+            break;
+    }
+    if (level == NANOFS_EXTENT_MAX_LEVEL)
+    {
+        log_error("nanofs_extent: index too deep");
+        fs_hd->h_error = ENOSPC;
+        return -1;
+    }
+
+    // New nodes below that level, and that level when it is a new root
+    need = level + (level == top);
+    for (i = 0; i < need; i++)
+    {
+        fresh[i] = nanofs_alloc_blocks(fs_hd, 1);
+        if (fresh[i] == 0)
+        {
+            err = fs_hd->h_error;
+            while (i-- > 0)
+                nanofs_free_blocks(fs_hd, fresh[i], 1);
+            fs_hd->h_error = err;
+            return -1;
+        }
+    }
+
+    if (top == 0)
+    {
+        // First data node, the index is a leaf
+        if (node_new(fs_hd, fresh[0], 0, offset, blk_no) != 0)
+            return -1;
+        m->m_extents = fresh[0];
+        m->m_levels = 1;
+        m->m_count = 1;
+        return 0;
+    }
+    child = blk_no;
+    for (i = 0; i < level; i++)
+    {
+        if (node_new(fs_hd, fresh[i], i, offset, child) != 0)
+            return -1;
+        child = fresh[i];
+    }
+    if (level == top)
+    {
+        // All full, the old root and the new path are the two children
+        // of a new root
+        if (node_new(fs_hd, fresh[level], level, 0, m->m_extents) != 0 ||
+                node_read(fs_hd, fresh[level], &n) != 0)
+            return -1;
+        path[level] = fresh[level];
+        m->m_extents = fresh[level];
+        m->m_levels = top + 1;
+    }
+    n.n_entries[n.n_count].x_offset = offset;
+    n.n_entries[n.n_count].x_blk_no = child;
+    n.n_entries[n.n_count].x_pad = 0;
+    n.n_count++;
+    if (node_write(fs_hd, path[level], &n) != 0)
+        return -1;
+    m->m_count++;
+    return 0;
+}
+
+/** Find the data node holding byte 'offset' of a file, the last one when
+ * 'offset' is past the end of file
+ * @param offset_out File offset of the data of the node
+ * @return 0 on success | -1 on error | 1 when the index is empty
+ * */
+int nanofs_extent_find(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_file_meta *m, __u64 offset, __u64 *offset_out,
+        __u32 *blk_out)
+{
+    struct nanofs_extent_node n;
+    __u32 blk_no = m->m_extents;
+    int level, i;
+
+    if (m->m_levels == 0)
+        return 1;
+    for (level = m->m_levels - 1; level >= 0; level--)
+    {
+        if (node_read(fs_hd, blk_no, &n) != 0)
+            return -1;
+        if (n.n_level != level)
+        {
+            log_error("nanofs_extent: bad level at block %u", blk_no);
+            fs_hd->h_error = EIO;
+            return -1;
+        }
+        i = entry_find(&n, offset);
+        blk_no = n.n_entries[i].x_blk_no;
+        *offset_out = n.n_entries[i].x_offset;
+    }
+    *blk_out = blk_no;
+    return 0;
+}
+
+/** Free the nodes under the node at 'blk_no', and the node itself */
+static int tree_free(struct nanofs_fs_handle *fs_hd, __u32 blk_no)
+{
+    struct nanofs_extent_node n;
+    int i;
+
+    if (node_read(fs_hd, blk_no, &n) != 0)
+        return -1;
+    for (i = 0; n.n_level > 0 && i < n.n_count; i++)
+        if (tree_free(fs_hd, n.n_entries[i].x_blk_no) != 0)
+            return -1;
+    return nanofs_free_blocks(fs_hd, blk_no, 1);
+}
+
+/** Free the index of a file, the file is left without index
+ * @param m Metadata of the file, the caller writes it
+ * @return 0 on success | -1 on error
+ * */
+int nanofs_extent_free(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_file_meta *m)
+{
+    int res = 0;
+
+    if (m->m_levels > 0)
+        res = tree_free(fs_hd, m->m_extents);
+    m->m_flags &= ~NANOFS_META_EXTENTS;
+    m->m_levels = 0;
+    m->m_extents = 0;
+    m->m_count = 0;
+    return res;
+}
@@ -0,0 +1,43 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_extent.h
+    @version 0.4
+    @brief Extent index of large files
+
+******************************************************************************/
+
+#ifndef __NANOFS_EXTENT_H__
+#define __NANOFS_EXTENT_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+struct nanofs_file_meta;
+struct nanofs_fs_handle;
+
+/** Deepest index, a node with a higher level is taken as damaged */
+#define NANOFS_EXTENT_MAX_LEVEL 8
+
+int nanofs_extent_append(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_file_meta *m, __u64 offset, __u32 blk_no);
+int nanofs_extent_find(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_file_meta *m, __u64 offset, __u64 *offset_out,
+        __u32 *blk_out);
+int nanofs_extent_free(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_file_meta *m);
+
+#endif
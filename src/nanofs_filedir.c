@@ -33,6 +33,8 @@
 /** Mandatory to use O_DIRECT flag, before including 'fnctl.h' */
 #define _GNU_SOURCE
 
+#include <config.h>
+
 #include <asm/types.h>
 
 #include <sys/types.h>
@@ -42,16 +44,25 @@
 
 #include <string.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <libgen.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 
 #include "nanofs.h"
 #include "nanofs_io.h"
+#include "nanofs_dev.h"
 #include "nanofs_filedir.h"
+#include "nanofs_journal.h"
+#include "nanofs_dirindex.h"
+#include "nanofs_dirbtree.h"
+#include "nanofs_extent.h"
+#include "nanofs_trace.h"
 #include "log.h"
 
 
@@ -59,7 +70,7 @@
 
 
 static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
-        struct nanofs_filedir_handle *fh, __u32 size,
+        struct nanofs_filedir_handle *fh, __u32 last, __u32 size,
         struct nanofs_data_node *dn_out);
 
 static int nanofs_alloc_dir_node(struct nanofs_fs_handle *fs_hd,
@@ -69,29 +80,114 @@ static int nanofs_alloc_dir_node(struct nanofs_fs_handle *fs_hd,
 static int nanofs_free_dir_node( struct nanofs_fs_handle *fs_hd,
         struct nanofs_filedir_handle *parent_hd,
         struct nanofs_filedir_handle *fd_hd);
+int nanofs_free_data_node(struct nanofs_fs_handle *hd,int blkno,
+        struct nanofs_data_node *dn);
+static int nanofs_link_dir_node(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd);
+static int nanofs_unlink_dir_node(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd, int release);
+
+static struct nanofs_dindex_dir *nanofs_index_dir(
+        struct nanofs_fs_handle *fs_hd, struct nanofs_filedir_handle *dir_hd);
+static int nanofs_index_link(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle fh_vec[], int count);
+static int nanofs_index_unlink(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd, int release);
+
+static int nanofs_writeback(struct nanofs_fs_handle *hd);
+static int nanofs_orphan(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd);
+
+static int nanofs_read_inline(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, char *buf, size_t size,
+        off_t offset);
+static int nanofs_write_inline(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, const char *buf, size_t size,
+        off_t offset);
+static int nanofs_inline_promote(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh);
+static __u32 nanofs_take_blocks(struct nanofs_fs_handle *hd, __u32 blocks);
+static int nanofs_write_nodes(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, const char *buf, size_t size,
+        off_t offset);
+static int nanofs_new_file_meta(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, struct nanofs_file_meta *m);
+static int nanofs_set_file_size(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, __u64 size);
+static int nanofs_index_data_node(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, __u64 offset, __u32 blk_no);
+static int nanofs_index_append(struct nanofs_fs_handle *hd,
+        struct nanofs_file_meta *m, __u64 offset, __u32 blk_no);
+static int nanofs_index_file(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, struct nanofs_file_meta *m);
+static int nanofs_free_file_meta(struct nanofs_fs_handle *hd,
+        struct nanofs_dir_node *dn);
+static __u32 nanofs_alloc_dir_slots(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *parent_hd, int slots);
+static int nanofs_free_dir_slots(struct nanofs_fs_handle *hd, __u32 addr,
+        int slots);
+static __u32 nanofs_resize_dir_slots(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *parent_hd, __u32 addr, int old_slots,
+        int slots);
+static int nanofs_push_free(struct nanofs_fs_handle *hd, __u32 blk_no,
+        __u32 len);
+static __u32 nanofs_create_blocks(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_create_entry *entry);
+static void nanofs_create_release(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, __u32 blk_no, __u32 data_blocks);
 
 
 
 
 /** Open device/file and init the filesystem handle
+ * @param engine Storage engine, NANOFS_DEV_POSIX, NANOFS_DEV_MMAP,
+ *      NANOFS_DEV_RAM or NANOFS_DEV_URING
+ * @param flags NANOFS_OPEN_DIRECT or 0
  * @return -1 on error | 0 on success
  * */
-int nanofs_open_dev(char *dev_name, struct nanofs_fs_handle *hd)
+int nanofs_open_dev(char *dev_name, int engine, int flags,
+        struct nanofs_fs_handle *hd)
 {
-    //hd->h_fd=open ( dev_name, O_FSYNC  | O_RDWR, 0 );
-    hd->h_fd = open(dev_name, O_RDWR);
+    int oflags = O_RDWR;
+
+    if (flags & NANOFS_OPEN_DIRECT)
+        oflags |= O_DIRECT;
     hd->h_error = 0;
-    if (hd->h_fd < 0)
+    hd->h_cache.c_hash = NULL;
+    hd->h_sb_dirty = 0;
+    hd->h_sb_lazy = 0;
+    hd->h_journal = 0;
+    hd->h_dir_index = 0;
+    hd->h_dir_shift = 0;
+    hd->h_inline = 0;
+    hd->h_dir_btree = 0;
+    hd->h_dir_fill = 0;
+    hd->h_orphans = 0;
+    hd->h_file_size = 0;
+    hd->h_extents = 0;
+    hd->h_defer_head = hd->h_defer_tail = 0;
+    memset(&hd->h_stats, 0, sizeof(hd->h_stats));
+    nanofs_dindex_init(&hd->h_dindex, NANOFS_DINDEX_DEFAULT);
+    nanofs_dcache_init(&hd->h_dcache, NANOFS_DCACHE_DEFAULT);
+    nanofs_acache_init(&hd->h_acache);
+    nanofs_emap_init(&hd->h_emap, NANOFS_EMAP_DEFAULT);
+    if (nanofs_dev_open(&hd->h_dev, dev_name, engine, oflags) != 0)
     {
         log_error("nanofs_open_dev: Cannot open device for R/W");
         hd->h_error = errno;
         return -1;
     }
+    hd->h_dev.d_stats = &hd->h_stats;
     if (hd->h_error == 0) // Ok
     {
         hd->h_dev_name = strdup(dev_name);
         // Reading superblock
-        if (nanofs_read_sb(hd->h_fd, (off_t) 0, &hd->h_sb) != 0)
+        if (nanofs_read_sb(&hd->h_dev, (off_t) 0, &hd->h_sb) != 0)
         {
             log_error("nanofs_open_dev: Error reading superblock");
             hd->h_error = EIO;
@@ -114,6 +210,95 @@ int nanofs_open_dev(char *dev_name, struct nanofs_fs_handle *hd)
             hd->h_error = EIO;
         }
     }
+    if (hd->h_error == 0 &&
+            nanofs_read_sb_extra(&hd->h_dev, &hd->h_sb, &hd->h_sbx) != 0)
+        hd->h_error = EIO;
+    // Features of a newer version would be ignored and the fs damaged
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & ~NANOFS_FEAT_ALL))
+    {
+        log_error("nanofs_open_dev: Unknown features 0x%X in superblock",
+                hd->h_sbx.s_features & ~NANOFS_FEAT_ALL);
+        hd->h_error = EIO;
+    }
+    // A crash may have left a journal record to be replayed
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_JOURNAL))
+    {
+        if (hd->h_block_bits < 9 ||
+                nanofs_journal_check(&hd->h_sbx, hd->h_sb.s_fs_size) != 0)
+        {
+            log_error("nanofs_open_dev: Error in superblock journal fields");
+            hd->h_error = EIO;
+        }
+        else if (nanofs_journal_replay(hd) != 0)
+        {
+            log_error("nanofs_open_dev: Journal replay failed");
+            hd->h_error = EIO;
+        }
+        else
+            hd->h_journal = 1;
+    }
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_DIR_INDEX))
+        hd->h_dir_index = 1;
+    // Slots of packed dir nodes are sized for 512 bytes blocks
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_PACKED_DIRS))
+    {
+        if (hd->h_block_bits != 9)
+        {
+            log_error("nanofs_open_dev: Packed dir nodes need 512 bytes blocks");
+            hd->h_error = EIO;
+        }
+        else
+            hd->h_dir_shift = NANOFS_DIR_SLOT_BITS;
+    }
+    // Inline data fills the rest of a cached dir node block
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_INLINE_DATA))
+    {
+        if (hd->h_block_bits != 9 || hd->h_dir_shift != 0)
+        {
+            log_error("nanofs_open_dev: Inline data needs 512 bytes blocks "
+                    "and unpacked dir nodes");
+            hd->h_error = EIO;
+        }
+        else
+            hd->h_inline = 1;
+    }
+    // A B-tree node takes a cached block
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_DIR_BTREE))
+    {
+        if (hd->h_block_bits != 9)
+        {
+            log_error("nanofs_open_dev: B-tree dirs need 512 bytes blocks");
+            hd->h_error = EIO;
+        }
+        else
+            hd->h_dir_btree = 1;
+    }
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_FILE_SIZE))
+        hd->h_file_size = 1;
+    // The extent index root shares the metadata block with the size
+    if (hd->h_error == 0 && (hd->h_sbx.s_features & NANOFS_FEAT_EXTENTS))
+    {
+        if (hd->h_block_bits != 9 || !hd->h_file_size)
+        {
+            log_error("nanofs_open_dev: Extent index needs 512 bytes blocks "
+                    "and file sizes");
+            hd->h_error = EIO;
+        }
+        else
+            hd->h_extents = 1;
+    }
+    if (hd->h_error == 0 && nanofs_cache_init(&hd->h_cache, &hd->h_dev,
+            hd->h_block_bits, NANOFS_CACHE_DEFAULT) != 0)
+    {
+        log_error("nanofs_open_dev: Cannot allocate header cache");
+        hd->h_error = ENOMEM;
+    }
+    if (hd->h_error == 0)
+    {
+        // Dirty headers only reach the device through journal commits
+        hd->h_cache.c_pin_dirty = hd->h_journal;
+        pthread_mutex_init(&hd->h_lock, NULL);
+    }
 
     if (hd->h_error != 0)
     {
@@ -122,18 +307,156 @@ int nanofs_open_dev(char *dev_name, struct nanofs_fs_handle *hd)
     }
     return 0;
 }
-/** Close the device associated to the filesystem handle
- *
+/** Close the device associated to the filesystem handle, cached headers
+ * and the superblock are written back first
  * */
 int nanofs_close_dev(struct nanofs_fs_handle *hd)
 {
-    if (hd->h_fd < 0)
+    if (hd->h_dev.d_ops == NULL)
         return -1;
-    close(hd->h_fd);
+    nanofs_dindex_destroy(&hd->h_dindex);
+    nanofs_dcache_destroy(&hd->h_dcache);
+    nanofs_acache_destroy(&hd->h_acache);
+    nanofs_emap_destroy(&hd->h_emap);
+    if (hd->h_cache.c_hash != NULL)
+    {
+        if (nanofs_writeback(hd) != 0)
+            log_error("nanofs_close_dev: cannot write back cached headers, "
+                    "filesystem may be corrupted");
+        nanofs_cache_destroy(&hd->h_cache);
+        pthread_mutex_destroy(&hd->h_lock);
+    }
+    nanofs_dev_close(&hd->h_dev);
     free(hd->h_dev_name);
-    hd->h_fd = -1;
+    hd->h_dev_name = NULL;
+    return 0;
+
+}
+
+/** Write superblock and extended superblock in place
+ * @return 0 on success | -1 on error
+ * */
+int nanofs_store_sb(struct nanofs_fs_handle *hd)
+{
+    __u8 buf[NANOFS_SB_SIZE + sizeof(struct nanofs_sb_extra)];
+    int size = nanofs_pack_sb(buf, &hd->h_sb, &hd->h_sbx);
+
+    NANOFS_STAT_INC(&hd->h_stats, st_sb_writes);
+    if (nanofs_write_dev(&hd->h_dev, (off_t) 0, buf, size) != size)
+    {
+        log_error("nanofs_store_sb: superblock write failed");
+        return -1;
+    }
+    return 0;
+}
+
+/** Write the superblock if it was changed since the last commit. With a
+ * journal the whole group of pending metadata is committed instead, see
+ * nanofs_journal_commit()
+ * @return 0 on success | -1 on error and h_error is set
+ * */
+int nanofs_commit(struct nanofs_fs_handle *hd)
+{
+    if (hd->h_journal)
+        return nanofs_journal_commit(hd);
+    if (!hd->h_sb_dirty)
+        return 0;
+    if (nanofs_store_sb(hd) != 0)
+    {
+        log_error("nanofs_commit: cannot update superblock, "
+                "filesystem may be corrupted");
+        hd->h_error = EIO;
+        return -1;
+    }
+    hd->h_sb_dirty = 0;
+    return 0;
+}
+
+/** Write back cached headers and the superblock
+ * @return 0 on success | -1 on error and h_error is set
+ * */
+static int nanofs_writeback(struct nanofs_fs_handle *hd)
+{
+    // The journal commit writes both and leaves them on stable storage
+    if (hd->h_journal)
+        return nanofs_journal_commit(hd);
+    if (nanofs_cache_flush(&hd->h_cache) != 0)
+    {
+        log_error("nanofs_writeback: cannot write back cached headers");
+        hd->h_error = EIO;
+        return -1;
+    }
+    return nanofs_commit(hd);
+}
+
+/** Write back cached headers and the superblock, then flush device data to
+ * stable storage (msync on mmap engine)
+ * @return 0 on success | -1 on error and h_error is set
+ * */
+int nanofs_sync(struct nanofs_fs_handle *hd)
+{
+    NANOFS_STAT_INC(&hd->h_stats, st_ops[NANOFS_OP_SYNC]);
+    if (nanofs_writeback(hd) != 0)
+        return -1;
+    if (hd->h_journal)
+        return 0;
+    if (nanofs_dev_flush(&hd->h_dev) != 0)
+    {
+        log_error("nanofs_sync: device flush failed");
+        hd->h_error = EIO;
+        return -1;
+    }
     return 0;
+}
+
+/** Start an operation, handles shared by threads must be locked
+ * */
+void nanofs_lock(struct nanofs_fs_handle *hd)
+{
+    pthread_mutex_lock(&hd->h_lock);
+}
+
+/** End an operation, the superblock is committed unless 'h_sb_lazy' is set,
+ * then it waits for nanofs_sync() or nanofs_close_dev(). With a journal the
+ * operation joins the current group, which is committed once it is full.
+ * */
+void nanofs_unlock(struct nanofs_fs_handle *hd)
+{
+    if (hd->h_journal)
+    {
+        if (nanofs_journal_full(hd))
+            nanofs_commit(hd);
+    }
+    else if (!hd->h_sb_lazy)
+        nanofs_commit(hd);
+    pthread_mutex_unlock(&hd->h_lock);
+}
+
+/** Copy the counters of the handle, they keep counting from their values
+ * */
+void nanofs_get_stats(struct nanofs_fs_handle *hd, struct nanofs_stats *st_out)
+{
+    memcpy(st_out, &hd->h_stats, sizeof(struct nanofs_stats));
+}
+
+/** Set all the counters of the handle to zero
+ * */
+void nanofs_reset_stats(struct nanofs_fs_handle *hd)
+{
+    memset(&hd->h_stats, 0, sizeof(struct nanofs_stats));
+}
 
+/** Set the memory cap of the header cache, 0 disables it
+ * @return 0 on success | -1 on error and h_error is set
+ * */
+int nanofs_set_cache_size(struct nanofs_fs_handle *hd, size_t bytes)
+{
+    if (nanofs_cache_set_size(&hd->h_cache, bytes) != 0)
+    {
+        hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
 }
 
 /** Get bits from block size
@@ -152,14 +475,28 @@ int nanofs_get_block_bits(struct nanofs_superblock *sb)
 
 
 
-/** Read dir_node given a blk_no
+/** Read dir_node given a blk_no, the address of the node with packed dir
+ * nodes
  * @return 0 on success | on error return -1 and set fs_hd->error
  * */
 int nanofs_read_dir_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
         struct nanofs_dir_node *dn_out)
 {
-    if( nanofs_read_dir_node(fs_hd->h_fd, blk_no << fs_hd->h_block_bits,
-            dn_out) != 0 )
+    __u8 *buf;
+    size_t len;
+    __u32 blk = DN_BLOCK(blk_no, fs_hd->h_dir_shift);
+    size_t off = DN_OFFSET(blk_no, fs_hd->h_dir_shift);
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&fs_hd->h_cache, blk,
+            off + NANOFS_HEADER_DIR_NODE_SIZE, &len);
+    // The entry may hold only a shorter node written before
+    if (buf != NULL &&
+            len < off + NANOFS_HEADER_DIR_NODE_SIZE + buf[off + 13])
+        buf = nanofs_cache_get(&fs_hd->h_cache, blk,
+                off + NANOFS_HEADER_DIR_NODE_SIZE + buf[off + 13], &len);
+    if( buf == NULL ||
+            nanofs_unpack_dir_node(buf + off, len - off, dn_out) != 0 )
     {
         fs_hd->h_error = EIO;
         return -1;
@@ -173,38 +510,52 @@ int nanofs_read_dir_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
 int nanofs_read_data_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
         struct nanofs_data_node *dn_out)
 {
-    if(nanofs_read_data_node(fs_hd->h_fd,
-            (off_t)(blk_no) << fs_hd->h_block_bits, dn_out) != 0)
+    __u8 *buf;
+    size_t len;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&fs_hd->h_cache, blk_no,
+            NANOFS_HEADER_DATA_NODE_SIZE, &len);
+    if(buf == NULL)
     {
          fs_hd->h_error = EIO;
          return -1;
     }
-     return 0;
+    // struct nanofs_data_node has the on-disk layout
+    memcpy(dn_out, buf, NANOFS_HEADER_DATA_NODE_SIZE);
+    return 0;
 }
 
-/** Write dir_node given a blk_no
+/** Write dir_node given a blk_no, the address of the node with packed dir
+ * nodes, it reaches the device on cache write back
  * @return 0 on success | on error return -1 and set fs_hd->errorned
  *  */
 
 inline int nanofs_write_dir_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
         struct nanofs_dir_node *dn)
 {
-    if(nanofs_write_dir_node(fs_hd->h_fd, blk_no << fs_hd->h_block_bits,dn) !=0 )
+    __u8 buf[NANOFS_HEADER_DIR_NODE_SIZE + NANOFS_MAXFILENAME];
+    int len = nanofs_pack_dir_node(buf, dn);
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    if(nanofs_cache_put_at(&fs_hd->h_cache,
+            DN_BLOCK(blk_no, fs_hd->h_dir_shift),
+            DN_OFFSET(blk_no, fs_hd->h_dir_shift), buf, len) != 0)
     {
         fs_hd->h_error = EIO;
         return -1;
     }
     return 0;
 }
-/** Write data_node given a blk_no
+/** Write data_node given a blk_no, it reaches the device on cache write back
  * @return 0 on success | on error return -1 and set fs_hd->errorned
  * */
 inline int nanofs_write_data_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
         struct nanofs_data_node *dn)
 {
-
-    if( nanofs_write_data_node(fs_hd->h_fd,
-            (off_t)(blk_no) << fs_hd->h_block_bits, dn) != 0)
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    if( nanofs_cache_put(&fs_hd->h_cache, blk_no, dn,
+            NANOFS_HEADER_DATA_NODE_SIZE) != 0)
     {
         fs_hd->h_error = EIO;
         return -1;
@@ -212,6 +563,70 @@ inline int nanofs_write_data_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
     return 0;
 }
 
+/** Write file data at a device offset, cached headers sharing the range are
+ * kept up to date
+ * @return bytes written on success | -1 on failure
+ * */
+static int nanofs_write_payload(struct nanofs_fs_handle *fs_hd, off_t offset,
+        const void *buf, int size)
+{
+    int res;
+
+    nanofs_cache_patch(&fs_hd->h_cache, offset, buf, size);
+    res = nanofs_write_dev(&fs_hd->h_dev, offset, buf, size);
+    if (res == size)
+        nanofs_cache_clean(&fs_hd->h_cache, offset, size);
+    return res;
+}
+
+/** Write data in a data node and, when 'dn' is not NULL, its header
+ *
+ * When the data starts right after the header both are sent as a single
+ * gather write and the cached header is left clean. Otherwise, or when
+ * metadata must go through the journal, the header is written through the
+ * cache.
+ *
+ * @param i_offset Offset of the data in the node payload
+ * @return bytes of data written | -1 on failure
+ * */
+static int nanofs_write_data(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_data_node *dn, off_t i_offset, const char *buf,
+        int size)
+{
+    off_t offset = ((off_t)(blk_no) << fs_hd->h_block_bits) +
+            NANOFS_HEADER_DATA_NODE_SIZE;
+    struct iovec iov[2];
+
+    if (dn != NULL && (i_offset != 0 || fs_hd->h_journal))
+    {
+        if (nanofs_write_data_node_b(fs_hd, blk_no, dn) != 0)
+            return -1;
+        dn = NULL;
+    }
+    if (dn == NULL)
+        return nanofs_write_payload(fs_hd, offset + i_offset, buf, size);
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_node_writes);
+    nanofs_cache_patch(&fs_hd->h_cache, offset, buf, size);
+    if (nanofs_cache_store(&fs_hd->h_cache, blk_no, dn,
+            NANOFS_HEADER_DATA_NODE_SIZE) != 0)
+        return -1;
+    iov[0].iov_base = dn;
+    iov[0].iov_len = NANOFS_HEADER_DATA_NODE_SIZE;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = size;
+    if (nanofs_writev_dev(&fs_hd->h_dev, offset - NANOFS_HEADER_DATA_NODE_SIZE,
+            iov, 2) != NANOFS_HEADER_DATA_NODE_SIZE + size)
+    {
+        // The node is already linked, keep its header for a later write back
+        nanofs_write_data_node_b(fs_hd, blk_no, dn);
+        return -1;
+    }
+    nanofs_cache_clean(&fs_hd->h_cache, offset - NANOFS_HEADER_DATA_NODE_SIZE,
+            NANOFS_HEADER_DATA_NODE_SIZE + size);
+    return size;
+}
+
 /** Util to calc the blocks required for a give size */
 inline __u32 nanofs_blocks_for_size(struct nanofs_fs_handle *fs_hd,__u32 size)
 {
@@ -230,8 +645,8 @@ inline __u32 nanofs_blocks_for_size(struct nanofs_fs_handle *fs_hd,__u32 size)
 inline int nanofs_read_data_node_data(struct nanofs_fs_handle *fs_hd,
         __u32 blk_no, char *buf, __u32 size, __u32 offset)
 {
-    return nanofs_read_dev(fs_hd->h_fd,
-            (blk_no << fs_hd->h_block_bits) + NANOFS_HEADER_DATA_NODE_SIZE + offset,
+    return nanofs_read_dev(&fs_hd->h_dev,
+            ((off_t)(blk_no) << fs_hd->h_block_bits) + NANOFS_HEADER_DATA_NODE_SIZE + offset,
             buf,size);
 }
 */
@@ -246,25 +661,34 @@ inline int nanofs_read_data_node_data(struct nanofs_fs_handle *fs_hd,
 long int nanofs_free(struct nanofs_fs_handle *hd)
 {
     long int free_size = 0;
-    __u32 blk_no = hd->h_sb.s_free_ptr;
+    __u32 blk_no;
     struct nanofs_data_node data_node;
-    while (blk_no > 0)
+    int list;
+
+    // Nodes waiting for the journal commit are also free space
+    for (list = 0; list < 2; list++)
     {
-        if (nanofs_read_data_node_b(hd, blk_no, &data_node) < 0)
+        blk_no = list == 0 ? hd->h_defer_head : hd->h_sb.s_free_ptr;
+        while (blk_no > 0)
         {
-            log_error("nanofs_free: error reading free space structure");
-            hd->h_error = EIO;
-            return -1;
+            if (nanofs_read_data_node_b(hd, blk_no, &data_node) < 0)
+            {
+                log_error("nanofs_free: error reading free space structure");
+                hd->h_error = EIO;
+                return -1;
+            }
+            free_size += data_node.d_len;
+            blk_no = data_node.d_next_ptr;
         }
-        free_size += data_node.d_len;
-        blk_no = data_node.d_next_ptr;
     }
     return free_size;
 }
 
 /** Get a handle for a given path, returned handle may be a file or a directory
  *
- * Util for navigate an absolute path and get a file/dir handle
+ * Util for navigate an absolute path and get a file/dir handle. The walk
+ * starts at the longest prefix of the path in h_dcache, and adds the
+ * components it resolves to it.
  *
  * @param absolute_path It must start by '/' and not end with '/'
  * @param hd_out Out param with the handle of the dir or file found
@@ -276,53 +700,74 @@ long int nanofs_free(struct nanofs_fs_handle *hd)
 int nanofs_lookup_absolute(struct nanofs_fs_handle *fs_hd,
         const char *absolute_path, struct nanofs_filedir_handle *fdh_out)
 {
-    int retstat;
+    struct nanofs_dcache *dc = &fs_hd->h_dcache;
+    struct nanofs_dcache_entry *e = NULL;
     struct nanofs_filedir_handle dir_handle;
-    int pos,i;
     char dir_name[NANOFS_MAXFILENAME + 1];
+    size_t len, pos, end;
+    int retstat;
+
     if (absolute_path[0] != '/')
     {
         log_error("nanofs_chpath: dir name must be absolute path");
         return EINVAL;
     }
-    // Start at root dir
-    fdh_out->f_blk_no = fs_hd->h_sb.s_alloc_ptr;
+    // Longest prefix of the path already resolved
+    len = strlen(absolute_path);
+    end = len;
+    while (end > 1 && (e = nanofs_dcache_get(dc, absolute_path, end)) == NULL)
+    {
+        while (absolute_path[end - 1] != '/')
+            end--;
+        end = end > 1 ? end - 1 : 1;
+    }
+    if (e != NULL)
+    {
+        if (end == len)
+            NANOFS_STAT_INC(&fs_hd->h_stats, st_dcache_hits);
+        if (e->e_blk_no == 0)
+            return ENOENT;
+        fdh_out->f_blk_no = e->e_blk_no;
+        pos = end + 1;
+    }
+    else // Start at root dir
+    {
+        fdh_out->f_blk_no = fs_hd->h_sb.s_alloc_ptr;
+        pos = 1;
+    }
     if(nanofs_read_dir_node_b(fs_hd,fdh_out->f_blk_no,
            &(fdh_out->f_dir_node)) != 0)
     {
-        log_error("nanofs_chpath: cannot read root dir");
+        log_error("nanofs_chpath: cannot read dir node");
         return EIO;
     }
-
-    pos = 1;
-    i = 0 ;
-    if ( absolute_path[1] == 0) // Return root dir_entry
+    if (end == len) // Cached or root dir
         return 0;
-    while(i < NANOFS_MAXFILENAME)  // loop for navigate dir by dir in path
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_dcache_misses);
+    while (pos <= len) // loop for navigate dir by dir in path
     {
-        dir_name[i] = 0;
-        if (absolute_path[pos] == '/' || absolute_path[pos] == 0)
-        {
-            // change to next dir
-            memcpy(&dir_handle,fdh_out,sizeof(struct nanofs_filedir_handle));
-            retstat = nanofs_lookup(fs_hd, dir_name, &dir_handle,  fdh_out);
-            if (retstat != 0)
-                return retstat;
-            else if (absolute_path[pos] == 0)
-                return 0; // Success
-
-            // else follow the path
-            i = 0;
-            pos++;
-            // the current dir_entry must be a directory
-            if (!DN_ISDIR(fdh_out->f_dir_node))
-                return ENOENT;
-        }
-        dir_name[i] = absolute_path[pos];
-        pos++;
-        i++;
+        // the current dir_entry must be a directory
+        if (!DN_ISDIR(fdh_out->f_dir_node))
+            return ENOENT;
+        for (end = pos; end < len && absolute_path[end] != '/'; end++)
+            ;
+        if (end - pos >= NANOFS_MAXFILENAME)
+            return ENOENT;
+        memcpy(dir_name, absolute_path + pos, end - pos);
+        dir_name[end - pos] = 0;
+        // change to next dir
+        memcpy(&dir_handle,fdh_out,sizeof(struct nanofs_filedir_handle));
+        retstat = nanofs_lookup(fs_hd, dir_name, &dir_handle,  fdh_out);
+        if (retstat == 0 || retstat == ENOENT)
+            nanofs_dcache_add(dc, absolute_path, end, dir_handle.f_blk_no,
+                    retstat == 0 ? fdh_out->f_blk_no : 0);
+        if (retstat != 0)
+            return retstat;
+        // else follow the path
+        pos = end + 1;
     }
-    return ENOENT;
+    return 0; // Success
 }
 /**
  * @return 0 on success
@@ -337,6 +782,7 @@ int nanofs_mkdir(struct nanofs_fs_handle *fs_hd,
     int retstat = 0;
     struct nanofs_filedir_handle new_dir_hd;
 
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_MKDIR]);
     retstat = nanofs_lookup(fs_hd, dir_name, parent_dir_hd, &new_dir_hd);
 
     // Check if directory already exists
@@ -373,13 +819,16 @@ int nanofs_rmdir(struct nanofs_fs_handle *fs_hd,char *dir_name,
 {
     int retstat;
     struct nanofs_filedir_handle fd_hd;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_RMDIR]);
     retstat = nanofs_lookup(fs_hd,dir_name,parent_dir_hd, &fd_hd);
     if(retstat !=0 )
         return retstat;
     return nanofs_free_dir_node(fs_hd,parent_dir_hd,&fd_hd);
 }
 
-/** Remove file in the given directory
+/** Remove file in the given directory. With 'fs_hd->h_orphans' large files
+ * are only unlinked, see nanofs_orphan().
  * @param file_name
  * @param parent_dir_hd parent directory
  * @return 0 on success | EIO |  ENOENT lookup error
@@ -393,11 +842,16 @@ int nanofs_rm(struct nanofs_fs_handle *fs_hd,char *file_name,
     //struct nanofs_data_node data_nd;
     //__u32 data_blkno;
 
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_RM]);
     retstat = nanofs_lookup(fs_hd,file_name,parent_dir_hd, &fd_hd);
 
     if(retstat != 0)
         return retstat;
 
+    retstat = nanofs_orphan(fs_hd, parent_dir_hd, &fd_hd);
+    if (retstat != EAGAIN)
+        return retstat;
+
     // Free data nodes calling truncate to 0
 
     retstat = nanofs_truncate(fs_hd, &fd_hd, 0);
@@ -425,81 +879,667 @@ int nanofs_rm(struct nanofs_fs_handle *fs_hd,char *file_name,
 }
 
 
-/**
- * List current dir filling fh_vec
- *
- * @param dir_hd Directory handle to be read
- * @param fh_vec Output array to fill
- * @param vec_size Size of the output array
- * @return number of items | -1 on error
- * */
-int nanofs_list_dir(struct nanofs_fs_handle *hd,
-        struct nanofs_filedir_handle *dir_hd,
-        struct nanofs_filedir_handle fh_vec[], int vec_size)
+/** Rename a file or directory relinking its dir node, the data is not
+ * copied. The node keeps its block unless its name grows out of its packed
+ * slots, or of the room left by inline data which then goes to a data
+ * node. An existing destination is removed in the same operation, it
+ * must be a file for a file and an empty directory for a directory.
+ * @param fh_out On success the handle of the renamed node, it is not
+ *      at the block of the old path when 'fh_out->f_blk_no' differs
+ * @return 0 on success | EIO on error
+ *      | ENOENT the old path or the new parent dir do not exist
+ *      | ENOTDIR the new parent or the destination are not a directory
+ *      | EISDIR a file would replace a directory
+ *      | ENOTEMPTY the destination directory is not empty
+ *      | EINVAL a directory would be moved below itself or the root
+ *      dir would be moved
+ *      | ENAMETOOLONG | ENOSPC when no free space is available
+ */
+int nanofs_rename(struct nanofs_fs_handle *fs_hd, const char *old_path,
+        const char *new_path, struct nanofs_filedir_handle *fh_out)
 {
-    struct nanofs_dir_node dir_n;
-    int items = 0;
-    //int block_bits = hd->h_block_bits;
-    __u32 blk_no;
-    //int errs = 0;
-
-    // Read parent dir node
-    /*if (nanofs_read_dir_node_b(hd, dir_hd->f_blk_no, &dir_n) != 0)
+    struct nanofs_filedir_handle old_parent_hd, new_parent_hd, dst_hd;
+    char data[NANOFS_CACHE_DATA];
+    char *old_dirc = strdup(old_path);
+    char *new_dirc = strdup(new_path);
+    char *new_basec = strdup(new_path);
+    char *new_name = basename(new_basec);
+    size_t len = strlen(new_name), old_len = strlen(old_path);
+    __u32 old_blk_no, new_blk_no, inline_len = 0;
+    int retstat, replace = 0, old_slots;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_RENAME]);
+    retstat = nanofs_lookup_absolute(fs_hd, old_path, fh_out);
+    if (retstat == 0)
+        retstat = nanofs_lookup_absolute(fs_hd, dirname(old_dirc),
+                &old_parent_hd);
+    if (retstat == 0)
+        retstat = nanofs_lookup_absolute(fs_hd, dirname(new_dirc),
+                &new_parent_hd);
+    if (retstat == 0 && !DN_ISDIR(new_parent_hd.f_dir_node))
+        retstat = ENOTDIR;
+    if (retstat == 0 && len > NANOFS_MAXFILENAME)
+        retstat = ENAMETOOLONG;
+    if (retstat == 0 && fh_out->f_blk_no == fs_hd->h_sb.s_alloc_ptr)
+        retstat = EINVAL; // Root dir
+    if (retstat == 0 && DN_ISDIR(fh_out->f_dir_node) &&
+            strncmp(new_path, old_path, old_len) == 0 &&
+            new_path[old_len] == '/')
+        retstat = EINVAL;
+    if (retstat != 0)
+        goto out;
+    retstat = nanofs_lookup(fs_hd, new_name, &new_parent_hd, &dst_hd);
+    if (retstat == -1)
+        retstat = EIO;
+    else if (retstat == ENOENT) // Nothing to replace
+        retstat = 0;
+    else if (retstat == 0 && dst_hd.f_blk_no == fh_out->f_blk_no)
+        goto out; // Same dir node, nothing to do
+    else if (retstat == 0 && DN_ISDIR(dst_hd.f_dir_node) &&
+            !DN_ISDIR(fh_out->f_dir_node))
+        retstat = EISDIR;
+    else if (retstat == 0 && !DN_ISDIR(dst_hd.f_dir_node) &&
+            DN_ISDIR(fh_out->f_dir_node))
+        retstat = ENOTDIR;
+    else if (retstat == 0 && DN_ISDIR(dst_hd.f_dir_node) &&
+            dst_hd.f_dir_node.d_data_ptr != 0)
+        retstat = ENOTEMPTY;
+    else if (retstat == 0)
+        replace = 1;
+    if (retstat != 0)
+        goto out;
+
+    // Inline data follows the name, it is moved with the new name. Space
+    // is taken before the destination is removed, so a rename that fails
+    // leaves both names as they were.
+    old_blk_no = new_blk_no = fh_out->f_blk_no;
+    old_slots = DN_SLOTS(fh_out->f_dir_node.d_fname_len);
+    fs_hd->h_error = 0;
+    if (DN_ISINLINE(fh_out->f_dir_node) && NANOFS_HEADER_DIR_NODE_SIZE +
+            len + fh_out->f_dir_node.d_data_ptr > (1u << fs_hd->h_block_bits))
     {
-        log_error(stderr, "nanofs_list_dir: cannot read directory node");
-        return -1;
-    }*/
-    // Reading childs dir nodes
-    blk_no = dir_hd->f_dir_node.d_data_ptr;
-    while (blk_no != 0 && items < vec_size)
+        if (nanofs_inline_promote(fs_hd, fh_out) != 0)
+            retstat = fs_hd->h_error == ENOSPC ? ENOSPC : EIO;
+    }
+    else if (DN_ISINLINE(fh_out->f_dir_node) &&
+            len != fh_out->f_dir_node.d_fname_len)
     {
-        if (nanofs_read_dir_node_b(hd,blk_no, &dir_n) != 0)
+        inline_len = fh_out->f_dir_node.d_data_ptr;
+        if (nanofs_read_inline(fs_hd, fh_out, data, inline_len, 0) !=
+                (int)inline_len)
+            retstat = EIO;
+    }
+    else if (fs_hd->h_dir_shift != 0)
+    {
+        new_blk_no = nanofs_resize_dir_slots(fs_hd, &new_parent_hd,
+                old_blk_no, old_slots, DN_SLOTS(len));
+        if (new_blk_no == 0)
+            retstat = fs_hd->h_error == ENOSPC ? ENOSPC : EIO;
+    }
+    if (retstat != 0)
+        goto out;
+
+    if (replace)
+    {
+        // Replaced under the same lock, and in the same journal group
+        if (DN_ISDIR(dst_hd.f_dir_node))
+            retstat = nanofs_rmdir(fs_hd, new_name, &new_parent_hd);
+        else
+            retstat = nanofs_rm(fs_hd, new_name, &new_parent_hd);
+        // It may have been the next node in the children list
+        if (retstat == 0 && nanofs_read_dir_node_b(fs_hd, old_blk_no,
+                &fh_out->f_dir_node) != 0)
+            retstat = EIO;
+        if (retstat != 0)
         {
-            log_error("nanofs_list_dir: Cannot read one child directory node");
-            return -1;
+            // The slots taken for the new name are given back
+            if (new_blk_no != old_blk_no)
+                nanofs_free_dir_slots(fs_hd, new_blk_no, DN_SLOTS(len));
+            else if (fs_hd->h_dir_shift != 0)
+                nanofs_resize_dir_slots(fs_hd, &new_parent_hd, old_blk_no,
+                        DN_SLOTS(len), old_slots);
+            goto out;
         }
-        memcpy(&(fh_vec[items].f_dir_node), &dir_n,
-                sizeof(struct nanofs_dir_node));
-        fh_vec[items].f_blk_no = blk_no;
-        //fi_vec[items].f_size=0;
-        //errs -= nanofs_get_file_size(&fi_vec[items], hd);
-        items++;
-        blk_no = dir_n.d_next_ptr;
     }
-    return items;
+
+    // Unlinked with the old name and block, then linked with the new ones
+    retstat = nanofs_unlink_dir_node(fs_hd, &old_parent_hd, fh_out, 0);
+    if (retstat == 0 && new_blk_no != old_blk_no)
+    {
+        if (nanofs_free_dir_slots(fs_hd, old_blk_no, old_slots) != 0)
+            retstat = EIO;
+        // Keyed by the old block
+        nanofs_acache_forget(&fs_hd->h_acache, old_blk_no);
+        nanofs_emap_drop(&fs_hd->h_emap, old_blk_no);
+        nanofs_acache_forget(&fs_hd->h_acache, new_blk_no);
+        nanofs_emap_drop(&fs_hd->h_emap, new_blk_no);
+        nanofs_dindex_drop(&fs_hd->h_dindex, old_blk_no);
+        if (DN_ISDIR(fh_out->f_dir_node))
+            nanofs_dcache_forget_dir(&fs_hd->h_dcache, old_blk_no);
+        fh_out->f_blk_no = new_blk_no;
+    }
+    if (retstat != 0)
+        goto out;
+    memcpy(fh_out->f_dir_node.d_fname, new_name, len);
+    fh_out->f_dir_node.d_fname_len = len;
+    if (nanofs_read_dir_node_b(fs_hd, new_parent_hd.f_blk_no,
+            &new_parent_hd.f_dir_node) != 0 ||
+            nanofs_link_dir_node(fs_hd, &new_parent_hd, fh_out) != 0)
+        retstat = EIO;
+    else if (inline_len > 0 && nanofs_write_inline(fs_hd, fh_out, data,
+            inline_len, 0) != (int)inline_len)
+        retstat = EIO;
+    if (retstat == 0 && DN_ISDIR(fh_out->f_dir_node))
+        nanofs_dcache_forget_below(&fs_hd->h_dcache, old_path, old_len);
+
+out:
+    free(old_dirc);
+    free(new_dirc);
+    free(new_basec);
+    return retstat;
 }
 
-/** Lookup for a dir entry into a given directory
- * @param file_name Name of the file to search in the directory
- * @param dir_hd Directory where the search takes place
- * @param dir_hd_out On success is filled
- * @return -1 on error | 0 on success | ENOENT if not found
- */
+/** Unlink a file of more than NANOFS_ORPHAN_MIN data nodes and put its
+ * dir node ahead of the orphan list, 's_orphan_ptr' in the extended
+ * superblock. The list is chained by 'd_next_ptr' as the children of a
+ * directory. The data is freed later by nanofs_reclaim(), so the time
+ * taken does not depend on the file size.
+ * @return 0 on success | EAGAIN the file is freed at once, it is small or
+ *      orphans are not used | EIO | ESTALE
+ * */
+static int nanofs_orphan(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd)
+{
+    struct nanofs_data_node dn;
+    __u32 blk_no = fd_hd->f_dir_node.d_data_ptr;
+    int nodes = 0, retstat;
+
+    if (!fs_hd->h_orphans ||
+            !(fs_hd->h_sbx.s_features & NANOFS_FEAT_ORPHANS) ||
+            DN_ISINLINE(fd_hd->f_dir_node))
+        return EAGAIN;
+    while (blk_no != 0 && nodes <= NANOFS_ORPHAN_MIN)
+    {
+        if (nanofs_read_data_node_b(fs_hd, blk_no, &dn) != 0)
+            return EIO;
+        blk_no = dn.d_next_ptr;
+        nodes++;
+    }
+    if (nodes <= NANOFS_ORPHAN_MIN)
+        return EAGAIN;
 
-int nanofs_lookup(struct nanofs_fs_handle *fs_hd, char *file_name,
-        struct nanofs_filedir_handle *dir_hd,
-        struct nanofs_filedir_handle *dir_hd_out)
+    nanofs_acache_forget(&fs_hd->h_acache, fd_hd->f_blk_no);
+    nanofs_emap_drop(&fs_hd->h_emap, fd_hd->f_blk_no);
+    retstat = nanofs_unlink_dir_node(fs_hd, parent_hd, fd_hd, 1);
+    if (retstat != 0)
+        return retstat;
+    // Its size goes stale as the data is freed, the metadata block and the
+    // extent index are freed with the dir node
+    fd_hd->f_dir_node.d_next_ptr = fs_hd->h_sbx.s_orphan_ptr;
+    if (nanofs_write_dir_node_b(fs_hd, fd_hd->f_blk_no,
+            &fd_hd->f_dir_node) != 0)
+        return EIO;
+    fs_hd->h_sbx.s_orphan_ptr = fd_hd->f_blk_no;
+    fs_hd->h_sb_dirty = 1;
+    return 0;
+}
+
+/** Free up to 'max' data nodes of the files in the orphan list, see
+ * nanofs_orphan(). The data of the first orphan is freed from its head and
+ * its dir node updated to the rest, so a crash resumes where it stopped.
+ * The dir node and the metadata block of the file are freed with its last
+ * data node.
+ * @return nodes freed, dir nodes included, 0 when the list is empty | -1 on
+ *      error, field fs_hd->h_error is set
+ * */
+int nanofs_reclaim(struct nanofs_fs_handle *fs_hd, int max)
 {
-    int blk_no;
-    blk_no = dir_hd->f_dir_node.d_data_ptr;
-    while (blk_no != 0)
+    struct nanofs_filedir_handle fh;
+    struct nanofs_data_node dn;
+    __u32 blk_no;
+    int freed = 0, res = 0;
+
+    nanofs_dev_batch_begin(&fs_hd->h_dev);
+    while (fs_hd->h_sbx.s_orphan_ptr != 0 && freed < max && res == 0)
     {
-        if (nanofs_read_dir_node_b(fs_hd,blk_no,&(dir_hd_out->f_dir_node)) != 0)
+        fh.f_blk_no = fs_hd->h_sbx.s_orphan_ptr;
+        if (nanofs_read_dir_node_b(fs_hd, fh.f_blk_no, &fh.f_dir_node) != 0)
         {
-            log_error("nanofs_lookup: 'list_dir' error reading directory node");
-            return -1;
+            res = -1;
+            break;
         }
-        if (strcmp(file_name, (char *)dir_hd_out->f_dir_node.d_fname) == 0) // Found
+        blk_no = fh.f_dir_node.d_data_ptr;
+        while (blk_no != 0 && freed < max)
         {
-            dir_hd_out->f_blk_no = blk_no;
-            return 0;
+            if (nanofs_read_data_node_b(fs_hd, blk_no, &dn) != 0 ||
+                    nanofs_free_data_node(fs_hd, blk_no, &dn) != 0)
+            {
+                res = -1;
+                break;
+            }
+            blk_no = dn.d_next_ptr;
+            freed++;
         }
-        blk_no = dir_hd_out->f_dir_node.d_next_ptr;
-    }
+        if (res != 0)
+            break;
+        if (blk_no != 0)
+        {
+            // The rest stays queued
+            fh.f_dir_node.d_data_ptr = blk_no;
+            res = nanofs_write_dir_node_b(fs_hd, fh.f_blk_no, &fh.f_dir_node);
+            break;
+        }
+        // All the data is free, the metadata block and the dir node go too
+        if (fh.f_dir_node.d_meta_ptr != 0 &&
+                (nanofs_free_file_meta(fs_hd, &fh.f_dir_node) != 0 ||
+                nanofs_write_dir_node_b(fs_hd, fh.f_blk_no,
+                        &fh.f_dir_node) != 0))
+        {
+            res = -1;
+            break;
+        }
+        fs_hd->h_sbx.s_orphan_ptr = fh.f_dir_node.d_next_ptr;
+        fs_hd->h_sb_dirty = 1;
+        if (fs_hd->h_dir_shift != 0)
+            res = nanofs_free_dir_slots(fs_hd, fh.f_blk_no,
+                    DN_SLOTS(fh.f_dir_node.d_fname_len));
+        else
+            res = nanofs_push_free(fs_hd, fh.f_blk_no,
+                    (1 << fs_hd->h_block_bits) - NANOFS_HEADER_DATA_NODE_SIZE);
+        freed++;
+    }
+    if (nanofs_dev_batch_end(&fs_hd->h_dev) != 0)
+        res = -1;
+    if (res != 0)
+    {
+        log_error("nanofs_reclaim: cannot free orphan files");
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return freed;
+}
+
+/**
+ * List current dir filling fh_vec
+ *
+ * @param dir_hd Directory handle to be read
+ * @param fh_vec Output array to fill
+ * @param vec_size Size of the output array
+ * @return number of items | -1 on error
+ * */
+int nanofs_list_dir(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *dir_hd,
+        struct nanofs_filedir_handle fh_vec[], int vec_size)
+{
+    return nanofs_read_dir(hd, dir_hd, 0, fh_vec, NULL, vec_size);
+}
+
+/* Children after the last one listed kept in a list dir cursor */
+#define NANOFS_CURSOR_LEFT_MAX 0x7FFFF
+
+/** Cursor following child 'blk_no' of a list dir: its address in the low
+ * 32 bits, 12 bits of its name hash to notice it was renamed and the
+ * number of children after it, up to NANOFS_CURSOR_LEFT_MAX. It is never
+ * 0 as block 0 is the superblock.
+ * */
+static off_t nanofs_list_cursor(__u32 blk_no, struct nanofs_dir_node *dn,
+        off_t left)
+{
+    __u64 hash = nanofs_dindex_hash(dn->d_fname, dn->d_fname_len) & 0xFFF;
+
+    if (left > NANOFS_CURSOR_LEFT_MAX)
+        left = NANOFS_CURSOR_LEFT_MAX;
+    return (off_t)(((__u64)left << 44) | (hash << 32) | blk_no);
+}
+
+/** Count the children of a list dir from 'blk_no'
+ * @return 0 on success | -1 on error
+ * */
+static int nanofs_list_count(struct nanofs_fs_handle *hd, __u32 blk_no,
+        off_t *count)
+{
+    struct nanofs_dir_node dn;
+
+    *count = 0;
+    while (blk_no != 0)
+    {
+        if (nanofs_read_dir_node_b(hd, blk_no, &dn) != 0)
+            return -1;
+        (*count)++;
+        blk_no = dn.d_next_ptr;
+    }
+    return 0;
+}
+
+/** Find where a list dir listing goes on from 'cursor'. When the last
+ * child listed is still in the dir under the same name it goes on from its
+ * next one. Otherwise, as children are added at the head, the ones not
+ * listed yet are the last 'left' of the list, unless some of them were
+ * removed too and then a few children may be listed again.
+ * @param blk_no First child to list
+ * @param left Number of children from 'blk_no'
+ * @return 0 on success | -1 on error
+ * */
+static int nanofs_list_resume(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *dir_hd, off_t cursor, __u32 *blk_no,
+        off_t *left)
+{
+    struct nanofs_filedir_handle fh;
+    struct nanofs_dir_node dn;
+    __u32 last = (__u32)cursor;
+    off_t count;
+
+    *blk_no = dir_hd->f_dir_node.d_data_ptr;
+    if (cursor == 0)
+        return nanofs_list_count(hd, *blk_no, left);
+    *left = (off_t)((__u64)cursor >> 44);
+    if (nanofs_read_dir_node_b(hd, last, &dn) == 0 &&
+            (nanofs_dindex_hash(dn.d_fname, dn.d_fname_len) & 0xFFF) ==
+                    (((__u64)cursor >> 32) & 0xFFF) &&
+            nanofs_lookup(hd, (char *)dn.d_fname, dir_hd, &fh) == 0 &&
+            fh.f_blk_no == last)
+    {
+        *blk_no = dn.d_next_ptr;
+        return 0;
+    }
+    // The node may have been freed and reused for anything
+    hd->h_error = 0;
+    if (nanofs_list_count(hd, *blk_no, &count) != 0)
+        return -1;
+    for (; count > *left; count--)
+    {
+        if (nanofs_read_dir_node_b(hd, *blk_no, &dn) != 0)
+            return -1;
+        *blk_no = dn.d_next_ptr;
+    }
+    *left = count;
+    return 0;
+}
+
+/**
+ * List current dir from 'cursor' filling fh_vec. A listing starts at cursor
+ * 0 and goes on from the cursor following the last item returned, children
+ * added or removed meanwhile may be listed or not.
+ *
+ * The cursor is the key of the next child in a B-tree directory, see
+ * struct nanofs_dir_btree. In a children list it is the last child
+ * listed, see nanofs_list_cursor(), so that children added at the head or
+ * removed meanwhile do not shift the listing.
+ *
+ * @param dir_hd Directory handle to be read, its dir node is read again
+ * @param next_vec If not NULL, cursor following each item
+ * @return number of items, 0 at the end | -1 on error
+ * */
+int nanofs_read_dir(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *dir_hd, off_t cursor,
+        struct nanofs_filedir_handle fh_vec[], off_t next_vec[],
+        int vec_size)
+{
+    struct nanofs_dir_node dir_n;
+    __u64 keys[NANOFS_READ_DIR_BATCH];
+    int items = 0, n, i;
+    __u32 blk_no;
+    off_t left = 0;
+
+    NANOFS_STAT_INC(&hd->h_stats, st_ops[NANOFS_OP_LIST]);
+    // The handle may be older than the last change of the directory
+    if (nanofs_read_dir_node_b(hd, dir_hd->f_blk_no, &dir_hd->f_dir_node) != 0)
+    {
+        log_error("nanofs_read_dir: cannot read directory node");
+        return -1;
+    }
+    while (DN_ISBTREE(dir_hd->f_dir_node) && items < vec_size)
+    {
+        n = vec_size - items;
+        if (n > NANOFS_READ_DIR_BATCH)
+            n = NANOFS_READ_DIR_BATCH;
+        n = nanofs_dirbtree_scan(hd, dir_hd, cursor, keys, n);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        for (i = 0; i < n; i++)
+        {
+            if (nanofs_read_dir_node_b(hd, (__u32)keys[i],
+                    &fh_vec[items].f_dir_node) != 0)
+                return -1;
+            fh_vec[items].f_blk_no = (__u32)keys[i];
+            cursor = keys[i] + 1;
+            if (next_vec != NULL)
+                next_vec[items] = cursor;
+            items++;
+        }
+    }
+    if (DN_ISBTREE(dir_hd->f_dir_node))
+        return items;
+
+    // Reading childs dir nodes
+    blk_no = dir_hd->f_dir_node.d_data_ptr;
+    if (next_vec != NULL || cursor != 0)
+    {
+        if (nanofs_list_resume(hd, dir_hd, cursor, &blk_no, &left) != 0)
+        {
+            log_error("nanofs_read_dir: cannot find where the listing goes on");
+            return -1;
+        }
+    }
+    while (blk_no != 0 && items < vec_size)
+    {
+        if (nanofs_read_dir_node_b(hd,blk_no, &dir_n) != 0)
+        {
+            log_error("nanofs_read_dir: Cannot read one child directory node");
+            return -1;
+        }
+        memcpy(&(fh_vec[items].f_dir_node), &dir_n,
+                sizeof(struct nanofs_dir_node));
+        fh_vec[items].f_blk_no = blk_no;
+        if (left > 0)
+            left--;
+        if (next_vec != NULL)
+            next_vec[items] = nanofs_list_cursor(blk_no, &dir_n, left);
+        items++;
+        blk_no = dir_n.d_next_ptr;
+    }
+    return items;
+}
+
+/** Lookup for a dir entry into a given directory
+ * @param file_name Name of the file to search in the directory
+ * @param dir_hd Directory where the search takes place
+ * @param dir_hd_out On success is filled
+ * @return -1 on error | 0 on success | ENOENT if not found
+ */
+
+int nanofs_lookup(struct nanofs_fs_handle *fs_hd, char *file_name,
+        struct nanofs_filedir_handle *dir_hd,
+        struct nanofs_filedir_handle *dir_hd_out)
+{
+    struct nanofs_dindex_dir *index;
+    __u32 hash, pos = 0;
+    int blk_no;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_LOOKUP]);
+    if (DN_ISBTREE(dir_hd->f_dir_node))
+        return nanofs_dirbtree_lookup(fs_hd, dir_hd, file_name, dir_hd_out);
+    // A cold directory with an on-disk index is not read whole
+    if (fs_hd->h_dir_index && DN_ISDIR(dir_hd->f_dir_node) &&
+            dir_hd->f_dir_node.d_meta_ptr != 0 &&
+            nanofs_dindex_get(&fs_hd->h_dindex, dir_hd->f_blk_no) == NULL)
+        return nanofs_dirindex_lookup(fs_hd, dir_hd, file_name, dir_hd_out);
+    index = nanofs_index_dir(fs_hd, dir_hd);
+    if (index != NULL)
+    {
+        // Only children with the same name hash are read
+        hash = nanofs_dindex_hash((__u8 *)file_name, strlen(file_name));
+        while ((blk_no = nanofs_dindex_next(index, hash, &pos)) != 0)
+        {
+            if (nanofs_read_dir_node_b(fs_hd, blk_no,
+                    &dir_hd_out->f_dir_node) != 0)
+            {
+                log_error("nanofs_lookup: error reading directory node");
+                return -1;
+            }
+            if (strcmp(file_name, (char *)dir_hd_out->f_dir_node.d_fname) == 0)
+            {
+                dir_hd_out->f_blk_no = blk_no;
+                return 0;
+            }
+        }
+        return ENOENT;
+    }
+    blk_no = dir_hd->f_dir_node.d_data_ptr;
+    while (blk_no != 0)
+    {
+        if (nanofs_read_dir_node_b(fs_hd,blk_no,&(dir_hd_out->f_dir_node)) != 0)
+        {
+            log_error("nanofs_lookup: 'list_dir' error reading directory node");
+            return -1;
+        }
+        if (strcmp(file_name, (char *)dir_hd_out->f_dir_node.d_fname) == 0) // Found
+        {
+            dir_hd_out->f_blk_no = blk_no;
+            return 0;
+        }
+        blk_no = dir_hd_out->f_dir_node.d_next_ptr;
+    }
     // Not found
     return ENOENT;
 }
 
+/** Get the index of a directory, it is built reading all the children the
+ * first time
+ * @return the index | NULL when 'dir_hd' is not a directory, on error or
+ *      when the index is full, then the children list is walked
+ * */
+static struct nanofs_dindex_dir *nanofs_index_dir(
+        struct nanofs_fs_handle *fs_hd, struct nanofs_filedir_handle *dir_hd)
+{
+    struct nanofs_dindex *di = &fs_hd->h_dindex;
+    struct nanofs_dindex_dir *index;
+    struct nanofs_dir_node dn;
+    __u32 blk_no;
+
+    if (!DN_ISDIR(dir_hd->f_dir_node) || DN_ISBTREE(dir_hd->f_dir_node))
+        return NULL;
+    index = nanofs_dindex_get(di, dir_hd->f_blk_no);
+    if (index != NULL)
+        return index;
+    index = nanofs_dindex_new(di, dir_hd->f_blk_no);
+    if (index == NULL)
+        return NULL;
+    blk_no = dir_hd->f_dir_node.d_data_ptr;
+    while (blk_no != 0)
+    {
+        if (nanofs_read_dir_node_b(fs_hd, blk_no, &dn) != 0 ||
+                nanofs_dindex_add(di, index,
+                        nanofs_dindex_hash(dn.d_fname, dn.d_fname_len),
+                        blk_no) != 0)
+        {
+            nanofs_dindex_drop(di, dir_hd->f_blk_no);
+            return NULL;
+        }
+        blk_no = dn.d_next_ptr;
+    }
+    return index;
+}
+
+/** Add dir nodes just linked to their parent to the parent indexes, the
+ * on-disk one is built when the parent reaches NANOFS_DIR_INDEX_MIN. With
+ * B-tree dirs the parent is turned into a B-tree at NANOFS_DIR_BTREE_MIN
+ * instead, and then the nodes are added to the tree.
+ * @param fh_vec The 'count' nodes linked, all of them already in the
+ *      children list unless the parent is a B-tree
+ * @return 0 on success | EIO on error
+ * */
+static int nanofs_index_link(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle fh_vec[], int count)
+{
+    struct nanofs_dindex_dir *index;
+    struct nanofs_dir_node child;
+    __u32 children = 0, child_blk_no, limit;
+    int i, res;
+
+    for (i = 0; DN_ISBTREE(parent_hd->f_dir_node) && i < count; i++)
+        if (nanofs_dirbtree_insert(fs_hd, parent_hd, &fh_vec[i].f_dir_node,
+                fh_vec[i].f_blk_no) != 0)
+            return EIO;
+    if (DN_ISBTREE(parent_hd->f_dir_node))
+        return 0;
+    index = nanofs_dindex_get(&fs_hd->h_dindex, parent_hd->f_blk_no);
+    for (i = 0; index != NULL && i < count; i++)
+        if (nanofs_dindex_add(&fs_hd->h_dindex, index,
+                nanofs_dindex_hash(fh_vec[i].f_dir_node.d_fname,
+                fh_vec[i].f_dir_node.d_fname_len), fh_vec[i].f_blk_no) != 0)
+        {
+            nanofs_dindex_drop(&fs_hd->h_dindex, parent_hd->f_blk_no);
+            index = NULL;
+        }
+    if (!fs_hd->h_dir_index && !fs_hd->h_dir_btree)
+        return 0;
+    for (i = 0; parent_hd->f_dir_node.d_meta_ptr != 0 && i < count; i++)
+    {
+        res = nanofs_dirindex_insert(fs_hd, parent_hd, &fh_vec[i].f_dir_node,
+                fh_vec[i].f_blk_no);
+        if (res != 0)
+            return res;
+    }
+    if (parent_hd->f_dir_node.d_meta_ptr != 0)
+        return 0;
+    // Count the children up to the size that gets an index
+    limit = fs_hd->h_dir_btree ? NANOFS_DIR_BTREE_MIN : NANOFS_DIR_INDEX_MIN;
+    child_blk_no = parent_hd->f_dir_node.d_data_ptr;
+    while (child_blk_no != 0 && children < limit)
+    {
+        if (nanofs_read_dir_node_b(fs_hd, child_blk_no, &child) != 0)
+            return EIO;
+        children++;
+        child_blk_no = child.d_next_ptr;
+    }
+    if (children < limit)
+        return 0;
+    if (fs_hd->h_dir_btree)
+        return nanofs_dirbtree_build(fs_hd, parent_hd);
+    return nanofs_dirindex_build(fs_hd, parent_hd);
+}
+
+/** Remove a dir node just unlinked from its parent indexes
+ * @param release The indexes of the node itself are released too, its
+ *      block will be reused. A renamed node keeps them.
+ * @return 0 on success | EIO on error
+ * */
+static int nanofs_index_unlink(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd, int release)
+{
+    struct nanofs_dindex_dir *index;
+
+    index = nanofs_dindex_get(&fs_hd->h_dindex, parent_hd->f_blk_no);
+    if (index != NULL)
+        nanofs_dindex_remove(index, nanofs_dindex_hash(
+                fd_hd->f_dir_node.d_fname, fd_hd->f_dir_node.d_fname_len),
+                fd_hd->f_blk_no);
+    // The index of a released dir goes with it, 'd_meta_ptr' of a file is
+    // its metadata block
+    release = release && DN_ISDIR(fd_hd->f_dir_node);
+    if (release)
+        nanofs_dindex_drop(&fs_hd->h_dindex, fd_hd->f_blk_no);
+    if (DN_ISBTREE(parent_hd->f_dir_node) &&
+            nanofs_dirbtree_remove(fs_hd, parent_hd, fd_hd) != 0)
+        return EIO;
+    if (release && nanofs_dirbtree_free(fs_hd, &fd_hd->f_dir_node) != 0)
+        return EIO;
+    if (!fs_hd->h_dir_index)
+        return 0;
+    if (parent_hd->f_dir_node.d_meta_ptr != 0 &&
+            nanofs_dirindex_remove(fs_hd, parent_hd, fd_hd) != 0)
+        return EIO;
+    if (!release)
+        return 0;
+    return nanofs_dirindex_free(fs_hd, &fd_hd->f_dir_node);
+}
+
 
 /** Create an empty file
  * @param file_path Full file path
@@ -521,7 +1561,7 @@ int nanofs_create_file(struct nanofs_fs_handle *fs_hd, const char *file_path,
     char *dir_name = dirname( dirc );
     char *base_name = basename( basec );
 
-
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_CREATE]);
     retstat = nanofs_lookup_absolute(fs_hd,dir_name,&parent_dir_hd);
 
     if(retstat == 0 && !DN_ISDIR(parent_dir_hd.f_dir_node))
@@ -543,25 +1583,303 @@ int nanofs_create_file(struct nanofs_fs_handle *fs_hd, const char *file_path,
     return retstat;
 }
 
-/** Calc file size
+/** Data blocks taken by a file of nanofs_create_files(), none when it is
+ * empty or its data fits inline
+ * */
+static __u32 nanofs_create_blocks(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_create_entry *entry)
+{
+    if (entry->c_size == 0 || (fs_hd->h_inline &&
+            NANOFS_HEADER_DIR_NODE_SIZE + strlen(entry->c_name) +
+            entry->c_size <= ((size_t)1 << fs_hd->h_block_bits)))
+        return 0;
+    return nanofs_blocks_for_size(fs_hd,
+            NANOFS_HEADER_DATA_NODE_SIZE + entry->c_size);
+}
+
+static int nanofs_create_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/** Check that the names of nanofs_create_files() are distinct
+ * @return 0 when they are | EEXIST when a name is twice | ENOMEM
+ * */
+static int nanofs_create_names_check(struct nanofs_create_entry vec[],
+        int count)
+{
+    const char **names;
+    int i, retstat = 0;
+
+    if (count < 2)
+        return 0;
+    names = malloc(count * sizeof(char *));
+    if (names == NULL)
+        return ENOMEM;
+    for (i = 0; i < count; i++)
+        names[i] = vec[i].c_name;
+    qsort(names, count, sizeof(char *), nanofs_create_name_cmp);
+    for (i = 1; i < count && retstat == 0; i++)
+        if (strcmp(names[i - 1], names[i]) == 0)
+            retstat = EEXIST;
+    free(names);
+    return retstat;
+}
+
+/** Create several files in a directory with their initial contents. The
+ * directory is resolved and its children list updated once for all of
+ * them, and their dir nodes and data take a single run of free blocks when
+ * the free list has one big enough. Otherwise each file takes its own run,
+ * or chained data nodes as nanofs_write() does when no free node is that
+ * big. Called in one nanofs_lock() section the superblock is committed
+ * once.
+ *
+ * On error the files created so far, those with 'c_blk_no' set, are left
+ * in the directory, the one that ran out of space is left empty.
+ *
+ * @param dir_path Full path of the directory
+ * @param vec The 'count' files to create, 'c_blk_no' is set on return
+ * @return 0 on success | EIO when IO error
+ *      | ENOENT not valid directory or in path
+ *      | EINVAL invalid path or name
+ *      | EEXIST a name is already in the directory or twice in 'vec'
+ *      | ENOSPC when no free space is available
+ *      | ENOMEM
+ */
+int nanofs_create_files(struct nanofs_fs_handle *fs_hd, const char *dir_path,
+        struct nanofs_create_entry vec[], int count)
+{
+    struct nanofs_filedir_handle parent_dir_hd, found_hd, *fh_vec, *fh;
+    struct nanofs_data_node data_node;
+    __u32 blocks = 0, run = 0, run_end = 0, blk_no, data_blocks;
+    size_t len;
+    int i, done = 0, retstat, btree, chained;
+
+    retstat = nanofs_lookup_absolute(fs_hd, dir_path, &parent_dir_hd);
+    if (retstat == 0 && !DN_ISDIR(parent_dir_hd.f_dir_node))
+        retstat = ENOENT;
+    if (retstat != 0)
+        return retstat;
+    // Names are checked before anything is written
+    for (i = 0; i < count; i++)
+    {
+        vec[i].c_blk_no = 0;
+        len = strlen(vec[i].c_name);
+        if (len == 0 || len > NANOFS_MAXFILENAME ||
+                strchr(vec[i].c_name, '/') != NULL ||
+                vec[i].c_size > 0x7fffffff)
+            return EINVAL;
+        retstat = nanofs_lookup(fs_hd, (char *)vec[i].c_name, &parent_dir_hd,
+                &found_hd);
+        if (retstat == 0)
+            return EEXIST;
+        if (retstat != ENOENT)
+            return EIO;
+        blocks += nanofs_create_blocks(fs_hd, &vec[i]);
+    }
+    retstat = nanofs_create_names_check(vec, count);
+    if (retstat != 0 || count <= 0)
+        return retstat;
+    fh_vec = malloc(count * sizeof(struct nanofs_filedir_handle));
+    if (fh_vec == NULL)
+        return ENOMEM;
+    NANOFS_STAT_ADD(&fs_hd->h_stats, st_ops[NANOFS_OP_CREATE], count);
+
+    // Dir nodes, unless packed, and data go in one run, each data node
+    // after its dir node. Block by block when no free node is that big.
+    if (fs_hd->h_dir_shift == 0)
+        blocks += count;
+    fs_hd->h_error = 0;
+    if (blocks > 0)
+        run = nanofs_alloc_blocks(fs_hd, blocks);
+    if (run == 0 && fs_hd->h_error != 0 && fs_hd->h_error != ENOSPC)
+    {
+        free(fh_vec);
+        return EIO;
+    }
+    if (run != 0)
+        run_end = run + blocks;
+
+    retstat = 0;
+    btree = DN_ISBTREE(parent_dir_hd.f_dir_node);
+    nanofs_dev_batch_begin(&fs_hd->h_dev);
+    for (i = 0; i < count; i++)
+    {
+        fh = &fh_vec[i];
+        len = strlen(vec[i].c_name);
+        fh->f_dir_node.d_fname_len = len;
+        nanofs_dcache_forget(&fs_hd->h_dcache, parent_dir_hd.f_blk_no,
+                vec[i].c_name, len);
+        fs_hd->h_error = 0;
+        if (fs_hd->h_dir_shift != 0)
+            fh->f_blk_no = nanofs_alloc_dir_slots(fs_hd, &parent_dir_hd,
+                    DN_SLOTS(len));
+        else if (run != 0)
+            fh->f_blk_no = run++;
+        else
+            fh->f_blk_no = nanofs_alloc_blocks(fs_hd, 1);
+        data_blocks = nanofs_create_blocks(fs_hd, &vec[i]);
+        blk_no = 0;
+        if (fh->f_blk_no != 0 && data_blocks > 0 && run != 0)
+        {
+            blk_no = run;
+            run += data_blocks;
+        }
+        else if (fh->f_blk_no != 0 && data_blocks > 0)
+            blk_no = nanofs_alloc_blocks(fs_hd, data_blocks);
+        // No free node that big was found, the data goes in chained nodes
+        // as nanofs_write() does once the file is linked
+        chained = fh->f_blk_no != 0 && data_blocks > 0 && blk_no == 0 &&
+                fs_hd->h_error == ENOSPC;
+        if (fh->f_blk_no == 0 || (data_blocks > 0 && blk_no == 0 &&
+                !chained))
+        {
+            retstat = fs_hd->h_error == ENOSPC ? ENOSPC : EIO;
+            nanofs_create_release(fs_hd, fh, 0, 0);
+            break;
+        }
+
+        // Written ahead of the children list as nanofs_alloc_dir_node()
+        // does, the parent is written after the last one
+        fh->f_dir_node.d_flags = 0; // Regular file
+        fh->f_dir_node.d_data_ptr = blk_no;
+        fh->f_dir_node.d_meta_ptr = 0;
+        fh->f_dir_node.d_next_ptr = btree ? 0 :
+                parent_dir_hd.f_dir_node.d_data_ptr;
+        strncpy((char *)(fh->f_dir_node.d_fname), vec[i].c_name,
+                NANOFS_MAXFILENAME);
+        if (nanofs_write_dir_node_b(fs_hd, fh->f_blk_no, &fh->f_dir_node) != 0)
+        {
+            log_error("nanofs_create_files: cannot write new dir node");
+            retstat = EIO;
+            break;
+        }
+        // B-tree children go one by one, the tree may have no room left
+        // for the last one
+        if (btree)
+            retstat = nanofs_dirbtree_insert(fs_hd, &parent_dir_hd,
+                    &fh->f_dir_node, fh->f_blk_no);
+        if (retstat != 0)
+        {
+            nanofs_create_release(fs_hd, fh, blk_no, data_blocks);
+            break;
+        }
+        if (!btree)
+            parent_dir_hd.f_dir_node.d_data_ptr = fh->f_blk_no;
+        vec[i].c_blk_no = fh->f_blk_no;
+        nanofs_acache_forget(&fs_hd->h_acache, fh->f_blk_no);
+        nanofs_emap_drop(&fs_hd->h_emap, fh->f_blk_no);
+        done++;
+
+        // Contents, the data node header goes with the data
+        data_node.d_next_ptr = 0;
+        data_node.d_len = vec[i].c_size;
+        fs_hd->h_error = 0;
+        if (chained)
+        {
+            // Too little space left, the file is left empty
+            if (nanofs_write_nodes(fs_hd, fh, vec[i].c_data, vec[i].c_size,
+                    0) != (int)vec[i].c_size)
+                retstat = fs_hd->h_error == ENOSPC ? ENOSPC : EIO;
+            else if (nanofs_set_file_size(fs_hd, fh, vec[i].c_size) != 0)
+                retstat = EIO;
+            if (retstat != 0 && nanofs_truncate(fs_hd, fh, 0) != 0)
+                retstat = EIO;
+        }
+        else if (blk_no != 0 && (nanofs_write_data(fs_hd, blk_no, &data_node,
+                0, vec[i].c_data, vec[i].c_size) != (int)vec[i].c_size ||
+                nanofs_set_file_size(fs_hd, fh, vec[i].c_size) != 0))
+            retstat = EIO;
+        else if (blk_no == 0 && vec[i].c_size > 0 &&
+                nanofs_write_inline(fs_hd, fh, vec[i].c_data, vec[i].c_size,
+                        0) != (int)vec[i].c_size)
+            retstat = EIO;
+        if (retstat != 0)
+        {
+            log_error("nanofs_create_files: cannot write file contents");
+            break;
+        }
+    }
+    // The rest of the run when some file failed
+    if (run != run_end)
+        nanofs_free_blocks(fs_hd, run, run_end - run);
+
+    if (done > 0 && !btree)
+    {
+        if (nanofs_write_dir_node_b(fs_hd, parent_dir_hd.f_blk_no,
+                &parent_dir_hd.f_dir_node) != 0)
+        {
+            log_error("nanofs_create_files: cannot update parent dir node");
+            retstat = EIO;
+        }
+        else if (nanofs_index_link(fs_hd, &parent_dir_hd, fh_vec, done) != 0)
+        {
+            log_error("nanofs_create_files: cannot update directory index");
+            retstat = EIO;
+        }
+    }
+    if (nanofs_dev_batch_end(&fs_hd->h_dev) != 0)
+    {
+        fs_hd->h_error = EIO;
+        retstat = EIO;
+    }
+    free(fh_vec);
+    return retstat;
+}
+
+/** Give back the blocks of a file of nanofs_create_files() that could not
+ * be linked to the directory
+ * */
+static void nanofs_create_release(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, __u32 blk_no, __u32 data_blocks)
+{
+    if (blk_no != 0)
+        nanofs_free_blocks(fs_hd, blk_no, data_blocks);
+    if (fh->f_blk_no != 0 && fs_hd->h_dir_shift != 0)
+        nanofs_free_dir_slots(fs_hd, fh->f_blk_no,
+                DN_SLOTS(fh->f_dir_node.d_fname_len));
+    else if (fh->f_blk_no != 0)
+        nanofs_free_blocks(fs_hd, fh->f_blk_no, 1);
+}
+
+/** Calc file size. Sizes found are kept in 'hd->h_acache', on a miss the
+ * size is read from the metadata block of the file when it has one or
+ * found walking the data chain, see nanofs_set_file_size().
  * @TODO: A directory has zero bytes?
  * @param fi_fh File handle
- * @return file size | on error 'hd->h_error' is set
+ * @return file size | -1 on error, field hd->h_error is set
  */
 long int nanofs_get_file_size(struct nanofs_fs_handle *hd,
         struct nanofs_filedir_handle *fh)
 {
     long int size;
+    __u64 cached;
+    struct nanofs_file_meta m;
     struct nanofs_data_node data_nd;
     if (DN_ISDIR(fh->f_dir_node))
         return 0;
+    if (DN_ISINLINE(fh->f_dir_node))
+        return fh->f_dir_node.d_data_ptr;
 
     if (fh->f_dir_node.d_data_ptr == 0)
         return 0;
-    else if (nanofs_read_data_node_b(hd, fh->f_dir_node.d_data_ptr, &data_nd) != 0)
+    if (nanofs_acache_get(&hd->h_acache, fh->f_blk_no, &cached) == 0)
+    {
+        NANOFS_STAT_INC(&hd->h_stats, st_acache_hits);
+        return cached;
+    }
+    NANOFS_STAT_INC(&hd->h_stats, st_acache_misses);
+    if (fh->f_dir_node.d_meta_ptr != 0 &&
+            nanofs_read_file_meta(hd, fh->f_dir_node.d_meta_ptr, &m) == 0)
+    {
+        NANOFS_STAT_INC(&hd->h_stats, st_fsize_meta);
+        nanofs_acache_set(&hd->h_acache, fh->f_blk_no, m.m_size);
+        return m.m_size;
+    }
+    if (nanofs_read_data_node_b(hd, fh->f_dir_node.d_data_ptr, &data_nd) != 0)
     {
         log_error("nanofs_get_file_size: IO error getting file size");
-        return 0;
+        return -1;
     }
     size = data_nd.d_len;
     while (data_nd.d_next_ptr != 0)
@@ -569,13 +1887,210 @@ long int nanofs_get_file_size(struct nanofs_fs_handle *hd,
         if (nanofs_read_data_node_b(hd,data_nd.d_next_ptr, &data_nd) != 0)
         {
             log_error("nanofs_get_file_size: IO error getting file size");
-            return 0;
+            return -1;
         }
         size += data_nd.d_len;
     }
+    nanofs_acache_set(&hd->h_acache, fh->f_blk_no, size);
     return size;
 }
 
+/** Read the metadata block of a file
+ * @return 0 on success | -1 on error, field hd->h_error is set
+ * */
+int nanofs_read_file_meta(struct nanofs_fs_handle *hd, __u32 blk_no,
+        struct nanofs_file_meta *m)
+{
+    __u8 *buf;
+    size_t len;
+
+    NANOFS_STAT_INC(&hd->h_stats, st_node_reads);
+    buf = nanofs_cache_get(&hd->h_cache, blk_no, sizeof(*m), &len);
+    if (buf == NULL)
+    {
+        hd->h_error = EIO;
+        return -1;
+    }
+    memcpy(m, buf, sizeof(*m));
+    if (m->m_magic != NANOFS_FILE_META_MAGIC)
+    {
+        log_error("nanofs_read_file_meta: bad metadata block 0x%x", blk_no);
+        hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/** Write the metadata block of a file
+ * @return 0 on success | -1 on error, field hd->h_error is set
+ * */
+int nanofs_write_file_meta(struct nanofs_fs_handle *hd, __u32 blk_no,
+        struct nanofs_file_meta *m)
+{
+    NANOFS_STAT_INC(&hd->h_stats, st_node_writes);
+    if (nanofs_cache_put(&hd->h_cache, blk_no, m, sizeof(*m)) != 0)
+    {
+        hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/** Allocate the metadata block of a file and link it from its dir node
+ * @return 0 on success | 1 when there is no room, the file is left
+ *      without it | -1 on error, field hd->h_error is set
+ * */
+static int nanofs_new_file_meta(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, struct nanofs_file_meta *m)
+{
+    __u32 blk_no;
+
+    blk_no = nanofs_alloc_blocks(hd, 1);
+    if (blk_no == 0)
+    {
+        if (hd->h_error != ENOSPC)
+            return -1;
+        hd->h_error = 0;
+        return 1;
+    }
+    if (nanofs_write_file_meta(hd, blk_no, m) != 0)
+        return -1;
+    fh->f_dir_node.d_meta_ptr = blk_no;
+    return nanofs_write_dir_node_b(hd, fh->f_blk_no, &fh->f_dir_node);
+}
+
+/** Record the size of a file whose data changed in 'hd->h_acache' and,
+ * with 'hd->h_file_size', in its metadata block. The block is allocated
+ * the first time, when there is no room the file is left without it.
+ * With 'hd->h_extents' the data nodes of the file are indexed then, see
+ * nanofs_index_data_node(). Inline files have their size in the dir node.
+ * @return 0 on success | -1 on error, field hd->h_error is set
+ * */
+static int nanofs_set_file_size(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, __u64 size)
+{
+    struct nanofs_file_meta m;
+    __u32 blk_no = fh->f_dir_node.d_meta_ptr;
+    int res;
+
+    nanofs_acache_set(&hd->h_acache, fh->f_blk_no, size);
+    if (!hd->h_file_size || DN_ISINLINE(fh->f_dir_node) ||
+            fh->f_dir_node.d_data_ptr == 0)
+        return 0;
+    if (blk_no == 0)
+    {
+        memset(&m, 0, sizeof(m));
+        m.m_magic = NANOFS_FILE_META_MAGIC;
+        m.m_size = size;
+        res = nanofs_new_file_meta(hd, fh, &m);
+        if (res != 0 || !hd->h_extents)
+            return res < 0 ? -1 : 0;
+        // The nodes the file has so far start its index
+        m.m_flags = NANOFS_META_EXTENTS;
+        if (nanofs_index_file(hd, fh, &m) != 0)
+            return -1;
+        return nanofs_write_file_meta(hd, fh->f_dir_node.d_meta_ptr, &m);
+    }
+    if (nanofs_read_file_meta(hd, blk_no, &m) != 0)
+        return -1;
+    m.m_size = size;
+    return nanofs_write_file_meta(hd, blk_no, &m);
+}
+
+/** Add a data node to the extent index in 'm', when there is no room for
+ * the index the file is left without it
+ * @return 0 on success | -1 on error, field hd->h_error is set
+ * */
+static int nanofs_index_append(struct nanofs_fs_handle *hd,
+        struct nanofs_file_meta *m, __u64 offset, __u32 blk_no)
+{
+    if (nanofs_extent_append(hd, m, offset, blk_no) == 0)
+        return 0;
+    if (hd->h_error != ENOSPC)
+        return -1;
+    // No room for the index, the file goes on without it
+    hd->h_error = 0;
+    return nanofs_extent_free(hd, m);
+}
+
+/** Index the data nodes of a file that has none in its index yet
+ * @param m Metadata of the file, the caller writes it
+ * @return 0 on success | -1 on error, field hd->h_error is set
+ * */
+static int nanofs_index_file(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, struct nanofs_file_meta *m)
+{
+    struct nanofs_data_node dn;
+    __u32 blk_no = fh->f_dir_node.d_data_ptr;
+    __u64 offset = 0;
+
+    while (blk_no != 0 && (m->m_flags & NANOFS_META_EXTENTS))
+    {
+        if (nanofs_read_data_node_b(hd, blk_no, &dn) != 0 ||
+                nanofs_index_append(hd, m, offset, blk_no) != 0)
+            return -1;
+        offset += dn.d_len;
+        blk_no = dn.d_next_ptr;
+    }
+    return 0;
+}
+
+/** Add a data node appended to a file to its extent index. With
+ * 'hd->h_extents' the index is started with the first data node of the
+ * file, a file left without it has its nodes found walking the chain.
+ * @param offset File offset of the data of the node
+ * @return 0 on success | -1 on error, field hd->h_error is set
+ * */
+static int nanofs_index_data_node(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *fh, __u64 offset, __u32 blk_no)
+{
+    struct nanofs_file_meta m;
+    __u32 meta_blk_no = fh->f_dir_node.d_meta_ptr;
+    int res;
+
+    if (!hd->h_extents)
+        return 0;
+    if (meta_blk_no == 0)
+    {
+        if (offset != 0)
+            return 0;
+        memset(&m, 0, sizeof(m));
+        m.m_magic = NANOFS_FILE_META_MAGIC;
+        m.m_flags = NANOFS_META_EXTENTS;
+        res = nanofs_new_file_meta(hd, fh, &m);
+        if (res != 0)
+            return res < 0 ? -1 : 0;
+        meta_blk_no = fh->f_dir_node.d_meta_ptr;
+    }
+    else if (nanofs_read_file_meta(hd, meta_blk_no, &m) != 0)
+        return -1;
+    if (!(m.m_flags & NANOFS_META_EXTENTS))
+        return 0;
+    if (nanofs_index_append(hd, &m, offset, blk_no) != 0)
+        return -1;
+    return nanofs_write_file_meta(hd, meta_blk_no, &m);
+}
+
+/** Free the metadata block of a file, if any, and its extent index. The
+ * dir node is left without it, the caller writes it.
+ * @return 0 on success | -1 on error
+ * */
+static int nanofs_free_file_meta(struct nanofs_fs_handle *hd,
+        struct nanofs_dir_node *dn)
+{
+    struct nanofs_file_meta m;
+    __u32 blk_no = dn->d_meta_ptr;
+
+    if (DN_ISDIR((*dn)) || blk_no == 0)
+        return 0;
+    if (nanofs_read_file_meta(hd, blk_no, &m) != 0)
+        return -1;
+    if ((m.m_flags & NANOFS_META_EXTENTS) && nanofs_extent_free(hd, &m) != 0)
+        return -1;
+    dn->d_meta_ptr = 0;
+    return nanofs_free_blocks(hd, blk_no, 1);
+}
+
 /** Calc space available on file system in bytes
  * @return -1 on error
  * */
@@ -604,7 +2119,8 @@ long int nanofs_get_file_size(struct nanofs_fs_handle *hd,
 
 /**
  * Allocate and write new dir_node.
- * fd_handle_io->dir_node_in data is written at the end of parent_dir_hd
+ * fd_handle_io->dir_node_in data is linked ahead of the children of
+ * parent_dir_hd, so the time taken does not depend on their number.
  * Used to create new dirs and files.
  *
  *
@@ -621,108 +2137,78 @@ static int nanofs_alloc_dir_node(struct nanofs_fs_handle *fs_hd,
         struct nanofs_filedir_handle *parent_dir_hd,
         struct nanofs_filedir_handle *fd_handle_io)
 {
-    struct nanofs_data_node data_nd;
-    struct nanofs_dir_node dir_node;
-    __u32 new_blkno, current_blkno;
+    __u32 new_blkno;
 
-    if(fs_hd->h_sb.s_free_ptr == 0) // No space left on device
-        return ENOSPC;
-
-    // Read free list
-    if (nanofs_read_data_node_b(fs_hd,fs_hd->h_sb.s_free_ptr,&data_nd) != 0)
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_ALLOC]);
+    // The handle may be older than the last change of the parent
+    if (nanofs_read_dir_node_b(fs_hd, parent_dir_hd->f_blk_no,
+            &parent_dir_hd->f_dir_node) != 0)
     {
-        log_error("nanofs_alloc_dir_node: fail getting free blocks");
+        log_error("nanofs_alloc_dir_node: reading directory fails");
         return EIO;
     }
 
-    if ( (data_nd.d_len + NANOFS_HEADER_DATA_NODE_SIZE ) <
-                ( (__u32)1 << fs_hd->h_block_bits))
-    {
-        // This may not happen due block size is 512, the free_node
-        // uses at least one 512 block
-
-        // Not enough free space on device to alloc new directory entry
-        return ENOSPC;
-    }
-
-    if((data_nd.d_len + NANOFS_HEADER_DATA_NODE_SIZE ) ==
-                ( (__u32)1 << fs_hd->h_block_bits ))
-    {
-        // data_node size = 1 block, convert data_node to dir_node
-        new_blkno = fs_hd->h_sb.s_free_ptr;
-        fs_hd->h_sb.s_free_ptr = data_nd.d_next_ptr;
-    }
+    fs_hd->h_error = 0;
+    if (fs_hd->h_dir_shift != 0)
+        new_blkno = nanofs_alloc_dir_slots(fs_hd, parent_dir_hd,
+                DN_SLOTS(fd_handle_io->f_dir_node.d_fname_len));
     else
+        new_blkno = nanofs_take_blocks(fs_hd, 1);
+    if (new_blkno == 0)
     {
-        // Take part of a data_node, 1 block
-        new_blkno = fs_hd->h_sb.s_free_ptr;
-        // FIXME: Only allowed 512 bytes block
-        fs_hd->h_sb.s_free_ptr = fs_hd->h_sb.s_free_ptr + 1;
-        // Reduce free list by one block
-        data_nd.d_len = data_nd.d_len - (__u32 ) (1 << fs_hd->h_block_bits);
-        // Write the updated free block
-        if (nanofs_write_data_node_b(fs_hd,fs_hd->h_sb.s_free_ptr,&data_nd) != 0)
-        {
-            log_error("nanofs_alloc_dir_node: cannot update freeblocks list, filesystem may be corrupted");
-            return EIO;
-        }
+        if (fs_hd->h_error == ENOSPC) // No space left on device
+            return ENOSPC;
+        log_error("nanofs_alloc_dir_node: fail getting free blocks");
+        return EIO;
     }
+    fd_handle_io->f_blk_no=new_blkno;
+    nanofs_acache_forget(&fs_hd->h_acache, new_blkno);
+    nanofs_emap_drop(&fs_hd->h_emap, new_blkno);
+    if (nanofs_link_dir_node(fs_hd, parent_dir_hd, fd_handle_io) != 0)
+        return EIO;
+    NANOFS_TRACE(NANOFS_EV_ALLOC, 0, new_blkno, 0, 0, 0);
+
+    return 0;
+}
 
-    // Update superblock
-    if (nanofs_write_sb(fs_hd->h_fd, (off_t) 0, &fs_hd->h_sb) != 0)
+/** Link a dir node to the children of a directory and write it
+ * @param parent_hd Directory just read, see nanofs_alloc_dir_node()
+ * @param fd_hd Node to link, 'fd_hd->f_blk_no' is already allocated
+ * @return 0 on success | EIO on error
+ * */
+static int nanofs_link_dir_node(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd)
+{
+    // The name may be cached as not found
+    nanofs_dcache_forget(&fs_hd->h_dcache, parent_hd->f_blk_no,
+            (char *)fd_hd->f_dir_node.d_fname, fd_hd->f_dir_node.d_fname_len);
+    // Write the dir_node ahead of the list of parent dir, then the
+    // parent pointing to it. Children of a B-tree directory are not chained.
+    fd_hd->f_dir_node.d_next_ptr = 0;
+    if (!DN_ISBTREE(parent_hd->f_dir_node))
+        fd_hd->f_dir_node.d_next_ptr = parent_hd->f_dir_node.d_data_ptr;
+    if (nanofs_write_dir_node_b(fs_hd, fd_hd->f_blk_no,
+            &fd_hd->f_dir_node) != 0)
     {
-        log_error("nanofs_alloc_dir_node:nanofs_alloc_dir_node:cannot update superblock, filesystem may be corrupted");
-        fs_hd->h_error = EIO;
+        log_error("nanofs_link_dir_node: cannot write dir node");
         return EIO;
     }
-
-    // Add new dir_node at the end of list of parent dir
-    if (parent_dir_hd->f_dir_node.d_data_ptr == 0)
-    {   // Empty child list parent_dir is updated
-        parent_dir_hd->f_dir_node.d_data_ptr = new_blkno;
-        if( nanofs_write_dir_node_b(fs_hd,parent_dir_hd->f_blk_no,
-                &parent_dir_hd->f_dir_node) != 0 )
-        {
-            log_error("nanofs_alloc_dir_node: cannot update parent dir node");
-            return EIO;
-        }
-    }
-    else
+    if (!DN_ISBTREE(parent_hd->f_dir_node))
     {
-        // follow list starting at first dir_node
-        current_blkno = parent_dir_hd->f_dir_node.d_data_ptr;
-        if (nanofs_read_dir_node_b(fs_hd,current_blkno,&dir_node) != 0)
-        {
-            log_error("nanofs_alloc_dir_node: reading directory fails");
-            return EIO;
-        }
-        while (dir_node.d_next_ptr != 0)
-        {
-            current_blkno = dir_node.d_next_ptr;
-            if (nanofs_read_dir_node_b(fs_hd, current_blkno, &dir_node) != 0)
-            {
-                log_error("nanofs_alloc_dir_node: reading directory node fails");
-                return EIO;
-            }
-        }
-        // Update the last dir_node for add the new dir_node
-        dir_node.d_next_ptr = new_blkno;
-        if (nanofs_write_dir_node_b(fs_hd,current_blkno,&dir_node) != 0)
+        parent_hd->f_dir_node.d_data_ptr = fd_hd->f_blk_no;
+        if( nanofs_write_dir_node_b(fs_hd,parent_hd->f_blk_no,
+                &parent_hd->f_dir_node) != 0 )
         {
-            log_error("nanofs_alloc_dir_node: cannot update last dir node");
+            log_error("nanofs_link_dir_node: cannot update parent dir node");
             return EIO;
         }
     }
-    // Write the added dir_node
-    fd_handle_io->f_blk_no=new_blkno;
-    fd_handle_io->f_dir_node.d_next_ptr = 0;
-    if (nanofs_write_dir_node_b(fs_hd,new_blkno,
-            &fd_handle_io->f_dir_node) != 0)
+    if (nanofs_index_link(fs_hd, parent_hd, fd_hd, 1) != 0)
     {
-        log_error("nanofs_alloc_dir_node: cannot write new dir node");
+        log_error("nanofs_link_dir_node: cannot update directory index");
         return EIO;
     }
-
     return 0;
 }
 
@@ -743,14 +2229,57 @@ static int nanofs_alloc_dir_node(struct nanofs_fs_handle *fs_hd,
 int nanofs_free_dir_node( struct nanofs_fs_handle *fs_hd,
         struct nanofs_filedir_handle *parent_hd,
         struct nanofs_filedir_handle *fd_hd)
+{
+    int retstat;
+
+    nanofs_acache_forget(&fs_hd->h_acache, fd_hd->f_blk_no);
+    nanofs_emap_drop(&fs_hd->h_emap, fd_hd->f_blk_no);
+    retstat = nanofs_unlink_dir_node(fs_hd, parent_hd, fd_hd, 1);
+    if (retstat != 0)
+        return retstat;
+
+    if (fs_hd->h_dir_shift != 0)
+    {
+        if (nanofs_free_dir_slots(fs_hd, fd_hd->f_blk_no,
+                DN_SLOTS(fd_hd->f_dir_node.d_fname_len)) != 0)
+            return EIO;
+        return 0;
+    }
+    // Convert dir_node into data_node and add it to free nodes list
+    if (nanofs_push_free(fs_hd, fd_hd->f_blk_no,
+            (1 << fs_hd->h_block_bits) - NANOFS_HEADER_DATA_NODE_SIZE) != 0)
+        return EIO;
+
+    return 0;
+}
+
+/** Unlink a dir node from the children of its parent, the node itself is
+ * not changed
+ * @param release The node is going to be freed, see nanofs_index_unlink()
+ * @return 0 on success | EIO when IO error |  ESTALE file system error
+ * */
+static int nanofs_unlink_dir_node(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *parent_hd,
+        struct nanofs_filedir_handle *fd_hd, int release)
 {
     struct nanofs_filedir_handle prev_fd_hd;
-    struct nanofs_data_node data_nd;
-    //struct nanofs_dir_node dir_nd;
-    //__u32 blk_no;
 
+    nanofs_dcache_forget(&fs_hd->h_dcache, parent_hd->f_blk_no,
+            (char *)fd_hd->f_dir_node.d_fname, fd_hd->f_dir_node.d_fname_len);
+    if (release && DN_ISDIR(fd_hd->f_dir_node))
+        nanofs_dcache_forget_dir(&fs_hd->h_dcache, fd_hd->f_blk_no);
+    // The handle may be older than the last change of the parent
+    if (nanofs_read_dir_node_b(fs_hd, parent_hd->f_blk_no,
+            &parent_hd->f_dir_node) != 0)
+        return EIO;
 
-    if( parent_hd->f_dir_node.d_data_ptr == fd_hd->f_blk_no )
+    if (DN_ISBTREE(parent_hd->f_dir_node))
+    {
+        // Children of a B-tree directory are not chained
+        if (nanofs_index_unlink(fs_hd, parent_hd, fd_hd, release) != 0)
+            return EIO;
+    }
+    else if( parent_hd->f_dir_node.d_data_ptr == fd_hd->f_blk_no )
     {
         // The dir_node is the first directory list
         // Update parent dir to next dir_node
@@ -758,6 +2287,8 @@ int nanofs_free_dir_node( struct nanofs_fs_handle *fs_hd,
         if(nanofs_write_dir_node_b(fs_hd,parent_hd->f_blk_no,
                 &parent_hd->f_dir_node) != 0)
             return EIO;
+        if (nanofs_index_unlink(fs_hd, parent_hd, fd_hd, release) != 0)
+            return EIO;
     }
     else
     {
@@ -776,7 +2307,7 @@ int nanofs_free_dir_node( struct nanofs_fs_handle *fs_hd,
         if (prev_fd_hd.f_blk_no == 0)
         {
             // Reached end of list, the block is not in list !
-            log_error("nanofs_free_dir_node: internal error in directory list");
+            log_error("nanofs_unlink_dir_node: internal error in directory list");
             return ESTALE;
         }
         // Update previous node dir in linked list
@@ -784,212 +2315,567 @@ int nanofs_free_dir_node( struct nanofs_fs_handle *fs_hd,
         if( nanofs_write_dir_node_b(fs_hd, prev_fd_hd.f_blk_no,
                 &prev_fd_hd.f_dir_node) != 0 )
         {
-            log_error("nanofs_free_dir_node: free node failed");
+            log_error("nanofs_unlink_dir_node: unlink node failed");
             return EIO;
         }
+        if (nanofs_index_unlink(fs_hd, parent_hd, fd_hd, release) != 0)
+            return EIO;
     }
+    return 0;
+}
 
-    // Convert dir_node into data_node and add it to free nodes list
-    data_nd.d_next_ptr = fs_hd->h_sb.s_free_ptr;
-    data_nd.d_len = (1 << fs_hd->h_block_bits) - NANOFS_HEADER_DATA_NODE_SIZE;
-    if (nanofs_write_data_node_b(fs_hd,fd_hd->f_blk_no,&data_nd) < 0)
-        return EIO;
-    // Update superblock
-    fs_hd->h_sb.s_free_ptr = fd_hd->f_blk_no;
-    if (nanofs_write_sb(fs_hd->h_fd, (off_t) 0, &fs_hd->h_sb) != 0)
+
+
+/** Position in the data chain of a file, see nanofs_seek_data() */
+struct nanofs_data_cursor {
+    __u32 c_blk_no;                 ///< Data node, 0 past the end of file
+    __u32 c_len;                    ///< Its d_len
+    __u32 c_next;                   ///< Its d_next_ptr
+    off_t c_pos;                    ///< File offset of its data
+    struct nanofs_emap_file *c_map; ///< Map of the file, NULL if none
+    __u32 c_index;                  ///< Extent of the node in 'c_map'
+};
+
+/** Move a cursor to the next data node of the file, taken from the map of
+ * the file or read and added to it
+ * @return 0 on success | -1 on error
+ * */
+static int nanofs_next_data(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_data_cursor *c)
+{
+    struct nanofs_emap_file *f = c->c_map;
+    struct nanofs_data_node dn;
+
+    c->c_pos += c->c_len;
+    if (f != NULL && c->c_blk_no != 0 && c->c_index + 1 < f->f_count)
     {
-        log_error("nanofs_free_dir_node: cannot update superblock, filesystem may be corrupted");
-        return EIO;
+        c->c_index++;
+        c->c_blk_no = f->f_ext[c->c_index].e_blk_no;
+        c->c_len = f->f_ext[c->c_index].e_len;
+        c->c_next = c->c_index + 1 < f->f_count ?
+                f->f_ext[c->c_index + 1].e_blk_no : f->f_more;
+        return 0;
+    }
+    c->c_blk_no = c->c_next;
+    c->c_len = 0;
+    if (c->c_blk_no == 0)
+        return 0;
+    if (nanofs_read_data_node_b(fs_hd, c->c_blk_no, &dn) != 0)
+        return -1;
+    c->c_len = dn.d_len;
+    c->c_next = dn.d_next_ptr;
+    if (f != NULL && nanofs_emap_add(&fs_hd->h_emap, f, c->c_blk_no,
+            c->c_len, c->c_next) != 0)
+    {
+        nanofs_emap_drop(&fs_hd->h_emap, f->f_blk_no);
+        c->c_map = NULL;
     }
+    else if (f != NULL)
+        c->c_index = f->f_count - 1;
+    return 0;
+}
+
+/** Place a cursor on the data node found in the extent index of a file
+ * for 'offset'. The map of the file is not used from there on, it only
+ * keeps the nodes walked from the start.
+ * @return 0 on success | 1 when the file has no index | -1 on error
+ * */
+static int nanofs_seek_extent(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, off_t offset,
+        struct nanofs_data_cursor *c)
+{
+    struct nanofs_file_meta m;
+    struct nanofs_data_node dn;
+    __u64 pos;
+    __u32 blk_no;
+    int res;
 
+    if (nanofs_read_file_meta(fs_hd, fh->f_dir_node.d_meta_ptr, &m) != 0)
+        return -1;
+    if (!(m.m_flags & NANOFS_META_EXTENTS))
+        return 1;
+    res = nanofs_extent_find(fs_hd, &m, offset, &pos, &blk_no);
+    if (res != 0)
+        return res;
+    if (nanofs_read_data_node_b(fs_hd, blk_no, &dn) != 0)
+        return -1;
+    c->c_map = NULL;
+    c->c_blk_no = blk_no;
+    c->c_len = dn.d_len;
+    c->c_next = dn.d_next_ptr;
+    c->c_pos = pos;
+    return 0;
+}
+
+/** Place a cursor on the data node holding byte 'offset' of a file, or on
+ * its last node when 'offset' is past the end. The node is found in the
+ * map of the file, the nodes walked to reach it are added to the map.
+ * The map is started again when the file does not begin where it did.
+ * Offsets past the nodes in the map are found in the extent index of the
+ * file when it has one, see nanofs_extent.c.
+ * @return 0 on success, 'c->c_blk_no' is 0 for an empty file | -1 on error
+ * */
+static int nanofs_seek_data(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, off_t offset,
+        struct nanofs_data_cursor *c)
+{
+    struct nanofs_emap_file *f;
+    struct nanofs_emap_extent *e;
+    __u32 first = fh->f_dir_node.d_data_ptr;
+    off_t mapped;
+    int res;
+
+    f = nanofs_emap_get(&fs_hd->h_emap, fh->f_blk_no);
+    if (f == NULL || f->f_first != first)
+        f = nanofs_emap_new(&fs_hd->h_emap, fh->f_blk_no, first);
+    c->c_map = f;
+    c->c_pos = 0;
+    c->c_len = 0;
+    c->c_blk_no = 0;
+    c->c_next = first;
+    c->c_index = 0;
+    // The offset is past the start of the first node missing from the map,
+    // walking to it may be long. Reads going on from the end of the map
+    // keep filling it.
+    e = f != NULL && f->f_count > 0 ? &f->f_ext[f->f_count - 1] : NULL;
+    mapped = e != NULL ? e->e_offset + e->e_len : 0;
+    res = 1;
+    if (fs_hd->h_extents && fh->f_dir_node.d_meta_ptr != 0 && first != 0 &&
+            (f == NULL || (f->f_more != 0 && offset > mapped)))
+        res = nanofs_seek_extent(fs_hd, fh, offset, c);
+    if (res < 0)
+        return -1;
+    if (res == 0)
+        NANOFS_STAT_INC(&fs_hd->h_stats, st_extent_seeks);
+    else if (f != NULL && f->f_count > 0)
+    {
+        NANOFS_STAT_INC(&fs_hd->h_stats, st_emap_hits);
+        c->c_index = nanofs_emap_find(f, offset);
+        c->c_blk_no = f->f_ext[c->c_index].e_blk_no;
+        c->c_len = f->f_ext[c->c_index].e_len;
+        c->c_pos = f->f_ext[c->c_index].e_offset;
+        c->c_next = c->c_index + 1 < f->f_count ?
+                f->f_ext[c->c_index + 1].e_blk_no : f->f_more;
+    }
+    else if (nanofs_next_data(fs_hd, c) != 0)
+        return -1;
+    while (c->c_blk_no != 0 && c->c_next != 0 &&
+            c->c_pos + c->c_len <= offset)
+        if (nanofs_next_data(fs_hd, c) != 0)
+            return -1;
     return 0;
 }
 
+/** Read the data nodes of a file queueing the payload reads, the first
+ * one is found with nanofs_seek_data().
+ * @return the number of bytes queued, or -1 on error
+ * */
+static int nanofs_read_nodes(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, char *buf, size_t size, off_t offset)
+{
+    struct nanofs_data_cursor c;
+    off_t buf_pos, i_offset;
+    size_t bytes_left;
+    int   bytes_to_read;
 
+    if (DN_ISINLINE(fh->f_dir_node))
+        return nanofs_read_inline(fs_hd, fh, buf, size, offset);
+    buf_pos = 0;
+    bytes_left = size;
+    if (nanofs_seek_data(fs_hd, fh, offset, &c) != 0)
+        return -1;
+
+    // When 'c.c_blk_no' is 0 end of file has been reached
+    while(c.c_blk_no != 0 && bytes_left > 0 )
+    {
+        if(c.c_len + c.c_pos > offset)
+        {
+            // Internal offset in this node, 0 once the read has started
+            i_offset = c.c_pos >= offset ? 0 : offset - c.c_pos;
+            if(c.c_len - (__u32)i_offset >= bytes_left)
+                bytes_to_read = bytes_left;
+            else
+                bytes_to_read = c.c_len - i_offset;
+
+            // Read from device, queued until the batch ends
+            if(nanofs_dev_queue_read(&fs_hd->h_dev,
+                        ((off_t)(c.c_blk_no) << fs_hd->h_block_bits) +
+                        NANOFS_HEADER_DATA_NODE_SIZE + i_offset,
+                        &buf[buf_pos], bytes_to_read) != 0)
+                return -1;
+
+            bytes_left -= bytes_to_read;
+            buf_pos += bytes_to_read;
+        }
+
+        // go forward through data_nodes list
+        if(bytes_left > 0 && nanofs_next_data(fs_hd, &c) != 0)
+            return -1;
+    }
+    return size - bytes_left;
+
+}
 
 /** Read data from a file
+ *
+ * Payload reads of all the data nodes are submitted as one batch, so the
+ * device can serve them in parallel (see nanofs_dev_batch_begin).
+ *
  * @param size It can be greater than the file size
  * @return the number of bytes read, or -1 on error
  * */
 int nanofs_read(struct nanofs_fs_handle *fs_hd,
         struct nanofs_filedir_handle *fh, char *buf, size_t size, off_t offset)
 {
-    struct nanofs_data_node data_node;
-    off_t buf_pos,  file_pos, i_offset;
-    size_t bytes_left;
-    __u32 blk_no;
-    int   bytes_to_read;
+    int res;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_READ]);
+    nanofs_dev_batch_begin(&fs_hd->h_dev);
+    res = nanofs_read_nodes(fs_hd, fh, buf, size, offset);
+    if(nanofs_dev_batch_end(&fs_hd->h_dev) != 0)
+        return -1;
+    return res;
+}
+
+/** Locate file data in the device without reading it
+ *
+ * Fills 'seg_vec' with the device ranges holding 'size' bytes of the file
+ * starting at 'offset'. Used for zero-copy reads where the caller transfers
+ * the data itself (e.g. splice from the image descriptor).
+ *
+ * @param size It can be greater than the file size
+ * @return number of segments filled | -1 on error | -2 when 'vec_size' is
+ *      too small | -3 when the data is inline in the dir node, it may be
+ *      only in the header cache, use nanofs_read()
+ * */
+int nanofs_read_segments(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, size_t size, off_t offset,
+        struct nanofs_segment seg_vec[], int vec_size)
+{
+    struct nanofs_data_cursor c;
+    off_t i_offset;
+    size_t bytes_left, bytes_to_read;
+    int items = 0;
 
-    blk_no = fh->f_dir_node.d_data_ptr;
-    file_pos = 0;
-    buf_pos = 0;
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_READ]);
+    if (DN_ISINLINE(fh->f_dir_node))
+        return -3;
     bytes_left = size;
+    if (nanofs_seek_data(fs_hd, fh, offset, &c) != 0)
+        return -1;
 
-    // When 'blk_no' is 0 end of file has been reached
-    while(blk_no != 0 && bytes_left > 0 )
+    while(c.c_blk_no != 0 && bytes_left > 0 )
     {
-
-        if(nanofs_read_data_node_b( fs_hd, blk_no , &data_node ) != 0)
-            return -1;
-
-        if(file_pos >= offset)
-        {
-            // Read data from data blocks, file_pos is not used anymore
-            if(bytes_left <= data_node.d_len)
-                bytes_to_read = bytes_left;
-            else
-                bytes_to_read = data_node.d_len;
-
-            // Read from device
-            if(nanofs_read_dev(fs_hd->h_fd,
-                        (blk_no << fs_hd->h_block_bits) +
-                        NANOFS_HEADER_DATA_NODE_SIZE,
-                        &buf[buf_pos], bytes_to_read) != bytes_to_read)
-                return -1;
-
-            bytes_left -= bytes_to_read;
-            buf_pos += bytes_to_read;
-        }
-        else if(data_node.d_len + file_pos > offset)
+        if(c.c_len + c.c_pos > offset)
         {
-            // The read start in this data_node
-            // Internal offset in this node
-            i_offset = offset - file_pos;
-
-            if(data_node.d_len - (__u32)i_offset >= bytes_left)
+            // Internal offset in this node, 0 once the read has started
+            i_offset = c.c_pos >= offset ? 0 : offset - c.c_pos;
+            bytes_to_read = c.c_len - i_offset;
+            if(bytes_to_read > bytes_left)
                 bytes_to_read = bytes_left;
-            else
-                bytes_to_read = data_node.d_len - i_offset;
-
-            if(nanofs_read_dev(fs_hd->h_fd,
-                        (blk_no << fs_hd->h_block_bits) +
-                        NANOFS_HEADER_DATA_NODE_SIZE + i_offset,
-                        &buf[buf_pos], bytes_to_read) != bytes_to_read)
-                return -1;
 
+            if(items == vec_size)
+                return -2;
+            seg_vec[items].s_offset = ((off_t)(c.c_blk_no) <<
+                    fs_hd->h_block_bits) + NANOFS_HEADER_DATA_NODE_SIZE +
+                    i_offset;
+            seg_vec[items].s_len = bytes_to_read;
+            items++;
             bytes_left -= bytes_to_read;
-            buf_pos += bytes_to_read;
         }
 
-        // go forward through data_nodes list
-        blk_no = data_node.d_next_ptr;
-        file_pos += data_node.d_len;
+        if(bytes_left > 0 && nanofs_next_data(fs_hd, &c) != 0)
+            return -1;
     }
-    return size - bytes_left;
-
+    return items;
 }
 
-/** Write data to a file
+/** Write data to a file, see nanofs_write()
+ *
+ * Data nodes holding the range are overwritten, the last one can also grow
+ * in the spare bytes of its last block. The rest goes to new nodes appended
+ * to the file. A node header is only written when its length changes, and
+ * together with the data for new nodes.
+ *
  * @return the number of bytes written | -1 on error
  * */
-int nanofs_write(struct nanofs_fs_handle *fs_hd,
+static int nanofs_write_nodes(struct nanofs_fs_handle *fs_hd,
         struct nanofs_filedir_handle *fh, const char *buf, size_t size,
         off_t offset)
 {
+    struct nanofs_data_cursor c;
     struct nanofs_data_node data_node;
-    __u32 blk_no, bytes_available;
-    size_t bytes_written, bytes_left;
+    __u32 blk_no, tail, capacity;
+    size_t done, n;
     off_t i_offset;
+    int changed, last;
 
-    bytes_left = size;
-    i_offset = 0;
+    done = 0;
 
-    blk_no = fh->f_dir_node.d_data_ptr;
-    if(blk_no == 0 && offset != 0)
-        // This may not happen. File size = 0 and offset != 0 ?
-        return -1;
-    while(blk_no != 0)
+    // Small files stay in the block of the dir node while they fit
+    if (DN_ISINLINE(fh->f_dir_node) || (fs_hd->h_inline &&
+            fh->f_dir_node.d_data_ptr == 0))
     {
-        // go forward trough linked list
-        if(nanofs_read_data_node_b(fs_hd,blk_no,&data_node) != 0)
+        if (nanofs_write_inline(fs_hd, fh, buf, size, offset) == (int)size)
+            return size;
+        if (fs_hd->h_error != ENOSPC)
             return -1;
-
-        if( i_offset + data_node.d_len >= offset)
-            break; // write in this data_node
-        i_offset += data_node.d_len;
-        blk_no = data_node.d_next_ptr;
-    }
-    if(blk_no != 0 ) // End of file not reached
-    {
-        // Internal offset in this data_node
-        i_offset = offset - i_offset;
-        // Bytes in current data_node + spare size
-        bytes_available = ( nanofs_blocks_for_size(
-                fs_hd, data_node.d_len + NANOFS_HEADER_DATA_NODE_SIZE)
-                        << fs_hd->h_block_bits ) - NANOFS_HEADER_DATA_NODE_SIZE
-                                - i_offset;
-        // Write data in this data_node
-
-        if(bytes_available  >= size)
-            // All data fits in this data_node
-            bytes_written = size;
-        else
-            bytes_written = bytes_available;
-
-        // write data
-        if( nanofs_write_dev(fs_hd->h_fd,
-                (blk_no << fs_hd->h_block_bits) + NANOFS_HEADER_DATA_NODE_SIZE +
-                i_offset , buf, bytes_written) != (int)bytes_written)
-            return size - bytes_left - bytes_written; // Error
-
-        // update data_node
-        data_node.d_len = i_offset + bytes_written;
-        if(nanofs_write_data_node_b(fs_hd,blk_no,&data_node) !=0 )
+        if (DN_ISINLINE(fh->f_dir_node) &&
+                nanofs_inline_promote(fs_hd, fh) != 0)
             return -1;
+    }
+    if (nanofs_seek_data(fs_hd, fh, offset, &c) != 0)
+        goto fail;
+    if(c.c_blk_no == 0 && offset != 0)
+        // This may not happen. File size = 0 and offset != 0 ?
+        return -1;
+    tail = c.c_blk_no;  // Last node seen, new nodes are linked after it
+    while(c.c_blk_no != 0 && done < size)
+    {
+        tail = c.c_blk_no;
+        last = c.c_next == 0;
 
-        bytes_left -= bytes_written;
+        if(offset + (off_t)done < c.c_pos + c.c_len || last)
+        {
+            // Internal offset in this data_node, writes beyond the end of
+            // file are appended
+            i_offset = offset + done - c.c_pos;
+            if(i_offset > c.c_len)
+                i_offset = c.c_len;
+            // The last node may use the spare bytes of its last block
+            if(last)
+                capacity = ( nanofs_blocks_for_size(fs_hd,
+                        c.c_len + NANOFS_HEADER_DATA_NODE_SIZE)
+                                << fs_hd->h_block_bits )
+                                        - NANOFS_HEADER_DATA_NODE_SIZE;
+            else
+                capacity = c.c_len;
+            n = capacity - i_offset;
+            if(n > size - done)
+                n = size - done;
+
+            changed = i_offset + n > c.c_len;
+            data_node.d_next_ptr = c.c_next;
+            data_node.d_len = changed ? i_offset + n : c.c_len;
+            if(n > 0 && nanofs_write_data(fs_hd, c.c_blk_no,
+                    changed ? &data_node : NULL, i_offset, &buf[done],
+                    n) != (int)n)
+                goto fail;
+            done += n;
+            c.c_len = data_node.d_len;
+            if(c.c_map != NULL)
+                c.c_map->f_ext[c.c_index].e_len = c.c_len;
+        }
 
+        if(done < size && nanofs_next_data(fs_hd, &c) != 0)
+            goto fail;
     }
 
     // Add new data_nodes to file
-    while (bytes_left > 0)
+    while (done < size)
     {
-        // i_offset is set to buf position to continue writing
-        i_offset = size - bytes_left;
-
-        // Appends new block to the end of the file and
+        // Appends new block after the last one and
         // returns the 'block_no' allocated
-        blk_no = nanofs_alloc_data_node(fs_hd,fh, bytes_left, &data_node);
+        blk_no = nanofs_alloc_data_node(fs_hd, fh, tail, size - done,
+                &data_node);
         if ( blk_no == 0) // No block
         {
             log_error("nanofs_write: cannot allocate free space for write a file");
-            return -1;
+            goto fail;
         }
-        // Now writes data. The header of the block
-        // was written by nanofsmgr_alloc_data_node
-        bytes_written = bytes_left > data_node.d_len ?
-                data_node.d_len : bytes_left;
-
-        if( nanofs_write_dev(fs_hd->h_fd,
-                (blk_no << fs_hd->h_block_bits) +
-                NANOFS_HEADER_DATA_NODE_SIZE,
-                &buf[i_offset], bytes_written) != (int)bytes_written)
-            return -1;
+        tail = blk_no;
+        if (nanofs_index_data_node(fs_hd, fh, c.c_pos, blk_no) != 0)
+            goto fail;
+        // The header is written with the data
+        n = size - done > data_node.d_len ? data_node.d_len : size - done;
+        data_node.d_len = n;
+        if(nanofs_write_data(fs_hd, blk_no, &data_node, 0, &buf[done],
+                n) != (int)n)
+            goto fail;
+        done += n;
+        c.c_pos += n;
+        // The map has all the nodes once the end of file is reached
+        if(c.c_map != NULL && nanofs_emap_add(&fs_hd->h_emap, c.c_map,
+                blk_no, n, 0) != 0)
+        {
+            nanofs_emap_drop(&fs_hd->h_emap, fh->f_blk_no);
+            c.c_map = NULL;
+        }
+    }
 
-        //  Update data_node. FIXME: Not always required, only when
-        //    bytes_written < data_node.d_len
-        data_node.d_len = bytes_written;
-        if(nanofs_write_data_node_b(fs_hd,blk_no,&data_node) !=0 )
-            return -1;
+    return done;
+
+fail:
+    // Nodes may be linked but not written, the chain is read again
+    nanofs_emap_drop(&fs_hd->h_emap, fh->f_blk_no);
+    return done > 0 ? (int)done : -1;
+}
+
+/** Write data to a file, its size is updated as in nanofs_set_file_size()
+ *
+ * Payload, node headers and superblock updates of the call are queued and
+ * submitted as one batch. Queued writes only fail when the batch ends, in
+ * that case nothing of this call is reported as written.
+ *
+ * @return the number of bytes written | -1 on error
+ * */
+int nanofs_write(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, const char *buf, size_t size,
+        off_t offset)
+{
+    long int old_size;
+    __u64 new_size;
+    int res;
+
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_WRITE]);
+    old_size = nanofs_get_file_size(fs_hd, fh);
+    if (old_size < 0)
+        return -1;
+    nanofs_dev_batch_begin(&fs_hd->h_dev);
+    res = nanofs_write_nodes(fs_hd, fh, buf, size, offset);
+    // Writes beyond the end of file are appended
+    if (res > 0)
+    {
+        if (offset > old_size)
+            offset = old_size;
+        new_size = offset + res > old_size ? offset + res : old_size;
+        if (nanofs_set_file_size(fs_hd, fh, new_size) != 0)
+            res = -1;
+    }
+    else
+        nanofs_acache_forget(&fs_hd->h_acache, fh->f_blk_no);
+    if(nanofs_dev_batch_end(&fs_hd->h_dev) != 0)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    return res;
+}
 
+/** Read data inline in the block of the dir node
+ * @return bytes read | -1 on error
+ * */
+static int nanofs_read_inline(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, char *buf, size_t size,
+        off_t offset)
+{
+    size_t start = NANOFS_HEADER_DIR_NODE_SIZE + fh->f_dir_node.d_fname_len;
+    __u32 len = fh->f_dir_node.d_data_ptr;
+    __u8 *data;
+    size_t have;
 
-        bytes_left -= bytes_written;
+    if (offset >= (off_t)len)
+        return 0;
+    if (size > (size_t)(len - offset))
+        size = len - offset;
+    data = nanofs_cache_get(&fs_hd->h_cache, fh->f_blk_no,
+            start + offset + size, &have);
+    if (data == NULL)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
     }
+    memcpy(buf, data + start + offset, size);
+    return size;
+}
 
-    return size - bytes_left;
+/** Write data inline in the block of the dir node, an empty file becomes
+ * inline. Writes beyond the end of file are appended as in
+ * nanofs_write().
+ * @return bytes written | -1 on error, field fs_hd->h_error is ENOSPC when
+ *      the data does not fit in the block
+ * */
+static int nanofs_write_inline(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, const char *buf, size_t size,
+        off_t offset)
+{
+    size_t start = NANOFS_HEADER_DIR_NODE_SIZE + fh->f_dir_node.d_fname_len;
+    __u32 len = DN_ISINLINE(fh->f_dir_node) ? fh->f_dir_node.d_data_ptr : 0;
+
+    if (offset > (off_t)len)
+        offset = len;
+    if (start + offset + size > ((size_t)1 << fs_hd->h_block_bits))
+    {
+        fs_hd->h_error = ENOSPC;
+        return -1;
+    }
+    if (size > 0 && nanofs_cache_put_at(&fs_hd->h_cache, fh->f_blk_no,
+            start + offset, buf, size) != 0)
+    {
+        fs_hd->h_error = EIO;
+        return -1;
+    }
+    if (!DN_ISINLINE(fh->f_dir_node) || offset + size > len)
+    {
+        fh->f_dir_node.d_flags |= 1 << NANOFS_FLG_INLINE;
+        if (offset + size > len)
+            fh->f_dir_node.d_data_ptr = offset + size;
+        if (nanofs_write_dir_node_b(fs_hd, fh->f_blk_no, &fh->f_dir_node) != 0)
+            return -1;
+    }
+    return size;
+}
+
+/** Move inline data to a data node, the file grew out of its dir node
+ * block
+ * @return 0 on success | -1 on error
+ * */
+static int nanofs_inline_promote(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh)
+{
+    struct nanofs_data_node data_node;
+    char data[NANOFS_CACHE_DATA];
+    __u32 len = fh->f_dir_node.d_data_ptr, blk_no;
+
+    if (nanofs_read_inline(fs_hd, fh, data, len, 0) != (int)len)
+        return -1;
+    fh->f_dir_node.d_flags &= ~(1 << NANOFS_FLG_INLINE);
+    fh->f_dir_node.d_data_ptr = 0;
+    if (len == 0)
+        return nanofs_write_dir_node_b(fs_hd, fh->f_blk_no, &fh->f_dir_node);
+    // The dir node is written pointing to the new data node
+    blk_no = nanofs_alloc_data_node(fs_hd, fh, 0, len, &data_node);
+    if (blk_no == 0)
+        return -1;
+    data_node.d_len = len;
+    if (nanofs_index_data_node(fs_hd, fh, 0, blk_no) != 0)
+        return -1;
+    if (nanofs_write_data(fs_hd, blk_no, &data_node, 0, data, len) != (int)len)
+        return -1;
+    // The metadata block may come with the index
+    return nanofs_set_file_size(fs_hd, fh, len);
+}
+
+/** Give space back to an empty free list, from the files being deleted
+ * and then from the nodes freed in the journal group
+ * @return 0 on success, the free list may still be empty | -1 on fail,
+ *      field hd->h_error is set
+ * */
+static int nanofs_refill_free(struct nanofs_fs_handle *hd)
+{
+    // Files being deleted give their space back first
+    if (hd->h_sb.s_free_ptr == 0 && hd->h_sbx.s_orphan_ptr != 0 &&
+            nanofs_reclaim(hd, INT_MAX) < 0)
+        return -1;
+    // Nodes freed in the journal group can be used once it is committed
+    if(hd->h_sb.s_free_ptr == 0 && hd->h_defer_head != 0 &&
+            nanofs_commit(hd) != 0)
+        return -1;
+    return 0;
 }
 
 /** Try to alloc one new block of a given size from free space and
- *  add it at the end of file.
+ *  add it at the end of file, after its node 'last'.
  *  The new empty 'data_node' is appended to the end of file.
  *
  *  The size of the allocated block is <= than the required size,
- *  'dn_out' have the size of the block allocated, this block already has been
- *  written to the device.
+ *  'dn_out' have the size of the block allocated. The node is linked to the
+ *  file but its header is not written, the caller writes it with the data.
  *
  * Required from write()
  *
  * @param fh File handle
+ * @param last Last data node of the file, 0 when it has none
  * @param size Required size
  * @param dn_out Datablock allocated, d_out->d_len has the size allocated
  * @return block_no of the data node allocated | 0 on fail, field hd->h_error
@@ -997,12 +2883,15 @@ int nanofs_write(struct nanofs_fs_handle *fs_hd,
  * */
 
 static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
-        struct nanofs_filedir_handle *fh, __u32 size,
+        struct nanofs_filedir_handle *fh, __u32 last, __u32 size,
         struct nanofs_data_node *dn_out)
 {
     struct nanofs_data_node free_data_node,data_node;
-    __u32 new_blkno,blocks_required,blk_no,blocks;
+    __u32 new_blkno,blocks_required,blocks;
 
+    NANOFS_STAT_INC(&hd->h_stats, st_ops[NANOFS_OP_ALLOC]);
+    if (nanofs_refill_free(hd) != 0)
+        return 0;
     if(hd->h_sb.s_free_ptr == 0)
     {
         // No free space on device
@@ -1025,16 +2914,13 @@ static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
     if (blocks <= blocks_required )
     {
         hd->h_sb.s_free_ptr = free_data_node.d_next_ptr;
-        // Updating superblock
-        if (nanofs_write_sb(hd->h_fd, (off_t) 0, &(hd->h_sb)) != 0)
-            return 0;
+        hd->h_sb_dirty = 1;
         dn_out->d_len = (blocks << hd->h_block_bits) -
                 NANOFS_HEADER_DATA_NODE_SIZE;
         dn_out->d_next_ptr = 0;
 
         // Add new data_node to the end of the file
-        blk_no = fh->f_dir_node.d_data_ptr;
-        if(blk_no == 0 )
+        if(last == 0 )
         {
             // File was empty, update dir node
             fh->f_dir_node.d_data_ptr = new_blkno;
@@ -1043,28 +2929,15 @@ static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
         }
         else
         {
-            // File was not empty, navigate along data list
-            if(nanofs_read_data_node_b(hd,blk_no,&data_node) != 0)
-                return 0;
-            while (data_node.d_next_ptr != 0 )
-            {
-                blk_no = data_node.d_next_ptr;
-                if(nanofs_read_data_node_b(hd,blk_no,&data_node) != 0)
-                {
-                    hd->h_error = EIO;
-                    return 0;
-                }
-            }
             // Update the last data_node if the file
+            if(nanofs_read_data_node_b(hd,last,&data_node) != 0)
+                return 0;
             data_node.d_next_ptr = new_blkno;
-            if(nanofs_write_data_node_b(hd,blk_no,&data_node) != 0)
+            if(nanofs_write_data_node_b(hd,last,&data_node) != 0)
                 return 0;
 
         }
-        // Write the new data_node
-        if(nanofs_write_data_node_b(hd,new_blkno,dn_out) != 0)
-            return 0;
-
+        NANOFS_TRACE(NANOFS_EV_ALLOC, 0, new_blkno, dn_out->d_len, 0, 0);
         return new_blkno;
     }
 
@@ -1080,12 +2953,7 @@ static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
     //    Create new data node for free space
     free_data_node.d_len -= (blocks_required << hd->h_block_bits);
     //    Update superblock
-    if (nanofs_write_sb(hd->h_fd, (off_t) 0, &(hd->h_sb)) != 0)
-    {
-        log_error("nanofs_alloc_data_node: IO Error updating superblock");
-        hd->h_error = EIO;
-        return 0;
-    }
+    hd->h_sb_dirty = 1;
     //  Write new freespace data node
     if(nanofs_write_data_node_b(hd,hd->h_sb.s_free_ptr,&free_data_node) != 0)
         return 0;
@@ -1096,8 +2964,7 @@ static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
     dn_out->d_next_ptr = 0;
 
     // Update file entry, add data_node to the end of file
-    blk_no = fh->f_dir_node.d_data_ptr;
-    if(blk_no == 0 )
+    if(last == 0 )
     {
         // File was empty, only update dir node
         fh->f_dir_node.d_data_ptr = new_blkno;
@@ -1106,27 +2973,232 @@ static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
     }
     else
     {
-        // File was not empty
-        if(nanofs_read_data_node_b(hd,blk_no,&data_node) != 0)
+        // Update last node to add the new node
+        if(nanofs_read_data_node_b(hd,last,&data_node) != 0)
+            return 0;
+        data_node.d_next_ptr = new_blkno;
+        if(nanofs_write_data_node_b(hd,last,&data_node) != 0)
+            return 0;
+
+    }
+    NANOFS_TRACE(NANOFS_EV_ALLOC, 0, new_blkno, dn_out->d_len, 0, 0);
+    return new_blkno;
+}
+
+/** Allocate 'blocks' contiguous blocks, the first node of the free list
+ * big enough is split, only the first NANOFS_ALLOC_SCAN nodes are tried.
+ * The blocks are not written.
+ * @return first block_no of the blocks | 0 on fail, field hd->h_error is
+ *      set, ENOSPC when no node is big enough
+ * */
+__u32 nanofs_alloc_blocks(struct nanofs_fs_handle *hd, __u32 blocks)
+{
+    __u32 blk_no;
+
+    NANOFS_STAT_INC(&hd->h_stats, st_ops[NANOFS_OP_ALLOC]);
+    blk_no = nanofs_take_blocks(hd, blocks);
+    if (blk_no != 0)
+        NANOFS_TRACE(NANOFS_EV_ALLOC, 0, blk_no,
+                blocks << hd->h_block_bits, 0, 0);
+    return blk_no;
+}
+
+/** Unlink 'blocks' contiguous blocks from the free list, see
+ * nanofs_alloc_blocks()
+ * @return first block_no of the blocks | 0 on fail, field hd->h_error is
+ *      set, ENOSPC when no node is big enough
+ * */
+static __u32 nanofs_take_blocks(struct nanofs_fs_handle *hd, __u32 blocks)
+{
+    struct nanofs_data_node dn, prev_dn;
+    __u32 blk_no, prev = 0, next, have = 0;
+    int scan;
+
+    if (nanofs_refill_free(hd) != 0)
+        return 0;
+    blk_no = hd->h_sb.s_free_ptr;
+    for (scan = 0; blk_no != 0 && scan < NANOFS_ALLOC_SCAN; scan++)
+    {
+        if (nanofs_read_data_node_b(hd, blk_no, &dn) != 0)
+            return 0;
+        have = nanofs_blocks_for_size(hd, NANOFS_HEADER_DATA_NODE_SIZE
+                + dn.d_len);
+        if (have >= blocks)
+            break;
+        prev = blk_no;
+        prev_dn = dn;
+        blk_no = dn.d_next_ptr;
+    }
+    if (blk_no == 0 || scan == NANOFS_ALLOC_SCAN)
+    {
+        hd->h_error = ENOSPC;
+        return 0;
+    }
+    next = dn.d_next_ptr;
+    if (have > blocks)
+    {
+        // The rest of the node stays in the list
+        next = blk_no + blocks;
+        dn.d_len -= blocks << hd->h_block_bits;
+        if (nanofs_write_data_node_b(hd, next, &dn) != 0)
+            return 0;
+    }
+    if (prev == 0)
+    {
+        hd->h_sb.s_free_ptr = next;
+        hd->h_sb_dirty = 1;
+    }
+    else
+    {
+        prev_dn.d_next_ptr = next;
+        if (nanofs_write_data_node_b(hd, prev, &prev_dn) != 0)
             return 0;
+    }
+    return blk_no;
+}
+
+/** Read the header of a block of packed dir nodes
+ * @return 0 on success | -1 on error
+ * */
+static int nanofs_read_dir_block(struct nanofs_fs_handle *hd, __u32 blk_no,
+        struct nanofs_dir_block *db_out)
+{
+    __u8 *buf;
+    size_t len;
+
+    buf = nanofs_cache_get(&hd->h_cache, blk_no, sizeof(*db_out), &len);
+    if (buf == NULL)
+        return -1;
+    memcpy(db_out, buf, sizeof(*db_out));
+    if (db_out->p_magic != NANOFS_DIR_BLOCK_MAGIC)
+    {
+        log_error("nanofs_read_dir_block: bad magic in block %u", blk_no);
+        return -1;
+    }
+    return 0;
+}
 
-        while (data_node.d_next_ptr != 0 )
+/** Allocate 'slots' contiguous slots for a packed dir node. Siblings are
+ * packed in the block of the first child of the parent, a new block is
+ * taken when it has no room. B-tree dirs have no first child, their
+ * children share the last block taken for one of them, hd->h_dir_fill.
+ * @return address of the slots | 0 on fail, field hd->h_error is set,
+ *      ENOSPC when no space is left
+ * */
+static __u32 nanofs_alloc_dir_slots(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *parent_hd, int slots)
+{
+    struct nanofs_dir_block db;
+    __u32 blk_no = 0;
+    __u16 run = (1 << slots) - 1;
+    int slot = 1;
+
+    if (DN_ISBTREE(parent_hd->f_dir_node))
+        blk_no = hd->h_dir_fill;
+    else if (parent_hd->f_dir_node.d_data_ptr != 0)
+        blk_no = DN_BLOCK(parent_hd->f_dir_node.d_data_ptr, hd->h_dir_shift);
+    if (blk_no != 0)
+    {
+        if (nanofs_read_dir_block(hd, blk_no, &db) != 0)
         {
-            blk_no = data_node.d_next_ptr;
-            if(nanofs_read_data_node_b(hd,blk_no,&data_node) != 0)
-                return 0;
+            hd->h_error = EIO;
+            return 0;
         }
-        // Reached end of file, update last node to add the new node
-        data_node.d_next_ptr = new_blkno;
-        if(nanofs_write_data_node_b(hd,blk_no,&data_node) != 0)
+        while (slot + slots <= (1 << hd->h_dir_shift) &&
+                (db.p_used & (run << slot)) != 0)
+            slot++;
+        if (slot + slots > (1 << hd->h_dir_shift))
+            blk_no = 0;
+    }
+    if (blk_no == 0)
+    {
+        blk_no = nanofs_take_blocks(hd, 1);
+        if (blk_no == 0)
             return 0;
+        db.p_magic = NANOFS_DIR_BLOCK_MAGIC;
+        db.p_used = 1;
+        db.p_pad = 0;
+        slot = 1;
+        if (DN_ISBTREE(parent_hd->f_dir_node))
+            hd->h_dir_fill = blk_no;
+    }
+    db.p_used |= run << slot;
+    if (nanofs_cache_put(&hd->h_cache, blk_no, &db, sizeof(db)) != 0)
+    {
+        hd->h_error = EIO;
+        return 0;
+    }
+    return blk_no << hd->h_dir_shift | slot;
+}
+
+/** Release the slots of a packed dir node, the block goes back to the free
+ * list with its last node
+ * @return 0 on success | -1 on fail
+ * */
+static int nanofs_free_dir_slots(struct nanofs_fs_handle *hd, __u32 addr,
+        int slots)
+{
+    struct nanofs_dir_block db;
+    __u32 blk_no = DN_BLOCK(addr, hd->h_dir_shift);
+    int slot = addr & ((1 << hd->h_dir_shift) - 1);
 
+    if (nanofs_read_dir_block(hd, blk_no, &db) != 0)
+        return -1;
+    db.p_used &= ~(((1 << slots) - 1) << slot);
+    if (db.p_used == 1 && blk_no == hd->h_dir_fill)
+        hd->h_dir_fill = 0;
+    if (db.p_used == 1)
+        return nanofs_push_free(hd, blk_no,
+                (1 << hd->h_block_bits) - NANOFS_HEADER_DATA_NODE_SIZE);
+    return nanofs_cache_put(&hd->h_cache, blk_no, &db, sizeof(db));
+}
+
+/** Resize the slots of a packed dir node whose name changes. It grows in
+ * place when the next slots are free, otherwise new slots are allocated
+ * as nanofs_alloc_dir_slots() does and the old ones are kept, the caller
+ * frees them once the node is unlinked.
+ * @return address of the slots, 'addr' unless they moved | 0 on fail,
+ *      field hd->h_error is set
+ * */
+static __u32 nanofs_resize_dir_slots(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *parent_hd, __u32 addr, int old_slots,
+        int slots)
+{
+    struct nanofs_dir_block db;
+    __u32 blk_no = DN_BLOCK(addr, hd->h_dir_shift);
+    int slot = addr & ((1 << hd->h_dir_shift) - 1);
+    __u16 run = ((1 << slots) - 1) ^ ((1 << old_slots) - 1); // Changed
+
+    if (slots == old_slots)
+        return addr;
+    if (nanofs_read_dir_block(hd, blk_no, &db) != 0)
+    {
+        hd->h_error = EIO;
+        return 0;
     }
-    // Write new data node
-    if(nanofs_write_data_node_b(hd,new_blkno,dn_out) != 0)
-         return 0;
+    if (slots < old_slots)
+        db.p_used &= ~(run << slot);
+    else if (slot + slots <= (1 << hd->h_dir_shift) &&
+            (db.p_used & (run << slot)) == 0)
+        db.p_used |= run << slot;
+    else
+        return nanofs_alloc_dir_slots(hd, parent_hd, slots);
+    if (nanofs_cache_put(&hd->h_cache, blk_no, &db, sizeof(db)) != 0)
+    {
+        hd->h_error = EIO;
+        return 0;
+    }
+    return addr;
+}
 
-    return new_blkno;
+/** Return 'blocks' contiguous blocks to the free list
+ * @return 0 on success | -1 on fail
+ * */
+int nanofs_free_blocks(struct nanofs_fs_handle *hd, __u32 blk_no,
+        __u32 blocks)
+{
+    return nanofs_push_free(hd, blk_no,
+            (blocks << hd->h_block_bits) - NANOFS_HEADER_DATA_NODE_SIZE);
 }
 
 /** Free data_node, data node is added at ahead of list of free nodes
@@ -1142,27 +3214,70 @@ static __u32 nanofs_alloc_data_node(struct nanofs_fs_handle *hd,
 int nanofs_free_data_node(struct nanofs_fs_handle *hd,int blkno,
         struct nanofs_data_node *dn)
 {
-    struct nanofs_data_node free_nd;
     __u32 blocks;
 
     // Link the node ahead of free nodes
     blocks = nanofs_blocks_for_size(hd,dn->d_len + NANOFS_HEADER_DATA_NODE_SIZE);
 
-    free_nd.d_next_ptr = hd->h_sb.s_free_ptr;
     // Calc length: expand len to fit block size
-    free_nd.d_len = (blocks << hd->h_block_bits) -  NANOFS_HEADER_DATA_NODE_SIZE;
+    return nanofs_push_free(hd, blkno,
+            (blocks << hd->h_block_bits) - NANOFS_HEADER_DATA_NODE_SIZE);
+}
 
-    if (nanofs_write_data_node_b(hd, blkno, &free_nd) != 0)
-        return -1;
+/** Link a freed node ahead of the list of free nodes
+ *
+ * With a journal the node is kept in a list of its own until the group is
+ * committed: the metadata on the device may still use it, and reusing it
+ * for file data, which is written in place, would damage it before the
+ * commit. See nanofs_free_deferred().
+ *
+ * @param len Bytes of the free node, without header
+ * @return 0 on success | -1 on fail
+ * */
+static int nanofs_push_free(struct nanofs_fs_handle *hd, __u32 blk_no,
+        __u32 len)
+{
+    struct nanofs_data_node free_nd;
 
-    hd->h_sb.s_free_ptr = blkno;
-    // Update superblock
-    if (nanofs_write_sb(hd->h_fd, (off_t) 0, &hd->h_sb) != 0)
+    NANOFS_STAT_INC(&hd->h_stats, st_ops[NANOFS_OP_FREE]);
+    NANOFS_TRACE(NANOFS_EV_FREE, 0, blk_no, len, 0, 0);
+    free_nd.d_len = len;
+    if (hd->h_journal)
     {
-        log_error("nanofs_free_data_node: Cannot update superblock, "
-                " filesystem may be corrupted");
-        return -1;
+        free_nd.d_next_ptr = hd->h_defer_head;
+        if (nanofs_write_data_node_b(hd, blk_no, &free_nd) != 0)
+            return -1;
+        if (hd->h_defer_head == 0)
+            hd->h_defer_tail = blk_no;
+        hd->h_defer_head = blk_no;
+        return 0;
     }
+    free_nd.d_next_ptr = hd->h_sb.s_free_ptr;
+    if (nanofs_write_data_node_b(hd, blk_no, &free_nd) != 0)
+        return -1;
+    hd->h_sb.s_free_ptr = blk_no;
+    hd->h_sb_dirty = 1;
+    return 0;
+}
+
+/** Move the nodes freed in the current journal group ahead of the free
+ * list, called by the commit of the group
+ * @return 0 on success | -1 on fail
+ * */
+int nanofs_free_deferred(struct nanofs_fs_handle *hd)
+{
+    struct nanofs_data_node dn;
+
+    if (hd->h_defer_head == 0)
+        return 0;
+    if (nanofs_read_data_node_b(hd, hd->h_defer_tail, &dn) != 0)
+        return -1;
+    dn.d_next_ptr = hd->h_sb.s_free_ptr;
+    if (nanofs_write_data_node_b(hd, hd->h_defer_tail, &dn) != 0)
+        return -1;
+    hd->h_sb.s_free_ptr = hd->h_defer_head;
+    hd->h_sb_dirty = 1;
+    hd->h_defer_head = hd->h_defer_tail = 0;
     return 0;
 }
 
@@ -1177,25 +3292,49 @@ int nanofs_truncate(struct nanofs_fs_handle *fs_hd,
     struct nanofs_data_node dn;
     __u32 blk_no;
 
+    NANOFS_STAT_INC(&fs_hd->h_stats, st_ops[NANOFS_OP_TRUNCATE]);
+    nanofs_acache_forget(&fs_hd->h_acache, fh->f_blk_no);
+    nanofs_emap_drop(&fs_hd->h_emap, fh->f_blk_no);
     if(size !=0 )
     {
         log_error("nanofs_truncate: not implented trunctate to size %lld",size);
         return ENOTSUP;
     }
+    // Header reads depend on each other, the writes freeing the nodes are
+    // batched
+    nanofs_dev_batch_begin(&fs_hd->h_dev);
     blk_no = fh->f_dir_node.d_data_ptr;
+    // Inline data goes away with the flag
+    if (DN_ISINLINE(fh->f_dir_node))
+    {
+        fh->f_dir_node.d_flags &= ~(1 << NANOFS_FLG_INLINE);
+        blk_no = 0;
+    }
     while(blk_no != 0)
     {
-        if(nanofs_read_data_node_b( fs_hd, blk_no , &dn ) != 0)
-            return EIO;
-        if(nanofs_free_data_node(fs_hd,blk_no,&dn) != 0)
+        if(nanofs_read_data_node_b( fs_hd, blk_no , &dn ) != 0 ||
+                nanofs_free_data_node(fs_hd,blk_no,&dn) != 0)
+        {
+            nanofs_dev_batch_end(&fs_hd->h_dev);
             return EIO;
+        }
         blk_no = dn.d_next_ptr;
     }
     // Update file
     fh->f_dir_node.d_data_ptr = 0;
+    if (nanofs_free_file_meta(fs_hd, &fh->f_dir_node) != 0)
+    {
+        nanofs_dev_batch_end(&fs_hd->h_dev);
+        return EIO;
+    }
 
     if(nanofs_write_dir_node_b(fs_hd,fh->f_blk_no,&fh->f_dir_node) != 0)
-        return EIO;;
+    {
+        nanofs_dev_batch_end(&fs_hd->h_dev);
+        return EIO;
+    }
+    if(nanofs_dev_batch_end(&fs_hd->h_dev) != 0)
+        return EIO;
     return 0;
 
 }
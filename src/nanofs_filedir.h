@@ -26,46 +26,120 @@
 #define __NANOFS_FILEDIR__
 
 #include<nanofs.h>
+#include <pthread.h>
+#include "nanofs_dev.h"
+#include "nanofs_cache.h"
+#include "nanofs_dindex.h"
+#include "nanofs_dcache.h"
+#include "nanofs_acache.h"
+#include "nanofs_emap.h"
+#include "nanofs_stats.h"
 
 #define NANOFS_NODETYPEDIR  0
 #define NANOFS_NODETYPEDATA 1
 
 #define NANOFS_MAX_PATH (NANOFS_MAXFILENAME+1)*100
 
+/* Flags for nanofs_open_dev() */
+#define NANOFS_OPEN_DIRECT  0x01    ///< Bypass host page cache (O_DIRECT)
+
+/** Free nodes tried by nanofs_alloc_blocks() */
+#define NANOFS_ALLOC_SCAN   64
+/** Keys read at once from a B-tree directory by nanofs_read_dir() */
+#define NANOFS_READ_DIR_BATCH 64
+/** Data nodes of a file freed by nanofs_rm() itself, larger files are left
+ * to nanofs_reclaim() when 'h_orphans' is set */
+#define NANOFS_ORPHAN_MIN     8
+/** Data nodes freed by a call to nanofs_reclaim() in the background */
+#define NANOFS_RECLAIM_BATCH  64
+
 /** Handle for device operations */
 struct nanofs_fs_handle {
     char *h_dev_name;
-    int  h_fd;                      ///< Open device/file descriptor
+    struct nanofs_dev h_dev;        ///< Device and storage engine
     int  h_block_bits;              ///< Helper for shift bits
     struct nanofs_superblock h_sb;  ///< Copy of the device superblock
+    struct nanofs_sb_extra h_sbx;   ///< Extended superblock, zeroed if none
+    int h_journal;                  ///< Metadata goes through the journal
+    int h_dir_index;                ///< Large dirs have an on-disk index
+    int h_dir_shift;                ///< NANOFS_DIR_SLOT_BITS with packed
+                                    ///<   dir nodes, 0 otherwise
+    int h_inline;                   ///< Small files keep their data inline
+    int h_dir_btree;                ///< Large dirs are turned into B-trees
+    __u32 h_dir_fill;               ///< Block packing B-tree dirs children
+    int h_orphans;                  ///< Set by the caller that runs
+                                    ///<   nanofs_reclaim(), see nanofs_rm()
+    int h_file_size;                ///< Files keep their size in a metadata
+                                    ///<   block, see nanofs_get_file_size()
+    int h_extents;                  ///< Files have an extent index, see
+                                    ///<   nanofs_extent.c
+    __u32 h_defer_head;             ///< Nodes freed in the current journal
+    __u32 h_defer_tail;             ///<   group, see nanofs_push_free()
+    struct nanofs_cache h_cache;    ///< Node headers, write-back
+    struct nanofs_dindex h_dindex;  ///< Children of directories by name
+    struct nanofs_dcache h_dcache;  ///< See nanofs_lookup_absolute()
+    struct nanofs_acache h_acache;  ///< See nanofs_get_file_size()
+    struct nanofs_emap h_emap;      ///< See nanofs_seek_data()
+    int h_sb_dirty;                 ///< h_sb changed, see nanofs_commit()
+    int h_sb_lazy;                  ///< Do not commit h_sb on nanofs_unlock()
+    pthread_mutex_t h_lock;         ///< See nanofs_lock()
+    struct nanofs_stats h_stats;    ///< See nanofs_get_stats()
     int h_error;                    ///< Last operation error, 0 not error
 
 };
 
 
+/** Piece of file data stored in the device, see nanofs_read_segments() */
+struct nanofs_segment {
+    off_t  s_offset;    ///< Absolute offset in the device
+    size_t s_len;       ///< Length in bytes
+};
+
 /** Handle for files and dirs */
 struct nanofs_filedir_handle {
     __u32 f_blk_no;                     ///< Block number of dir entry
     struct nanofs_dir_node f_dir_node;  ///< File copy of dir entry
 };
 
+/** File to be created by nanofs_create_files() */
+struct nanofs_create_entry {
+    const char *c_name;     ///< Name in the directory
+    const char *c_data;     ///< Initial contents, may be NULL if c_size is 0
+    size_t c_size;
+    __u32 c_blk_no;         ///< Out, block number of the dir entry or 0
+};
+
 
 
 /* File system operations */
-int nanofs_open_dev(char *dev,struct nanofs_fs_handle *handle);
+int nanofs_open_dev(char *dev, int engine, int flags,
+        struct nanofs_fs_handle *handle);
 int nanofs_close_dev(struct nanofs_fs_handle *handle);
+int nanofs_sync(struct nanofs_fs_handle *handle);
+int nanofs_commit(struct nanofs_fs_handle *handle);
+void nanofs_lock(struct nanofs_fs_handle *handle);
+void nanofs_unlock(struct nanofs_fs_handle *handle);
+int nanofs_set_cache_size(struct nanofs_fs_handle *handle, size_t bytes);
 int nanofs_get_block_bits(struct nanofs_superblock *sb);
 long int nanofs_free(struct nanofs_fs_handle *fs_hd);
+void nanofs_get_stats(struct nanofs_fs_handle *handle,
+        struct nanofs_stats *st_out);
+void nanofs_reset_stats(struct nanofs_fs_handle *handle);
 
 /* File operations */
 int nanofs_create_file(struct nanofs_fs_handle *fs_hd, const char *file_path,
         struct nanofs_filedir_handle * fh_out);
+int nanofs_create_files(struct nanofs_fs_handle *fs_hd, const char *dir_path,
+        struct nanofs_create_entry vec[], int count);
 int nanofs_truncate(struct nanofs_fs_handle *fs_hd,
         struct nanofs_filedir_handle *fh, size_t size);
 int nanofs_read(struct nanofs_fs_handle *fs_hd,struct nanofs_filedir_handle *fh,
         char *buf, size_t size, off_t offset);
 int nanofs_write(struct nanofs_fs_handle *fs_hd, struct nanofs_filedir_handle *fh,
         const char *buf, size_t size, off_t offset);
+int nanofs_read_segments(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *fh, size_t size, off_t offset,
+        struct nanofs_segment seg_vec[], int vec_size);
 
 long int nanofs_get_file_size(struct nanofs_fs_handle *hd,
         struct nanofs_filedir_handle *fh);
@@ -76,6 +150,10 @@ long int nanofs_get_file_size(struct nanofs_fs_handle *hd,
 int nanofs_list_dir(struct nanofs_fs_handle *hd,
         struct nanofs_filedir_handle *dir_hd,
         struct nanofs_filedir_handle fh_vec[], int vec_size);
+int nanofs_read_dir(struct nanofs_fs_handle *hd,
+        struct nanofs_filedir_handle *dir_hd, off_t cursor,
+        struct nanofs_filedir_handle fh_vec[], off_t next_vec[],
+        int vec_size);
 int nanofs_lookup(struct nanofs_fs_handle *fs_hd, char *file_name,
         struct nanofs_filedir_handle *dir_hd,
         struct nanofs_filedir_handle *dir_hd_out);
@@ -90,6 +168,8 @@ int nanofs_lookup_absolute(struct nanofs_fs_handle *fs_hd,
 
 int nanofs_rm(struct nanofs_fs_handle *fs_hd,char *file_name,
         struct nanofs_filedir_handle *parent_dir_hd);
+int nanofs_rename(struct nanofs_fs_handle *fs_hd, const char *old_path,
+        const char *new_path, struct nanofs_filedir_handle *fh_out);
 
 
 /* Low level utilities */
@@ -97,6 +177,21 @@ int nanofs_read_dir_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
         struct nanofs_dir_node *dn_out);
 int nanofs_read_data_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
         struct nanofs_data_node *dn_out);
+int nanofs_write_dir_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
+        struct nanofs_dir_node *dn);
+int nanofs_write_data_node_b(struct nanofs_fs_handle *fs_hd,__u32 blk_no,
+        struct nanofs_data_node *dn);
+__u32 nanofs_blocks_for_size(struct nanofs_fs_handle *fs_hd,__u32 size);
+int nanofs_store_sb(struct nanofs_fs_handle *fs_hd);
+int nanofs_free_deferred(struct nanofs_fs_handle *fs_hd);
+int nanofs_reclaim(struct nanofs_fs_handle *fs_hd, int max);
+__u32 nanofs_alloc_blocks(struct nanofs_fs_handle *fs_hd, __u32 blocks);
+int nanofs_free_blocks(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        __u32 blocks);
+int nanofs_read_file_meta(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_file_meta *m);
+int nanofs_write_file_meta(struct nanofs_fs_handle *fs_hd, __u32 blk_no,
+        struct nanofs_file_meta *m);
 
 
 
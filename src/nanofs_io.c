@@ -32,6 +32,7 @@
 
 #include <asm/types.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
@@ -40,16 +41,24 @@
 #include "log.h"
 #include "nanofs.h"
 #include "nanofs_io.h"
+#include "nanofs_dev.h"
 
+/* All the functions below use positional I/O through the device engine
+ * (see nanofs_dev.c), there is no shared file offset. Each node access costs
+ * a single engine call and the functions can be called from several threads
+ * sharing the same device. Inside a batch (nanofs_dev_batch_begin) writes
+ * are queued and reach the device when the batch ends.
+ * */
 
 
 /** Be carefully with memory aligment in C structs
  * @return  0 on success | 'errno' from write on error.
  * */
-int nanofs_write_sb(int fd, off_t offset, struct nanofs_superblock *sb)
+int nanofs_write_sb(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_superblock *sb)
 {
     int size = sizeof ( struct nanofs_superblock );
-    int res = nanofs_write_dev ( fd, offset,  sb, size);
+    int res = nanofs_write_dev ( dev, offset,  sb, size);
     // Superblock struct is mem aligned, do direct write
     if(res != size)
     {
@@ -62,85 +71,140 @@ int nanofs_write_sb(int fd, off_t offset, struct nanofs_superblock *sb)
 /**
  * @return 0 on success, -1 on fail
  */
-int nanofs_read_sb(int fd, off_t offset,struct nanofs_superblock *sb)
+int nanofs_read_sb(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_superblock *sb)
 {
     int size = sizeof ( struct nanofs_superblock );
-    if ( lseek64 ( fd, offset, SEEK_SET ) != offset )
+    if (nanofs_dev_pread ( dev, offset, sb, size) != size)
     {
-        log_error("nanofs_read_sb: cannot read superblock, lseek failed: '%s'",
+        log_error("nanofs_read_sb: cannot read superblock: '%s'",
                 strerror ( errno ));
         return -1;
     }
-    if (read ( fd, sb, size) != size)
+    return 0;
+}
+
+/** Read the extended superblock that follows the superblock, fields beyond
+ * 's_extra_size' are set to 0
+ * @return 0 on success, -1 on fail
+ */
+int nanofs_read_sb_extra(struct nanofs_dev *dev,
+        const struct nanofs_superblock *sb, struct nanofs_sb_extra *sbx)
+{
+    int size = sb->s_extra_size;
+
+    memset(sbx, 0, sizeof(struct nanofs_sb_extra));
+    if (size > (int)sizeof(struct nanofs_sb_extra))
+        size = sizeof(struct nanofs_sb_extra);
+    if (size > 0 && nanofs_dev_pread(dev, NANOFS_SB_SIZE, sbx, size) != size)
     {
-        log_error("nanofs_read_sb: cannot read superblock");
+        log_error("nanofs_read_sb_extra: cannot read extended superblock");
         return -1;
     }
     return 0;
 }
 
-/** Write dir node to device
- * @return 0 on success | -1 on error, 'errno' can be used
+/** Encode superblock and extended superblock in their on-disk layout,
+ * the gap between them is zeroed
+ * @param buf At least NANOFS_SB_SIZE + sizeof(struct nanofs_sb_extra) bytes
+ * @return bytes used in 'buf'
  * */
-int nanofs_write_dir_node(int fd, off_t offset, struct nanofs_dir_node *dn)
+int nanofs_pack_sb(__u8 *buf, const struct nanofs_superblock *sb,
+        const struct nanofs_sb_extra *sbx)
 {
-    __u8 buf[NANOFS_HEADER_DIR_NODE_SIZE];
+    int size = sb->s_extra_size;
+
+    if (size > (int)sizeof(struct nanofs_sb_extra))
+        size = sizeof(struct nanofs_sb_extra);
+    memset(buf, 0, NANOFS_SB_SIZE);
+    memcpy(buf, sb, sizeof(struct nanofs_superblock));
+    if (size == 0)
+        return sizeof(struct nanofs_superblock);
+    memcpy(&buf[NANOFS_SB_SIZE], sbx, size);
+    return NANOFS_SB_SIZE + size;
+}
 
+/** Encode a dir node in its on-disk layout
+ * @param buf At least NANOFS_HEADER_DIR_NODE_SIZE + d_fname_len bytes
+ * @return bytes used in 'buf'
+ * */
+int nanofs_pack_dir_node(__u8 *buf, const struct nanofs_dir_node *dn)
+{
     buf[0] = dn->d_flags;
     memcpy(&buf[1],&(dn->d_next_ptr),4);
     memcpy(&buf[5],&(dn->d_data_ptr),4);
     memcpy(&buf[9],&(dn->d_meta_ptr),4);
     buf[13] = dn->d_fname_len;
+    memcpy(&buf[NANOFS_HEADER_DIR_NODE_SIZE], dn->d_fname, dn->d_fname_len);
+    return NANOFS_HEADER_DIR_NODE_SIZE + dn->d_fname_len;
+}
 
-    if ( lseek64 ( fd, offset, SEEK_SET ) != offset )
+/** Decode a dir node from its on-disk layout
+ * @param len Bytes available in 'buf'
+ * @return 0 on success | -1 when 'buf' does not hold the whole node
+ * */
+int nanofs_unpack_dir_node(const __u8 *buf, size_t len,
+        struct nanofs_dir_node *dn)
+{
+    if (len < NANOFS_HEADER_DIR_NODE_SIZE)
         return -1;
 
-    if ( write( fd, buf, NANOFS_HEADER_DIR_NODE_SIZE)
-            != NANOFS_HEADER_DIR_NODE_SIZE)
+    dn->d_flags = buf[0];
+    memcpy(&dn->d_next_ptr, &buf [1], 4);
+    memcpy(&dn->d_data_ptr, &buf [5], 4);
+    memcpy(&dn->d_meta_ptr, &buf [9], 4);
+    dn->d_fname_len = buf[13];
+
+    if (len < (size_t)NANOFS_HEADER_DIR_NODE_SIZE + dn->d_fname_len)
         return -1;
 
+    memcpy(dn->d_fname, &buf[NANOFS_HEADER_DIR_NODE_SIZE], dn->d_fname_len);
+    dn->d_fname[dn->d_fname_len] = 0;
+    return 0;
+}
+
+/** Write dir node to device
+ * @return 0 on success | -1 on error, 'errno' can be used
+ * */
+int nanofs_write_dir_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_dir_node *dn)
+{
+    __u8 buf[NANOFS_HEADER_DIR_NODE_SIZE + NANOFS_MAXFILENAME];
+    int size = nanofs_pack_dir_node(buf, dn);
 
-    if(write ( fd, &(dn->d_fname), dn->d_fname_len) != dn->d_fname_len)
+    if (nanofs_dev_pwrite ( dev, offset, buf, size) != size)
         return -1;
 
     return 0;
 }
 
 /** Read dir_node from device, low level method
+ *
+ * Header and name are fetched with a single read of the maximum dir_node
+ * size, a short read is only accepted when it holds the whole name.
  *
  * @return -1 on error | 0 on success
  */
-int nanofs_read_dir_node(int fd, off_t offset,struct nanofs_dir_node *dn)
+int nanofs_read_dir_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_dir_node *dn)
 {
-    __u8 buf[NANOFS_HEADER_DIR_NODE_SIZE];
-
-    if ( lseek64 ( fd, offset, SEEK_SET ) != offset )
-        return -1;
+    __u8 buf[NANOFS_HEADER_DIR_NODE_SIZE + NANOFS_MAXFILENAME];
+    ssize_t res;
 
-    if (read(fd, &buf, NANOFS_HEADER_DIR_NODE_SIZE )
-            != NANOFS_HEADER_DIR_NODE_SIZE)
+    res = nanofs_dev_pread(dev, offset, buf, sizeof(buf));
+    if (res < 0)
         return -1;
-
-    dn->d_flags = buf[0];
-    memcpy(&dn->d_next_ptr, &buf [1], 4);
-    memcpy(&dn->d_data_ptr, &buf [5], 4);
-    memcpy(&dn->d_meta_ptr, &buf [9], 4);
-    dn->d_fname_len = buf[13];
-
-    if (read(fd,dn->d_fname,dn->d_fname_len) != dn->d_fname_len)
-        return -1;
-
-    dn->d_fname[dn->d_fname_len] = 0;
-    return 0;
+    return nanofs_unpack_dir_node(buf, res, dn);
 }
 
 /** Write the header of the 'data_node'
  * @return 0 on success | -1 on error
  * */
-int nanofs_write_data_node(int fd, off_t offset, struct nanofs_data_node *dn)
+int nanofs_write_data_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_data_node *dn)
 {
     // Direct call to write, struct_data_node is mem aligned
-    int res = nanofs_write_dev ( fd, offset,  dn,
+    int res = nanofs_write_dev ( dev, offset,  dn,
             sizeof(struct nanofs_data_node));
     if(res != sizeof(struct nanofs_data_node))
     {
@@ -155,9 +219,10 @@ int nanofs_write_data_node(int fd, off_t offset, struct nanofs_data_node *dn)
  * @return -1 on fail, 0 on success
  * */
 
-int nanofs_read_data_node(int fd, off_t offset,struct nanofs_data_node *dn)
+int nanofs_read_data_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_data_node *dn)
 {
-    int res = nanofs_read_dev ( fd, offset,  dn,
+    int res = nanofs_read_dev ( dev, offset,  dn,
             sizeof(struct nanofs_data_node));
     if(res != sizeof(struct nanofs_data_node))
     {
@@ -173,11 +238,10 @@ int nanofs_read_data_node(int fd, off_t offset,struct nanofs_data_node *dn)
 /** Writes size bytes from offset
 *  @return bytes written on success | -1 on failure
 */
-int nanofs_write_dev ( int fd, off_t offset,const void *buf, int size )
+int nanofs_write_dev ( struct nanofs_dev *dev, off_t offset,
+        const void *buf, int size )
 {
-    if ( lseek64 ( fd, offset, SEEK_SET ) != offset )
-        return -1;
-    if ( write ( fd, buf, size ) != size )
+    if ( nanofs_dev_pwrite ( dev, offset, buf, size ) != size )
         return -1;
     return size;
 }
@@ -185,16 +249,40 @@ int nanofs_write_dev ( int fd, off_t offset,const void *buf, int size )
 /** Read size bytes from offset
  *  @return bytes read on success | -1 on failure
  */
-int nanofs_read_dev ( int fd, off_t offset,void *buf, int size )
+int nanofs_read_dev ( struct nanofs_dev *dev, off_t offset,void *buf,
+        int size )
 {
-    if ( lseek64 ( fd, offset, SEEK_SET ) != offset )
-        return -1;
-    if ( read ( fd, buf, size ) != size )
+    if ( nanofs_dev_pread ( dev, offset, buf, size ) != size )
         return -1;
     return size;
 }
 
+/** Gather write of 'iovcnt' buffers starting at offset
+ *  @return bytes written on success | -1 on failure
+ */
+int nanofs_writev_dev ( struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt )
+{
+    ssize_t size = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    if ( nanofs_dev_pwritev ( dev, offset, iov, iovcnt ) != size )
+        return -1;
+    return size;
+}
 
-
-
-
+/** Scatter read of 'iovcnt' buffers starting at offset
+ *  @return bytes read on success | -1 on failure
+ */
+int nanofs_readv_dev ( struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt )
+{
+    ssize_t size = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+    if ( nanofs_dev_preadv ( dev, offset, iov, iovcnt ) != size )
+        return -1;
+    return size;
+}
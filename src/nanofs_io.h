@@ -25,24 +25,48 @@
 #define __NANOFS_IO_H__
 
 struct nanofs_superblock;
+struct nanofs_sb_extra;
 struct nanofs_dir_node;
 struct nanofs_data_node;
+struct iovec;
+struct nanofs_dev;
 
-/* Low level device access 
+/* Low level device access, positional I/O through the device engine
  * All functions return 0 on success, < 0 on fail */
 
-int nanofs_read_sb(int fd, off_t offset,struct nanofs_superblock *sb);
-int nanofs_write_sb(int fd, off_t offset, struct nanofs_superblock *sb);
+int nanofs_read_sb(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_superblock *sb);
+int nanofs_write_sb(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_superblock *sb);
+int nanofs_read_sb_extra(struct nanofs_dev *dev,
+        const struct nanofs_superblock *sb, struct nanofs_sb_extra *sbx);
+int nanofs_pack_sb(__u8 *buf, const struct nanofs_superblock *sb,
+        const struct nanofs_sb_extra *sbx);
 
-int nanofs_read_dir_node(int fd, off_t offset, struct nanofs_dir_node *dn);
-int nanofs_read_data_node(int fd, off_t offset, struct nanofs_data_node *db);
+int nanofs_read_dir_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_dir_node *dn);
+int nanofs_read_data_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_data_node *db);
 
 
-int nanofs_write_dir_node(int fd, off_t offset, struct nanofs_dir_node *dn);
-int nanofs_write_data_node(int fd, off_t offset, struct nanofs_data_node *db);
+int nanofs_write_dir_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_dir_node *dn);
+int nanofs_write_data_node(struct nanofs_dev *dev, off_t offset,
+        struct nanofs_data_node *db);
+
+/* On-disk layout of dir nodes */
+int nanofs_pack_dir_node(__u8 *buf, const struct nanofs_dir_node *dn);
+int nanofs_unpack_dir_node(const __u8 *buf, size_t len,
+        struct nanofs_dir_node *dn);
 
 /* Raw write/read to device*/
-int nanofs_write_dev( int fd, off_t offset, const void *buf, int size );
-int nanofs_read_dev ( int fd, off_t offset, void *buf, int size );
+int nanofs_write_dev( struct nanofs_dev *dev, off_t offset, const void *buf,
+        int size );
+int nanofs_read_dev ( struct nanofs_dev *dev, off_t offset, void *buf,
+        int size );
+int nanofs_writev_dev( struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt );
+int nanofs_readv_dev ( struct nanofs_dev *dev, off_t offset,
+        const struct iovec *iov, int iovcnt );
 
 #endif
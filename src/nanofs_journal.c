@@ -0,0 +1,369 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_journal.c
+    @version 0.4
+    @brief Write-ahead journal of metadata
+
+    The journal is a region of blocks reserved by mkfs.nanofs and described
+    in the extended superblock. Metadata changes (node headers and the
+    superblock) stay pinned in the header cache until a group commit, which
+    is done at the end of the operation that fills the group, on
+    nanofs_sync() and on nanofs_close_dev():
+
+      1. The dirty cache entries and the superblock are written as a single
+         record at the journal head, then the device is flushed. File data
+         written before is also stable at this point.
+      2. The same bytes are written in place (checkpoint), the superblock
+         copy points the journal head past the record, then the device is
+         flushed again so the record is never needed after this point.
+
+    Nodes freed in a group are only returned to the free list by its commit,
+    so file data never overwrites metadata the device still relies on.
+
+    A crash leaves at most one record not checkpointed. nanofs_open_dev()
+    replays it when its magic, id, sequence and CRC are right, a torn record
+    is ignored and the filesystem is seen as it was before the group.
+
+******************************************************************************/
+
+#define _LARGEFILE64_SOURCE
+
+#include <config.h>
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "nanofs.h"
+#include "nanofs_io.h"
+#include "nanofs_dev.h"
+#include "nanofs_filedir.h"
+#include "nanofs_journal.h"
+#include "nanofs_trace.h"
+
+/** Bytes of a record with the superblock and no other entry */
+#define JOURNAL_BASE_SIZE (sizeof(struct nanofs_journal_header) + \
+        sizeof(struct nanofs_journal_entry) + NANOFS_SB_SIZE + \
+        sizeof(struct nanofs_sb_extra))
+
+/** CRC32 (IEEE 802.3), half-byte table */
+__u32 nanofs_crc32(__u32 crc, const void *buf, size_t size)
+{
+    static const __u32 table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const __u8 *p = buf;
+
+    crc = ~crc;
+    while (size-- > 0)
+    {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+static __u32 record_crc(struct nanofs_journal_header *jh, const __u8 *data)
+{
+    struct nanofs_journal_header h = *jh;
+
+    h.j_crc = 0;
+    return nanofs_crc32(nanofs_crc32(0, &h, sizeof(h)), data, jh->j_bytes);
+}
+
+/** Check the journal fields of the extended superblock
+ * @return 0 when they are valid | -1 otherwise */
+int nanofs_journal_check(const struct nanofs_sb_extra *sbx, __u32 fs_size)
+{
+    if (sbx->s_journal_ptr < 2 ||
+            sbx->s_journal_blocks < NANOFS_JOURNAL_MIN_BLOCKS ||
+            sbx->s_journal_blocks > fs_size ||
+            sbx->s_journal_ptr > fs_size - sbx->s_journal_blocks ||
+            sbx->s_journal_head >= sbx->s_journal_blocks)
+        return -1;
+    return 0;
+}
+
+/** Read the record expected at block 'pos' of the journal, its sequence
+ * must be 's_journal_seq'
+ * @return the record, to be freed by the caller | NULL when there is no
+ *      valid record */
+__u8 *nanofs_journal_read(struct nanofs_dev *dev, int block_bits,
+        const struct nanofs_sb_extra *sbx, __u32 pos)
+{
+    struct nanofs_journal_header jh;
+    off_t offset = (off_t)(sbx->s_journal_ptr + pos) << block_bits;
+    size_t size;
+    __u8 *rec;
+
+    if (pos >= sbx->s_journal_blocks ||
+            nanofs_dev_pread(dev, offset, &jh, sizeof(jh)) != sizeof(jh))
+        return NULL;
+    if (jh.j_magic != NANOFS_JOURNAL_MAGIC || jh.j_id != sbx->s_journal_id ||
+            jh.j_seq != sbx->s_journal_seq || jh.j_blocks == 0 ||
+            jh.j_blocks > sbx->s_journal_blocks - pos)
+        return NULL;
+    size = (size_t)jh.j_blocks << block_bits;
+    if (sizeof(jh) + jh.j_bytes > size)
+        return NULL;
+    rec = malloc(size);
+    if (rec == NULL)
+        return NULL;
+    if (nanofs_dev_pread(dev, offset, rec, size) != (ssize_t)size ||
+            record_crc(&jh, rec + sizeof(jh)) != jh.j_crc)
+    {
+        free(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+/** Write the entries of a record in place
+ * @return 0 on success | -1 on error */
+static int journal_apply(struct nanofs_fs_handle *hd, const __u8 *rec)
+{
+    struct nanofs_journal_header jh;
+    struct nanofs_journal_entry je;
+    const __u8 *p, *end;
+    __u32 i;
+
+    memcpy(&jh, rec, sizeof(jh));
+    p = rec + sizeof(jh);
+    end = p + jh.j_bytes;
+    for (i = 0; i < jh.j_count; i++)
+    {
+        if (end - p < (long)sizeof(je))
+            return -1;
+        memcpy(&je, p, sizeof(je));
+        p += sizeof(je);
+        if (end - p < je.e_len || je.e_blk_no >= hd->h_sb.s_fs_size)
+            return -1;
+        if (nanofs_write_dev(&hd->h_dev,
+                ((off_t)(je.e_blk_no) << hd->h_block_bits) + je.e_off,
+                p, je.e_len) != je.e_len)
+            return -1;
+        p += je.e_len;
+    }
+    return 0;
+}
+
+/** Replay the records left by a crash, called when the device is opened
+ * and before any metadata is read
+ * @return 0 on success | -1 on error */
+int nanofs_journal_replay(struct nanofs_fs_handle *hd)
+{
+    struct nanofs_sb_extra *sbx = &hd->h_sbx;
+    __u32 seq;
+    __u8 *rec;
+    int records = 0;
+
+    for (;;)
+    {
+        rec = nanofs_journal_read(&hd->h_dev, hd->h_block_bits, sbx,
+                sbx->s_journal_head);
+        // The writer starts over when the record does not fit at the end
+        if (rec == NULL && sbx->s_journal_head != 0)
+            rec = nanofs_journal_read(&hd->h_dev, hd->h_block_bits, sbx, 0);
+        if (rec == NULL)
+            break;
+        seq = sbx->s_journal_seq;
+        if (journal_apply(hd, rec) != 0)
+        {
+            log_error("nanofs_journal_replay: bad journal record %u", seq);
+            free(rec);
+            return -1;
+        }
+        free(rec);
+        records++;
+        // The record carries the superblock pointing past it
+        if (nanofs_read_sb(&hd->h_dev, 0, &hd->h_sb) != 0 ||
+                nanofs_read_sb_extra(&hd->h_dev, &hd->h_sb, sbx) != 0 ||
+                sbx->s_journal_seq != seq + 1 ||
+                nanofs_journal_check(sbx, hd->h_sb.s_fs_size) != 0)
+        {
+            log_error("nanofs_journal_replay: bad superblock in record %u",
+                    seq);
+            return -1;
+        }
+    }
+    if (records > 0)
+    {
+        log_debug("nanofs_journal_replay: %d records replayed", records);
+        if (nanofs_dev_flush(&hd->h_dev) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/** Write the dirty headers and the superblock in place and flush
+ * @return 0 on success | -1 on error */
+static int journal_checkpoint(struct nanofs_fs_handle *hd)
+{
+    if (nanofs_cache_flush(&hd->h_cache) != 0 || nanofs_store_sb(hd) != 0 ||
+            nanofs_dev_flush(&hd->h_dev) != 0)
+        return -1;
+    hd->h_sb_dirty = 0;
+    return 0;
+}
+
+static __u8 *put_entry(__u8 *p, __u32 blk_no, __u16 off, const void *buf,
+        __u16 len)
+{
+    struct nanofs_journal_entry je;
+
+    je.e_blk_no = blk_no;
+    je.e_off = off;
+    je.e_len = len;
+    memcpy(p, &je, sizeof(je));
+    memcpy(p + sizeof(je), buf, len);
+    return p + sizeof(je) + len;
+}
+
+/** Commit the current group: log it as one record, then checkpoint it
+ * @return 0 on success | -1 on error and h_error is set */
+int nanofs_journal_commit(struct nanofs_fs_handle *hd)
+{
+    struct nanofs_sb_extra *sbx = &hd->h_sbx;
+    struct nanofs_journal_header jh;
+    struct nanofs_cache_entry **vec, *e;
+    __u8 sb_buf[NANOFS_SB_SIZE + sizeof(struct nanofs_sb_extra)];
+    __u32 pos, blocks, old_seq, old_head;
+    size_t bytes;
+    __u8 *rec, *p;
+    int n, i, res;
+
+    if (nanofs_free_deferred(hd) != 0)
+    {
+        hd->h_error = EIO;
+        return -1;
+    }
+    if (hd->h_cache.c_ndirty == 0 && !hd->h_sb_dirty)
+        return 0;
+    n = nanofs_cache_dirty(&hd->h_cache, &vec);
+    if (n < 0)
+    {
+        hd->h_error = ENOMEM;
+        return -1;
+    }
+    bytes = JOURNAL_BASE_SIZE;
+    for (i = 0; i < n; i++)
+        bytes += sizeof(struct nanofs_journal_entry) +
+                vec[i]->e_dirty_hi - vec[i]->e_dirty_lo;
+    blocks = nanofs_blocks_for_size(hd, bytes);
+    if (blocks > sbx->s_journal_blocks)
+    {
+        free(vec);
+        log_error("nanofs_journal_commit: %u blocks do not fit in the "
+                "journal, written in place", blocks);
+        if (journal_checkpoint(hd) != 0)
+        {
+            hd->h_error = EIO;
+            return -1;
+        }
+        return 0;
+    }
+
+    pos = sbx->s_journal_head;
+    if (pos + blocks > sbx->s_journal_blocks)
+        pos = 0;
+    // Superblock as it will be after the checkpoint
+    old_seq = sbx->s_journal_seq;
+    old_head = sbx->s_journal_head;
+    sbx->s_journal_seq = old_seq + 1;
+    sbx->s_journal_head = pos + blocks;
+    if (sbx->s_journal_head == sbx->s_journal_blocks)
+        sbx->s_journal_head = 0;
+
+    rec = calloc(blocks, (size_t)1 << hd->h_block_bits);
+    if (rec == NULL)
+    {
+        free(vec);
+        sbx->s_journal_seq = old_seq;
+        sbx->s_journal_head = old_head;
+        hd->h_error = ENOMEM;
+        return -1;
+    }
+    p = put_entry(rec + sizeof(jh), 0, 0, sb_buf,
+            nanofs_pack_sb(sb_buf, &hd->h_sb, sbx));
+    for (i = 0; i < n; i++)
+    {
+        e = vec[i];
+        p = put_entry(p, e->e_blk_no, e->e_dirty_lo,
+                e->e_data + e->e_dirty_lo, e->e_dirty_hi - e->e_dirty_lo);
+    }
+    free(vec);
+    jh.j_magic = NANOFS_JOURNAL_MAGIC;
+    jh.j_id = sbx->s_journal_id;
+    jh.j_seq = old_seq;
+    jh.j_blocks = blocks;
+    jh.j_count = n + 1;
+    jh.j_bytes = p - (rec + sizeof(jh));
+    jh.j_crc = record_crc(&jh, rec + sizeof(jh));
+    memcpy(rec, &jh, sizeof(jh));
+    NANOFS_STAT_INC(&hd->h_stats, st_journal_commits);
+    NANOFS_STAT_ADD(&hd->h_stats, st_journal_blocks, blocks);
+    NANOFS_TRACE(NANOFS_EV_COMMIT, 0, sbx->s_journal_ptr + pos,
+            blocks << hd->h_block_bits, 0, 0);
+
+    res = nanofs_write_dev(&hd->h_dev,
+            (off_t)(sbx->s_journal_ptr + pos) << hd->h_block_bits, rec,
+            blocks << hd->h_block_bits);
+    free(rec);
+    if (res != (int)(blocks << hd->h_block_bits) ||
+            nanofs_dev_flush(&hd->h_dev) != 0)
+    {
+        // Nothing was changed in place, the group stays pinned
+        log_error("nanofs_journal_commit: cannot write journal record");
+        sbx->s_journal_seq = old_seq;
+        sbx->s_journal_head = old_head;
+        hd->h_error = EIO;
+        return -1;
+    }
+    if (journal_checkpoint(hd) != 0)
+    {
+        // Replayed from the record on the next mount
+        log_error("nanofs_journal_commit: checkpoint of record %u failed",
+                old_seq);
+        hd->h_error = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/** Tell whether the current group should be committed at the end of the
+ * operation: its record could take more than half of the journal, or the
+ * pinned headers took the cache over its cap
+ * */
+int nanofs_journal_full(struct nanofs_fs_handle *hd)
+{
+    struct nanofs_cache *c = &hd->h_cache;
+    size_t worst;
+
+    if (c->c_ndirty == 0)
+        return 0;
+    worst = JOURNAL_BASE_SIZE + c->c_ndirty *
+            (sizeof(struct nanofs_journal_entry) + NANOFS_CACHE_DATA);
+    return c->c_count > c->c_max ||
+            worst > ((size_t)hd->h_sbx.s_journal_blocks << hd->h_block_bits) / 2;
+}
@@ -0,0 +1,47 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_journal.h
+    @version 0.4
+    @brief Write-ahead journal of metadata
+
+******************************************************************************/
+
+#ifndef __NANOFS_JOURNAL_H__
+#define __NANOFS_JOURNAL_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+struct nanofs_dev;
+struct nanofs_sb_extra;
+struct nanofs_fs_handle;
+
+/** Default journal size in blocks used by mkfs.nanofs */
+#define NANOFS_JOURNAL_DEFAULT_BLOCKS 1024
+/** Smallest journal accepted, in blocks */
+#define NANOFS_JOURNAL_MIN_BLOCKS     8
+
+int nanofs_journal_check(const struct nanofs_sb_extra *sbx, __u32 fs_size);
+int nanofs_journal_replay(struct nanofs_fs_handle *hd);
+int nanofs_journal_commit(struct nanofs_fs_handle *hd);
+int nanofs_journal_full(struct nanofs_fs_handle *hd);
+
+__u8 *nanofs_journal_read(struct nanofs_dev *dev, int block_bits,
+        const struct nanofs_sb_extra *sbx, __u32 pos);
+__u32 nanofs_crc32(__u32 crc, const void *buf, size_t size);
+
+#endif
@@ -0,0 +1,90 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_stats.c
+    @version 0.4
+    @brief I/O and operation counters
+
+******************************************************************************/
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdio.h>
+
+#include "nanofs_stats.h"
+
+static const char *op_names[NANOFS_OP_MAX] = {
+    "lookup", "read", "write", "alloc", "free", "truncate",
+    "mkdir", "create", "rm", "rmdir", "list", "sync", "rename"
+};
+
+/** @return name of a NANOFS_OP_* operation */
+const char *nanofs_op_name(int op)
+{
+    if (op < 0 || op >= NANOFS_OP_MAX)
+        return "unknown";
+    return op_names[op];
+}
+
+/** Format the counters as "name value" lines
+ * @return length of the text, as snprintf(), it is truncated when it is
+ *      not less than 'size' */
+int nanofs_stats_format(const struct nanofs_stats *st, char *buf,
+        size_t size)
+{
+    size_t len = 0;
+    int i, res;
+
+#define FMT(name, value) do { \
+        res = snprintf(buf + (len < size ? len : size), \
+                len < size ? size - len : 0, "%s %llu\n", name, \
+                (unsigned long long)(value)); \
+        if (res < 0) \
+            return -1; \
+        len += res; \
+    } while (0)
+
+    FMT("dev_reads", st->st_dev_reads);
+    FMT("dev_read_bytes", st->st_dev_read_bytes);
+    FMT("dev_writes", st->st_dev_writes);
+    FMT("dev_write_bytes", st->st_dev_write_bytes);
+    FMT("dev_flushes", st->st_dev_flushes);
+    FMT("dev_batches", st->st_dev_batches);
+    FMT("node_reads", st->st_node_reads);
+    FMT("node_writes", st->st_node_writes);
+    FMT("cache_hits", st->st_cache_hits);
+    FMT("cache_misses", st->st_cache_misses);
+    FMT("cache_writebacks", st->st_cache_writebacks);
+    FMT("sb_writes", st->st_sb_writes);
+    FMT("journal_commits", st->st_journal_commits);
+    FMT("journal_blocks", st->st_journal_blocks);
+    FMT("dcache_hits", st->st_dcache_hits);
+    FMT("dcache_misses", st->st_dcache_misses);
+    FMT("acache_hits", st->st_acache_hits);
+    FMT("acache_misses", st->st_acache_misses);
+    FMT("fsize_meta", st->st_fsize_meta);
+    FMT("emap_hits", st->st_emap_hits);
+    FMT("extent_seeks", st->st_extent_seeks);
+    for (i = 0; i < NANOFS_OP_MAX; i++)
+    {
+        char name[32];
+
+        snprintf(name, sizeof(name), "op_%s", op_names[i]);
+        FMT(name, st->st_ops[i]);
+    }
+#undef FMT
+    return len;
+}
@@ -0,0 +1,89 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_stats.h
+    @version 0.4
+    @brief I/O and operation counters
+
+******************************************************************************/
+
+#ifndef __NANOFS_STATS_H__
+#define __NANOFS_STATS_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/* Operations counted in st_ops[] */
+#define NANOFS_OP_LOOKUP    0   ///< Name searches in a directory
+#define NANOFS_OP_READ      1
+#define NANOFS_OP_WRITE     2
+#define NANOFS_OP_ALLOC     3   ///< Dir and data nodes allocated
+#define NANOFS_OP_FREE      4   ///< Dir and data nodes freed
+#define NANOFS_OP_TRUNCATE  5
+#define NANOFS_OP_MKDIR     6
+#define NANOFS_OP_CREATE    7
+#define NANOFS_OP_RM        8
+#define NANOFS_OP_RMDIR     9
+#define NANOFS_OP_LIST      10
+#define NANOFS_OP_SYNC      11
+#define NANOFS_OP_RENAME    12
+#define NANOFS_OP_MAX       13
+
+/** Counters of a filesystem handle, see nanofs_get_stats(). They are
+ * updated without atomics, callers sharing a handle must hold its lock.
+ * */
+struct nanofs_stats {
+    /* Device requests, counted by the nanofs_dev_* wrappers */
+    __u64 st_dev_reads;
+    __u64 st_dev_read_bytes;
+    __u64 st_dev_writes;
+    __u64 st_dev_write_bytes;
+    __u64 st_dev_flushes;
+    __u64 st_dev_batches;       ///< Batches submitted, not empty
+
+    /* Metadata */
+    __u64 st_node_reads;        ///< Headers read, steps walking node lists
+    __u64 st_node_writes;       ///< Headers written, cached or not
+    __u64 st_cache_hits;
+    __u64 st_cache_misses;
+    __u64 st_cache_writebacks;  ///< Dirty headers written to the device
+    __u64 st_sb_writes;         ///< Superblock written in place
+    __u64 st_journal_commits;
+    __u64 st_journal_blocks;    ///< Blocks of journal records written
+    __u64 st_dcache_hits;       ///< Paths resolved by nanofs_lookup_absolute()
+    __u64 st_dcache_misses;     ///<   with one probe, or walked
+    __u64 st_acache_hits;       ///< File sizes known by nanofs_get_file_size()
+    __u64 st_acache_misses;     ///<   or not
+    __u64 st_fsize_meta;        ///< Sizes read from the file metadata on
+                                ///<   a miss, the rest walk the data chain
+    __u64 st_emap_hits;         ///< Reads and writes starting from the
+                                ///<   extent map of the file
+    __u64 st_extent_seeks;      ///< Reads and writes starting from the
+                                ///<   extent index of the file
+
+    __u64 st_ops[NANOFS_OP_MAX];
+};
+
+/** Add 'n' to a counter, 'st' may be NULL */
+#define NANOFS_STAT_ADD(st, field, n) \
+    do { if ((st) != NULL) (st)->field += (n); } while (0)
+#define NANOFS_STAT_INC(st, field) NANOFS_STAT_ADD(st, field, 1)
+
+const char *nanofs_op_name(int op);
+int nanofs_stats_format(const struct nanofs_stats *st, char *buf,
+        size_t size);
+
+#endif
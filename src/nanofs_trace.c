@@ -0,0 +1,131 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_trace.c
+    @version 0.4
+    @brief Binary trace of operations and device requests
+
+******************************************************************************/
+
+/* The ring is shared by all the threads of the process. A slot is taken
+ * with an atomic increment and filled without locks, a dump taken while
+ * operations run may show a few events half written.
+ * */
+
+#include <config.h>
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "nanofs_trace.h"
+
+static const char *event_names[NANOFS_EV_MAX] = {
+    "none", "getattr", "open", "read", "read_buf", "write", "create",
+    "mkdir", "unlink", "rmdir", "truncate", "readdir", "fsync", "alloc",
+    "free", "commit", "dev_read", "dev_write", "dev_flush", "rename"
+};
+
+/** @return name of a NANOFS_EV_* event */
+const char *nanofs_trace_event_name(int event)
+{
+    if (event < 0 || event >= NANOFS_EV_MAX)
+        return "unknown";
+    return event_names[event];
+}
+
+/** FNV-1a hash of a path, paths are not stored in the trace
+ * @return the hash | 0 for NULL
+ * */
+__u32 nanofs_trace_hash(const char *path)
+{
+    __u32 h = 2166136261u;
+
+    if (path == NULL)
+        return 0;
+    while (*path != '\0')
+        h = (h ^ (__u8)*path++) * 16777619u;
+    return h;
+}
+
+#ifdef ENABLE_TRACE
+
+static struct nanofs_trace_event trace_ring[NANOFS_TRACE_EVENTS];
+static __u64 trace_next;    ///< Events recorded so far
+
+/** Record an event in the ring, the oldest one is overwritten when full */
+void nanofs_trace_record(int event, __u32 path, __u32 blk_no, __u32 bytes,
+        __u64 offset, int res)
+{
+    struct nanofs_trace_event *ev;
+    struct timespec ts;
+    __u64 n;
+
+    n = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    ev = &trace_ring[n & (NANOFS_TRACE_EVENTS - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->t_time = (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->t_offset = offset;
+    ev->t_path = path;
+    ev->t_blk_no = blk_no;
+    ev->t_bytes = bytes;
+    ev->t_event = event;
+    ev->t_res = res < -32768 ? -32768 : res;
+}
+
+/** Write the events of the ring to a file, see nanofstrace.c
+ * @return 0 on success | -1 on error
+ * */
+int nanofs_trace_dump(const char *file_name)
+{
+    struct nanofs_trace_header fh;
+    __u64 total, first;
+    FILE *f;
+    int err = 0;
+
+    total = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+    first = total > NANOFS_TRACE_EVENTS ? total - NANOFS_TRACE_EVENTS : 0;
+    memset(&fh, 0, sizeof(fh));
+    fh.f_magic = NANOFS_TRACE_MAGIC;
+    fh.f_version = NANOFS_TRACE_VERSION;
+    fh.f_event_size = sizeof(struct nanofs_trace_event);
+    fh.f_count = total - first;
+    fh.f_total = total;
+
+    f = fopen(file_name, "w");
+    if (f == NULL)
+    {
+        log_error("nanofs_trace_dump: cannot open '%s'", file_name);
+        return -1;
+    }
+    if (fwrite(&fh, sizeof(fh), 1, f) != 1)
+        err = -1;
+    // Oldest events are at the slot that comes next
+    for (; err == 0 && first < total; first++)
+        if (fwrite(&trace_ring[first & (NANOFS_TRACE_EVENTS - 1)],
+                sizeof(struct nanofs_trace_event), 1, f) != 1)
+            err = -1;
+    if (fclose(f) != 0)
+        err = -1;
+    if (err != 0)
+        log_error("nanofs_trace_dump: cannot write '%s'", file_name);
+    return err;
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_trace.h
+    @version 0.4
+    @brief Binary trace of operations and device requests
+
+******************************************************************************/
+
+#ifndef __NANOFS_TRACE_H__
+#define __NANOFS_TRACE_H__
+
+#include <sys/types.h>
+#include <asm/types.h>
+
+/* Trace file, see nanofs_trace_dump() */
+#define NANOFS_TRACE_MAGIC   0x6e465472
+#define NANOFS_TRACE_VERSION 1
+/** Events kept in the ring, a power of two */
+#define NANOFS_TRACE_EVENTS  65536
+
+/* Events */
+#define NANOFS_EV_GETATTR   1
+#define NANOFS_EV_OPEN      2
+#define NANOFS_EV_READ      3
+#define NANOFS_EV_READ_BUF  4
+#define NANOFS_EV_WRITE     5
+#define NANOFS_EV_CREATE    6
+#define NANOFS_EV_MKDIR     7
+#define NANOFS_EV_UNLINK    8
+#define NANOFS_EV_RMDIR     9
+#define NANOFS_EV_TRUNCATE  10
+#define NANOFS_EV_READDIR   11
+#define NANOFS_EV_FSYNC     12
+#define NANOFS_EV_ALLOC     13  ///< Node allocated, bytes of payload
+#define NANOFS_EV_FREE      14  ///< Node freed, bytes of payload
+#define NANOFS_EV_COMMIT    15  ///< Journal record, bytes written
+#define NANOFS_EV_DEV_READ  16  ///< Device request, offset in the device
+#define NANOFS_EV_DEV_WRITE 17
+#define NANOFS_EV_DEV_FLUSH 18
+#define NANOFS_EV_RENAME    19
+#define NANOFS_EV_MAX       20
+
+/** Fixed size event, the trace file stores them as they are in memory */
+struct nanofs_trace_event {
+    __u64 t_time;       ///< Nanoseconds, CLOCK_MONOTONIC
+    __u64 t_offset;     ///< File or device offset
+    __u32 t_path;       ///< See nanofs_trace_hash(), 0 if none
+    __u32 t_blk_no;
+    __u32 t_bytes;
+    __u16 t_event;      ///< NANOFS_EV_*
+    __s16 t_res;        ///< 0 or -errno
+};
+
+/** Trace file header, followed by 'f_count' events, oldest first */
+struct nanofs_trace_header {
+    __u32 f_magic;
+    __u16 f_version;
+    __u16 f_event_size;
+    __u32 f_count;
+    __u32 f_pad;
+    __u64 f_total;      ///< Events recorded, older ones were overwritten
+};
+
+const char *nanofs_trace_event_name(int event);
+__u32 nanofs_trace_hash(const char *path);
+
+/* Tracing is built with ./configure --enable-trace, otherwise the macro
+ * and its arguments are compiled out. Sources using it include config.h */
+#ifdef ENABLE_TRACE
+
+void nanofs_trace_record(int event, __u32 path, __u32 blk_no, __u32 bytes,
+        __u64 offset, int res);
+int nanofs_trace_dump(const char *file_name);
+
+#define NANOFS_TRACE(event, path, blk_no, bytes, offset, res) \
+    nanofs_trace_record(event, path, blk_no, bytes, offset, res)
+
+#else
+
+#define NANOFS_TRACE(event, path, blk_no, bytes, offset, res) ((void)0)
+
+#endif
+
+#endif
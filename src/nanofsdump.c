@@ -43,13 +43,30 @@
 
 #include "nanofs.h"
 #include "nanofs_io.h"
+#include "nanofs_dev.h"
+#include "nanofs_journal.h"
+#include "nanofs_dirindex.h"
+#include "nanofs_dirbtree.h"
 
 
 int dump_nanofs(char *device);
-int dump_directory(int fd_dev, int blk_bits, int dir_blkno, int level);
-int dump_free_blocks(int fd, struct nanofs_superblock *sb, int blk_bits);
-int dump_data_blocks(int fd_dev, int blk_bits, int blkno, int level);
-int dump_file_contents(int fd_dev, int blk_bits, int data_blkno);
+int dump_directory(struct nanofs_dev *dev, int blk_bits, int dir_blkno,
+        int level);
+int dump_dir_entry(struct nanofs_dev *dev, int blk_bits, int blkno,
+        struct nanofs_dir_node *dn, int level);
+int dump_dir_btree(struct nanofs_dev *dev, int blk_bits, int tree_blkno,
+        int level);
+int dump_free_blocks(struct nanofs_dev *dev, struct nanofs_superblock *sb,
+        int blk_bits);
+int dump_journal(struct nanofs_dev *dev, struct nanofs_superblock *sb,
+        int blk_bits);
+int dump_data_blocks(struct nanofs_dev *dev, int blk_bits, int blkno,
+        int level);
+int dump_file_contents(struct nanofs_dev *dev, int blk_bits, int data_blkno);
+int dump_file_meta(struct nanofs_dev *dev, int blk_bits,
+        struct nanofs_dir_node *dn, int level);
+int dump_extent_node(struct nanofs_dev *dev, int blk_bits, __u32 blkno,
+        int node_level, __u32 *data_blkno, __u64 *data_pos, __u32 *count);
 
 
 char *ltoh(__u64 bytes);
@@ -72,6 +89,12 @@ static const char *UsageStr = "Usage: nanofs-dump [OPTION...] file or device \n"
 // Global options
 int global_verbose = 0; // Global verbosity
 int global_file_contents = 0; // Dump file contents
+int global_dir_shift = 0; // Dir nodes are packed, see dump_journal()
+
+/** Device offset of the dir node at 'addr' */
+#define DIR_NODE_OFFSET(addr, blk_bits) \
+        (((off_t)DN_BLOCK(addr, global_dir_shift) << (blk_bits)) + \
+        DN_OFFSET(addr, global_dir_shift))
 
 int main(int argc, char **argv)
 {
@@ -124,25 +147,25 @@ int dump_nanofs(char *device_str)
 {
     int err = 0;
     unsigned long long dev_size = 1000000L;
-    int fd;
+    struct nanofs_dev dev;
     int blk_size = 0;
     int blk_bits = 0;
 
     struct nanofs_superblock sb;
     struct nanofs_dir_node dn;
 
-    fd = open(device_str, O_FSYNC | O_RDONLY, 0);
-    if (fd < 0)
+    if (nanofs_dev_open(&dev, device_str, NANOFS_DEV_POSIX,
+            O_FSYNC | O_RDONLY) != 0)
     {
         fprintf(stderr, "** Error cannot open device %s\n", device_str);
         return -1;
     }
 
-    dev_size = lseek64(fd, (off_t) 0, SEEK_END);
+    dev_size = nanofs_dev_size(&dev);
     printf("Opened device/file of size %lld bytes (%s)\n", dev_size,
             ltoh(dev_size));
 
-    if (nanofs_read_sb(fd, (off_t) 0, &sb) != 0)
+    if (nanofs_read_sb(&dev, (off_t) 0, &sb) != 0)
     {
         fprintf(stderr, "** Error cannot read superblock %s\n", device_str);
         err = -1;
@@ -174,7 +197,7 @@ int dump_nanofs(char *device_str)
         else
             printf(" %2x [ERROR]\n", sb.s_blocksize);
         printf(" - Filesystem revision: %4d", sb.s_revision);
-        if (sb.s_revision != 0)
+        if (sb.s_revision > NANOFS_REVISION_EXTRA)
             printf(" [ERROR]\n");
         else
             printf(" [OK]\n");
@@ -194,15 +217,20 @@ int dump_nanofs(char *device_str)
 
     }
 
+    // Dump extended superblock
+    if (err == 0 && sb.s_extra_size > 0)
+        err = dump_journal(&dev, &sb, blk_bits);
+
     // Dump free blocks
     if (err == 0)
-        err = dump_free_blocks(fd, &sb, blk_bits);
+        err = dump_free_blocks(&dev, &sb, blk_bits);
     // Dump directories
 
     if (err == 0)
     {
         printf("Root directory         ");
-        if (nanofs_read_dir_node(fd, sb.s_alloc_ptr << blk_bits, &dn) != 0)
+        if (nanofs_read_dir_node(&dev,
+                DIR_NODE_OFFSET(sb.s_alloc_ptr, blk_bits), &dn) != 0)
         {
             printf(" [READ Error]\n");
             err = -2;
@@ -226,10 +254,10 @@ int dump_nanofs(char *device_str)
 
     // Recursive dump dirs
     if (err == 0)
-        err = dump_directory(fd, blk_bits, sb.s_alloc_ptr, 0);
+        err = dump_directory(&dev, blk_bits, sb.s_alloc_ptr, 0);
 
 
-    close(fd);
+    nanofs_dev_close(&dev);
     return err;
 }
 
@@ -237,7 +265,8 @@ int dump_nanofs(char *device_str)
 
 /** Recursive dump directory
  * @return number of errors found, 0 on success */
-int dump_directory(int fd_dev, int blk_bits, int dir_blkno, int level)
+int dump_directory(struct nanofs_dev *dev, int blk_bits, int dir_blkno,
+        int level)
 {
     struct nanofs_dir_node dir_node;
 
@@ -245,7 +274,7 @@ int dump_directory(int fd_dev, int blk_bits, int dir_blkno, int level)
     int err = 0;
     print_tabs(level);
     printf(" - Dump directory on level %d,", level);
-    if (nanofs_read_dir_node(fd_dev, (off_t)(dir_blkno) << blk_bits,
+    if (nanofs_read_dir_node(dev, DIR_NODE_OFFSET(dir_blkno, blk_bits),
             &dir_node) != 0)
     {
         printf(" [READ Error]\n");
@@ -254,8 +283,9 @@ int dump_directory(int fd_dev, int blk_bits, int dir_blkno, int level)
     printf(" name '%s' \n", dir_node.d_fname);
 
     print_tabs(level);
-    printf(" - Directory entry at block 0x%x (offset 0x%x), data:\n",
-            dir_blkno, dir_blkno << blk_bits);
+    printf(" - Directory entry at block 0x%x (offset 0x%llx), data:\n",
+            dir_blkno,
+            (unsigned long long)DIR_NODE_OFFSET(dir_blkno, blk_bits));
 
     if (DN_ISDIR(dir_node))
     {
@@ -283,52 +313,113 @@ int dump_directory(int fd_dev, int blk_bits, int dir_blkno, int level)
         return err;
 
     // Listing dir contents
+    if (DN_ISBTREE(dir_node))
+    {
+        print_tabs(level);
+        printf("   + B-tree directory\n");
+        return dump_dir_btree(dev, blk_bits, dir_node.d_data_ptr, level);
+    }
     current_blkno = dir_node.d_data_ptr; // First directory entry
     while (current_blkno != 0)
     {
-
-        if (nanofs_read_dir_node(fd_dev,
-                (off_t)(current_blkno) << blk_bits, &dir_node) != 0)
+        if (nanofs_read_dir_node(dev,
+                DIR_NODE_OFFSET(current_blkno, blk_bits), &dir_node) != 0)
         {
             printf("** IO Error reading directory entry\n");
             return ++err;
         }
+        err += dump_dir_entry(dev, blk_bits, current_blkno, &dir_node, level);
+        current_blkno = dir_node.d_next_ptr;
+    }
+    return err;
+}
 
-        if (DN_ISDIR(dir_node))
+/** Dump a child of a directory, recursing into directories
+ * @return number of errors found */
+int dump_dir_entry(struct nanofs_dev *dev, int blk_bits, int blkno,
+        struct nanofs_dir_node *dn, int level)
+{
+    struct nanofs_dir_node dir_node = *dn;
+    int err = 0;
+
+    if (DN_ISDIR(dir_node))
+    {
+        // Recursive call
+        err += dump_directory(dev, blk_bits, blkno, level + 1);
+    }
+    else if (DN_ISREG(dir_node))
+    {
+        print_tabs(level + 1);
+        printf(" - Directory entry at block 0x%x (offset 0x%llx), data:\n",
+                blkno, (unsigned long long)
+                DIR_NODE_OFFSET(blkno, blk_bits));
+        print_tabs(level + 1);
+        printf("   + Node type (flag):       REG_FILE\n");
+        print_tabs(level + 1);
+        printf("   + Next dir node at block: 0x%x\n", dir_node.d_next_ptr);
+        print_tabs(level + 1);
+        printf("   + Metadata at block:      0x%x\n", dir_node.d_meta_ptr);
+        print_tabs(level + 1);
+        printf("   + FName length:            %-d\n", dir_node.d_fname_len);
+        print_tabs(level + 1);
+        printf("   + FName:                  '%s'\n", dir_node.d_fname);
+        print_tabs(level + 1);
+        if (DN_ISINLINE(dir_node))
+            printf("   + Inline data:            %u bytes\n",
+                    dir_node.d_data_ptr);
+        else
+            printf("   + Data start at block:    0x%x (offset 0x%x)\n",
+                    dir_node.d_data_ptr,dir_node.d_data_ptr << blk_bits);
+        if (dir_node.d_meta_ptr != 0)
+            err += dump_file_meta(dev, blk_bits, &dir_node, level + 1);
+        // Data blocks
+        if (!DN_ISINLINE(dir_node) && dir_node.d_data_ptr != 0)
         {
-            // Recursive call
-            err += dump_directory(fd_dev, blk_bits, current_blkno, level + 1);
+            if (global_file_contents)
+                err += dump_file_contents(dev, blk_bits,
+                        dir_node.d_data_ptr);
+            else
+                err += dump_data_blocks(dev, blk_bits,
+                        dir_node.d_data_ptr,level+1);
         }
-        else if (DN_ISREG(dir_node))
+    }
+    return err;
+}
+
+/** Dump the entries of a B-tree directory, see struct nanofs_dir_btree
+ * @return number of errors found */
+int dump_dir_btree(struct nanofs_dev *dev, int blk_bits, int tree_blkno,
+        int level)
+{
+    struct nanofs_dir_btree t;
+    struct nanofs_dir_node dir_node;
+    int err = 0, i;
+
+    if (dev->d_ops->read(dev, (off_t)tree_blkno << blk_bits, &t,
+            sizeof(t)) != sizeof(t) || t.t_magic != NANOFS_DIR_BTREE_MAGIC ||
+            t.t_count > NANOFS_DIR_BTREE_ORDER)
+    {
+        printf("** Error reading B-tree node at block 0x%x\n", tree_blkno);
+        return 1;
+    }
+    print_tabs(level);
+    printf("   + B-tree node at block 0x%x: level %u, %u entries\n",
+            tree_blkno, t.t_level, t.t_count);
+    for (i = 0; i < t.t_count; i++)
+    {
+        if (t.t_level > 0)
         {
-            print_tabs(level + 1);
-            printf(" - Directory entry at block 0x%x (offset 0x%x), data:\n",
-                    current_blkno, current_blkno << blk_bits);
-            print_tabs(level + 1);
-            printf("   + Node type (flag):       REG_FILE\n");
-            print_tabs(level + 1);
-            printf("   + Next dir node at block: 0x%x\n", dir_node.d_next_ptr);
-            print_tabs(level + 1);
-            printf("   + Metadata at block:      0x%x\n", dir_node.d_meta_ptr);
-            print_tabs(level + 1);
-            printf("   + FName length:            %-d\n", dir_node.d_fname_len);
-            print_tabs(level + 1);
-            printf("   + FName:                  '%s'\n", dir_node.d_fname);
-            print_tabs(level + 1);
-            printf("   + Data start at block:    0x%x (offset 0x%x)\n",
-                    dir_node.d_data_ptr,dir_node.d_data_ptr << blk_bits);
-            // Data blocks
-            if (dir_node.d_data_ptr != 0)
-            {
-                if (global_file_contents)
-                    err += dump_file_contents(fd_dev, blk_bits,
-                            dir_node.d_data_ptr);
-                else
-                    err += dump_data_blocks(fd_dev, blk_bits,
-                            dir_node.d_data_ptr,level+1);
-            }
+            err += dump_dir_btree(dev, blk_bits, t.t_child[i], level);
+            continue;
         }
-        current_blkno = dir_node.d_next_ptr;
+        if (nanofs_read_dir_node(dev,
+                DIR_NODE_OFFSET((__u32)t.t_keys[i], blk_bits), &dir_node) != 0)
+        {
+            printf("** IO Error reading directory entry\n");
+            return ++err;
+        }
+        err += dump_dir_entry(dev, blk_bits, (__u32)t.t_keys[i], &dir_node,
+                level);
     }
     return err;
 }
@@ -337,13 +428,14 @@ int dump_directory(int fd_dev, int blk_bits, int dir_blkno, int level)
  * @return Number of errors found
  * **/
 
-int dump_data_blocks(int fd_dev, int blk_bits, int blkno, int level)
+int dump_data_blocks(struct nanofs_dev *dev, int blk_bits, int blkno,
+        int level)
 {
     struct nanofs_data_node data_node;
     __u32 current_blk = blkno;
     while(current_blk !=0 )
     {
-        if (nanofs_read_data_node(fd_dev, current_blk << blk_bits,
+        if (nanofs_read_data_node(dev, current_blk << blk_bits,
                 &data_node) != 0)
         {
             printf("** IO Error reading data block, blk_no = 0x%8.8X\n",
@@ -359,21 +451,133 @@ int dump_data_blocks(int fd_dev, int blk_bits, int blkno, int level)
     return 0;
 }
 
-int dump_file_contents(int fd_dev, int blk_bits, int data_blkno)
+/** Dump the size kept in the metadata block of a file, see struct
+ * nanofs_file_meta, it must match the lengths of its data nodes
+ * @return number of errors found */
+int dump_file_meta(struct nanofs_dev *dev, int blk_bits,
+        struct nanofs_dir_node *dn, int level)
+{
+    struct nanofs_file_meta m;
+    struct nanofs_data_node data_node;
+    __u64 size = 0;
+    __u32 blkno, count;
+
+    if (dev->d_ops->read(dev, (off_t)dn->d_meta_ptr << blk_bits, &m,
+            sizeof(m)) != sizeof(m) || m.m_magic != NANOFS_FILE_META_MAGIC)
+    {
+        printf("** Error reading file metadata at block 0x%x\n",
+                dn->d_meta_ptr);
+        return 1;
+    }
+    for (blkno = dn->d_data_ptr; blkno != 0; blkno = data_node.d_next_ptr)
+    {
+        if (nanofs_read_data_node(dev, (off_t)blkno << blk_bits,
+                &data_node) != 0)
+            return 0; // Reported by dump_data_blocks()
+        size += data_node.d_len;
+    }
+    print_tabs(level);
+    printf("   + File size (metadata):   %llu Bytes",
+            (unsigned long long)m.m_size);
+    if (DN_ISINLINE((*dn)) || m.m_size != size)
+    {
+        printf(" [**Error, data is %llu Bytes]\n", (unsigned long long)size);
+        return 1;
+    }
+    printf("\n");
+    if (!(m.m_flags & NANOFS_META_EXTENTS))
+        return 0;
+    print_tabs(level);
+    printf("   + Extent index:           %u nodes, %u levels, root at "
+            "block 0x%x\n", m.m_count, m.m_levels, m.m_extents);
+    // The leaves must list the data nodes in file order
+    blkno = dn->d_data_ptr;
+    size = 0;
+    count = 0;
+    if (m.m_levels > 0 && dump_extent_node(dev, blk_bits, m.m_extents,
+            m.m_levels - 1, &blkno, &size, &count) != 0)
+        return 1;
+    if (blkno != 0 || count != m.m_count)
+    {
+        printf("** Error, extent index of %u nodes misses data block 0x%x\n",
+                count, blkno);
+        return 1;
+    }
+    return 0;
+}
+
+/** Check a node of an extent index, see struct nanofs_extent_node, and the
+ * nodes under it against the data nodes of the file from 'data_blkno'
+ * @return number of errors found */
+int dump_extent_node(struct nanofs_dev *dev, int blk_bits, __u32 blkno,
+        int node_level, __u32 *data_blkno, __u64 *data_pos, __u32 *count)
+{
+    struct nanofs_extent_node n;
+    struct nanofs_data_node data_node;
+    int i;
+
+    if (dev->d_ops->read(dev, (off_t)blkno << blk_bits, &n, sizeof(n)) !=
+            sizeof(n) || n.n_magic != NANOFS_EXTENT_MAGIC ||
+            n.n_level != node_level || n.n_count == 0 ||
+            n.n_count > NANOFS_EXTENT_SLOTS)
+    {
+        printf("** Error reading extent index node at block 0x%x\n", blkno);
+        return 1;
+    }
+    for (i = 0; i < n.n_count; i++)
+    {
+        if (n.n_entries[i].x_offset != *data_pos)
+        {
+            printf("** Error, extent index node at block 0x%x has offset "
+                    "%llu, data is at %llu\n", blkno,
+                    (unsigned long long)n.n_entries[i].x_offset,
+                    (unsigned long long)*data_pos);
+            return 1;
+        }
+        if (n.n_level > 0)
+        {
+            if (dump_extent_node(dev, blk_bits, n.n_entries[i].x_blk_no,
+                    node_level - 1, data_blkno, data_pos, count) != 0)
+                return 1;
+            continue;
+        }
+        if (n.n_entries[i].x_blk_no != *data_blkno)
+        {
+            printf("** Error, extent index node at block 0x%x lists data "
+                    "block 0x%x, not 0x%x\n", blkno,
+                    n.n_entries[i].x_blk_no, *data_blkno);
+            return 1;
+        }
+        if (nanofs_read_data_node(dev, (off_t)*data_blkno << blk_bits,
+                &data_node) != 0)
+            return 1;
+        *data_blkno = data_node.d_next_ptr;
+        *data_pos += data_node.d_len;
+        (*count)++;
+    }
+    return 0;
+}
+
+int dump_file_contents(struct nanofs_dev *dev, int blk_bits, int data_blkno)
 {
     char buf[1024];
     __u32 i;
     int err = 0;
     struct nanofs_data_node data_nd;
     int bytes;
-    if (nanofs_read_data_node(fd_dev, (off_t)(data_blkno) << blk_bits,
+    off_t offset = ((off_t)(data_blkno) << blk_bits) +
+            NANOFS_HEADER_DATA_NODE_SIZE;
+    if (nanofs_read_data_node(dev, (off_t)(data_blkno) << blk_bits,
             &data_nd) != 0)
     {
         printf("** Error reading data block\n");
         return ++err;
     }
 
-    bytes = read(fd_dev, buf, 1024);
+    bytes = dev->d_ops->read(dev, offset, buf, 1024);
+    if (bytes <= 0)
+        return ++err;
+    offset += bytes;
     for (i = 0; i < data_nd.d_len; i++)
     {
         if (i % 64 == 0)
@@ -384,13 +588,19 @@ int dump_file_contents(int fd_dev, int blk_bits, int data_blkno)
             printf(".");
         bytes--;
         if (bytes == 0)
-            bytes = read(fd_dev, buf, 1024);
+        {
+            bytes = dev->d_ops->read(dev, offset, buf, 1024);
+            if (bytes <= 0)
+                break;
+            offset += bytes;
+        }
     }
     printf("\n");
     return err;
 }
 
-int dump_free_blocks(int fd, struct nanofs_superblock *sb, int blk_bits)
+int dump_free_blocks(struct nanofs_dev *dev, struct nanofs_superblock *sb,
+        int blk_bits)
 {
     int err = 0;
     struct nanofs_data_node free_node;
@@ -404,7 +614,7 @@ int dump_free_blocks(int fd, struct nanofs_superblock *sb, int blk_bits)
 
     while (blk_no > 0)
     {
-        if (nanofs_read_data_node(fd, (off_t)(blk_no) << blk_bits,
+        if (nanofs_read_data_node(dev, (off_t)(blk_no) << blk_bits,
                 &free_node) != 0)
         {
             printf("** IO Error reading a free block at blk_no 0x%8.8X\n",
@@ -424,6 +634,82 @@ int dump_free_blocks(int fd, struct nanofs_superblock *sb, int blk_bits)
     return err;
 }
 
+/** Dump extended superblock and journal state
+ * @return 0 on success, -1 when the extended superblock cannot be read */
+int dump_journal(struct nanofs_dev *dev, struct nanofs_superblock *sb,
+        int blk_bits)
+{
+    struct nanofs_sb_extra sbx;
+    struct nanofs_dir_node dn;
+    __u32 blkno;
+    __u8 *rec;
+
+    if (nanofs_read_sb_extra(dev, sb, &sbx) != 0)
+    {
+        printf("** IO Error reading extended superblock\n");
+        return -1;
+    }
+    printf("Extended superblock data:\n");
+    printf(" - Features:           0x%8.8X\n", sbx.s_features);
+    if (sbx.s_features & NANOFS_FEAT_DIR_INDEX)
+        printf(" - Directory index:    from %d entries\n",
+                NANOFS_DIR_INDEX_MIN);
+    if (sbx.s_features & NANOFS_FEAT_DIR_BTREE)
+        printf(" - Directory B-trees:  from %d entries\n",
+                NANOFS_DIR_BTREE_MIN);
+    if (sbx.s_features & NANOFS_FEAT_INLINE_DATA)
+        printf(" - Inline data:        small files\n");
+    if (sbx.s_features & NANOFS_FEAT_PACKED_DIRS)
+    {
+        printf(" - Packed dir nodes:   %d bytes slots\n",
+                NANOFS_DIR_SLOT_SIZE);
+        global_dir_shift = NANOFS_DIR_SLOT_BITS;
+    }
+    if (sbx.s_features & NANOFS_FEAT_ORPHANS)
+        printf(" - Deleted files at:   0x%8.8X\n", sbx.s_orphan_ptr);
+    if (sbx.s_features & NANOFS_FEAT_FILE_SIZE)
+        printf(" - File sizes:         metadata blocks\n");
+    if (sbx.s_features & NANOFS_FEAT_EXTENTS)
+        printf(" - Extent index:       %d nodes per block\n",
+                NANOFS_EXTENT_SLOTS);
+    // Files whose data is not freed yet, chained as the entries of a dir
+    for (blkno = sbx.s_orphan_ptr; blkno != 0; blkno = dn.d_next_ptr)
+    {
+        if (nanofs_read_dir_node(dev, DIR_NODE_OFFSET(blkno, blk_bits),
+                &dn) != 0)
+        {
+            printf("** IO Error reading deleted file\n");
+            return -1;
+        }
+        dump_dir_entry(dev, blk_bits, blkno, &dn, 0);
+    }
+    if (!(sbx.s_features & NANOFS_FEAT_JOURNAL))
+        return 0;
+    printf(" - Journal at block:   0x%8.8X, %u blocks",
+            sbx.s_journal_ptr, sbx.s_journal_blocks);
+    if (nanofs_journal_check(&sbx, sb->s_fs_size) != 0)
+    {
+        printf(" [ERROR]\n");
+        return 0;
+    }
+    printf(" [OK]\n");
+    printf(" - Journal id:         0x%8.8X\n", sbx.s_journal_id);
+    printf(" - Next record:        %u at journal block %u\n",
+            sbx.s_journal_seq, sbx.s_journal_head);
+    rec = nanofs_journal_read(dev, blk_bits, &sbx, sbx.s_journal_head);
+    if (rec == NULL && sbx.s_journal_head != 0)
+        rec = nanofs_journal_read(dev, blk_bits, &sbx, 0);
+    if (rec != NULL)
+    {
+        printf(" - Journal state:      record pending replay, "
+                "mount to recover\n");
+        free(rec);
+    }
+    else
+        printf(" - Journal state:      clean\n");
+    return 0;
+}
+
 /* Formating funcs */
 void print_version()
 {
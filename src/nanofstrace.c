@@ -0,0 +1,134 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @author Paulino Ruiz de Clavijo Vázquez <pruiz@us.es>
+    @date 2016-23-05
+    @version 0.4
+
+******************************************************************************/
+
+
+/* Decoder of the trace files written by nanofuse -o trace=file */
+
+#include<config.h>
+
+#include <asm/types.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nanofs_trace.h"
+
+
+/** Help str */
+
+static const char *UsageStr = "Usage: nanofs.trace [OPTION...] trace file\n"
+        "Options\n"
+        "\t-e event Only show the given event, see the man page\n"
+        "\t-V Version number\n";
+
+
+/** Print the events of a trace file, times relative to the first event
+ * @return 0 on success | -1 on error
+ * */
+int dump_trace(const char *file_name, int only_event)
+{
+    struct nanofs_trace_header fh;
+    struct nanofs_trace_event ev;
+    __u64 t0 = 0;
+    __u32 i;
+    FILE *f;
+
+    f = fopen(file_name, "r");
+    if (f == NULL)
+    {
+        printf("Cannot open %s\n", file_name);
+        return -1;
+    }
+    if (fread(&fh, sizeof(fh), 1, f) != 1 || fh.f_magic != NANOFS_TRACE_MAGIC)
+    {
+        printf("%s is not a nanofs trace\n", file_name);
+        fclose(f);
+        return -1;
+    }
+    if (fh.f_version != NANOFS_TRACE_VERSION ||
+            fh.f_event_size != sizeof(struct nanofs_trace_event))
+    {
+        printf("Unsupported trace version %u\n", fh.f_version);
+        fclose(f);
+        return -1;
+    }
+    printf("Events: %u of %llu recorded\n", fh.f_count,
+            (unsigned long long)fh.f_total);
+    printf("%14s %-10s %8s %10s %10s %14s %6s\n", "time(s)", "event", "path",
+            "blk_no", "bytes", "offset", "res");
+    for (i = 0; i < fh.f_count; i++)
+    {
+        if (fread(&ev, sizeof(ev), 1, f) != 1)
+        {
+            printf("Trace truncated after %u events\n", i);
+            break;
+        }
+        if (i == 0)
+            t0 = ev.t_time;
+        if (only_event != 0 && ev.t_event != only_event)
+            continue;
+        printf("%14.6f %-10s %08x %10u %10u %14llu %6d\n",
+                (double)(ev.t_time - t0) / 1e9,
+                nanofs_trace_event_name(ev.t_event), ev.t_path, ev.t_blk_no,
+                ev.t_bytes, (unsigned long long)ev.t_offset, ev.t_res);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int optc, only_event = 0;
+
+    while ((optc = getopt(argc, argv, "e:V")) != -1)
+    {
+        switch (optc)
+        {
+        case 'e':
+            for (only_event = 1; only_event < NANOFS_EV_MAX; only_event++)
+                if (strcmp(optarg, nanofs_trace_event_name(only_event)) == 0)
+                    break;
+            if (only_event == NANOFS_EV_MAX)
+            {
+                printf("Unknown event %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'V':
+            printf("nanofs.trace Version %s\n", VERSION);
+            return EXIT_SUCCESS;
+        case '?':
+        default:
+            printf("%s", UsageStr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc)
+    {
+        printf("Missing argument in command line\n");
+        return EXIT_FAILURE;
+    }
+    return dump_trace(argv[optind], only_event) == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+}
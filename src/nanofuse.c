@@ -28,6 +28,8 @@
 
 ******************************************************************************/
 
+#include <config.h>
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -35,9 +37,12 @@
 
 #include <libgen.h>
 #include <limits.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
@@ -48,10 +53,29 @@
 #include "fuse.h"
 #include "log.h"
 #include "nanofs_filedir.h"
+#include "nanofs_trace.h"
 #include "nanofuse.h"
 
-// Max number of entries to read in a directory
-#define MAX_DIRENTRIES 5000
+// Attribute of "/" with the filesystem counters, setting it resets them
+#define NANOFUSE_STATS_XATTR "user.nanofs.stats"
+// Setting this attribute of "/" dumps the trace ring to -o trace=file
+#define NANOFUSE_TRACE_XATTR "user.nanofs.trace"
+
+// Default seconds between periodic syncs
+#define NANOFUSE_COMMIT_DEFAULT 5
+
+#define NANOFUSE_OPT(t, p, v) { t, offsetof(struct nanofuse_state, p), v }
+
+/** nanofuse specific mount options, the rest are passed to FUSE */
+static struct fuse_opt nanofuse_opts[] = {
+    NANOFUSE_OPT("engine=%s", engine, 0),
+    NANOFUSE_OPT("direct", direct, 1),
+    NANOFUSE_OPT("cache_size=%u", cache_kb, 0),
+    NANOFUSE_OPT("commit=%u", commit, 0),
+    NANOFUSE_OPT("lazy_sb", lazy_sb, 1),
+    NANOFUSE_OPT("trace=%s", trace_file, 0),
+    FUSE_OPT_END
+};
 
 // Work around -Wall gcc
 #define UNUSED(...) (void)(__VA_ARGS__)
@@ -59,6 +83,40 @@
 int nanofuse_buildstatbuf(struct nanofs_filedir_handle *, struct stat *);
 int nanofuse_rootfsstat(struct stat *);
 
+/** List an open file or directory, the filesystem must be locked */
+static void nanofuse_open_link(struct nanofuse_open *o)
+{
+    o->o_prev = NULL;
+    o->o_next = nanofuse_CONTEXT->open_list;
+    if (o->o_next != NULL)
+        o->o_next->o_prev = o;
+    nanofuse_CONTEXT->open_list = o;
+}
+
+/** Remove a closed file or directory from the list, the filesystem must be
+ * locked */
+static void nanofuse_open_unlink(struct nanofuse_open *o)
+{
+    if (o->o_prev != NULL)
+        o->o_prev->o_next = o->o_next;
+    else
+        nanofuse_CONTEXT->open_list = o->o_next;
+    if (o->o_next != NULL)
+        o->o_next->o_prev = o->o_prev;
+}
+
+/** Wake nanofuse_reclaimer(), a file removed may have been left in the
+ * orphan list */
+static void nanofuse_reclaim_wake(void)
+{
+    if (!nanofuse_CONTEXT->reclaim_running)
+        return;
+    pthread_mutex_lock(&nanofuse_CONTEXT->reclaim_mutex);
+    nanofuse_CONTEXT->reclaim_wake = 1;
+    pthread_cond_signal(&nanofuse_CONTEXT->reclaim_cond);
+    pthread_mutex_unlock(&nanofuse_CONTEXT->reclaim_mutex);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -85,13 +143,14 @@ int nanofuse_getattr(const char *path, struct stat *statbuf)
     int retstat = 0;
     struct nanofs_filedir_handle fd_hd;
 
-
-    log_debug("nanofuse_getattr: path='%s'",path);
-
+	nanofs_lock(&nanofuse_CONTEXT->fs_hd);
 	retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,path,&fd_hd);
 	if (retstat == 0)
 	    // Build stat buf
 	    retstat = nanofuse_buildstatbuf(&fd_hd,statbuf);
+	nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_GETATTR, nanofs_trace_hash(path),
+            retstat == 0 ? fd_hd.f_blk_no : 0, 0, 0, -retstat);
     return -retstat;
 }
 
@@ -116,6 +175,7 @@ int nanofuse_buildstatbuf(struct nanofs_filedir_handle *fd_hd,
          statbuf->st_mode = 0100755;
      }
 
+     statbuf->st_ino = fd_hd->f_blk_no; // with -o use_ino
      statbuf->st_nlink = 0;  // number of hard links
      statbuf->st_uid = fuse_get_context()->uid;
      statbuf->st_gid = fuse_get_context()->gid;
@@ -209,6 +269,7 @@ int nanofuse_mkdir(const char *path, mode_t mode)
 
     log_debug("nanofuse_mkdir: path='%s', mode=0%3o", path, mode);
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,
             dir_name, &dir_hd);
     if (retstat != 0)
@@ -222,6 +283,8 @@ int nanofuse_mkdir(const char *path, mode_t mode)
 		    log_error("nanofuse_mkdir: mkdir fails for path %s",path);
 		}
     }
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_MKDIR, nanofs_trace_hash(path), 0, 0, 0, -retstat);
 
     free(basename_buf);
     free(dirname_buf);
@@ -240,6 +303,7 @@ int nanofuse_unlink(const char *path)
 
     log_debug("nanofuse_unlink: path='%s'", path);
 
+	nanofs_lock(&nanofuse_CONTEXT->fs_hd);
 	retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,
 	        dir_name, &parent_dir_hd);
     if (retstat != 0)
@@ -253,6 +317,10 @@ int nanofuse_unlink(const char *path)
 		if (retstat != 0)
 		    log_error("nanofuse_unlink: nanofs_rm failed");
     }
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    if (retstat == 0)
+        nanofuse_reclaim_wake();
+    NANOFS_TRACE(NANOFS_EV_UNLINK, nanofs_trace_hash(path), 0, 0, 0, -retstat);
 
     free(dirname_buf);
     free(basename_buf);
@@ -272,6 +340,7 @@ int nanofuse_rmdir(const char *path)
 
     log_debug("nanofuse_rmdir: path='%s'", path);
 
+	nanofs_lock(&nanofuse_CONTEXT->fs_hd);
 	retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,
 	        dir_name,&parent_dir_hd);
     if (retstat != 0)
@@ -283,6 +352,8 @@ int nanofuse_rmdir(const char *path)
 		if (retstat)
 		    log_error("nanofuse_rmdir: rmdir failed for path '%s'",path);
     }
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_RMDIR, nanofs_trace_hash(path), 0, 0, 0, -retstat);
 
     free(dirname_buf);
     free(basename_buf);
@@ -307,11 +378,29 @@ int nanofuse_symlink(const char *path, const char *link)
  * */
 int nanofuse_rename(const char *path, const char *newpath)
 {
-    int retstat = ENOTSUP;
+    int retstat;
+    struct nanofs_filedir_handle old_hd, new_hd;
+    struct nanofuse_open *o;
 
-    log_debug("nanofuse_rename: not implemented: path='%s', newpath='%s'",
-	    path, newpath);
+    log_debug("nanofuse_rename: path='%s', newpath='%s'", path, newpath);
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd, path, &old_hd);
+    if (retstat == 0)
+        retstat = nanofs_rename(&nanofuse_CONTEXT->fs_hd, path, newpath,
+                &new_hd);
+    // Open handles follow the dir node, it may have moved
+    for (o = nanofuse_CONTEXT->open_list; retstat == 0 && o != NULL;
+            o = o->o_next)
+        if (o->o_hd.f_blk_no == old_hd.f_blk_no)
+            memcpy(&o->o_hd, &new_hd, sizeof(struct nanofs_filedir_handle));
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_RENAME, nanofs_trace_hash(path),
+            retstat == 0 ? new_hd.f_blk_no : 0, 0, 0, -retstat);
+    if (retstat != 0)
+        log_error("nanofuse_rename: cannot rename");
+    else // The file replaced may be left to the reclaimer
+        nanofuse_reclaim_wake();
 
     return -retstat;
 }
@@ -361,11 +450,15 @@ int nanofuse_truncate(const char *path, off_t newsize)
     log_debug("nanofuse_truncate: path='%s', newsize=%lld)",
 	    path, newsize);
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,
             path, &file_hd);
     if(retstat == 0)
         retstat = nanofs_truncate(&nanofuse_CONTEXT->fs_hd,
                 &file_hd, newsize);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_TRUNCATE, nanofs_trace_hash(path),
+            retstat == 0 ? file_hd.f_blk_no : 0, 0, newsize, -retstat);
 
     return -retstat;
 }
@@ -402,25 +495,31 @@ int nanofuse_utime(const char *path, struct utimbuf *ubuf)
 int nanofuse_open(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    struct nanofs_filedir_handle *file_hd =
-            malloc(sizeof(struct nanofs_filedir_handle));
+    struct nanofuse_open *file_open = malloc(sizeof(struct nanofuse_open));
+    struct nanofs_filedir_handle *file_hd = &file_open->o_hd;
 
     log_debug("nanofuse_open: path'%s', fi=0x%08x",
 	    path, fi);
 
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,path,file_hd);
     if (retstat != 0)
         log_error("nanofuse_open: lookup file error ");
     // Check if the path is a regular file
     if (retstat == 0 && !DN_ISREG(file_hd->f_dir_node))
         retstat = -1;
+    if (retstat == 0)
+        nanofuse_open_link(file_open);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
 
+    NANOFS_TRACE(NANOFS_EV_OPEN, nanofs_trace_hash(path),
+            retstat == 0 ? file_hd->f_blk_no : 0, 0, 0, retstat == 0 ? 0 : -1);
     if(retstat == 0 ) // returning file handle to use later in fuse operations
         fi->fh = (uint64_t)file_hd;
 
     if(retstat != 0) // On error free resources
-        free(file_hd);
+        free(file_open);
 
     return -retstat;
 }
@@ -438,15 +537,150 @@ int nanofuse_open(const char *path, struct fuse_file_info *fi)
 int nanofuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
+    struct nanofs_filedir_handle *file_hd;
     int retstat = 0;
 
-    log_debug("nanofuse_read: path='%s' size=%d, offset=%lld ",
-            path, size, offset );
+    UNUSED(path);
+    file_hd = (struct nanofs_filedir_handle *)fi->fh;
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    retstat = nanofs_read(&nanofuse_CONTEXT->fs_hd, file_hd, buf, size,
+            offset);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_READ, nanofs_trace_hash(path), file_hd->f_blk_no,
+            retstat < 0 ? size : (size_t)retstat, offset,
+            retstat < 0 ? -EIO : 0);
+
+    return retstat;
+}
+
+/** Read data from an open file into a buffer, for nanofuse_read_buf()
+ * @return 0 on success | -errno on error
+ */
+static int nanofuse_read_buf_copy(struct nanofs_fs_handle *fs_hd,
+        struct nanofs_filedir_handle *file_hd, struct fuse_bufvec **bufp,
+        size_t size, off_t offset)
+{
+    struct fuse_bufvec *bufv;
+    int res;
+
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL)
+        return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].mem = malloc(size);
+    if (bufv->buf[0].mem == NULL)
+    {
+        free(bufv);
+        return -ENOMEM;
+    }
+    res = nanofs_read(fs_hd, file_hd, bufv->buf[0].mem, size, offset);
+    if (res < 0)
+    {
+        free(bufv->buf[0].mem);
+        free(bufv);
+        return -EIO;
+    }
+    bufv->buf[0].size = res;
+    *bufp = bufv;
+    return 0;
+}
+
+/** Read data from an open file without copying it
+ *
+ * Instead of filling a buffer, the file data is described as ranges of the
+ * image descriptor. FUSE moves them to the kernel with splice() when
+ * possible, so the pages are taken from the page cache that also backs the
+ * mapping of the mmap engine.
+ *
+ * The ranges are read after the filesystem is unlocked. A truncate, rm or
+ * rename of the file in between frees its blocks and a write can take them
+ * before the splice, the reader would get the data of another file. Only
+ * with a journal freed blocks wait for the group commit before they are
+ * used again, so zero-copy is limited to journaled filesystems. A group
+ * committed in that short window still leaves the hazard open. The rest
+ * of the time data is copied as in nanofuse_read(), and also when the ram
+ * engine has no descriptor, the direct mode cannot hand out unaligned
+ * ranges or inline data may be only in the header cache.
+ */
+
+static int nanofuse_read_buf_locked(const char *path,
+        struct fuse_bufvec **bufp, size_t size, off_t offset,
+        struct fuse_file_info *fi)
+{
+    struct nanofs_fs_handle *fs_hd = &nanofuse_CONTEXT->fs_hd;
+    struct nanofs_filedir_handle *file_hd;
+    struct nanofs_segment *seg_vec;
+    struct fuse_bufvec *bufv;
+    int nsegs, vec_size, i;
+
+    UNUSED(path);
+    file_hd = (struct nanofs_filedir_handle *)fi->fh;
+
+    if (!fs_hd->h_journal || fs_hd->h_dev.d_fd < 0 ||
+            nanofuse_CONTEXT->direct || DN_ISINLINE(file_hd->f_dir_node))
+        return nanofuse_read_buf_copy(fs_hd, file_hd, bufp, size, offset);
+
+    // A node carries at most block size - header bytes per block, plus
+    // partial nodes at both ends. Nodes not full take more, the vector
+    // grows then.
+    vec_size = size / ((1 << fs_hd->h_block_bits) -
+            NANOFS_HEADER_DATA_NODE_SIZE) + 2;
+    do
+    {
+        seg_vec = malloc(vec_size * sizeof(struct nanofs_segment));
+        if (seg_vec == NULL)
+            return -ENOMEM;
+        nsegs = nanofs_read_segments(fs_hd, file_hd, size, offset, seg_vec,
+                vec_size);
+        if (nsegs == -2)
+        {
+            free(seg_vec);
+            vec_size *= 2;
+        }
+    } while (nsegs == -2);
+    if (nsegs < 0)
+    {
+        free(seg_vec);
+        return -EIO;
+    }
+
+    // fuse_bufvec has room for one buffer, allocate the rest
+    bufv = malloc(sizeof(struct fuse_bufvec) +
+            (nsegs > 1 ? nsegs - 1 : 0) * sizeof(struct fuse_buf));
+    if (bufv == NULL)
+    {
+        free(seg_vec);
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = nsegs;
+    for (i = 0; i < nsegs; i++)
+    {
+        bufv->buf[i].size  = seg_vec[i].s_len;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].mem   = NULL;
+        bufv->buf[i].fd    = fs_hd->h_dev.d_fd;
+        bufv->buf[i].pos   = seg_vec[i].s_offset;
+    }
+    if (nsegs == 0)
+        bufv->count = 1; // Empty buffer means EOF
 
-    retstat = nanofs_read(&nanofuse_CONTEXT->fs_hd,
-            (struct nanofs_filedir_handle *)fi->fh, buf, size, offset);
+    free(seg_vec);
+    *bufp = bufv;
+    return 0;
+}
 
+int nanofuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    int retstat;
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    retstat = nanofuse_read_buf_locked(path, bufp, size, offset, fi);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_READ_BUF, nanofs_trace_hash(path),
+            ((struct nanofs_filedir_handle *)fi->fh)->f_blk_no,
+            size, offset, retstat);
     return retstat;
 }
 
@@ -467,20 +701,26 @@ int nanofuse_write(const char *path, const char *buf, size_t size, off_t offset,
     size_t bytes_written;
     struct nanofs_filedir_handle *file_handle;
 
-    log_debug("nanofuse_write: path='%s',size=%d, offset=%lld",
-            path, size, offset);
-
+    UNUSED(path);
     // no need to get path on this one, since I work from fi->fh
     // but 'dir_node' must be reloaded from device
     file_handle = (struct nanofs_filedir_handle *)fi->fh;
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     if (nanofs_read_dir_node_b(&nanofuse_CONTEXT->fs_hd,
             file_handle->f_blk_no,&file_handle->f_dir_node) != 0)
+    {
+        nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
         return -EIO;
+    }
 
     // Get dir_node from block_no stored in fi->fh
     bytes_written = nanofs_write(&nanofuse_CONTEXT->fs_hd, file_handle,
              buf, size, offset);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_WRITE, nanofs_trace_hash(path),
+            file_handle->f_blk_no, size, offset,
+            bytes_written == size ? 0 : -EIO);
     if(bytes_written != size)
     {
         log_error("nanofuse_write: cannot write ");
@@ -497,7 +737,11 @@ int nanofuse_statfs(const char *path, struct statvfs *statv)
 {
     int retstat = 0;
     struct nanofs_superblock *sb =  &nanofuse_CONTEXT->fs_hd.h_sb;
-    __s64 free_space = nanofs_free(&nanofuse_CONTEXT->fs_hd);
+    __s64 free_space;
+
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    free_space = nanofs_free(&nanofuse_CONTEXT->fs_hd);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
 
     log_debug("nanofuse_statfs: path='%s'",path);
     statv->f_bsize = 512;             // File system block size
@@ -559,8 +803,11 @@ int nanofuse_release(const char *path, struct fuse_file_info *fi)
 {
     log_debug("nanofuse_release: path='%s'", path);
 
-    // Free the allocated 'nanofs_filedir_handle' in open()
-    free( (struct nanofs_filedir_handle *)(fi->fh) );
+    // Free the allocated 'nanofuse_open' in open()
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    nanofuse_open_unlink((struct nanofuse_open *)(fi->fh));
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    free( (struct nanofuse_open *)(fi->fh) );
 
     return 0;
 }
@@ -572,9 +819,20 @@ int nanofuse_release(const char *path, struct fuse_file_info *fi)
  */
 int nanofuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
+    int retstat;
+
     UNUSED(fi);
 
     log_debug("nanofuse_fsync: path='%s', datasync=%d", path, datasync);
+    // Cached headers and superblock, then fdatasync() or msync() depending
+    // on the engine
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    retstat = nanofs_sync(&nanofuse_CONTEXT->fs_hd);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_FSYNC, nanofs_trace_hash(path), 0, 0, 0,
+            retstat == 0 ? 0 : -EIO);
+    if (retstat != 0)
+        return -EIO;
     return 0;
 }
 
@@ -587,6 +845,19 @@ int nanofuse_setxattr(const char *path, const char *name, const char *value,
     log_debug("nanofuse_setxattr: path='%s', name='%s', value='%s', size=%d, "
             "flags=0x%08x", path, name, value, size, flags);
 
+    if (strcmp(path, "/") == 0 && strcmp(name, NANOFUSE_STATS_XATTR) == 0)
+    {
+        nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+        nanofs_reset_stats(&nanofuse_CONTEXT->fs_hd);
+        nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+        retstat = 0;
+    }
+#ifdef ENABLE_TRACE
+    if (strcmp(path, "/") == 0 && strcmp(name, NANOFUSE_TRACE_XATTR) == 0 &&
+            nanofuse_CONTEXT->trace_file != NULL)
+        retstat = nanofs_trace_dump(nanofuse_CONTEXT->trace_file) == 0 ?
+                0 : EIO;
+#endif
     return -retstat;
 }
 
@@ -595,11 +866,28 @@ int nanofuse_getxattr(const char *path, const char *name, char *value,
         size_t size)
 {
     int retstat = ENOTSUP;
+    struct nanofs_stats st;
+    char text[2048];
+    int len;
 
     log_debug("nanofuse_getxattr: path=' %s', name='%s', value = 0x%08x, "
             "size = %d", path, name, value, size);
 
-    return -retstat;
+    if (strcmp(path, "/") != 0 || strcmp(name, NANOFUSE_STATS_XATTR) != 0)
+        return -retstat;
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    nanofs_get_stats(&nanofuse_CONTEXT->fs_hd, &st);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    len = nanofs_stats_format(&st, text, sizeof(text));
+    if (len < 0 || len >= (int)sizeof(text))
+        return -EIO;
+    // Size 0 asks for the length of the value
+    if (size == 0)
+        return len;
+    if (size < (size_t)len)
+        return -ERANGE;
+    memcpy(value, text, len);
+    return len;
 }
 
 /** List extended attributes */
@@ -637,20 +925,24 @@ int nanofuse_removexattr(const char *path, const char *name)
 int nanofuse_opendir(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
-    struct nanofs_filedir_handle *dir_handle =
-            malloc(sizeof(struct nanofs_filedir_handle));
+    struct nanofuse_open *dir_open = malloc(sizeof(struct nanofuse_open));
+    struct nanofs_filedir_handle *dir_handle = &dir_open->o_hd;
 
     log_debug("nanofuse_opendir: path='%s'", path);
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,path,dir_handle);
     // Check if it is a directory
     if(retstat == 0 && !DN_ISDIR(dir_handle->f_dir_node))
         retstat = ENOTDIR;
+    if (retstat == 0)
+        nanofuse_open_link(dir_open);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
 
     if (retstat)
     {
         log_error("nanofuse_opendir: error");
-        free(dir_handle);
+        free(dir_open);
     }
     else
         fi->fh = (uint64_t) (dir_handle);
@@ -675,37 +967,61 @@ int nanofuse_opendir(const char *path, struct fuse_file_info *fi)
  * '1'.
  *
  *
- * 'readdir' is called after opendir, in 'fi->fh' is the 'dir_handle'
+ * 'readdir' is called after opendir, in 'fi->fh' is the 'dir_handle'. The
+ * second mode is used, the offsets are nanofs_read_dir() cursors so large
+ * directories are read in several calls. They stay valid when the
+ * directory changes while the lock is dropped between batches.
+ *
+ * Only the inode and the type are filled for each entry. This version of
+ * the API has no readdirplus, the kernel ignores the rest and calls
+ * getattr() for each entry when it needs it, so the sizes are not
+ * computed here with the lock held.
  * */
 
 int nanofuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    int retstat = 0;
-    int nitems , i;
-    struct nanofs_filedir_handle fh_vector[MAX_DIRENTRIES];
+    int nitems , i, total = 0;
+    struct nanofs_filedir_handle fh_vector[NANOFS_READ_DIR_BATCH];
+    off_t next[NANOFS_READ_DIR_BATCH];
+    struct stat st[NANOFS_READ_DIR_BATCH];
     struct nanofs_filedir_handle *dir_handle;
 
-    UNUSED(offset);
-
-    log_debug("nanofuse_readdir: path='%s'",path);
+    log_debug("nanofuse_readdir: path='%s' offset=%lld",path,
+            (long long)offset);
 
     dir_handle =(struct nanofs_filedir_handle *)fi->fh;
 
-    nitems = nanofs_list_dir(&nanofuse_CONTEXT->fs_hd, dir_handle, fh_vector,
-                MAX_DIRENTRIES);
-
-    if(nitems >= 0 )
+    do
+    {
+        nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+        nitems = nanofs_read_dir(&nanofuse_CONTEXT->fs_hd, dir_handle, offset,
+                fh_vector, next, NANOFS_READ_DIR_BATCH);
+        nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+        for(i=0; i<nitems; i++)
+        {
+            memset(&st[i], 0, sizeof(struct stat));
+            st[i].st_ino = fh_vector[i].f_blk_no;
+            st[i].st_mode = DN_ISDIR(fh_vector[i].f_dir_node) ? 0040755 :
+                    0100755;
+        }
         for(i=0; i<nitems; i++)
         {
             log_debug("nanofuse_readdir: calling filler for '%s'",
                     fh_vector[i].f_dir_node.d_fname);
-            if (filler(buf, (char *)fh_vector[i].f_dir_node.d_fname, NULL, 0) != 0) {
+            if (filler(buf, (char *)fh_vector[i].f_dir_node.d_fname, &st[i],
+                    next[i]) != 0) {
                 log_debug(" nanofuse_readdir: filler returned buffer full");
-                return -ENOMEM;
+                nitems = 0;
+                break;
             }
+            offset = next[i];
+            total++;
         }
-    return -retstat;
+    } while (nitems == NANOFS_READ_DIR_BATCH);
+    NANOFS_TRACE(NANOFS_EV_READDIR, nanofs_trace_hash(path),
+            dir_handle->f_blk_no, total, 0, nitems < 0 ? -EIO : 0);
+    return nitems < 0 ? -EIO : 0;
 }
 
 /** Release directory
@@ -715,8 +1031,11 @@ int nanofuse_releasedir(const char *path, struct fuse_file_info *fi)
 {
 
     log_debug("nanofuse_releasedir: path='%s'",path);
-    // Release directory handle allocated in readdir()
-    free((struct nanofs_filedir_handle *)fi->fh);
+    // Release directory handle allocated in opendir()
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
+    nanofuse_open_unlink((struct nanofuse_open *)fi->fh);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    free((struct nanofuse_open *)fi->fh);
 
     return 0;
 }
@@ -734,6 +1053,66 @@ int nanofuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
     return 0;
 }
 
+/** Periodic sync thread
+ *
+ * Every 'commit' seconds cached headers and the superblock are written back
+ * and the device is flushed, bounding the data lost on power failure when
+ * the superblock is not written on each operation (-o lazy_sb).
+ */
+static void *nanofuse_flusher(void *arg)
+{
+    struct nanofuse_state *state = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&state->flusher_mutex);
+    while (!state->flusher_stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += state->commit;
+        if (pthread_cond_timedwait(&state->flusher_cond,
+                &state->flusher_mutex, &ts) != ETIMEDOUT)
+            continue;
+        nanofs_lock(&state->fs_hd);
+        if (nanofs_sync(&state->fs_hd) != 0)
+            log_error("nanofuse_flusher: periodic sync failed");
+        nanofs_unlock(&state->fs_hd);
+    }
+    pthread_mutex_unlock(&state->flusher_mutex);
+    return NULL;
+}
+
+/** Background deletion thread
+ *
+ * Frees the data of the files left in the orphan list by nanofs_rm(),
+ * NANOFS_RECLAIM_BATCH nodes each time the filesystem is locked, so other
+ * operations wait for a batch at most. Woken by nanofuse_unlink(), at start
+ * it frees the orphans left by a previous mount.
+ */
+static void *nanofuse_reclaimer(void *arg)
+{
+    struct nanofuse_state *state = arg;
+    int freed;
+
+    pthread_mutex_lock(&state->reclaim_mutex);
+    while (!state->reclaim_stop)
+    {
+        state->reclaim_wake = 0;
+        pthread_mutex_unlock(&state->reclaim_mutex);
+        nanofs_lock(&state->fs_hd);
+        freed = nanofs_reclaim(&state->fs_hd, NANOFS_RECLAIM_BATCH);
+        nanofs_unlock(&state->fs_hd);
+        if (freed < 0)
+            log_error("nanofuse_reclaimer: cannot free deleted files");
+        else if (freed > 0)
+            sched_yield();
+        pthread_mutex_lock(&state->reclaim_mutex);
+        if (freed <= 0 && !state->reclaim_stop && !state->reclaim_wake)
+            pthread_cond_wait(&state->reclaim_cond, &state->reclaim_mutex);
+    }
+    pthread_mutex_unlock(&state->reclaim_mutex);
+    return NULL;
+}
+
 /**
  * Initialize filesystem
  *
@@ -756,8 +1135,41 @@ void *nanofuse_init(struct fuse_conn_info *conn)
 {
     log_debug("nanofuse_init: rootdir='%s'", nanofuse_CONTEXT->rootdir);
 
-	if(nanofs_open_dev(nanofuse_CONTEXT->rootdir, & nanofuse_CONTEXT->fs_hd) != 0)
+	if(nanofs_open_dev(nanofuse_CONTEXT->rootdir,
+	        nanofuse_CONTEXT->dev_engine,
+	        nanofuse_CONTEXT->direct ? NANOFS_OPEN_DIRECT : 0,
+	        & nanofuse_CONTEXT->fs_hd) != 0)
 	    log_error("nanofuse_init: nanofs_open_dev failed");
+	else
+	{
+	    if (nanofs_set_cache_size(&nanofuse_CONTEXT->fs_hd,
+	            (size_t)nanofuse_CONTEXT->cache_kb * 1024) != 0)
+	        log_error("nanofuse_init: cannot set header cache size");
+	    nanofuse_CONTEXT->fs_hd.h_sb_lazy = nanofuse_CONTEXT->lazy_sb;
+	    if (nanofuse_CONTEXT->commit > 0)
+	    {
+	        pthread_mutex_init(&nanofuse_CONTEXT->flusher_mutex, NULL);
+	        pthread_cond_init(&nanofuse_CONTEXT->flusher_cond, NULL);
+	        if (pthread_create(&nanofuse_CONTEXT->flusher, NULL,
+	                nanofuse_flusher, nanofuse_CONTEXT) == 0)
+	            nanofuse_CONTEXT->flusher_running = 1;
+	        else
+	            log_error("nanofuse_init: cannot start periodic sync");
+	    }
+	    if (nanofuse_CONTEXT->fs_hd.h_sbx.s_features & NANOFS_FEAT_ORPHANS)
+	    {
+	        pthread_mutex_init(&nanofuse_CONTEXT->reclaim_mutex, NULL);
+	        pthread_cond_init(&nanofuse_CONTEXT->reclaim_cond, NULL);
+	        if (pthread_create(&nanofuse_CONTEXT->reclaimer, NULL,
+	                nanofuse_reclaimer, nanofuse_CONTEXT) == 0)
+	        {
+	            nanofuse_CONTEXT->reclaim_running = 1;
+	            nanofuse_CONTEXT->fs_hd.h_orphans = 1;
+	        }
+	        else
+	            log_error("nanofuse_init: cannot start background deletion");
+	    }
+	}
 
 	// filesystem can handle write size larger than 4kB
 	conn->capable |= FUSE_CAP_BIG_WRITES;
@@ -778,7 +1190,33 @@ void nanofuse_destroy(void *userdata)
 
 	UNUSED(userdata);
 
+	if (nanofuse_CONTEXT->flusher_running)
+	{
+	    pthread_mutex_lock(&nanofuse_CONTEXT->flusher_mutex);
+	    nanofuse_CONTEXT->flusher_stop = 1;
+	    pthread_cond_signal(&nanofuse_CONTEXT->flusher_cond);
+	    pthread_mutex_unlock(&nanofuse_CONTEXT->flusher_mutex);
+	    pthread_join(nanofuse_CONTEXT->flusher, NULL);
+	    nanofuse_CONTEXT->flusher_running = 0;
+	}
+	// Files not freed yet stay in the orphan list for the next mount
+	if (nanofuse_CONTEXT->reclaim_running)
+	{
+	    pthread_mutex_lock(&nanofuse_CONTEXT->reclaim_mutex);
+	    nanofuse_CONTEXT->reclaim_stop = 1;
+	    pthread_cond_signal(&nanofuse_CONTEXT->reclaim_cond);
+	    pthread_mutex_unlock(&nanofuse_CONTEXT->reclaim_mutex);
+	    pthread_join(nanofuse_CONTEXT->reclaimer, NULL);
+	    nanofuse_CONTEXT->reclaim_running = 0;
+	}
+
+	// Cached headers and superblock are written back, the mmap engine also
+	// does msync()
 	nanofs_close_dev(&nanofuse_CONTEXT->fs_hd);
+#ifdef ENABLE_TRACE
+	if (nanofuse_CONTEXT->trace_file != NULL)
+	    nanofs_trace_dump(nanofuse_CONTEXT->trace_file);
+#endif
 
 }
 
@@ -796,7 +1234,9 @@ int nanofuse_access(const char *path, int mask)
     struct nanofs_filedir_handle fd_hd;
     log_debug("nanofuse_access: path='%s', mask=0%o)", path, mask);
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofs_lookup_absolute(&nanofuse_CONTEXT->fs_hd,path,&fd_hd);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
 
     if (retstat != 0)
         log_error("nanofuse_access: failed");
@@ -814,11 +1254,19 @@ int nanofuse_access(const char *path, int mask)
 int nanofuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct nanofuse_open *file_open;
     struct nanofs_filedir_handle *file_handle;
 
-    file_handle = malloc(sizeof(struct nanofs_filedir_handle));
+    file_open = malloc(sizeof(struct nanofuse_open));
+    file_handle = &file_open->o_hd;
 
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofs_create_file(&nanofuse_CONTEXT->fs_hd, path, file_handle);
+    if (retstat == 0)
+        nanofuse_open_link(file_open);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
+    NANOFS_TRACE(NANOFS_EV_CREATE, nanofs_trace_hash(path),
+            retstat == 0 ? file_handle->f_blk_no : 0, 0, 0, -retstat);
 
     if (retstat == 0)
     {
@@ -828,7 +1276,7 @@ int nanofuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     else
     {
         log_error("nanofuse_create: cannot create file");
-        free(file_handle);
+        free(file_open);
     }
 
     return -retstat;
@@ -874,8 +1322,10 @@ int nanofuse_fgetattr(const char *path, struct stat *statbuf,
     int retstat;
 
     log_debug("nanofuse_fgetattr: path='%s'", path);
+    nanofs_lock(&nanofuse_CONTEXT->fs_hd);
     retstat = nanofuse_buildstatbuf((struct nanofs_filedir_handle *) fi->fh,
             statbuf);
+    nanofs_unlock(&nanofuse_CONTEXT->fs_hd);
 
 
     return -retstat;
@@ -897,6 +1347,9 @@ struct fuse_operations nanofuse_oper = {
   .utime = nanofuse_utime,
   .open = nanofuse_open,
   .read = nanofuse_read,
+#if FUSE_VERSION >= 29
+  .read_buf = nanofuse_read_buf,
+#endif
   .write = nanofuse_write,
   /** Just a placeholder, don't set */ // huh???
   .statfs = nanofuse_statfs,
@@ -923,15 +1376,48 @@ struct fuse_operations nanofuse_oper = {
 void nanofuse_usage()
 {
     fprintf(stderr,
-            "usage:  nanofuse [fuse-options] nanofs-image mount-point\n");
+            "usage:  nanofuse [fuse-options] nanofs-image mount-point\n"
+            "\n"
+            "nanofuse options:\n"
+            "    -o engine=posix|mmap|ram|uring\n"
+            "                              storage engine (default: posix)\n"
+            "    -o direct                 bypass the host page cache\n"
+            "    -o cache_size=KiB         header cache size, 0 disables it\n"
+            "                              (default: %d)\n"
+            "    -o commit=SECONDS         periodic sync, 0 disables it\n"
+            "                              (default: %d)\n"
+            "    -o lazy_sb                superblock written on sync only\n",
+            NANOFS_CACHE_DEFAULT / 1024, NANOFUSE_COMMIT_DEFAULT);
+#ifdef ENABLE_TRACE
+    fprintf(stderr,
+            "    -o trace=FILE             trace ring written to FILE on\n"
+            "                              unmount and on demand\n");
+#endif
     exit(1);
 }
 
+/** Map engine name to NANOFS_DEV_*
+ * @return engine number | -1 when unknown
+ */
+static int nanofuse_parse_engine(const char *name)
+{
+    if (name == NULL || strcmp(name, "posix") == 0)
+        return NANOFS_DEV_POSIX;
+    if (strcmp(name, "mmap") == 0)
+        return NANOFS_DEV_MMAP;
+    if (strcmp(name, "ram") == 0)
+        return NANOFS_DEV_RAM;
+    if (strcmp(name, "uring") == 0)
+        return NANOFS_DEV_URING;
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     int fuse_stat,i;
     struct nanofuse_state *nanofuse_data;
     char *new_argv[argc+1];
+    struct fuse_args args;
 
     // nanofuse doesn't do any access checking on its own (the comment
     // blocks in fuse.h mention some of the functions that need
@@ -955,7 +1441,7 @@ int main(int argc, char *argv[])
     if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
     	nanofuse_usage();
 
-    nanofuse_data = malloc(sizeof(struct nanofuse_state));
+    nanofuse_data = calloc(1, sizeof(struct nanofuse_state));
     if (nanofuse_data == NULL) {
     	perror("main: nanofuse_data malloc error");
     	return 1;
@@ -976,10 +1462,27 @@ int main(int argc, char *argv[])
         new_argv[i] = argv[i-1];
 
 
+    // Take nanofuse options out of the argument list
+    args.argc = argc + 1;
+    args.argv = new_argv;
+    args.allocated = 0;
+    nanofuse_data->cache_kb = NANOFS_CACHE_DEFAULT / 1024;
+    nanofuse_data->commit = NANOFUSE_COMMIT_DEFAULT;
+    if (fuse_opt_parse(&args, nanofuse_data, nanofuse_opts, NULL) != 0)
+        nanofuse_usage();
+    nanofuse_data->dev_engine = nanofuse_parse_engine(nanofuse_data->engine);
+    if (nanofuse_data->dev_engine < 0)
+    {
+        fprintf(stderr, "nanofuse: unknown engine '%s'\n",
+                nanofuse_data->engine);
+        nanofuse_usage();
+    }
+
     // turn over control to fuse
     log_debug("main: Call to fuse_main");
-    fuse_stat = fuse_main(argc + 1, new_argv, &nanofuse_oper, nanofuse_data);
+    fuse_stat = fuse_main(args.argc, args.argv, &nanofuse_oper, nanofuse_data);
     log_debug("main: fuse_main returned %d\n", fuse_stat);
 
+    fuse_opt_free_args(&args);
     return fuse_stat;
 }
@@ -41,11 +41,47 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
+
+/** Open file or directory, 'fi->fh' points to it. Handles are listed to
+ * follow dir nodes moved by nanofuse_rename() */
+struct nanofuse_open {
+    struct nanofs_filedir_handle o_hd;  ///< First, 'fi->fh' is this handle
+    struct nanofuse_open *o_prev;
+    struct nanofuse_open *o_next;
+};
 
 /** Used to keep state */
 struct nanofuse_state {
     char *rootdir;
     struct nanofs_fs_handle fs_hd; ///< File system handle
+
+    /* Mount options, see nanofuse_opts in nanofuse.c */
+    char *engine;                  ///< -o engine=posix|mmap|ram|uring
+    int   dev_engine;              ///< NANOFS_DEV_* parsed from 'engine'
+    int   direct;                  ///< -o direct, device opened with O_DIRECT
+    unsigned int cache_kb;         ///< -o cache_size=KiB of header cache
+    unsigned int commit;           ///< -o commit=seconds between syncs
+    int   lazy_sb;                 ///< -o lazy_sb, superblock only on sync
+    char *trace_file;              ///< -o trace=file, see nanofs_trace.h
+
+    /* Periodic sync, see nanofuse_flusher() */
+    pthread_t flusher;
+    pthread_mutex_t flusher_mutex;
+    pthread_cond_t flusher_cond;
+    int   flusher_running;
+    int   flusher_stop;
+
+    /* Background deletion, see nanofuse_reclaimer() */
+    pthread_t reclaimer;
+    pthread_mutex_t reclaim_mutex;
+    pthread_cond_t reclaim_cond;
+    int   reclaim_running;
+    int   reclaim_stop;
+    int   reclaim_wake;
+
+    struct nanofuse_open *open_list; ///< See nanofuse_open_link() and
+                                     ///<   nanofuse_open_unlink()
 };
 
 #define nanofuse_CONTEXT ((struct nanofuse_state *) fuse_get_context()->private_data)
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Random operations checked against a model of the files, see
+# nanofs_model.c, on a new image for each set of features. SEED and OPS may
+# be given to run other sequences.
+
+set -e
+
+SRC=${top_builddir:-..}/src
+IMG=./model.img
+SEED=${SEED:-1}
+OPS=${OPS:-2000}
+
+run() {
+    opts=$1
+    rm -f $IMG
+    truncate -s 32M $IMG
+    $SRC/mkfs.nanofs $opts $IMG > /dev/null
+    ./nanofs_model $IMG $SEED $OPS
+    if $SRC/nanofs.dump $IMG | grep -q "Error"; then
+        echo "FAIL ($opts): nanofs.dump found errors"
+        exit 1
+    fi
+    echo "PASS ($opts) seed $SEED, $OPS operations"
+}
+
+run ""
+run "-j"
+run "-x"
+run "-p"
+run "-i"
+run "-t"
+run "-s -d"
+run "-e"
+run "-p -t -j"
+run "-x -e -d -j"
+run "-i -x -s -d"
+
+rm -f $IMG
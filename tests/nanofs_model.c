@@ -0,0 +1,350 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_model.c
+    @version 0.4
+    @brief Random operations checked against an in-memory model
+
+    Usage: nanofs_model <image> <seed> <ops>. The image is made by model.sh
+    with each set of features. Files are created, written, read, truncated,
+    removed and renamed at random, and the device is closed and opened
+    again from time to time. The contents of every file must match the
+    model, and removing all of them must give back the free space the
+    empty filesystem had.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <asm/types.h>
+
+#include "nanofs.h"
+#include "nanofs_filedir.h"
+
+#define CHECK(cond) do { if (!(cond)) { \
+        fprintf(stderr, "%s:%d: op %d: check failed: %s\n", __FILE__, \
+                __LINE__, op, #cond); \
+        exit(EXIT_FAILURE); } } while (0)
+
+#define MODEL_FILES 160         // Half of them in /a and half in /b, more
+                                // than NANOFS_DIR_INDEX_MIN each
+#define MODEL_MAX_SIZE 32768
+#define MODEL_MAX_WRITE 6000
+
+/** Expected state of a file */
+struct model_file {
+    int m_exists;
+    size_t m_size;
+    char m_data[MODEL_MAX_SIZE];
+};
+
+static struct nanofs_fs_handle hd;
+static char *image;
+static struct model_file files[MODEL_FILES];
+static int op;
+
+/** Dir, name and full path of file 'i'. Names have different lengths to
+ * use several slots of packed dir nodes and leave different room for
+ * inline data */
+static void model_path(int i, char *dir, char *base, char *path)
+{
+    int n, len = 1 + (i * 13) % 60;
+
+    strcpy(dir, i < MODEL_FILES / 2 ? "/a" : "/b");
+    n = sprintf(base, "f%d_", i);
+    memset(base + n, 'n', len);
+    base[n + len] = '\0';
+    sprintf(path, "%s/%s", dir, base);
+}
+
+static void model_open(void)
+{
+    CHECK(nanofs_open_dev(image, NANOFS_DEV_POSIX, 0, &hd) == 0);
+    hd.h_orphans = (hd.h_sbx.s_features & NANOFS_FEAT_ORPHANS) != 0;
+}
+
+/** Contents and size of file 'i' match the model, or it is not found */
+static void model_check(int i)
+{
+    struct nanofs_filedir_handle fh;
+    static char buf[MODEL_MAX_SIZE + 1];
+    char dir[8], base[NANOFS_MAXFILENAME + 1], path[NANOFS_MAXFILENAME + 8];
+
+    model_path(i, dir, base, path);
+    if (!files[i].m_exists)
+    {
+        CHECK(nanofs_lookup_absolute(&hd, path, &fh) == ENOENT);
+        return;
+    }
+    CHECK(nanofs_lookup_absolute(&hd, path, &fh) == 0);
+    CHECK(nanofs_get_file_size(&hd, &fh) == (long)files[i].m_size);
+    CHECK(nanofs_read(&hd, &fh, buf, sizeof(buf), 0) ==
+            (int)files[i].m_size);
+    CHECK(memcmp(buf, files[i].m_data, files[i].m_size) == 0);
+}
+
+/** Entries of a directory match the model */
+static void model_check_dir(const char *dir, int first)
+{
+    struct nanofs_filedir_handle dir_hd, vec[MODEL_FILES + 1];
+    int i, n = 0;
+
+    for (i = first; i < first + MODEL_FILES / 2; i++)
+        n += files[i].m_exists;
+    CHECK(nanofs_lookup_absolute(&hd, dir, &dir_hd) == 0);
+    CHECK(nanofs_list_dir(&hd, &dir_hd, vec, MODEL_FILES + 1) == n);
+}
+
+static void model_check_all(void)
+{
+    int i;
+
+    for (i = 0; i < MODEL_FILES; i++)
+        model_check(i);
+    model_check_dir("/a", 0);
+    model_check_dir("/b", MODEL_FILES / 2);
+}
+
+static void model_fill(char *buf, size_t size)
+{
+    size_t i;
+    char c = rand();
+
+    for (i = 0; i < size; i++)
+        buf[i] = c + i * 3;
+}
+
+static void op_create(int i)
+{
+    struct nanofs_filedir_handle fh;
+    char dir[8], base[NANOFS_MAXFILENAME + 1], path[NANOFS_MAXFILENAME + 8];
+
+    model_path(i, dir, base, path);
+    CHECK(nanofs_create_file(&hd, path, &fh) == 0);
+    files[i].m_exists = 1;
+    files[i].m_size = 0;
+}
+
+/** Create several files of the same dir with their data in one call */
+static void op_create_files(int i)
+{
+    struct nanofs_create_entry vec[3];
+    static char names[3][NANOFS_MAXFILENAME + 1];
+    char dir[8], path[NANOFS_MAXFILENAME + 8];
+    int n = 0, last = i < MODEL_FILES / 2 ? MODEL_FILES / 2 : MODEL_FILES;
+
+    for (; i < last && n < 3; i++)
+    {
+        if (files[i].m_exists)
+            continue;
+        model_path(i, dir, names[n], path);
+        files[i].m_size = rand() % (3 * MODEL_MAX_WRITE);
+        model_fill(files[i].m_data, files[i].m_size);
+        files[i].m_exists = 1;
+        vec[n].c_name = names[n];
+        vec[n].c_data = files[i].m_data;
+        vec[n].c_size = files[i].m_size;
+        n++;
+    }
+    if (n > 0)
+        CHECK(nanofs_create_files(&hd, dir, vec, n) == 0);
+}
+
+/** Overwrite or append at a random offset */
+static void op_write(int i)
+{
+    struct nanofs_filedir_handle fh;
+    char dir[8], base[NANOFS_MAXFILENAME + 1], path[NANOFS_MAXFILENAME + 8];
+    static char buf[MODEL_MAX_WRITE];
+    size_t offset, size;
+
+    model_path(i, dir, base, path);
+    offset = rand() % (files[i].m_size + 1);
+    if (rand() % 2)
+        offset = files[i].m_size;
+    size = 1 + rand() % MODEL_MAX_WRITE;
+    if (offset + size > MODEL_MAX_SIZE)
+        return;
+    model_fill(buf, size);
+    CHECK(nanofs_lookup_absolute(&hd, path, &fh) == 0);
+    CHECK(nanofs_write(&hd, &fh, buf, size, offset) == (int)size);
+    memcpy(files[i].m_data + offset, buf, size);
+    if (offset + size > files[i].m_size)
+        files[i].m_size = offset + size;
+}
+
+static void op_truncate(int i)
+{
+    struct nanofs_filedir_handle fh;
+    char dir[8], base[NANOFS_MAXFILENAME + 1], path[NANOFS_MAXFILENAME + 8];
+
+    model_path(i, dir, base, path);
+    CHECK(nanofs_lookup_absolute(&hd, path, &fh) == 0);
+    CHECK(nanofs_truncate(&hd, &fh, 0) == 0);
+    files[i].m_size = 0;
+}
+
+static void op_rm(int i)
+{
+    struct nanofs_filedir_handle dir_hd;
+    char dir[8], base[NANOFS_MAXFILENAME + 1], path[NANOFS_MAXFILENAME + 8];
+
+    model_path(i, dir, base, path);
+    CHECK(nanofs_lookup_absolute(&hd, dir, &dir_hd) == 0);
+    CHECK(nanofs_rm(&hd, base, &dir_hd) == 0);
+    files[i].m_exists = 0;
+}
+
+/** Rename file 'i' as file 'j', which is replaced when it exists */
+static void op_rename(int i, int j)
+{
+    struct nanofs_filedir_handle fh;
+    char dir[8], base[NANOFS_MAXFILENAME + 1], path[NANOFS_MAXFILENAME + 8];
+    char new_path[NANOFS_MAXFILENAME + 8];
+
+    model_path(i, dir, base, path);
+    model_path(j, dir, base, new_path);
+    CHECK(nanofs_rename(&hd, path, new_path, &fh) == 0);
+    files[j].m_exists = 1;
+    files[j].m_size = files[i].m_size;
+    memcpy(files[j].m_data, files[i].m_data, files[i].m_size);
+    files[i].m_exists = 0;
+}
+
+static void model_reopen(void)
+{
+    CHECK(nanofs_close_dev(&hd) == 0);
+    model_open();
+    model_check_all();
+}
+
+/** Blocks of the free list and of the nodes waiting for the journal
+ * commit. nanofs_free() gives the payload of the free nodes, which is less
+ * when the same blocks are split in more nodes.
+ * */
+static long int model_free_blocks(void)
+{
+    struct nanofs_data_node dn;
+    long int blocks = 0;
+    __u32 blk_no;
+    int list;
+
+    for (list = 0; list < 2; list++)
+    {
+        blk_no = list == 0 ? hd.h_defer_head : hd.h_sb.s_free_ptr;
+        while (blk_no != 0)
+        {
+            CHECK(nanofs_read_data_node_b(&hd, blk_no, &dn) == 0);
+            blocks += nanofs_blocks_for_size(&hd,
+                    dn.d_len + NANOFS_HEADER_DATA_NODE_SIZE);
+            blk_no = dn.d_next_ptr;
+        }
+    }
+    return blocks;
+}
+
+/** Remove every file, their dirs and the deferred work, the free blocks
+ * must be back to 'free0'. The dirs go too as the index of a dir is kept
+ * when it has few entries again. */
+static void model_clear(long int free0)
+{
+    struct nanofs_filedir_handle root;
+    int i, freed;
+
+    for (i = 0; i < MODEL_FILES; i++)
+        if (files[i].m_exists)
+            op_rm(i);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_rmdir(&hd, "a", &root) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_rmdir(&hd, "b", &root) == 0);
+    do
+    {
+        freed = nanofs_reclaim(&hd, NANOFS_RECLAIM_BATCH);
+        CHECK(freed >= 0);
+    } while (freed > 0);
+    CHECK(hd.h_sbx.s_orphan_ptr == 0);
+    CHECK(nanofs_commit(&hd) == 0);
+    CHECK(model_free_blocks() == free0);
+}
+
+int main(int argc, char **argv)
+{
+    struct nanofs_filedir_handle root;
+    long int free0;
+    int ops, i, j;
+
+    if (argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <image> <seed> <ops>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    image = argv[1];
+    srand(atoi(argv[2]));
+    ops = atoi(argv[3]);
+
+    model_open();
+    free0 = model_free_blocks();
+    CHECK(free0 > 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_mkdir(&hd, "a", &root) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_mkdir(&hd, "b", &root) == 0);
+    for (op = 0; op < ops; op++)
+    {
+        i = rand() % MODEL_FILES;
+        j = rand() % MODEL_FILES;
+        switch (rand() % 16)
+        {
+        case 0:
+            model_reopen();
+            break;
+        case 1:
+        case 2:
+            op_create_files(i);
+            break;
+        case 3:
+            if (files[i].m_exists)
+                op_rm(i);
+            else
+                op_create(i);
+            break;
+        case 4:
+            if (files[i].m_exists && i != j)
+                op_rename(i, j);
+            break;
+        case 5:
+            if (files[i].m_exists)
+                op_truncate(i);
+            break;
+        case 6:
+        case 7:
+        case 8:
+            model_check(i);
+            break;
+        default:
+            if (!files[i].m_exists)
+                op_create(i);
+            op_write(i);
+        }
+    }
+    model_reopen();
+    model_clear(free0);
+    CHECK(nanofs_close_dev(&hd) == 0);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,439 @@
+/*****************************************************************************
+    This file is part of NanoFS project
+
+    NanoFS is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NanoFS is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NanoFS.  If not, see <http://www.gnu.org/licenses/>.
+
+    @file nanofs_regress.c
+    @version 0.4
+    @brief Regression tests of the library
+
+    Usage: nanofs_regress <case> <image>. The image is made by regress.sh
+    with the options the case needs, see the table at the end.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <asm/types.h>
+
+#include "nanofs.h"
+#include "nanofs_filedir.h"
+#include "nanofs_io.h"
+
+#define CHECK(cond) do { if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                #cond); \
+        exit(EXIT_FAILURE); } } while (0)
+
+static struct nanofs_fs_handle hd;
+static char *image;
+
+/** Write 'nodes' data nodes to a file, a write to another file between
+ * them keeps the nodes apart */
+static void write_nodes(const char *path, int nodes)
+{
+    struct nanofs_filedir_handle fh, gap;
+    char buf[600];
+    int i;
+
+    memset(buf, 'a', sizeof(buf));
+    CHECK(nanofs_create_file(&hd, path, &fh) == 0);
+    if (nanofs_lookup_absolute(&hd, "/gap", &gap) == ENOENT)
+        CHECK(nanofs_create_file(&hd, "/gap", &gap) == 0);
+    for (i = 0; i < nodes; i++)
+    {
+        CHECK(nanofs_write(&hd, &fh, buf, sizeof(buf),
+                (off_t)i * sizeof(buf)) == sizeof(buf));
+        CHECK(nanofs_write(&hd, &gap, buf, 1,
+                nanofs_get_file_size(&hd, &gap)) == 1);
+    }
+}
+
+/** A large file removed with the orphan list keeps its metadata block in
+ * 'd_meta_ptr', it is not the index of a directory */
+static int test_rm_orphan(void)
+{
+    struct nanofs_filedir_handle root, fh;
+    long int free0;
+    int freed;
+
+    hd.h_orphans = 1;
+    write_nodes("/big", 4 * NANOFS_ORPHAN_MIN);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    free0 = nanofs_free(&hd);
+    CHECK(nanofs_rm(&hd, "big", &root) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/big", &fh) == ENOENT);
+    CHECK(hd.h_sbx.s_orphan_ptr != 0);
+    do
+    {
+        freed = nanofs_reclaim(&hd, NANOFS_RECLAIM_BATCH);
+        CHECK(freed >= 0);
+    } while (freed > 0);
+    CHECK(hd.h_sbx.s_orphan_ptr == 0);
+    CHECK(nanofs_free(&hd) > free0);
+    return 0;
+}
+
+/** Files of nanofs_create_files() fit in chained nodes when the free list
+ * starts with more than NANOFS_ALLOC_SCAN small nodes */
+static int test_create_fragmented(void)
+{
+    struct nanofs_create_entry vec[4];
+    struct nanofs_filedir_handle root, fh;
+    static char data[5000], got[5000];
+    char name[32];
+    int i;
+
+    for (i = 0; i < 4 * NANOFS_ALLOC_SCAN; i++)
+    {
+        sprintf(name, "/small%d", i);
+        CHECK(nanofs_create_file(&hd, name, &fh) == 0);
+        CHECK(nanofs_write(&hd, &fh, "x", 1, 0) == 1);
+    }
+    for (i = 0; i < 4 * NANOFS_ALLOC_SCAN; i += 2)
+    {
+        sprintf(name, "small%d", i);
+        CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+        CHECK(nanofs_rm(&hd, name, &root) == 0);
+    }
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = i * 7;
+    for (i = 0; i < 4; i++)
+    {
+        sprintf(name, "file%d", i);
+        vec[i].c_name = strdup(name);
+        vec[i].c_data = data;
+        vec[i].c_size = sizeof(data) - i;
+    }
+    CHECK(nanofs_create_files(&hd, "/", vec, 4) == 0);
+    for (i = 0; i < 4; i++)
+    {
+        sprintf(name, "/file%d", i);
+        CHECK(nanofs_lookup_absolute(&hd, name, &fh) == 0);
+        CHECK(nanofs_get_file_size(&hd, &fh) == (long)vec[i].c_size);
+        CHECK(nanofs_read(&hd, &fh, got, sizeof(got), 0) ==
+                (int)vec[i].c_size);
+        CHECK(memcmp(got, data, vec[i].c_size) == 0);
+        free((char *)vec[i].c_name);
+    }
+    return 0;
+}
+
+/** A file of nanofs_create_files() gets an extent index as it grows, a
+ * cold read near its end reads a few nodes */
+static int test_create_extents(void)
+{
+    struct nanofs_create_entry vec[1];
+    struct nanofs_filedir_handle fh, gap;
+    struct nanofs_stats st;
+    char buf[600];
+    int i;
+
+    memset(buf, 'b', sizeof(buf));
+    vec[0].c_name = "grown";
+    vec[0].c_data = buf;
+    vec[0].c_size = sizeof(buf);
+    CHECK(nanofs_create_files(&hd, "/", vec, 1) == 0);
+    CHECK(nanofs_create_file(&hd, "/gap", &gap) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/grown", &fh) == 0);
+    for (i = 1; i <= 300; i++)
+    {
+        CHECK(nanofs_write(&hd, &fh, buf, sizeof(buf),
+                (off_t)i * sizeof(buf)) == sizeof(buf));
+        CHECK(nanofs_write(&hd, &gap, buf, 1, i - 1) == 1);
+    }
+    CHECK(nanofs_close_dev(&hd) == 0);
+    CHECK(nanofs_open_dev(image, NANOFS_DEV_POSIX, 0, &hd) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/grown", &fh) == 0);
+    nanofs_reset_stats(&hd);
+    CHECK(nanofs_read(&hd, &fh, buf, 100, 300 * sizeof(buf)) == 100);
+    nanofs_get_stats(&hd, &st);
+    CHECK(st.st_extent_seeks == 1);
+    CHECK(st.st_node_reads < 10);
+    return 0;
+}
+
+/** A rename over an existing name that runs out of space leaves both
+ * names as they were */
+static int test_rename_full(void)
+{
+    struct nanofs_filedir_handle fh;
+    char dst[101], name[32], buf[4096];
+    int i;
+
+    memset(dst, 'd', 100);
+    dst[0] = '/';
+    dst[100] = '\0';
+    CHECK(nanofs_create_file(&hd, dst, &fh) == 0);
+    for (i = 0; i < 64; i++)
+    {
+        sprintf(name, "/s%d", i);
+        CHECK(nanofs_create_file(&hd, name, &fh) == 0);
+    }
+    CHECK(nanofs_write(&hd, &fh, "src", 3, 0) == 3);
+    // No free block is left for the slots of a longer name
+    memset(buf, 'f', sizeof(buf));
+    CHECK(nanofs_create_file(&hd, "/fill", &fh) == 0);
+    while (nanofs_write(&hd, &fh, buf, sizeof(buf),
+            nanofs_get_file_size(&hd, &fh)) > 0)
+        ;
+    for (i = 0; ; i++)
+    {
+        sprintf(name, "/t%d", i);
+        if (nanofs_create_file(&hd, name, &fh) == ENOSPC)
+            break;
+    }
+    CHECK(nanofs_rename(&hd, "/s63", dst, &fh) == ENOSPC);
+    CHECK(nanofs_lookup_absolute(&hd, dst, &fh) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/s63", &fh) == 0);
+    CHECK(nanofs_read(&hd, &fh, buf, sizeof(buf), 0) == 3);
+    CHECK(memcmp(buf, "src", 3) == 0);
+    return 0;
+}
+
+/** A name twice in the same nanofs_create_files() call is refused before
+ * anything is created */
+static int test_create_dup(void)
+{
+    struct nanofs_create_entry vec[3];
+    struct nanofs_filedir_handle root, fh_vec[4];
+
+    vec[0].c_name = "dup";
+    vec[1].c_name = "other";
+    vec[2].c_name = "dup";
+    vec[0].c_data = vec[1].c_data = vec[2].c_data = "data";
+    vec[0].c_size = vec[1].c_size = vec[2].c_size = 4;
+    CHECK(nanofs_create_files(&hd, "/", vec, 3) == EEXIST);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_list_dir(&hd, &root, fh_vec, 4) == 0);
+    CHECK(nanofs_create_files(&hd, "/", vec, 2) == 0);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_list_dir(&hd, &root, fh_vec, 4) == 2);
+    return 0;
+}
+
+/** Counters of a known sequence of operations. Without a journal the
+ * superblock is written once by the commit of each nanofs_unlock() that
+ * follows a change. */
+static int test_stats(void)
+{
+    struct nanofs_stats st, zero;
+    struct nanofs_filedir_handle fh;
+    char buf[100];
+    int i;
+
+    memset(&zero, 0, sizeof(zero));
+    CHECK(nanofs_commit(&hd) == 0);
+    nanofs_reset_stats(&hd);
+    nanofs_get_stats(&hd, &st);
+    CHECK(memcmp(&st, &zero, sizeof(st)) == 0);
+
+    nanofs_lock(&hd);
+    CHECK(nanofs_create_file(&hd, "/s0", &fh) == 0);
+    CHECK(nanofs_create_file(&hd, "/s1", &fh) == 0);
+    CHECK(nanofs_create_file(&hd, "/s2", &fh) == 0);
+    nanofs_get_stats(&hd, &st);
+    CHECK(st.st_ops[NANOFS_OP_CREATE] == 3);
+    CHECK(st.st_sb_writes == 0);
+    nanofs_unlock(&hd);
+    nanofs_get_stats(&hd, &st);
+    CHECK(st.st_sb_writes == 1);
+
+    memset(buf, 's', sizeof(buf));
+    nanofs_lock(&hd);
+    CHECK(nanofs_write(&hd, &fh, buf, sizeof(buf), 0) == sizeof(buf));
+    nanofs_unlock(&hd);
+    for (i = 0; i < 2; i++)
+    {
+        nanofs_lock(&hd);
+        CHECK(nanofs_read(&hd, &fh, buf, sizeof(buf), 0) == sizeof(buf));
+        nanofs_unlock(&hd);
+    }
+    // The snapshot is a copy
+    CHECK(st.st_ops[NANOFS_OP_WRITE] == 0);
+    nanofs_get_stats(&hd, &st);
+    CHECK(st.st_ops[NANOFS_OP_CREATE] == 3);
+    CHECK(st.st_ops[NANOFS_OP_WRITE] == 1);
+    CHECK(st.st_ops[NANOFS_OP_READ] == 2);
+    CHECK(st.st_sb_writes == 2);
+    CHECK(st.st_dev_write_bytes >= sizeof(buf));
+
+    nanofs_reset_stats(&hd);
+    nanofs_get_stats(&hd, &st);
+    CHECK(memcmp(&st, &zero, sizeof(st)) == 0);
+    return 0;
+}
+
+/** Small appends leave one block nodes, a read of them takes one segment
+ * per block size less the node header */
+static int test_segments_small_nodes(void)
+{
+    struct nanofs_filedir_handle fh;
+    struct nanofs_segment seg_vec[65536 / (512 - NANOFS_HEADER_DATA_NODE_SIZE)
+            + 2];
+    static char buf[100], data[65536], got[65536];
+    size_t pos = 0;
+    FILE *f;
+    int i, nsegs;
+
+    CHECK(nanofs_create_file(&hd, "/small", &fh) == 0);
+    for (i = 0; i < 1000; i++)
+    {
+        memset(buf, i, sizeof(buf));
+        CHECK(nanofs_write(&hd, &fh, buf, sizeof(buf), i * sizeof(buf)) ==
+                sizeof(buf));
+    }
+    CHECK(nanofs_read(&hd, &fh, data, sizeof(data), 0) == sizeof(data));
+    nsegs = nanofs_read_segments(&hd, &fh, sizeof(data), 0, seg_vec,
+            sizeof(seg_vec) / sizeof(seg_vec[0]));
+    CHECK(nsegs > 0);
+    // The ranges hold the data once the headers are written back
+    CHECK(nanofs_sync(&hd) == 0);
+    CHECK((f = fopen(image, "rb")) != NULL);
+    for (i = 0; i < nsegs; i++)
+    {
+        CHECK(pos + seg_vec[i].s_len <= sizeof(got));
+        CHECK(fseeko(f, seg_vec[i].s_offset, SEEK_SET) == 0);
+        CHECK(fread(got + pos, 1, seg_vec[i].s_len, f) == seg_vec[i].s_len);
+        pos += seg_vec[i].s_len;
+    }
+    CHECK(fclose(f) == 0);
+    CHECK(pos == sizeof(data));
+    CHECK(memcmp(got, data, sizeof(data)) == 0);
+    return 0;
+}
+
+/** A superblock with features of a newer version is not mounted */
+static int test_unknown_features(void)
+{
+    struct nanofs_superblock sb = hd.h_sb;
+    struct nanofs_sb_extra sbx = hd.h_sbx;
+    __u8 buf[NANOFS_SB_SIZE + sizeof(struct nanofs_sb_extra)];
+    FILE *f;
+    int size;
+
+    hd.h_sbx.s_features |= NANOFS_FEAT_ALL + 1;
+    CHECK(nanofs_store_sb(&hd) == 0);
+    CHECK(nanofs_close_dev(&hd) == 0);
+    CHECK(nanofs_open_dev(image, NANOFS_DEV_POSIX, 0, &hd) == -1);
+    CHECK(hd.h_error == EIO);
+    // The superblock is put back so the image can be checked
+    size = nanofs_pack_sb(buf, &sb, &sbx);
+    CHECK((f = fopen(image, "r+b")) != NULL);
+    CHECK(fwrite(buf, 1, size, f) == (size_t)size);
+    CHECK(fclose(f) == 0);
+    CHECK(nanofs_open_dev(image, NANOFS_DEV_POSIX, 0, &hd) == 0);
+    return 0;
+}
+
+/** Read one page of '/' from 'cursor', counting the names f<i> listed */
+static int readdir_page(off_t *cursor, int seen[], char last[])
+{
+    struct nanofs_filedir_handle root, fh_vec[16];
+    off_t next[16];
+    int n, i, f;
+
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    n = nanofs_read_dir(&hd, &root, *cursor, fh_vec, next, 16);
+    CHECK(n >= 0);
+    for (i = 0; i < n; i++)
+        if (sscanf((char *)fh_vec[i].f_dir_node.d_fname, "f%d", &f) == 1)
+            seen[f]++;
+    if (n > 0)
+    {
+        *cursor = next[n - 1];
+        strcpy(last, (char *)fh_vec[n - 1].f_dir_node.d_fname);
+    }
+    return n;
+}
+
+/** Children added, removed or renamed between two pages of a list dir do
+ * not make the listing give a child twice or skip one left in place. The
+ * removed and renamed ones were listed already. */
+static int test_readdir_cursor(void)
+{
+    struct nanofs_filedir_handle root, fh;
+    char path[NANOFS_MAXFILENAME + 2], last[NANOFS_MAXFILENAME + 1];
+    int seen[80], i, f;
+    off_t cursor = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (i = 0; i < 80; i++)
+    {
+        sprintf(path, "/f%d", i);
+        CHECK(nanofs_create_file(&hd, path, &fh) == 0);
+    }
+    CHECK(readdir_page(&cursor, seen, last) == 16);
+    // Added at the head of the list
+    CHECK(nanofs_create_file(&hd, "/new", &fh) == 0);
+    CHECK(readdir_page(&cursor, seen, last) == 16);
+    // The last child listed and another one listed before are removed
+    CHECK(sscanf(last, "f%d", &f) == 1);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_rm(&hd, last, &root) == 0);
+    for (i = 0; seen[i] == 0 || i == f; i++)
+        ;
+    sprintf(path, "f%d", i);
+    CHECK(nanofs_lookup_absolute(&hd, "/", &root) == 0);
+    CHECK(nanofs_rm(&hd, path, &root) == 0);
+    CHECK(readdir_page(&cursor, seen, last) == 16);
+    // Renamed in the same dir, it goes to the head of the list
+    sprintf(path, "/%s", last);
+    CHECK(nanofs_rename(&hd, path, "/renamed", &fh) == 0);
+    while (readdir_page(&cursor, seen, last) > 0)
+        ;
+    for (i = 0; i < 80; i++)
+        CHECK(seen[i] == 1);
+    return 0;
+}
+
+static const struct {
+    const char *name;
+    int (*run)(void);
+} cases[] = {
+    { "rm_orphan", test_rm_orphan },
+    { "create_fragmented", test_create_fragmented },
+    { "create_extents", test_create_extents },
+    { "rename_full", test_rename_full },
+    { "create_dup", test_create_dup },
+    { "stats", test_stats },
+    { "segments_small_nodes", test_segments_small_nodes },
+    { "readdir_cursor", test_readdir_cursor },
+    { "unknown_features", test_unknown_features },
+};
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <case> <image>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (strcmp(cases[i].name, argv[1]) != 0)
+            continue;
+        image = argv[2];
+        CHECK(nanofs_open_dev(image, NANOFS_DEV_POSIX, 0, &hd) == 0);
+        CHECK(cases[i].run() == 0);
+        CHECK(nanofs_close_dev(&hd) == 0);
+        return EXIT_SUCCESS;
+    }
+    fprintf(stderr, "Unknown case %s\n", argv[1]);
+    return EXIT_FAILURE;
+}
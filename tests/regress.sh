@@ -0,0 +1,45 @@
+#!/bin/sh
+# Regression tests of the library, each case runs on a new image made with
+# the mkfs.nanofs options it needs and the image is checked afterwards
+
+set -e
+
+SRC=${top_builddir:-..}/src
+IMG=./regress.img
+
+run() {
+    opts=$1
+    name=$2
+    rm -f $IMG
+    truncate -s 32M $IMG
+    $SRC/mkfs.nanofs $opts $IMG > /dev/null
+    ./nanofs_regress $name $IMG
+    if $SRC/nanofs.dump $IMG | grep -q "Error"; then
+        echo "FAIL $name ($opts): nanofs.dump found errors"
+        exit 1
+    fi
+    echo "PASS $name ($opts)"
+}
+
+run "-s -d -x" rm_orphan
+run "-e -d -x" rm_orphan
+run "-s -d -x -j" rm_orphan
+run "" create_fragmented
+run "-j" create_fragmented
+run "-p -e" create_fragmented
+run "-e" create_extents
+run "-e -j -x" create_extents
+run "-p" rename_full
+run "-p -t" rename_full
+run "" create_dup
+run "-p -t" create_dup
+run "" stats
+run "-p -x" stats
+run "" segments_small_nodes
+run "-j -e" segments_small_nodes
+run "" readdir_cursor
+run "-p" readdir_cursor
+run "-x" readdir_cursor
+run "-j -x" unknown_features
+
+rm -f $IMG